@@ -828,6 +828,26 @@ int bdrv_parse_discard_flags(const char *mode, int *flags)
     return 0;
 }
 
+/**
+ * Set open flags for a given aio mode
+ *
+ * Return 0 on success, -1 if the aio mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * Set open flags for a given cache mode
  *
@@ -3714,6 +3734,8 @@ static void bdrv_delete(BlockDriverState *bs)
 static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
     }
@@ -3722,7 +3744,11 @@ static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    ret = bs->drv->bdrv_co_check(bs, res, fix);
+    if (fix) {
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+    }
+    return ret;
 }
 
 typedef struct CheckCo {
@@ -4318,6 +4344,24 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+/*
+ * Return a host file descriptor holding the data of @bs, or -errno if reads
+ * cannot bypass the block layer.  Unlike bdrv_get_info(), this does not
+ * look through filters: a filter may change what a read returns.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t *offset)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd || bs->copy_on_read) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs, offset);
+}
+
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -4327,6 +4371,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv || !drv->bdrv_get_specific_stats) {
+        return NULL;
+    }
+    return drv->bdrv_get_specific_stats(bs);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -4496,6 +4549,9 @@ static void coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs,
         return;
     }
 
+    /* Someone else may have changed the image while we were inactive */
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+
     QLIST_FOREACH(child, &bs->children, next) {
         bdrv_co_invalidate_cache(child->bs, &local_err);
         if (local_err) {
@@ -5182,6 +5238,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        BlockDriverAmendStatusCB *status_cb, void *cb_opaque,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -5191,7 +5249,9 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+    return ret;
 }
 
 /* This function will be called by the bdrv_recurse_is_first_non_filter method
@@ -32,9 +32,38 @@
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+/* Lock and return the counter shard of the current AioContext */
+static BlockAcctCounters *block_acct_shard_lock(BlockAcctStats *stats)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    BlockAcctShard *shard = &stats->shards[ctx->index % BLOCK_ACCT_SHARDS];
+
+    qemu_spin_lock(&shard->lock);
+    return &shard->counters;
+}
+
+static void block_acct_shard_unlock(BlockAcctStats *stats,
+                                    BlockAcctCounters *c)
+{
+    BlockAcctShard *shard = container_of(c, BlockAcctShard, counters);
+
+    qemu_spin_unlock(&shard->lock);
+}
+
 void block_acct_init(BlockAcctStats *stats)
 {
+    int i;
+
     qemu_mutex_init(&stats->lock);
+    /* BlockBackend is allocated with g_new0(), so the shards cannot be
+     * embedded without losing their alignment
+     */
+    stats->shards = qemu_memalign(BLOCK_ACCT_SHARD_ALIGN,
+                                  sizeof(*stats->shards) * BLOCK_ACCT_SHARDS);
+    memset(stats->shards, 0, sizeof(*stats->shards) * BLOCK_ACCT_SHARDS);
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        qemu_spin_init(&stats->shards[i].lock);
+    }
     if (qtest_enabled()) {
         clock_type = QEMU_CLOCK_VIRTUAL;
     }
@@ -53,6 +82,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    qemu_vfree(stats->shards);
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -155,6 +185,7 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
         prev = entry->value;
     }
 
+    qemu_mutex_lock(&stats->lock);
     hist->nbins = new_nbins;
     g_free(hist->boundaries);
     hist->boundaries = g_new(uint64_t, hist->nbins - 1);
@@ -166,6 +197,7 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
 
     g_free(hist->bins);
     hist->bins = g_new0(uint64_t, hist->nbins);
+    qemu_mutex_unlock(&stats->lock);
 
     return 0;
 }
@@ -174,20 +206,25 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
 {
     int i;
 
+    qemu_mutex_lock(&stats->lock);
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
         BlockLatencyHistogram *hist = &stats->latency_histogram[i];
         g_free(hist->bins);
         g_free(hist->boundaries);
         memset(hist, 0, sizeof(*hist));
     }
+    qemu_mutex_unlock(&stats->lock);
 }
 
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
     BlockAcctTimedStats *s;
+    BlockAcctCounters *c;
+    BlockLatencyHistogram *hist;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
+    bool account_time;
 
     if (qtest_enabled()) {
         latency_ns = qtest_latency_ns;
@@ -195,22 +232,35 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
+    account_time = !failed || stats->account_failed;
 
+    c = block_acct_shard_lock(stats);
     if (failed) {
-        stats->failed_ops[cookie->type]++;
+        c->failed_ops[cookie->type]++;
     } else {
-        stats->nr_bytes[cookie->type] += cookie->bytes;
-        stats->nr_ops[cookie->type]++;
+        c->nr_bytes[cookie->type] += cookie->bytes;
+        c->nr_ops[cookie->type]++;
+    }
+    if (account_time) {
+        c->total_time_ns[cookie->type] += latency_ns;
+        c->last_access_time_ns = time_ns;
     }
+    block_acct_shard_unlock(stats, c);
 
-    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
-                                    latency_ns);
+    /* Latency histograms and timed intervals are shared by all threads;
+     * only take the lock if at least one of them is configured.
+     */
+    hist = &stats->latency_histogram[cookie->type];
+    if (atomic_read(&hist->bins) == NULL &&
+        (!account_time || QSLIST_EMPTY(&stats->intervals))) {
+        return;
+    }
 
-    if (!failed || stats->account_failed) {
-        stats->total_time_ns[cookie->type] += latency_ns;
-        stats->last_access_time_ns = time_ns;
+    qemu_mutex_lock(&stats->lock);
+
+    block_latency_histogram_account(hist, latency_ns);
 
+    if (account_time) {
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
@@ -237,28 +287,73 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
      * not.  The reason is that invalid requests are accounted during their
      * submission, therefore there's no actual I/O involved.
      */
-    qemu_mutex_lock(&stats->lock);
-    stats->invalid_ops[type]++;
+    BlockAcctCounters *c = block_acct_shard_lock(stats);
+
+    c->invalid_ops[type]++;
 
     if (stats->account_invalid) {
-        stats->last_access_time_ns = qemu_clock_get_ns(clock_type);
+        c->last_access_time_ns = qemu_clock_get_ns(clock_type);
     }
-    qemu_mutex_unlock(&stats->lock);
+    block_acct_shard_unlock(stats, c);
 }
 
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                       int num_requests)
 {
+    BlockAcctCounters *c;
+
     assert(type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
-    stats->merged[type] += num_requests;
-    qemu_mutex_unlock(&stats->lock);
+    c = block_acct_shard_lock(stats);
+    c->merged[type] += num_requests;
+    block_acct_shard_unlock(stats, c);
+}
+
+void block_acct_merge_gap(BlockAcctStats *stats, enum BlockAcctType type,
+                          uint64_t bytes)
+{
+    BlockAcctCounters *c;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    c = block_acct_shard_lock(stats);
+    c->merge_gap_bytes[type] += bytes;
+    block_acct_shard_unlock(stats, c);
+}
+
+/* Sum up the per-thread counter shards of @stats into @c */
+void block_acct_get_counters(BlockAcctStats *stats, BlockAcctCounters *c)
+{
+    int i, t;
+
+    memset(c, 0, sizeof(*c));
+
+    for (i = 0; i < BLOCK_ACCT_SHARDS; i++) {
+        BlockAcctShard *shard = &stats->shards[i];
+        BlockAcctCounters *sc = &shard->counters;
+
+        qemu_spin_lock(&shard->lock);
+        for (t = 0; t < BLOCK_MAX_IOTYPE; t++) {
+            c->nr_bytes[t] += sc->nr_bytes[t];
+            c->nr_ops[t] += sc->nr_ops[t];
+            c->invalid_ops[t] += sc->invalid_ops[t];
+            c->failed_ops[t] += sc->failed_ops[t];
+            c->total_time_ns[t] += sc->total_time_ns[t];
+            c->merged[t] += sc->merged[t];
+            c->merge_gap_bytes[t] += sc->merge_gap_bytes[t];
+        }
+        c->last_access_time_ns = MAX(c->last_access_time_ns,
+                                     sc->last_access_time_ns);
+        qemu_spin_unlock(&shard->lock);
+    }
 }
 
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
-    return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
+    BlockAcctCounters c;
+
+    block_acct_get_counters(stats, &c);
+    return qemu_clock_get_ns(clock_type) - c.last_access_time_ns;
 }
 
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
@@ -2249,3 +2249,47 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               blk_out->root, off_out,
                               bytes, read_flags, write_flags);
 }
+
+/*
+ * Let @fn read @bytes at @offset of @blk itself from the host file that
+ * holds them, see bdrv_co_read_host_fd().  The request is subject to the
+ * I/O limits of @blk and counts as in flight like one from blk_co_preadv(),
+ * so drained sections (and with them reopen and graph changes) wait for it.
+ *
+ * Returns -ENOTSUP without calling @fn if the data cannot be read from a
+ * host file, and otherwise the return value of @fn.
+ */
+int coroutine_fn blk_co_read_host_fd(BlockBackend *blk, int64_t offset,
+                                     unsigned int bytes,
+                                     BdrvHostFdReadFunc *fn, void *opaque)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    int64_t host_offset;
+    int ret;
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * Check before throttling, so that requests which the caller then
+     * retries through blk_co_preadv() are not charged twice
+     */
+    ret = bdrv_get_host_fd(bs, &host_offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+
+    /* throttling disk I/O */
+    if (blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                bytes, false);
+    }
+
+    ret = bdrv_co_read_host_fd(blk->root, offset, bytes, fn, opaque);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
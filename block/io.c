@@ -30,6 +30,7 @@
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
 #include "qemu/cutils.h"
+#include "qemu/range.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 
@@ -1255,6 +1256,8 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                                           &local_qiov,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            /* The data is unchanged, but its allocation status is not */
+            bdrv_bsc_invalidate_range(bs, cluster_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -1471,6 +1474,32 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     return ret;
 }
 
+int coroutine_fn bdrv_co_read_host_fd(BdrvChild *child, int64_t offset,
+                                      unsigned int bytes,
+                                      BdrvHostFdReadFunc *fn, void *opaque)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int64_t host_offset;
+    int fd, ret;
+
+    fd = bdrv_get_host_fd(bs, &host_offset);
+    if (fd < 0) {
+        return fd;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    wait_serialising_requests(&req);
+
+    ret = fn(fd, host_offset + offset, opaque);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 static int coroutine_fn bdrv_co_do_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags)
 {
@@ -1652,6 +1681,11 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
         bdrv_parent_cb_resize(bs);
         bdrv_dirty_bitmap_truncate(bs, end_sector << BDRV_SECTOR_BITS);
     }
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+    } else {
+        bdrv_bsc_invalidate_range(bs, offset, bytes);
+    }
     if (req->bytes) {
         switch (req->type) {
         case BDRV_TRACKED_WRITE:
@@ -2056,6 +2090,106 @@ int coroutine_fn bdrv_co_block_status_from_backing(BlockDriverState *bs,
     return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
 }
 
+/*
+ * Drops the cached block status answers that overlap the given range, and
+ * keeps answers that the driver is still computing from being cached.
+ */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes)
+{
+    int i;
+
+    bs->bsc_gen++;
+    for (i = 0; i < BDRV_BSC_SIZE; i++) {
+        BdrvBlockStatusCacheEntry *e = &bs->bsc[i];
+
+        if (e->valid && ranges_overlap(e->offset, e->bytes, offset, bytes)) {
+            e->valid = false;
+        }
+    }
+}
+
+/*
+ * Driver answers are only cached for drivers whose metadata cannot change
+ * behind our back, and only while no other process may write to the image.
+ */
+static bool bdrv_bsc_enabled(BlockDriverState *bs)
+{
+    return bs->drv->supports_block_status_cache && !bs->force_share &&
+           !(bs->open_flags & BDRV_O_INACTIVE);
+}
+
+/*
+ * Look for a cached driver answer that covers @offset.  An answer is only
+ * used if it is at least as precise as requested and if the node it maps
+ * to is still @bs itself or one of its children.
+ */
+static bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero,
+                            int64_t offset, int64_t bytes, int *ret,
+                            int64_t *pnum, int64_t *map,
+                            BlockDriverState **file)
+{
+    BdrvChild *child;
+    int i;
+
+    if (!bdrv_bsc_enabled(bs)) {
+        return false;
+    }
+
+    for (i = 0; i < BDRV_BSC_SIZE; i++) {
+        BdrvBlockStatusCacheEntry *e = &bs->bsc[i];
+
+        if (!e->valid || (want_zero && !e->want_zero) ||
+            offset < e->offset || offset >= e->offset + e->bytes) {
+            continue;
+        }
+
+        if (e->file && e->file != bs) {
+            QLIST_FOREACH(child, &bs->children, next) {
+                if (child->bs == e->file) {
+                    break;
+                }
+            }
+            if (!child) {
+                e->valid = false;
+                continue;
+            }
+        }
+
+        *ret = e->ret;
+        *pnum = MIN(e->offset + e->bytes - offset, bytes);
+        *map = e->map;
+        if (e->ret & BDRV_BLOCK_OFFSET_VALID) {
+            *map += offset - e->offset;
+        }
+        *file = e->file;
+        return true;
+    }
+
+    return false;
+}
+
+/* Remember a driver answer, unless the mapping changed while it was made */
+static void bdrv_bsc_insert(BlockDriverState *bs, uint64_t gen, bool want_zero,
+                            int ret, int64_t offset, int64_t bytes,
+                            int64_t map, BlockDriverState *file)
+{
+    if (gen != bs->bsc_gen || !bdrv_bsc_enabled(bs)) {
+        return;
+    }
+
+    bs->bsc[bs->bsc_next] = (BdrvBlockStatusCacheEntry) {
+        .valid      = true,
+        .want_zero  = want_zero,
+        .ret        = ret,
+        .offset     = offset,
+        .bytes      = bytes,
+        .map        = map,
+        .file       = file,
+    };
+    bs->bsc_next = (bs->bsc_next + 1) % BDRV_BSC_SIZE;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2142,9 +2276,18 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_offset = QEMU_ALIGN_DOWN(offset, align);
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
-    ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                        aligned_bytes, pnum, &local_map,
-                                        &local_file);
+    if (!bdrv_bsc_lookup(bs, want_zero, aligned_offset, aligned_bytes, &ret,
+                         pnum, &local_map, &local_file)) {
+        uint64_t gen = bs->bsc_gen;
+
+        ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                            aligned_bytes, pnum, &local_map,
+                                            &local_file);
+        if (ret >= 0) {
+            bdrv_bsc_insert(bs, gen, want_zero, ret, aligned_offset, *pnum,
+                            local_map, local_file);
+        }
+    }
     if (ret < 0) {
         *pnum = 0;
         goto out;
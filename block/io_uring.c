@@ -0,0 +1,451 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright (C) 2009 IBM, Corp.
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+/* io_uring ring size */
+#define MAX_ENTRIES 128
+
+/* Number of slots in the registered file table */
+#define MAX_FILES 64
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may come back short and are then resubmitted for the
+     * rest, see luring_resubmit_short_read().
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /*
+     * Registered file table, -1 marks a free slot.  Requests on a
+     * registered file skip the per-request fget/fput in the kernel.
+     */
+    int files[MAX_FILES];
+    bool has_files;
+};
+
+static void ioq_submit(LuringState *s);
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Unlike linux-aio, io_uring does not return short reads only at EOF:
+ * buffered reads can stop early too.  Resubmit the remainder of the
+ * request.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    resubmit_qiov = &luringcb->resubmit_qiov;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)resubmit_qiov->iov;
+    luringcb->sqeq.len = resubmit_qiov->niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests and wakes up their coroutines.
+ *
+ * Request completions can run a nested event loop, so the completion BH
+ * is scheduled while processing; a nested aio_poll() then sees the
+ * remaining completed requests.  The BH is cancelled once the completion
+ * queue is empty.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        int total_bytes;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        /* total_read is non-zero only for resubmitted read requests */
+        total_bytes = ret + luringcb->total_read;
+
+        if (ret < 0) {
+            if (ret == -EINTR) {
+                luring_resubmit(s, luringcb);
+                continue;
+            }
+        } else if (!luringcb->qiov) {
+            /* fsync */
+            ret = 0;
+        } else if (total_bytes == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                continue;
+            }
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total_bytes, 0,
+                              luringcb->qiov->size - total_bytes);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+
+        luringcb->ret = ret;
+        if (luringcb->resubmit_qiov.iov) {
+            qemu_iovec_destroy(&luringcb->resubmit_qiov);
+        }
+
+        /* If the coroutine is already entered it must be in ioq_submit() and
+         * will notice luringcb->ret has been filled in when it eventually
+         * runs later.  Coroutines cannot be entered recursively so avoid
+         * doing that!
+         */
+        if (!qemu_coroutine_entered(luringcb->co)) {
+            aio_co_wake(luringcb->co);
+        }
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+/*
+ * Completions are visible in the shared CQ ring without a system call,
+ * so aio_poll() busy waiting can pick them up directly.
+ */
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Move queued requests into the submission ring and submit them all with
+ * a single io_uring_enter().  Requests that do not fit in the ring stay
+ * queued until completions make room.
+ */
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb, *luringcb_next;
+    int ret;
+
+    while (s->io_q.in_queue > 0) {
+        QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
+                              luringcb_next) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* Retried from the completion path once requests finish */
+            break;
+        }
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /* We can try to complete something just right away if there are
+         * still requests in-flight. */
+        luring_process_completions(s);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    trace_luring_io_plug(s);
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    trace_luring_io_unplug(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_do_submit(LuringState *s, LuringAIOCB *luringcb,
+                             int fd, int fd_index, uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+
+    if (fd_index >= 0) {
+        fd = fd_index;
+    }
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, luringcb->qiov->iov,
+                             luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, fd, luringcb->qiov->iov,
+                            luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        abort();
+    }
+    if (fd_index >= 0) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * Submit a read, write or flush (@qiov is NULL) on @fd.  When @fd_index is
+ * not negative it is the slot of @fd in the registered file table, see
+ * luring_register_fd().
+ */
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  int fd_index, uint64_t offset,
+                                  QEMUIOVector *qiov, int type)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset,
+                           qiov ? qiov->size : 0, type);
+    luring_do_submit(s, &luringcb, fd, fd_index, offset, type);
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+/*
+ * Put @fd in the registered file table.  Returns its slot, or -1 if there
+ * is no free slot or the kernel cannot update the table; the caller then
+ * keeps submitting with the plain file descriptor.  The slot must be
+ * released with luring_unregister_fd() before @fd is closed.
+ */
+int luring_register_fd(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->has_files) {
+        return -1;
+    }
+
+    for (i = 0; i < MAX_FILES; i++) {
+        if (s->files[i] == -1) {
+            break;
+        }
+    }
+    if (i == MAX_FILES ||
+        io_uring_register_files_update(&s->ring, i, &fd, 1) != 1) {
+        return -1;
+    }
+
+    s->files[i] = fd;
+    trace_luring_register_fd(s, fd, i);
+    return i;
+}
+
+void luring_unregister_fd(LuringState *s, int fd_index)
+{
+    int fd = -1;
+
+    if (fd_index < 0) {
+        return;
+    }
+
+    assert(fd_index < MAX_FILES && s->files[fd_index] != -1);
+    io_uring_register_files_update(&s->ring, fd_index, &fd, 1);
+    s->files[fd_index] = -1;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
+                       s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL,
+                       qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    int rc, i;
+    LuringState *s;
+
+    s = g_malloc0(sizeof(*s));
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+
+    /*
+     * Register an empty file table that luring_register_fd() fills in.
+     * Sparse tables need Linux 5.5; older kernels just use plain fds.
+     */
+    for (i = 0; i < MAX_FILES; i++) {
+        s->files[i] = -1;
+    }
+    s->has_files = io_uring_register_files(&s->ring, s->files,
+                                           MAX_FILES) == 0;
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    g_free(s);
+}
@@ -47,10 +47,30 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+/*
+ * Pick the connection for a new request.  If the server allows several
+ * connections, requests go to the one with the fewest requests in flight.
+ */
+static NBDClientSession *nbd_client_pick_session(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *sessions, *best;
+    int i, num_sessions;
+
+    sessions = nbd_get_client_sessions(bs, &num_sessions);
+    best = &sessions[0];
+    for (i = 1; i < num_sessions; i++) {
+        NBDClientSession *s = &sessions[i];
+
+        if (best->quit || (!s->quit && s->in_flight < best->in_flight)) {
+            best = s;
+        }
+    }
+
+    return best;
+}
 
+static void nbd_teardown_connection(NBDClientSession *client)
+{
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -59,9 +79,9 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     qio_channel_shutdown(client->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    BDRV_POLL_WHILE(bs, client->read_reply_co);
+    BDRV_POLL_WHILE(client->bs, client->read_reply_co);
 
-    nbd_client_detach_aio_context(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -118,11 +138,10 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
     s->read_reply_co = NULL;
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientSession *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -750,12 +769,11 @@ static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+static int nbd_co_request(NBDClientSession *client, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -764,7 +782,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(client, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -781,7 +799,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -794,7 +812,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -810,7 +828,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -828,13 +846,13 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(client, &request, qiov);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int bytes, BdrvRequestFlags flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -857,12 +875,14 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    /* With several connections the server guarantees that a flush on any
+     * of them covers the writes completed on all of them */
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
 
     if (!(client->info.flags & NBD_FLAG_SEND_FLUSH)) {
@@ -872,12 +892,12 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -889,7 +909,7 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
@@ -900,7 +920,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
 {
     int64_t ret;
     NBDExtent extent = { 0 };
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_client_pick_session(bs);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -917,7 +937,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -939,33 +959,56 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    NBDClientSession *sessions;
+    int i, num_sessions;
+
+    sessions = nbd_get_client_sessions(bs, &num_sessions);
+    for (i = 0; i < num_sessions; i++) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(sessions[i].ioc));
+    }
 }
 
-void nbd_client_attach_aio_context(BlockDriverState *bs,
-                                   AioContext *new_context)
+static void nbd_client_session_attach(NBDClientSession *client,
+                                      AioContext *new_context)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
     aio_co_schedule(new_context, client->read_reply_co);
 }
 
+void nbd_client_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    NBDClientSession *sessions;
+    int i, num_sessions;
+
+    sessions = nbd_get_client_sessions(bs, &num_sessions);
+    for (i = 0; i < num_sessions; i++) {
+        nbd_client_session_attach(&sessions[i], new_context);
+    }
+}
+
 void nbd_client_close(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *sessions;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i, num_sessions;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    sessions = nbd_get_client_sessions(bs, &num_sessions);
+    for (i = 0; i < num_sessions; i++) {
+        NBDClientSession *client = &sessions[i];
 
-    nbd_send_request(client->ioc, &request);
+        if (client->ioc == NULL) {
+            continue;
+        }
+
+        nbd_send_request(client->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(client);
+    }
 }
 
 int nbd_client_init(BlockDriverState *bs,
+                    NBDClientSession *client,
                     QIOChannelSocket *sioc,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
@@ -973,7 +1016,6 @@ int nbd_client_init(BlockDriverState *bs,
                     const char *x_dirty_bitmap,
                     Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
@@ -1014,6 +1056,7 @@ int nbd_client_init(BlockDriverState *bs,
 
     qemu_co_mutex_init(&client->send_mutex);
     qemu_co_queue_init(&client->free_sema);
+    client->bs = bs;
     client->sioc = sioc;
     object_ref(OBJECT(client->sioc));
 
@@ -1026,7 +1069,7 @@ int nbd_client_init(BlockDriverState *bs,
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_client_session_attach(client, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
@@ -16,6 +16,7 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define NBD_MAX_CONNECTIONS 16
 
 typedef struct {
     Coroutine *coroutine;
@@ -24,6 +25,7 @@ typedef struct {
 } NBDClientRequest;
 
 typedef struct NBDClientSession {
+    BlockDriverState *bs;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     NBDExportInfo info;
@@ -39,8 +41,11 @@ typedef struct NBDClientSession {
 } NBDClientSession;
 
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
+NBDClientSession *nbd_get_client_sessions(BlockDriverState *bs,
+                                          int *num_sessions);
 
 int nbd_client_init(BlockDriverState *bs,
+                    NBDClientSession *client,
                     QIOChannelSocket *sock,
                     const char *export_name,
                     QCryptoTLSCreds *tlscreds,
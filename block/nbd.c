@@ -40,11 +40,13 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NBDClientSession client;
+    NBDClientSession *client;
+    int num_connections;
 
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
@@ -292,7 +294,16 @@ done:
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
-    return &s->client;
+    return &s->client[0];
+}
+
+NBDClientSession *nbd_get_client_sessions(BlockDriverState *bs,
+                                          int *num_sessions)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    *num_sessions = s->num_connections;
+    return s->client;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -384,6 +395,11 @@ static QemuOptsList nbd_runtime_opts = {
             .help = "experimental: expose named dirty bitmap in place of "
                     "block status",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server",
+        },
         { /* end of list */ }
     },
 };
@@ -397,7 +413,8 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QIOChannelSocket *sioc = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
-    int ret = -EINVAL;
+    uint64_t connections;
+    int i, ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -434,18 +451,55 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = s->saddr->u.inet.host;
     }
 
-    /* establish TCP connection, return error if it fails
-     * TODO: Configurable retry-until-timeout behaviour.
-     */
-    sioc = nbd_establish_connection(s->saddr, errp);
-    if (!sioc) {
-        ret = -ECONNREFUSED;
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
         goto error;
     }
+    s->client = g_new0(NBDClientSession, connections);
+
+    for (i = 0; i < connections; i++) {
+        NBDClientSession *client = &s->client[i];
+
+        /* establish TCP connection, return error if it fails
+         * TODO: Configurable retry-until-timeout behaviour.
+         */
+        sioc = nbd_establish_connection(s->saddr, errp);
+        if (!sioc) {
+            ret = -ECONNREFUSED;
+            goto error;
+        }
+
+        /* NBD handshake */
+        ret = nbd_client_init(bs, client, sioc, s->export, tlscreds,
+                              hostname, qemu_opt_get(opts, "x-dirty-bitmap"),
+                              errp);
+        object_unref(OBJECT(sioc));
+        sioc = NULL;
+        if (ret < 0) {
+            goto error;
+        }
+        s->num_connections++;
+
+        if (i == 0) {
+            /* Only servers that promise consistent results across
+             * connections (in particular for flush) may be striped over */
+            if (connections > 1 &&
+                !(client->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+                warn_report("NBD server does not support multiple "
+                            "connections, using a single connection");
+                connections = 1;
+            }
+        } else if (client->info.size != s->client[0].info.size ||
+                   client->info.flags != s->client[0].info.flags) {
+            error_setg(errp, "NBD server reported different export "
+                       "parameters on connection %d", i);
+            ret = -EINVAL;
+            goto error;
+        }
+    }
 
-    /* NBD handshake */
-    ret = nbd_client_init(bs, sioc, s->export, tlscreds, hostname,
-                          qemu_opt_get(opts, "x-dirty-bitmap"), errp);
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -454,6 +508,10 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         object_unref(OBJECT(tlscreds));
     }
     if (ret < 0) {
+        if (s->num_connections) {
+            nbd_client_close(bs);
+        }
+        g_free(s->client);
         qapi_free_SocketAddress(s->saddr);
         g_free(s->export);
         g_free(s->tlscredsid);
@@ -490,6 +548,7 @@ static void nbd_close(BlockDriverState *bs)
 
     nbd_client_close(bs);
 
+    g_free(s->client);
     qapi_free_SocketAddress(s->saddr);
     g_free(s->export);
     g_free(s->tlscredsid);
@@ -499,7 +558,7 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.info.size;
+    return s->client[0].info.size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
@@ -559,6 +618,9 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put_str(opts, "tls-creds", s->tlscredsid);
     }
+    if (s->num_connections > 1) {
+        qdict_put_int(opts, "connections", s->num_connections);
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -429,29 +429,33 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockAcctCounters c;
 
-    ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
-    ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
-    ds->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
-    ds->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
+    block_acct_get_counters(stats, &c);
 
-    ds->failed_rd_operations = stats->failed_ops[BLOCK_ACCT_READ];
-    ds->failed_wr_operations = stats->failed_ops[BLOCK_ACCT_WRITE];
-    ds->failed_flush_operations = stats->failed_ops[BLOCK_ACCT_FLUSH];
+    ds->rd_bytes = c.nr_bytes[BLOCK_ACCT_READ];
+    ds->wr_bytes = c.nr_bytes[BLOCK_ACCT_WRITE];
+    ds->rd_operations = c.nr_ops[BLOCK_ACCT_READ];
+    ds->wr_operations = c.nr_ops[BLOCK_ACCT_WRITE];
 
-    ds->invalid_rd_operations = stats->invalid_ops[BLOCK_ACCT_READ];
-    ds->invalid_wr_operations = stats->invalid_ops[BLOCK_ACCT_WRITE];
+    ds->failed_rd_operations = c.failed_ops[BLOCK_ACCT_READ];
+    ds->failed_wr_operations = c.failed_ops[BLOCK_ACCT_WRITE];
+    ds->failed_flush_operations = c.failed_ops[BLOCK_ACCT_FLUSH];
+
+    ds->invalid_rd_operations = c.invalid_ops[BLOCK_ACCT_READ];
+    ds->invalid_wr_operations = c.invalid_ops[BLOCK_ACCT_WRITE];
     ds->invalid_flush_operations =
-        stats->invalid_ops[BLOCK_ACCT_FLUSH];
+        c.invalid_ops[BLOCK_ACCT_FLUSH];
 
-    ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
-    ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
-    ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
-    ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
-    ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
-    ds->flush_total_time_ns = stats->total_time_ns[BLOCK_ACCT_FLUSH];
+    ds->rd_merged = c.merged[BLOCK_ACCT_READ];
+    ds->wr_merged = c.merged[BLOCK_ACCT_WRITE];
+    ds->rd_merge_gap_bytes = c.merge_gap_bytes[BLOCK_ACCT_READ];
+    ds->flush_operations = c.nr_ops[BLOCK_ACCT_FLUSH];
+    ds->wr_total_time_ns = c.total_time_ns[BLOCK_ACCT_WRITE];
+    ds->rd_total_time_ns = c.total_time_ns[BLOCK_ACCT_READ];
+    ds->flush_total_time_ns = c.total_time_ns[BLOCK_ACCT_FLUSH];
 
-    ds->has_idle_time_ns = stats->last_access_time_ns > 0;
+    ds->has_idle_time_ns = c.last_access_time_ns > 0;
     if (ds->has_idle_time_ns) {
         ds->idle_time_ns = block_acct_idle_time_ns(stats);
     }
@@ -529,6 +533,11 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    if (s->driver_specific) {
+        s->has_driver_specific = true;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
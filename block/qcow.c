@@ -1050,6 +1050,7 @@ static int qcow_make_empty(BlockDriverState *bs)
     memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
     memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
     memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
 
     return 0;
 }
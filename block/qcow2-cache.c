@@ -33,6 +33,10 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* CLOCK reference bit, set on every access */
+    bool     referenced;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -44,6 +48,16 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Offset -> entry index; hash_size is a power of two */
+    int                    *hash_buckets;
+    int                     hash_size;
+    /* Next entry to be considered for eviction */
+    int                     clock_hand;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -86,6 +100,88 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+static inline int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size) & (c->hash_size - 1);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->hash_buckets[qcow2_cache_hash(c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+/* Changes the offset of entry @i, keeping the hash table up to date */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        p = &c->hash_buckets[qcow2_cache_hash(c, t->offset)];
+        while (*p != i) {
+            assert(*p >= 0);
+            p = &c->entries[*p].hash_next;
+        }
+        *p = t->hash_next;
+        t->hash_next = -1;
+    }
+
+    t->offset = offset;
+
+    if (offset) {
+        p = &c->hash_buckets[qcow2_cache_hash(c, offset)];
+        t->hash_next = *p;
+        *p = i;
+    }
+}
+
+static void qcow2_cache_reset_hash(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->hash_size; i++) {
+        c->hash_buckets[i] = -1;
+    }
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].hash_next = -1;
+    }
+}
+
+/*
+ * Picks an entry to be replaced using the CLOCK algorithm: unused entries
+ * are taken immediately, entries that were accessed since the hand last
+ * passed them get a second chance.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+
+        if (t->ref) {
+            continue;
+        }
+        if (t->offset && t->referenced) {
+            t->referenced = false;
+            continue;
+        }
+        return i;
+    }
+
+    return -1;
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -106,8 +202,9 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_set_offset(c, i, 0);
             c->entries[i].lru_counter = 0;
+            c->entries[i].referenced = false;
             i++;
             to_clean++;
         }
@@ -137,12 +234,17 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
+    c->hash_size = pow2ceil(num_tables);
+    c->hash_buckets = g_try_new(int, c->hash_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->hash_buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->hash_buckets);
         g_free(c);
         c = NULL;
+    } else {
+        qcow2_cache_reset_hash(c);
     }
 
     return c;
@@ -158,6 +260,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
 
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->hash_buckets);
     g_free(c);
 
     return 0;
@@ -309,11 +412,14 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
         c->entries[i].lru_counter = 0;
+        c->entries[i].referenced = false;
     }
+    qcow2_cache_reset_hash(c);
 
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
@@ -324,9 +430,6 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -341,29 +444,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
+    }
+    c->misses++;
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_find_victim(c);
+    if (i < 0) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -372,9 +467,13 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
+    if (c->entries[i].offset) {
+        c->evictions++;
+    }
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -388,11 +487,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    c->entries[i].referenced = true;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -438,12 +538,12 @@ void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (!offset) {
+        return NULL;
     }
-    return NULL;
+
+    i = qcow2_cache_lookup(c, offset);
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -452,9 +552,17 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     c->entries[i].lru_counter = 0;
     c->entries[i].dirty = false;
+    c->entries[i].referenced = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+}
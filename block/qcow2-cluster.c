@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -211,7 +210,7 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int start_of_slice = sizeof(uint64_t) *
+    int start_of_slice = l2_entry_size(s) *
         (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
     return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
@@ -279,7 +278,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -300,7 +299,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
@@ -364,7 +363,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -377,13 +376,14 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_slice, uint64_t stop_flags)
+static int count_contiguous_clusters(BlockDriverState *bs, int nb_clusters,
+        uint64_t *l2_slice, int l2_index, uint64_t stop_flags)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
     QCow2ClusterType first_cluster_type;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_slice[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset) {
@@ -396,8 +396,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
            first_cluster_type == QCOW2_CLUSTER_ZERO_ALLOC);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -409,16 +409,19 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
  * Checks how many consecutive unallocated clusters in a given L2
  * slice have the same cluster type.
  */
-static int count_contiguous_clusters_unallocated(int nb_clusters,
+static int count_contiguous_clusters_unallocated(BlockDriverState *bs,
+                                                 int nb_clusters,
                                                  uint64_t *l2_slice,
+                                                 int l2_index,
                                                  QCow2ClusterType wanted_type)
 {
+    BDRVQcow2State *s = bs->opaque;
     int i;
 
     assert(wanted_type == QCOW2_CLUSTER_ZERO_PLAIN ||
            wanted_type == QCOW2_CLUSTER_UNALLOCATED);
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t entry = be64_to_cpu(l2_slice[i]);
+        uint64_t entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType type = qcow2_get_cluster_type(entry);
 
         if (type != wanted_type) {
@@ -429,6 +432,59 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     return i;
 }
 
+/*
+ * For images with extended L2 entries: counts how many consecutive
+ * subclusters, starting with subcluster @sc_index of the cluster at
+ * @l2_index, have the same type as the first one. Allocated subclusters must
+ * also be contiguous in the image file. The search stops at compressed
+ * clusters, at clusters with an invalid bitmap and after @nb_clusters
+ * clusters.
+ */
+static int count_contiguous_subclusters(BlockDriverState *bs, int nb_clusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        int l2_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QCow2ClusterType expected_type = QCOW2_CLUSTER_UNALLOCATED;
+    uint64_t expected_offset = 0;
+    bool check_offset = false;
+    int count = 0;
+    int i, j;
+
+    assert(has_subclusters(s));
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+        if ((l2_entry & QCOW_OFLAG_COMPRESSED) ||
+            !qcow2_l2_bitmap_is_valid(l2_entry, l2_bitmap)) {
+            break;
+        }
+
+        for (j = (i == 0) ? sc_index : 0; j < s->subclusters_per_cluster; j++) {
+            QCow2ClusterType type =
+                qcow2_get_subcluster_type(l2_entry, l2_bitmap, j);
+            uint64_t host_offset = (l2_entry & L2E_OFFSET_MASK) +
+                                   ((uint64_t) j << s->subcluster_bits);
+
+            if (count == 0) {
+                expected_type = type;
+                check_offset = type == QCOW2_CLUSTER_NORMAL ||
+                               type == QCOW2_CLUSTER_ZERO_ALLOC;
+                expected_offset = host_offset;
+            } else if (type != expected_type ||
+                       (check_offset && host_offset != expected_offset)) {
+                return count;
+            }
+
+            expected_offset += s->subcluster_size;
+            count++;
+        }
+    }
+
+    return count;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -529,8 +585,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                              unsigned int *bytes, uint64_t *cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int l2_index;
+    unsigned int l2_index, sc_index;
     uint64_t l1_index, l2_offset, *l2_slice;
+    uint64_t l2_entry, l2_bitmap;
     int c;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
@@ -584,7 +641,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = offset_to_l2_slice_index(s, offset);
-    *cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -592,7 +651,18 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
-    type = qcow2_get_cluster_type(*cluster_offset);
+    if (has_subclusters(s)) {
+        if (!qcow2_l2_bitmap_is_valid(l2_entry, l2_bitmap)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry "
+                                    "found (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+        type = qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index);
+    } else {
+        type = qcow2_get_cluster_type(l2_entry);
+    }
     if (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
                                 type == QCOW2_CLUSTER_ZERO_ALLOC)) {
         qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
@@ -605,21 +675,37 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     case QCOW2_CLUSTER_COMPRESSED:
         /* Compressed clusters can only be processed one by one */
         c = 1;
-        *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        *cluster_offset = l2_entry & L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        bytes_available = (int64_t)c * s->cluster_size;
         break;
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_unallocated(nb_clusters,
-                                                  &l2_slice[l2_index], type);
+        if (has_subclusters(s)) {
+            c = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                             l2_slice, l2_index);
+            bytes_available = (int64_t)(sc_index + c) << s->subcluster_bits;
+        } else {
+            c = count_contiguous_clusters_unallocated(bs, nb_clusters,
+                                                      l2_slice, l2_index,
+                                                      type);
+            bytes_available = (int64_t)c * s->cluster_size;
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_ZERO_ALLOC:
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_ZERO);
-        *cluster_offset &= L2E_OFFSET_MASK;
+        if (has_subclusters(s)) {
+            c = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                             l2_slice, l2_index);
+            bytes_available = (int64_t)(sc_index + c) << s->subcluster_bits;
+        } else {
+            c = count_contiguous_clusters(bs, nb_clusters, l2_slice, l2_index,
+                                          QCOW_OFLAG_ZERO);
+            bytes_available = (int64_t)c * s->cluster_size;
+        }
+        *cluster_offset = l2_entry & L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1,
                                     "Cluster allocation offset %#"
@@ -636,8 +722,6 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
-    bytes_available = (int64_t)c * s->cluster_size;
-
 out:
     if (bytes_available > bytes_needed) {
         bytes_available = bytes_needed;
@@ -704,7 +788,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
 
@@ -759,7 +843,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
         return 0;
@@ -783,7 +867,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-    l2_slice[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     return cluster_offset;
@@ -958,18 +1045,48 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_slice, l2_index + i);
+
         /* if two concurrent writes happen to the same unallocated cluster
          * each write allocates separate cluster and writes data concurrently.
          * The first one to complete updates l2 table with pointer to its
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_slice[l2_index + i] != 0) {
-            old_cluster[j++] = l2_slice[l2_index + i];
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
         }
 
-        l2_slice[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i,
+                     (cluster_offset + (i << s->cluster_bits)) |
+                     QCOW_OFLAG_COPIED);
+
+        /*
+         * With extended L2 entries, mark the subclusters that have been
+         * written (either with guest data or by COW) as allocated. The
+         * others keep their old state, which is only possible if the old
+         * cluster was unallocated or if it is being reused.
+         */
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+            unsigned written_from = m->cow_start.offset;
+            unsigned written_to = m->cow_end.offset + m->cow_end.nb_bytes;
+            int first_sc, last_sc;
+
+            /* Narrow written_from and written_to down to this cluster */
+            written_from = MAX(written_from, i << s->cluster_bits);
+            written_to = MIN(written_to, (i + 1) << s->cluster_bits);
+            assert(written_from < written_to);
+
+            if (!m->keep_old_clusters) {
+                l2_bitmap &= ~QCOW_L2_BITMAP_ALL_ALLOC;
+            }
+            first_sc = offset_to_sc_index(s, written_from);
+            last_sc = offset_to_sc_index(s, written_to - 1);
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc + 1);
+            l2_bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc + 1);
+            set_l2_bitmap(s, l2_slice, l2_index + i, l2_bitmap);
+        }
      }
 
 
@@ -983,7 +1100,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (!m->keep_old_clusters && j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -1001,8 +1118,11 @@ err:
 void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
-    qcow2_free_clusters(bs, m->alloc_offset, m->nb_clusters << s->cluster_bits,
-                        QCOW2_DISCARD_NEVER);
+    if (!m->keep_old_clusters) {
+        qcow2_free_clusters(bs, m->alloc_offset,
+                            m->nb_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+    }
 }
 
 /*
@@ -1016,7 +1136,7 @@ static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -1040,6 +1160,110 @@ out:
     return i;
 }
 
+/*
+ * For images with extended L2 entries: returns how many of the first
+ * @nb_clusters clusters at @l2_index have all subclusters allocated that the
+ * write request at @guest_offset touches, i.e. can be written in place
+ * without updating their L2 entries.
+ */
+static int count_single_write_clusters(BlockDriverState *bs, int nb_clusters,
+                                       uint64_t *l2_slice, int l2_index,
+                                       uint64_t guest_offset, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start = offset_into_cluster(s, guest_offset);
+    uint64_t end = start + bytes;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        uint64_t from = MAX(start, (uint64_t) i << s->cluster_bits);
+        uint64_t to = MIN(end, (uint64_t) (i + 1) << s->cluster_bits);
+        uint64_t mask;
+
+        if (from >= to) {
+            break;
+        }
+
+        mask = QCOW_OFLAG_SUB_ALLOC_RANGE(offset_to_sc_index(s, from),
+                                          offset_to_sc_index(s, to - 1) + 1);
+        if (!qcow2_l2_bitmap_is_valid(l2_entry, l2_bitmap) ||
+            (l2_bitmap & mask) != mask) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*
+ * For images with extended L2 entries: computes the COW regions of a new
+ * allocation of @nb_clusters clusters for a write of @bytes bytes at
+ * @guest_offset. Only the head and the tail of the partially written
+ * subclusters need to be copied, unless the old cluster contents must be
+ * preserved as a whole (shared or compressed clusters). If @keep_old is true
+ * the clusters are reused, so subclusters that are already allocated need no
+ * COW either.
+ *
+ * The offsets are relative to the start of the first cluster, as in
+ * QCowL2Meta.
+ */
+static void calculate_subcluster_cow(BlockDriverState *bs,
+                                     uint64_t *l2_slice, int l2_index,
+                                     int nb_clusters, uint64_t guest_offset,
+                                     unsigned nb_bytes, bool keep_old,
+                                     Qcow2COWRegion *cow_start,
+                                     Qcow2COWRegion *cow_end)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned start = offset_into_cluster(s, guest_offset);
+    unsigned end = nb_bytes;
+    unsigned avail = nb_clusters << s->cluster_bits;
+    uint64_t l2_entry, l2_bitmap;
+    unsigned cow_from, cow_to;
+
+    /* Head: the subcluster containing the start of the request */
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    if (keep_old) {
+        cow_from = QEMU_ALIGN_DOWN(start, s->subcluster_size);
+        if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(offset_to_sc_index(s, start))) {
+            cow_from = start;
+        }
+    } else if (qcow2_get_cluster_type(l2_entry) ==
+               QCOW2_CLUSTER_UNALLOCATED) {
+        cow_from = QEMU_ALIGN_DOWN(start, s->subcluster_size);
+    } else {
+        cow_from = 0;
+    }
+    *cow_start = (Qcow2COWRegion) {
+        .offset     = cow_from,
+        .nb_bytes   = start - cow_from,
+    };
+
+    /* Tail: the subcluster containing the end of the request */
+    l2_entry = get_l2_entry(s, l2_slice, l2_index + nb_clusters - 1);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + nb_clusters - 1);
+    if (keep_old) {
+        cow_to = ROUND_UP(end, s->subcluster_size);
+        if (l2_bitmap &
+            QCOW_OFLAG_SUB_ALLOC(offset_to_sc_index(s, end - 1))) {
+            cow_to = end;
+        }
+    } else if (qcow2_get_cluster_type(l2_entry) ==
+               QCOW2_CLUSTER_UNALLOCATED) {
+        cow_to = ROUND_UP(end, s->subcluster_size);
+    } else {
+        cow_to = avail;
+    }
+    assert(cow_to <= avail);
+    *cow_end = (Qcow2COWRegion) {
+        .offset     = end,
+        .nb_bytes   = cow_to - end,
+    };
+}
+
 /*
  * Check if there already is an AIO write request in flight which allocates
  * the same cluster. In this case we need to wait until the previous
@@ -1065,11 +1289,20 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 
         uint64_t start = guest_offset;
         uint64_t end = start + bytes;
-        uint64_t old_start = l2meta_cow_start(old_alloc);
-        uint64_t old_end = l2meta_cow_end(old_alloc);
+        /* With subclusters, the COW regions of an allocation need not cover
+         * whole clusters, but no other request may allocate the same
+         * clusters in the meantime */
+        uint64_t old_start = start_of_cluster(s, l2meta_cow_start(old_alloc));
+        uint64_t old_end = ROUND_UP(l2meta_cow_end(old_alloc),
+                                    s->cluster_size);
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
+        } else if (old_alloc->keep_old_clusters &&
+                   (end <= l2meta_cow_start(old_alloc) ||
+                    start >= l2meta_cow_end(old_alloc))) {
+            /* The clusters are already allocated and only the parts
+             * written by the in-flight request change; no conflict */
         } else {
             if (start < old_start) {
                 /* Stop at the start of a running allocation */
@@ -1159,7 +1392,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1186,11 +1419,22 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index],
+            count_contiguous_clusters(bs, nb_clusters, l2_slice, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
+        if (has_subclusters(s)) {
+            keep_clusters = count_single_write_clusters(bs, keep_clusters,
+                                                        l2_slice, l2_index,
+                                                        guest_offset, *bytes);
+        }
+
+        if (keep_clusters == 0) {
+            /* Subclusters must be allocated first, see handle_alloc() */
+            ret = 0;
+            goto out;
+        }
+
         *bytes = MIN(*bytes,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
@@ -1315,11 +1559,27 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_slice[l2_index]);
+    entry = get_l2_entry(s, l2_slice, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
+    } else if (has_subclusters(s) &&
+               qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+               (entry & QCOW_OFLAG_COPIED)) {
+        /* handle_copied() didn't take this cluster because some of the
+         * subclusters that the request touches are still unallocated.
+         * Allocate them inside the existing cluster, one cluster at a time */
+        if (*host_offset &&
+            start_of_cluster(s, *host_offset) != (entry & L2E_OFFSET_MASK)) {
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+            *bytes = 0;
+            return 0;
+        }
+
+        nb_clusters = 1;
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        keep_old_clusters = true;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_slice, l2_index);
     }
@@ -1349,8 +1609,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
          * would be fine, too, but count_cow_clusters() above has limited
          * nb_clusters already to a range of COW clusters */
         preallocated_nb_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_COPIED);
+            count_contiguous_clusters(bs, nb_clusters, l2_slice, l2_index,
+                                      QCOW_OFLAG_COPIED);
         assert(preallocated_nb_clusters > 0);
 
         nb_clusters = preallocated_nb_clusters;
@@ -1407,8 +1667,34 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
     int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
     int nb_bytes = MIN(requested_bytes, avail_bytes);
+    Qcow2COWRegion cow_start = {
+        .offset     = 0,
+        .nb_bytes   = offset_into_cluster(s, guest_offset),
+    };
+    Qcow2COWRegion cow_end = {
+        .offset     = nb_bytes,
+        .nb_bytes   = avail_bytes - nb_bytes,
+    };
     QCowL2Meta *old_m = *m;
 
+    if (has_subclusters(s)) {
+        /* Look at the old L2 entries again to find out which parts of the
+         * first and last cluster must be copied */
+        ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
+        if (ret < 0) {
+            if (!keep_old_clusters) {
+                qcow2_free_clusters(bs, alloc_cluster_offset,
+                                    nb_clusters << s->cluster_bits,
+                                    QCOW2_DISCARD_NEVER);
+            }
+            goto fail;
+        }
+        calculate_subcluster_cow(bs, l2_slice, l2_index, nb_clusters,
+                                 guest_offset, nb_bytes, keep_old_clusters,
+                                 &cow_start, &cow_end);
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1420,14 +1706,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
         .keep_old_clusters  = keep_old_clusters,
 
-        .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
-        },
-        .cow_end = {
-            .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
-        },
+        .cow_start  = cow_start,
+        .cow_end    = cow_end,
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
@@ -1571,76 +1851,6 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
-{
-    BDRVQcow2State *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
-
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-
-        /* Allocate buffers on first decompress operation, most images are
-         * uncompressed and the memory overhead can be avoided.  The buffers
-         * are freed in .bdrv_close().
-         */
-        if (!s->cluster_data) {
-            /* one more sector for decompressed data alignment */
-            s->cluster_data = qemu_try_blockalign(bs->file->bs,
-                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size + 512);
-            if (!s->cluster_data) {
-                return -ENOMEM;
-            }
-        }
-        if (!s->cluster_cache) {
-            s->cluster_cache = g_malloc(s->cluster_size);
-        }
-
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
-    }
-    return 0;
-}
-
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 slice) and returns the number of discarded
@@ -1666,9 +1876,11 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_l2_entry;
-
-        old_l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        uint64_t old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        uint64_t new_l2_entry = old_l2_entry;
+        uint64_t new_l2_bitmap = old_l2_bitmap;
+        QCow2ClusterType cluster_type = qcow2_get_cluster_type(old_l2_entry);
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1683,34 +1895,27 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
          * If full_discard is true, the sector should not read back as zeroes,
          * but rather fall through to the backing file.
          */
-        switch (qcow2_get_cluster_type(old_l2_entry)) {
-        case QCOW2_CLUSTER_UNALLOCATED:
-            if (full_discard || !bs->backing) {
-                continue;
-            }
-            break;
-
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-            if (!full_discard) {
-                continue;
+        if (full_discard) {
+            new_l2_entry = new_l2_bitmap = 0;
+        } else if (bs->backing || (cluster_type != QCOW2_CLUSTER_UNALLOCATED &&
+                                   cluster_type != QCOW2_CLUSTER_ZERO_PLAIN)) {
+            if (has_subclusters(s)) {
+                new_l2_entry = 0;
+                new_l2_bitmap = QCOW_L2_BITMAP_ALL_ZEROES;
+            } else {
+                new_l2_entry = s->qcow_version >= 3 ? QCOW_OFLAG_ZERO : 0;
             }
-            break;
-
-        case QCOW2_CLUSTER_ZERO_ALLOC:
-        case QCOW2_CLUSTER_NORMAL:
-        case QCOW2_CLUSTER_COMPRESSED:
-            break;
+        }
 
-        default:
-            abort();
+        if (old_l2_entry == new_l2_entry && old_l2_bitmap == new_l2_bitmap) {
+            continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
-        } else {
-            l2_slice[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_slice, l2_index + i, new_l2_entry);
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
         }
 
         /* Then decrease the refcount */
@@ -1787,27 +1992,37 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_offset;
-        QCow2ClusterType cluster_type;
-
-        old_offset = be64_to_cpu(l2_slice[l2_index + i]);
+        uint64_t old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        QCow2ClusterType cluster_type = qcow2_get_cluster_type(old_l2_entry);
+        bool free_cluster = cluster_type == QCOW2_CLUSTER_COMPRESSED ||
+            (unmap && (cluster_type == QCOW2_CLUSTER_NORMAL ||
+                       cluster_type == QCOW2_CLUSTER_ZERO_ALLOC));
+        uint64_t new_l2_entry = free_cluster ? 0 : old_l2_entry;
+        uint64_t new_l2_bitmap = old_l2_bitmap;
+
+        if (has_subclusters(s)) {
+            new_l2_bitmap = QCOW_L2_BITMAP_ALL_ZEROES;
+        } else {
+            new_l2_entry |= QCOW_OFLAG_ZERO;
+        }
 
         /*
          * Minimize L2 changes if the cluster already reads back as
          * zeroes with correct allocation.
          */
-        cluster_type = qcow2_get_cluster_type(old_offset);
-        if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
-            (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
+        if (old_l2_entry == new_l2_entry && old_l2_bitmap == new_l2_bitmap) {
             continue;
         }
 
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-        if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
-            qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
-        } else {
-            l2_slice[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+        set_l2_entry(s, l2_slice, l2_index + i, new_l2_entry);
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
+        }
+        if (free_cluster) {
+            qcow2_free_any_clusters(bs, old_l2_entry, 1,
+                                    QCOW2_DISCARD_REQUEST);
         }
     }
 
@@ -1816,18 +2031,71 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
+/*
+ * Marks @nb_subclusters subclusters of the cluster at @offset as reading
+ * zeroes.  This is for partial clusters of images with extended L2 entries;
+ * whole clusters go through zero_in_l2_slice().
+ */
+static int zero_l2_subclusters(BlockDriverState *bs, uint64_t offset,
+                               unsigned nb_subclusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t old_l2_bitmap, l2_bitmap;
+    int l2_index, ret, sc = offset_to_sc_index(s, offset);
+
+    assert(nb_subclusters > 0 && nb_subclusters < s->subclusters_per_cluster);
+    assert(sc + nb_subclusters <= s->subclusters_per_cluster);
+    assert(offset_into_subcluster(s, offset) == 0);
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    switch (qcow2_get_cluster_type(get_l2_entry(s, l2_slice, l2_index))) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        /* Compressed clusters can only be replaced as a whole */
+        ret = -ENOTSUP;
+        goto out;
+    case QCOW2_CLUSTER_NORMAL:
+    case QCOW2_CLUSTER_UNALLOCATED:
+        break;
+    default:
+        /* The zero flag is reserved with extended L2 entries */
+        ret = -EIO;
+        goto out;
+    }
+
+    old_l2_bitmap = l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+
+    l2_bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(sc, sc + nb_subclusters);
+    l2_bitmap &= ~QCOW_OFLAG_SUB_ALLOC_RANGE(sc, sc + nb_subclusters);
+
+    if (old_l2_bitmap != l2_bitmap) {
+        set_l2_bitmap(s, l2_slice, l2_index, l2_bitmap);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    }
+
+    ret = 0;
+out:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
 int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t end_offset = offset + bytes;
     uint64_t nb_clusters;
+    unsigned head, tail;
     int64_t cleared;
     int ret;
 
     /* Caller must pass aligned values, except at image end */
-    assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
-    assert(QEMU_IS_ALIGNED(end_offset, s->cluster_size) ||
+    assert(offset_into_subcluster(s, offset) == 0);
+    assert(offset_into_subcluster(s, end_offset) == 0 ||
            end_offset == bs->total_sectors << BDRV_SECTOR_BITS);
 
     /* The zero flag is only supported by version 3 and newer */
@@ -1835,11 +2103,28 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
         return -ENOTSUP;
     }
 
-    /* Each L2 slice is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, bytes);
+    /* With extended L2 entries, the first and last cluster may only be
+     * partially covered; only some of their subclusters are zeroed then */
+    head = MIN(end_offset, ROUND_UP(offset, s->cluster_size)) - offset;
+    offset += head;
+
+    tail = (end_offset >= bs->total_sectors << BDRV_SECTOR_BITS) ? 0 :
+           end_offset - MAX(offset, start_of_cluster(s, end_offset));
+    end_offset -= tail;
 
     s->cache_discards = true;
 
+    if (head) {
+        ret = zero_l2_subclusters(bs, offset - head,
+                                  size_to_subclusters(s, head));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* Each L2 slice is handled by its own loop iteration */
+    nb_clusters = size_to_clusters(s, end_offset - offset);
+
     while (nb_clusters > 0) {
         cleared = zero_in_l2_slice(bs, offset, nb_clusters, flags);
         if (cleared < 0) {
@@ -1851,6 +2136,14 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
         offset += (cleared * s->cluster_size);
     }
 
+    if (tail) {
+        ret = zero_l2_subclusters(bs, end_offset,
+                                  size_to_subclusters(s, tail));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     s->cache_discards = false;
@@ -1880,7 +2173,11 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     int ret;
     int i, j;
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    /* Only used when downgrading to compat=0.10, which has no extended L2
+     * entries */
+    assert(!has_subclusters(s));
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     if (!is_active_l1) {
@@ -2151,3 +2448,399 @@ fail:
     g_free(l1_table);
     return ret;
 }
+
+/*
+ * Converts the L2 entry @l2_entry (and, for extended L2 entries, the
+ * subcluster bitmap @l2_bitmap) of the cluster at @guest_offset to the other
+ * L2 entry format. Clusters whose subclusters are not all in the same state
+ * cannot be described by a normal L2 entry; their missing subclusters are
+ * filled with zeroes or backing file data first.
+ */
+static int convert_l2_entry(BlockDriverState *bs, bool extended,
+                            uint64_t guest_offset, uint64_t *l2_entry,
+                            uint64_t *l2_bitmap, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t entry = *l2_entry;
+    uint64_t alloc, zero, host_offset;
+    uint8_t *buf;
+    int64_t cluster_offset;
+    bool new_cluster = false;
+    int sc, ret;
+
+    if (extended) {
+        switch (qcow2_get_cluster_type(entry)) {
+        case QCOW2_CLUSTER_UNALLOCATED:
+        case QCOW2_CLUSTER_COMPRESSED:
+            *l2_bitmap = 0;
+            break;
+        case QCOW2_CLUSTER_ZERO_PLAIN:
+        case QCOW2_CLUSTER_ZERO_ALLOC:
+            *l2_entry = entry & ~QCOW_OFLAG_ZERO;
+            *l2_bitmap = QCOW_L2_BITMAP_ALL_ZEROES;
+            break;
+        case QCOW2_CLUSTER_NORMAL:
+            *l2_bitmap = QCOW_L2_BITMAP_ALL_ALLOC;
+            break;
+        default:
+            abort();
+        }
+        return 0;
+    }
+
+    if (entry & QCOW_OFLAG_COMPRESSED) {
+        return 0;
+    }
+
+    if (!qcow2_l2_bitmap_is_valid(entry, *l2_bitmap)) {
+        error_setg(errp, "Invalid subcluster bitmap for guest offset %#"
+                   PRIx64, guest_offset);
+        return -EIO;
+    }
+
+    alloc = *l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+    zero = *l2_bitmap >> 32;
+    host_offset = entry & L2E_OFFSET_MASK;
+
+    if (alloc == QCOW_L2_BITMAP_ALL_ALLOC) {
+        return 0;
+    } else if (zero == QCOW_L2_BITMAP_ALL_ALLOC ||
+               (alloc == 0 && !bs->backing && (zero || host_offset))) {
+        /* Reads as zeroes, whether it has a host cluster or not */
+        *l2_entry = entry | QCOW_OFLAG_ZERO;
+        return 0;
+    } else if (alloc == 0 && zero == 0 && !host_offset) {
+        return 0;
+    }
+
+    /* Mixed cluster: make all of it allocated */
+    if (bs->encrypted) {
+        error_setg(errp, "Cannot convert partially allocated clusters of "
+                   "encrypted images");
+        return -ENOTSUP;
+    }
+
+    if (!host_offset) {
+        cluster_offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (cluster_offset < 0) {
+            error_setg_errno(errp, -cluster_offset,
+                             "Failed to allocate a data cluster");
+            return cluster_offset;
+        }
+        host_offset = cluster_offset;
+        new_cluster = true;
+    } else if (!(entry & QCOW_OFLAG_COPIED)) {
+        error_setg(errp, "Cannot convert shared partially allocated cluster "
+                   "at guest offset %#" PRIx64, guest_offset);
+        return -ENOTSUP;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->subcluster_size);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (sc = 0; sc < s->subclusters_per_cluster; sc++) {
+        uint64_t sc_offset = (uint64_t) sc << s->subcluster_bits;
+
+        if (alloc & QCOW_OFLAG_SUB_ALLOC(sc)) {
+            continue;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, host_offset + sc_offset,
+                                            s->subcluster_size);
+        if (ret < 0) {
+            break;
+        }
+
+        if ((zero & QCOW_OFLAG_SUB_ALLOC(sc)) || !bs->backing) {
+            ret = bdrv_pwrite_zeroes(bs->file, host_offset + sc_offset,
+                                     s->subcluster_size, 0);
+        } else {
+            ret = bdrv_pread(bs->backing, guest_offset + sc_offset, buf,
+                             s->subcluster_size);
+            if (ret >= 0) {
+                ret = bdrv_pwrite(bs->file, host_offset + sc_offset, buf,
+                                  s->subcluster_size);
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        goto fail;
+    }
+
+    *l2_entry = host_offset | QCOW_OFLAG_COPIED;
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Failed to fill partially allocated cluster "
+                     "at guest offset %#" PRIx64, guest_offset);
+    if (new_cluster) {
+        qcow2_free_clusters(bs, host_offset, s->cluster_size,
+                            QCOW2_DISCARD_NEVER);
+    }
+    return ret;
+}
+
+/*
+ * Switches the active L1/L2 tables between normal and extended L2 entries.
+ * All L2 tables are rewritten (an extended L2 table covers half the guest
+ * range of a normal one), then a new L1 table is written and the header is
+ * updated to point to it. Only then are the old tables freed, so a failure
+ * leaves the image in its previous state (possibly with leaked clusters).
+ *
+ * Images with internal snapshots are not supported.
+ */
+int qcow2_change_l2_entry_size(BlockDriverState *bs, bool extended,
+                               BlockDriverAmendStatusCB *status_cb,
+                               void *cb_opaque, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    size_t old_entry_size = l2_entry_size(s);
+    size_t new_entry_size = extended ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+    int old_l2_size = s->l2_size;
+    int new_l2_size = s->cluster_size / new_entry_size;
+    int64_t new_l1_size =
+        DIV_ROUND_UP((uint64_t) s->l1_size * old_l2_size, new_l2_size);
+    int64_t new_l1_size2 = new_l1_size * sizeof(uint64_t);
+    int64_t new_l1_table_offset = 0;
+    int64_t old_l1_table_offset, old_l1_size, loaded_l1_index = -1;
+    uint64_t *new_l1_table = NULL, *old_l1_table;
+    uint64_t *old_l2_table = NULL, *new_l2_table = NULL;
+    int64_t i, j;
+    int ret;
+
+    assert(extended != has_subclusters(s));
+
+    if (s->nb_snapshots) {
+        error_setg(errp, "Cannot change the L2 entry size of images with "
+                   "internal snapshots");
+        return -ENOTSUP;
+    }
+
+    if (new_l1_size > QCOW_MAX_L1_SIZE / sizeof(uint64_t)) {
+        error_setg(errp, "The image size is too large for extended L2 "
+                   "entries (try using a larger cluster size)");
+        return -EFBIG;
+    }
+
+    /* The old L2 tables are read directly from the image file */
+    ret = qcow2_cache_empty(bs, s->l2_table_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to flush the L2 table cache");
+        return ret;
+    }
+
+    if (new_l1_size) {
+        new_l1_table = qemu_try_blockalign(bs->file->bs,
+                                           ROUND_UP(new_l1_size2, 512));
+        old_l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        new_l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        if (!new_l1_table || !old_l2_table || !new_l2_table) {
+            error_setg(errp, "Failed to allocate memory for the L2 tables");
+            ret = -ENOMEM;
+            goto fail;
+        }
+        memset(new_l1_table, 0, ROUND_UP(new_l1_size2, 512));
+    }
+
+    for (i = 0; i < new_l1_size; i++) {
+        bool empty = true;
+        int64_t l2_offset;
+
+        memset(new_l2_table, 0, s->cluster_size);
+
+        for (j = 0; j < new_l2_size; j++) {
+            uint64_t cluster_index = i * new_l2_size + j;
+            int64_t old_l1_index = cluster_index / old_l2_size;
+            uint64_t l2_entry, l2_bitmap;
+
+            if (old_l1_index >= s->l1_size) {
+                break;
+            }
+
+            l2_offset = s->l1_table[old_l1_index] & L1E_OFFSET_MASK;
+            if (!l2_offset) {
+                continue;
+            }
+
+            if (old_l1_index != loaded_l1_index) {
+                if (offset_into_cluster(s, l2_offset)) {
+                    error_setg(errp, "L2 table offset %#" PRIx64 " unaligned "
+                               "(L1 index: %#" PRIx64 ")", l2_offset,
+                               old_l1_index);
+                    ret = -EIO;
+                    goto fail;
+                }
+                ret = bdrv_pread(bs->file, l2_offset, old_l2_table,
+                                 s->cluster_size);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "Failed to read L2 table");
+                    goto fail;
+                }
+                loaded_l1_index = old_l1_index;
+            }
+
+            l2_entry = get_l2_entry(s, old_l2_table,
+                                    cluster_index % old_l2_size);
+            l2_bitmap = get_l2_bitmap(s, old_l2_table,
+                                      cluster_index % old_l2_size);
+            ret = convert_l2_entry(bs, extended,
+                                   cluster_index << s->cluster_bits,
+                                   &l2_entry, &l2_bitmap, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            if (l2_entry || (extended && l2_bitmap)) {
+                new_l2_table[j * (new_entry_size / sizeof(uint64_t))] =
+                    cpu_to_be64(l2_entry);
+                if (extended) {
+                    new_l2_table[j * 2 + 1] = cpu_to_be64(l2_bitmap);
+                }
+                empty = false;
+            }
+        }
+
+        if (!empty) {
+            l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (l2_offset < 0) {
+                ret = l2_offset;
+                error_setg_errno(errp, -ret, "Failed to allocate L2 table");
+                goto fail;
+            }
+            new_l1_table[i] = l2_offset | QCOW_OFLAG_COPIED;
+
+            ret = qcow2_pre_write_overlap_check(bs, 0, l2_offset,
+                                                s->cluster_size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Failed to write L2 table");
+                goto fail;
+            }
+
+            ret = bdrv_pwrite(bs->file, l2_offset, new_l2_table,
+                              s->cluster_size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Failed to write L2 table");
+                goto fail;
+            }
+        }
+
+        if (status_cb) {
+            status_cb(bs, i + 1, new_l1_size, cb_opaque);
+        }
+    }
+
+    if (new_l1_size) {
+        new_l1_table_offset = qcow2_alloc_clusters(bs, new_l1_size2);
+        if (new_l1_table_offset < 0) {
+            ret = new_l1_table_offset;
+            new_l1_table_offset = 0;
+            error_setg_errno(errp, -ret, "Failed to allocate L1 table");
+            goto fail;
+        }
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to flush the refcount cache");
+        goto fail;
+    }
+
+    if (new_l1_size) {
+        ret = qcow2_pre_write_overlap_check(bs, 0, new_l1_table_offset,
+                                            new_l1_size2);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write L1 table");
+            goto fail;
+        }
+
+        for (i = 0; i < new_l1_size; i++) {
+            cpu_to_be64s(&new_l1_table[i]);
+        }
+        ret = bdrv_pwrite_sync(bs->file, new_l1_table_offset, new_l1_table,
+                               new_l1_size2);
+        for (i = 0; i < new_l1_size; i++) {
+            be64_to_cpus(&new_l1_table[i]);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write L1 table");
+            goto fail;
+        }
+    }
+
+    /* Switch to the new tables */
+    old_l1_table = s->l1_table;
+    old_l1_table_offset = s->l1_table_offset;
+    old_l1_size = s->l1_size;
+
+    s->l1_table = new_l1_table;
+    s->l1_table_offset = new_l1_table_offset;
+    s->l1_size = new_l1_size;
+    if (extended) {
+        s->incompatible_features |= QCOW2_INCOMPAT_EXTL2;
+    } else {
+        s->incompatible_features &= ~QCOW2_INCOMPAT_EXTL2;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->l1_table = old_l1_table;
+        s->l1_table_offset = old_l1_table_offset;
+        s->l1_size = old_l1_size;
+        s->incompatible_features ^= QCOW2_INCOMPAT_EXTL2;
+        error_setg_errno(errp, -ret, "Failed to update the image header");
+        goto fail;
+    }
+    new_l1_table = NULL;
+
+    s->l2_slice_size = s->l2_slice_size * old_entry_size / new_entry_size;
+    s->l2_bits = s->cluster_bits - ctz32(new_entry_size);
+    s->l2_size = 1 << s->l2_bits;
+    s->subclusters_per_cluster =
+        extended ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+    s->l1_vm_state_index = size_to_l1(s, bs->total_sectors * BDRV_SECTOR_SIZE);
+
+    /* The old tables are not referenced any more */
+    for (i = 0; i < old_l1_size; i++) {
+        uint64_t l2_offset = old_l1_table[i] & L1E_OFFSET_MASK;
+        if (l2_offset) {
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (old_l1_size) {
+        qcow2_free_clusters(bs, old_l1_table_offset,
+                            old_l1_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+    }
+    qemu_vfree(old_l1_table);
+
+    ret = 0;
+
+fail:
+    if (new_l1_table) {
+        for (i = 0; i < new_l1_size; i++) {
+            if (new_l1_table[i] & L1E_OFFSET_MASK) {
+                qcow2_free_clusters(bs, new_l1_table[i] & L1E_OFFSET_MASK,
+                                    s->cluster_size, QCOW2_DISCARD_OTHER);
+            }
+        }
+        if (new_l1_table_offset) {
+            qcow2_free_clusters(bs, new_l1_table_offset, new_l1_size2,
+                                QCOW2_DISCARD_OTHER);
+        }
+        qemu_vfree(new_l1_table);
+    }
+    qemu_vfree(old_l2_table);
+    qemu_vfree(new_l2_table);
+    return ret;
+}
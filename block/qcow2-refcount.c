@@ -26,10 +26,12 @@
 #include "qapi/error.h"
 #include "qemu-common.h"
 #include "block/block_int.h"
+#include "block/aio_task.h"
 #include "qcow2.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
                                     uint64_t max);
@@ -133,6 +135,7 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    qcow2_drop_used_cluster_bitmaps(bs);
     g_free(s->refcount_table);
 }
 
@@ -237,6 +240,225 @@ static int load_refcount_block(BlockDriverState *bs,
                            refcount_block);
 }
 
+/*
+ * The allocator keeps a bitmap of used clusters per refcount block so that
+ * searching for free space does not have to go through the refcount block
+ * cache for every single cluster.  Bitmaps are built lazily the first time
+ * the allocator looks at the range a refcount block covers and are kept
+ * up to date by update_refcount().  A bit may be set for a cluster that is
+ * actually free, but never the other way round.
+ *
+ * There are at most as many bitmaps as the refcount block cache has
+ * entries.  When the allocator needs another one, the least recently used
+ * bitmap is dropped.
+ */
+
+/* Forgets all used cluster bitmaps; they will be rebuilt on demand */
+void qcow2_drop_used_cluster_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t i;
+
+    for (i = 0; i < s->nb_used_cluster_bitmaps; i++) {
+        g_free(s->used_cluster_bitmaps[i].bitmap);
+    }
+    g_free(s->used_cluster_bitmaps);
+    s->used_cluster_bitmaps = NULL;
+    s->nb_used_cluster_bitmaps = 0;
+    s->used_cluster_bitmaps_loaded = 0;
+}
+
+static void drop_used_cluster_bitmap(BDRVQcow2State *s,
+                                     uint64_t refblock_index)
+{
+    Qcow2UsedClusterBitmap *ucb = &s->used_cluster_bitmaps[refblock_index];
+
+    if (ucb->bitmap) {
+        g_free(ucb->bitmap);
+        ucb->bitmap = NULL;
+        s->used_cluster_bitmaps_loaded--;
+    }
+}
+
+/* Drops the least recently used bitmap */
+static void evict_used_cluster_bitmap(BDRVQcow2State *s)
+{
+    uint64_t i, victim = 0;
+    uint64_t min_lru_counter = UINT64_MAX;
+
+    for (i = 0; i < s->nb_used_cluster_bitmaps; i++) {
+        if (s->used_cluster_bitmaps[i].bitmap &&
+            s->used_cluster_bitmaps[i].lru_counter < min_lru_counter)
+        {
+            victim = i;
+            min_lru_counter = s->used_cluster_bitmaps[i].lru_counter;
+        }
+    }
+    drop_used_cluster_bitmap(s, victim);
+}
+
+/* Forgets the bitmaps covering the host range [offset, offset + length) */
+static void invalidate_used_cluster_bitmaps(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t length)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t first, last, i;
+
+    if (length == 0) {
+        return;
+    }
+
+    first = (offset >> s->cluster_bits) >> s->refcount_block_bits;
+    last = ((offset + length - 1) >> s->cluster_bits) >> s->refcount_block_bits;
+    for (i = first; i <= last && i < s->nb_used_cluster_bitmaps; i++) {
+        drop_used_cluster_bitmap(s, i);
+    }
+}
+
+static void update_used_cluster_bitmap(BDRVQcow2State *s,
+                                       uint64_t cluster_index, bool used)
+{
+    uint64_t refblock_index = cluster_index >> s->refcount_block_bits;
+    unsigned long *bitmap;
+
+    if (refblock_index >= s->nb_used_cluster_bitmaps) {
+        return;
+    }
+    bitmap = s->used_cluster_bitmaps[refblock_index].bitmap;
+    if (!bitmap) {
+        return;
+    }
+
+    if (used) {
+        set_bit(cluster_index & (s->refcount_block_size - 1), bitmap);
+    } else {
+        clear_bit(cluster_index & (s->refcount_block_size - 1), bitmap);
+    }
+}
+
+/*
+ * Returns the used cluster bitmap for the given refcount block, building it
+ * from the refcount block if necessary.  Refcount blocks that do not exist
+ * yield an empty bitmap.
+ */
+static int get_used_cluster_bitmap(BlockDriverState *bs,
+                                   uint64_t refblock_index,
+                                   unsigned long **bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t refblock_offset = 0;
+    void *refblock;
+    Qcow2UsedClusterBitmap *ucb;
+    unsigned long *new_bitmap;
+    uint64_t i;
+    int ret;
+
+    if (refblock_index < s->nb_used_cluster_bitmaps &&
+        s->used_cluster_bitmaps[refblock_index].bitmap)
+    {
+        ucb = &s->used_cluster_bitmaps[refblock_index];
+        ucb->lru_counter = ++s->used_cluster_bitmap_lru_counter;
+        *bitmap = ucb->bitmap;
+        return 0;
+    }
+
+    if (refblock_index < s->refcount_table_size) {
+        refblock_offset = s->refcount_table[refblock_index] & REFT_OFFSET_MASK;
+    }
+    if (offset_into_cluster(s, refblock_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refblock_offset, refblock_index);
+        return -EIO;
+    }
+
+    new_bitmap = bitmap_new(s->refcount_block_size);
+    if (refblock_offset) {
+        ret = load_refcount_block(bs, refblock_offset, &refblock);
+        if (ret < 0) {
+            g_free(new_bitmap);
+            return ret;
+        }
+        for (i = 0; i < s->refcount_block_size; i++) {
+            if (s->get_refcount(refblock, i)) {
+                set_bit(i, new_bitmap);
+            }
+        }
+        qcow2_cache_put(s->refcount_block_cache, &refblock);
+    }
+
+    if (refblock_index >= s->nb_used_cluster_bitmaps) {
+        uint64_t new_size = MAX(refblock_index + 1,
+                                s->nb_used_cluster_bitmaps * 2);
+        s->used_cluster_bitmaps = g_renew(Qcow2UsedClusterBitmap,
+                                          s->used_cluster_bitmaps, new_size);
+        memset(s->used_cluster_bitmaps + s->nb_used_cluster_bitmaps, 0,
+               (new_size - s->nb_used_cluster_bitmaps) *
+               sizeof(Qcow2UsedClusterBitmap));
+        s->nb_used_cluster_bitmaps = new_size;
+    }
+    while (s->used_cluster_bitmaps_loaded >=
+           MAX(s->max_used_cluster_bitmaps, 1))
+    {
+        evict_used_cluster_bitmap(s);
+    }
+
+    ucb = &s->used_cluster_bitmaps[refblock_index];
+    ucb->bitmap = new_bitmap;
+    ucb->lru_counter = ++s->used_cluster_bitmap_lru_counter;
+    s->used_cluster_bitmaps_loaded++;
+
+    *bitmap = new_bitmap;
+    return 0;
+}
+
+/*
+ * Looks for the first cluster in [start, end) that is used (if @used is
+ * true) or free (otherwise) and stores its index in *cluster_index, or @end
+ * if there is none.  Returns 0 on success and -errno on failure.
+ */
+static int find_used_cluster(BlockDriverState *bs, uint64_t start,
+                             uint64_t end, bool used,
+                             uint64_t *cluster_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t i = start;
+    int ret;
+
+    while (i < end) {
+        uint64_t refblock_index = i >> s->refcount_block_bits;
+        uint64_t block_start = refblock_index << s->refcount_block_bits;
+        unsigned long *bitmap;
+        unsigned long bit, bits;
+
+        /* Nothing is used beyond the end of the refcount table */
+        if (refblock_index >= s->refcount_table_size) {
+            *cluster_index = used ? end : i;
+            return 0;
+        }
+
+        ret = get_used_cluster_bitmap(bs, refblock_index, &bitmap);
+        if (ret < 0) {
+            return ret;
+        }
+
+        bits = MIN(end - block_start, s->refcount_block_size);
+        if (used) {
+            bit = find_next_bit(bitmap, bits, i - block_start);
+        } else {
+            bit = find_next_zero_bit(bitmap, bits, i - block_start);
+        }
+        if (bit < bits) {
+            *cluster_index = block_start + bit;
+            return 0;
+        }
+        i = block_start + bits;
+    }
+
+    *cluster_index = end;
+    return 0;
+}
+
 /*
  * Retrieves the refcount of the cluster given by its index and stores it in
  * *refcount. Returns 0 on success and -errno on failure.
@@ -395,6 +617,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
         int block_index = (new_block >> s->cluster_bits) &
             (s->refcount_block_size - 1);
         s->set_refcount(*refcount_block, block_index, 1);
+        update_used_cluster_bitmap(s, new_block >> s->cluster_bits, true);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -604,6 +827,10 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t start_offset,
     table_offset = start_offset + additional_refblock_count * s->cluster_size;
     end_offset = table_offset + table_clusters * s->cluster_size;
 
+    /* The new refcount structures are accounted for behind the back of the
+     * used cluster bitmaps */
+    invalidate_used_cluster_bitmaps(bs, start_offset, end_offset - start_offset);
+
     /* Fill the refcount blocks, and create new ones, if necessary */
     block_offset = start_offset;
     for (i = area_reftable_index; i < total_refblock_count; i++) {
@@ -875,6 +1102,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
+        update_used_cluster_bitmap(s, cluster_index, refcount != 0);
 
         if (refcount == 0) {
             void *table;
@@ -959,7 +1187,7 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
                                     uint64_t max)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t start, used, nb_clusters;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -968,17 +1196,24 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
     }
 
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
 
+    /* Find the first run of nb_clusters free clusters */
+    start = s->free_cluster_index;
+    for (;;) {
+        ret = find_used_cluster(bs, start, UINT64_MAX, false, &start);
         if (ret < 0) {
             return ret;
-        } else if (refcount != 0) {
-            goto retry;
         }
+        ret = find_used_cluster(bs, start, start + nb_clusters, true, &used);
+        if (ret < 0) {
+            return ret;
+        }
+        if (used == start + nb_clusters) {
+            break;
+        }
+        start = used + 1;
     }
+    s->free_cluster_index = start + nb_clusters;
 
     /* Make sure that all offsets in the "allocated" range are representable
      * in the requested max */
@@ -1022,7 +1257,7 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t cluster_index, refcount;
+    uint64_t cluster_index, used;
     uint64_t i;
     int ret;
 
@@ -1034,14 +1269,12 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
-        for(i = 0; i < nb_clusters; i++) {
-            ret = qcow2_get_refcount(bs, cluster_index++, &refcount);
-            if (ret < 0) {
-                return ret;
-            } else if (refcount != 0) {
-                break;
-            }
+        ret = find_used_cluster(bs, cluster_index, cluster_index + nb_clusters,
+                                true, &used);
+        if (ret < 0) {
+            return ret;
         }
+        i = used - cluster_index;
 
         /* And then allocate them */
         ret = update_refcount(bs, offset, i << s->cluster_bits, 1, false,
@@ -1236,7 +1469,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
@@ -1292,7 +1525,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     uint64_t cluster_index;
                     uint64_t offset;
 
-                    entry = be64_to_cpu(l2_slice[j]);
+                    entry = get_l2_entry(s, l2_slice, j);
                     old_entry = entry;
                     entry &= ~QCOW_OFLAG_COPIED;
                     offset = entry & L2E_OFFSET_MASK;
@@ -1363,7 +1596,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                                        s->refcount_block_cache);
                         }
-                        l2_slice[j] = cpu_to_be64(entry);
+                        set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
                     }
@@ -1546,10 +1779,143 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Amount of L2 tables the checks read ahead of the table they process */
+#define QCOW2_CHECK_READAHEAD (8 * MiB)
+
+/*
+ * A window of L2 tables that are read in parallel and then processed in
+ * order, so the checks only keep a bounded number of tables in memory.
+ */
+typedef struct Qcow2CheckL2Batch {
+    int size;           /* Capacity */
+    int count;          /* Tables in the current window */
+    int *l1_index;
+    uint64_t *l2_offset;
+    uint64_t **l2_table;
+    int *ret;           /* Result of reading each table */
+} Qcow2CheckL2Batch;
+
+typedef struct Qcow2CheckReadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t offset;
+    void *buf;
+    int *ret;
+} Qcow2CheckReadTask;
+
+static Qcow2CheckL2Batch *check_l2_batch_new(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CheckL2Batch *batch = g_new0(Qcow2CheckL2Batch, 1);
+    int i;
+
+    batch->size = MAX(1, QCOW2_CHECK_READAHEAD / s->cluster_size);
+    batch->l1_index = g_new(int, batch->size);
+    batch->l2_offset = g_new(uint64_t, batch->size);
+    batch->l2_table = g_new(uint64_t *, batch->size);
+    batch->ret = g_new(int, batch->size);
+    for (i = 0; i < batch->size; i++) {
+        batch->l2_table[i] = qemu_blockalign(bs, s->cluster_size);
+    }
+
+    return batch;
+}
+
+static void check_l2_batch_free(Qcow2CheckL2Batch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->size; i++) {
+        qemu_vfree(batch->l2_table[i]);
+    }
+    g_free(batch->l1_index);
+    g_free(batch->l2_offset);
+    g_free(batch->l2_table);
+    g_free(batch->ret);
+    g_free(batch);
+}
+
+static int coroutine_fn check_read_task_entry(AioTask *task)
+{
+    Qcow2CheckReadTask *t = container_of(task, Qcow2CheckReadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    *t->ret = bdrv_pread(t->bs->file, t->offset, t->buf,
+                         s->l2_size * l2_entry_size(s));
+    return *t->ret < 0 ? *t->ret : 0;
+}
+
+/*
+ * Reads all L2 tables of the current window.  In coroutine context up to
+ * QCOW2_MAX_WORKERS reads are in flight at the same time.  Errors are only
+ * reported through batch->ret so that the caller can handle them at the
+ * right point of its walk.
+ */
+static void check_l2_batch_read(BlockDriverState *bs, Qcow2CheckL2Batch *batch)
+{
+    BDRVQcow2State *s = bs->opaque;
+    AioTaskPool *pool = NULL;
+    int i;
+
+    if (qemu_in_coroutine() && batch->count > 1) {
+        pool = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        Qcow2CheckReadTask *task;
+
+        if (!pool) {
+            batch->ret[i] = bdrv_pread(bs->file, batch->l2_offset[i],
+                                       batch->l2_table[i],
+                                       s->l2_size * l2_entry_size(s));
+            continue;
+        }
+
+        task = g_new(Qcow2CheckReadTask, 1);
+        *task = (Qcow2CheckReadTask) {
+            .task.func = check_read_task_entry,
+            .bs = bs,
+            .offset = batch->l2_offset[i],
+            .buf = batch->l2_table[i],
+            .ret = &batch->ret[i],
+        };
+        aio_task_pool_start_task(pool, &task->task);
+    }
+
+    if (pool) {
+        aio_task_pool_wait_all(pool);
+        aio_task_pool_free(pool);
+    }
+}
+
+/*
+ * Fills the window with the L2 tables referenced by the L1 entries starting
+ * at *l1_index and reads them.  *l1_index is advanced past the last L1 entry
+ * that was looked at.
+ */
+static void check_l2_batch_fill(BlockDriverState *bs, Qcow2CheckL2Batch *batch,
+                                const uint64_t *l1_table, int l1_size,
+                                int *l1_index)
+{
+    batch->count = 0;
+    for (; *l1_index < l1_size && batch->count < batch->size; (*l1_index)++) {
+        uint64_t l2_offset = l1_table[*l1_index] & L1E_OFFSET_MASK;
+
+        if (l2_offset) {
+            batch->l1_index[batch->count] = *l1_index;
+            batch->l2_offset[batch->count] = l2_offset;
+            batch->count++;
+        }
+    }
+
+    check_l2_batch_read(bs, batch);
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller has read from @l2_offset.
+ * While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1557,27 +1923,25 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags, BdrvCheckMode fix)
+                              uint64_t *l2_table, int flags, BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s) &&
+            !qcow2_l2_bitmap_is_valid(l2_entry,
+                                      get_l2_bitmap(s, l2_table, i))) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": L2 index %#x has "
+                    "an invalid subcluster allocation bitmap\n",
+                    l2_offset, i);
+            res->corruptions++;
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1598,7 +1962,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                            refcount_table, refcount_table_size,
                                            l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1639,24 +2003,32 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
                             offset);
                     if (fix & BDRV_FIX_ERRORS) {
+                        int idx = i * (l2_entry_size(s) / sizeof(uint64_t));
                         uint64_t l2e_offset =
-                            l2_offset + (uint64_t)i * sizeof(uint64_t);
+                            l2_offset + (uint64_t)i * l2_entry_size(s);
 
-                        l2_entry = QCOW_OFLAG_ZERO;
-                        l2_table[i] = cpu_to_be64(l2_entry);
+                        if (has_subclusters(s)) {
+                            l2_entry = 0;
+                            set_l2_bitmap(s, l2_table, i,
+                                          QCOW_L2_BITMAP_ALL_ZEROES);
+                        } else {
+                            l2_entry = QCOW_OFLAG_ZERO;
+                        }
+                        set_l2_entry(s, l2_table, i, l2_entry);
                         ret = qcow2_pre_write_overlap_check(bs,
                                 QCOW2_OL_ACTIVE_L2 | QCOW2_OL_INACTIVE_L2,
-                                l2e_offset, sizeof(uint64_t));
+                                l2e_offset, l2_entry_size(s));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Overlap check failed\n");
                             res->check_errors++;
                             /* Something is seriously wrong, so abort checking
                              * this L2 table */
-                            goto fail;
+                            return ret;
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
-                                               &l2_table[i], sizeof(uint64_t));
+                                               &l2_table[idx],
+                                               l2_entry_size(s));
                         if (ret < 0) {
                             fprintf(stderr, "ERROR: Failed to overwrite L2 "
                                     "table entry: %s\n", strerror(-ret));
@@ -1684,7 +2056,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                            refcount_table, refcount_table_size,
                                            offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
             break;
         }
@@ -1698,12 +2070,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    g_free(l2_table);
-    return ret;
 }
 
 /*
@@ -1711,6 +2078,8 @@ fail:
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * The L2 tables are read in windows of @batch, ahead of being processed.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1719,11 +2088,12 @@ static int check_refcounts_l1(BlockDriverState *bs,
                               void **refcount_table,
                               int64_t *refcount_table_size,
                               int64_t l1_table_offset, int l1_size,
+                              Qcow2CheckL2Batch *batch,
                               int flags, BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    int i, j, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1753,11 +2123,14 @@ static int check_refcounts_l1(BlockDriverState *bs,
     }
 
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
+    i = 0;
+    while (i < l1_size) {
+        check_l2_batch_fill(bs, batch, l1_table, l1_size, &i);
+
+        for (j = 0; j < batch->count; j++) {
+            l2_offset = batch->l2_offset[j];
+
             /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
             ret = qcow2_inc_refcounts_imrt(bs, res,
                                            refcount_table, refcount_table_size,
                                            l2_offset, s->cluster_size);
@@ -1772,10 +2145,17 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
+            ret = batch->ret[j];
+            if (ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                goto fail;
+            }
+
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix);
+                                     refcount_table_size, l2_offset,
+                                     batch->l2_table[j], flags, fix);
             if (ret < 0) {
                 goto fail;
             }
@@ -1801,10 +2181,11 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
+    Qcow2CheckL2Batch *batch = check_l2_batch_new(bs);
+    uint64_t *l2_table;
     int ret;
     uint64_t refcount;
-    int i, j;
+    int i, j, k;
     bool repair;
 
     if (fix & BDRV_FIX_ERRORS) {
@@ -1819,97 +2200,108 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         repair = false;
     }
 
-    for (i = 0; i < s->l1_size; i++) {
-        uint64_t l1_entry = s->l1_table[i];
-        uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
-
-        if (!l2_offset) {
-            continue;
-        }
+    k = 0;
+    while (k < s->l1_size) {
+        int n;
 
-        ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                 &refcount);
-        if (ret < 0) {
-            /* don't print message nor increment check_errors */
-            continue;
-        }
-        if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
-            fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
-                    "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                    repair ? "Repairing" : "ERROR", i, l1_entry, refcount);
-            if (repair) {
-                s->l1_table[i] = refcount == 1
-                               ? l1_entry |  QCOW_OFLAG_COPIED
-                               : l1_entry & ~QCOW_OFLAG_COPIED;
-                ret = qcow2_write_l1_entry(bs, i);
-                if (ret < 0) {
-                    res->check_errors++;
-                    goto fail;
-                }
-                res->corruptions_fixed++;
-            } else {
-                res->corruptions++;
-            }
-        }
+        check_l2_batch_fill(bs, batch, s->l1_table, s->l1_size, &k);
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
-        if (ret < 0) {
-            fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
-                    strerror(-ret));
-            res->check_errors++;
-            goto fail;
-        }
+        for (n = 0; n < batch->count; n++) {
+            uint64_t l1_entry;
+            uint64_t l2_offset;
+            bool l2_dirty = false;
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
-            QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
+            i = batch->l1_index[n];
+            l1_entry = s->l1_table[i];
+            l2_offset = l1_entry & L1E_OFFSET_MASK;
+            l2_table = batch->l2_table[n];
 
-            if (cluster_type == QCOW2_CLUSTER_NORMAL ||
-                cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) {
-                ret = qcow2_get_refcount(bs,
-                                         data_offset >> s->cluster_bits,
-                                         &refcount);
-                if (ret < 0) {
-                    /* don't print message nor increment check_errors */
-                    continue;
-                }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
-                    fprintf(stderr, "%s OFLAG_COPIED data cluster: "
-                            "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
-                            repair ? "Repairing" : "ERROR", l2_entry, refcount);
-                    if (repair) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
-                        l2_dirty = true;
-                        res->corruptions_fixed++;
-                    } else {
-                        res->corruptions++;
+            ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                                     &refcount);
+            if (ret < 0) {
+                /* don't print message nor increment check_errors */
+                continue;
+            }
+            if ((refcount == 1) != ((l1_entry & QCOW_OFLAG_COPIED) != 0)) {
+                fprintf(stderr, "%s OFLAG_COPIED L2 cluster: l1_index=%d "
+                        "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                        repair ? "Repairing" : "ERROR", i, l1_entry, refcount);
+                if (repair) {
+                    s->l1_table[i] = refcount == 1
+                                   ? l1_entry |  QCOW_OFLAG_COPIED
+                                   : l1_entry & ~QCOW_OFLAG_COPIED;
+                    ret = qcow2_write_l1_entry(bs, i);
+                    if (ret < 0) {
+                        res->check_errors++;
+                        goto fail;
                     }
+                    res->corruptions_fixed++;
+                } else {
+                    res->corruptions++;
                 }
             }
-        }
 
-        if (l2_dirty) {
-            ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                                                l2_offset, s->cluster_size);
+            ret = batch->ret[n];
             if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table; metadata "
-                        "overlap check failed: %s\n", strerror(-ret));
+                fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
+                        strerror(-ret));
                 res->check_errors++;
                 goto fail;
             }
 
-            ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
-                              s->cluster_size);
-            if (ret < 0) {
-                fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
-                        strerror(-ret));
-                res->check_errors++;
-                goto fail;
+            for (j = 0; j < s->l2_size; j++) {
+                uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+                uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
+                QCow2ClusterType cluster_type =
+                    qcow2_get_cluster_type(l2_entry);
+
+                if (cluster_type == QCOW2_CLUSTER_NORMAL ||
+                    cluster_type == QCOW2_CLUSTER_ZERO_ALLOC) {
+                    ret = qcow2_get_refcount(bs,
+                                             data_offset >> s->cluster_bits,
+                                             &refcount);
+                    if (ret < 0) {
+                        /* don't print message nor increment check_errors */
+                        continue;
+                    }
+                    if ((refcount == 1) !=
+                        ((l2_entry & QCOW_OFLAG_COPIED) != 0))
+                    {
+                        fprintf(stderr, "%s OFLAG_COPIED data cluster: "
+                                "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
+                                repair ? "Repairing" : "ERROR", l2_entry,
+                                refcount);
+                        if (repair) {
+                            set_l2_entry(s, l2_table, j, refcount == 1
+                                         ? l2_entry |  QCOW_OFLAG_COPIED
+                                         : l2_entry & ~QCOW_OFLAG_COPIED);
+                            l2_dirty = true;
+                            res->corruptions_fixed++;
+                        } else {
+                            res->corruptions++;
+                        }
+                    }
+                }
+            }
+
+            if (l2_dirty) {
+                ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
+                                                    l2_offset, s->cluster_size);
+                if (ret < 0) {
+                    fprintf(stderr, "ERROR: Could not write L2 table; metadata "
+                            "overlap check failed: %s\n", strerror(-ret));
+                    res->check_errors++;
+                    goto fail;
+                }
+
+                ret = bdrv_pwrite(bs->file, l2_offset, l2_table,
+                                  s->cluster_size);
+                if (ret < 0) {
+                    fprintf(stderr, "ERROR: Could not write L2 table: %s\n",
+                            strerror(-ret));
+                    res->check_errors++;
+                    goto fail;
+                }
             }
         }
     }
@@ -1917,7 +2309,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    check_l2_batch_free(batch);
     return ret;
 }
 
@@ -2037,6 +2429,7 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                void **refcount_table, int64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CheckL2Batch *batch;
     int64_t i;
     QCowSnapshot *sn;
     int ret;
@@ -2059,10 +2452,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* current L1 table */
+    batch = check_l2_batch_new(bs);
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix);
+                             s->l1_table_offset, s->l1_size, batch,
+                             CHECK_FRAG_INFO, fix);
     if (ret < 0) {
+        check_l2_batch_free(batch);
         return ret;
     }
 
@@ -2084,11 +2479,15 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                                 sn->l1_table_offset, sn->l1_size, 0, fix);
+                                 sn->l1_table_offset, sn->l1_size, batch, 0,
+                                 fix);
         if (ret < 0) {
+            check_l2_batch_free(batch);
             return ret;
         }
     }
+    check_l2_batch_free(batch);
+
     ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
                                    s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
@@ -2448,6 +2847,7 @@ write_refblocks:
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
     update_max_refcount_table_index(s);
+    qcow2_drop_used_cluster_bitmaps(bs);
 
     return 0;
 
@@ -3173,6 +3573,7 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     old_reftable = s->refcount_table;
     s->refcount_table = new_reftable;
     update_max_refcount_table_index(s);
+    qcow2_drop_used_cluster_bitmaps(bs);
 
     s->refcount_bits = 1 << refcount_order;
     s->refcount_max = UINT64_C(1) << (s->refcount_bits - 1);
@@ -3271,6 +3672,7 @@ static int qcow2_discard_refcount_block(BlockDriverState *bs,
         return -EINVAL;
     }
     s->set_refcount(refblock, block_index, 0);
+    update_used_cluster_bitmap(s, cluster_index, false);
 
     qcow2_cache_entry_mark_dirty(s->refcount_block_cache, refblock);
 
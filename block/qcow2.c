@@ -27,7 +27,13 @@
 #define ZLIB_CONST
 #include <zlib.h>
 
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "block/block_int.h"
+#include "block/aio_task.h"
 #include "block/qdict.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
@@ -783,7 +789,8 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     bool l2_cache_size_set, refcount_cache_size_set, combined_cache_size_set;
     int min_refcount_cache = MIN_REFCOUNT_CACHE_SIZE * s->cluster_size;
     uint64_t virtual_disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
-    uint64_t max_l2_cache = virtual_disk_size / (s->cluster_size / 8);
+    uint64_t max_l2_cache =
+        virtual_disk_size / (s->cluster_size / l2_entry_size(s));
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
     l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
@@ -851,6 +858,7 @@ typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
     int l2_slice_size; /* Number of entries in a slice of the L2 table */
+    int max_used_cluster_bitmaps;
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
@@ -932,11 +940,13 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
                                                  s->cluster_size);
+    /* A bitmap never takes more memory than a refcount block */
+    r->max_used_cluster_bitmaps = refcount_cache_size;
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -1097,6 +1107,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
     s->l2_slice_size = r->l2_slice_size;
+    s->max_used_cluster_bitmaps = r->max_used_cluster_bitmaps;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -1143,6 +1154,36 @@ static int qcow2_update_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+static int validate_compression_type(BDRVQcow2State *s, Error **errp)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+        break;
+
+    default:
+        error_setg(errp, "qcow2: unsupported compression type %u",
+                   s->compression_type);
+        return -ENOTSUP;
+    }
+
+    /*
+     * The incompatible bit keeps old implementations, which would try to
+     * inflate everything, from opening images with another compression type
+     */
+    if ((s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) !=
+        !!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION)) {
+        error_setg(errp, "qcow2: compression type incompatible feature bit "
+                   "must be set if and only if the compression type is not "
+                   "zlib");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 /* Called with s->lock held.  */
 static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
                                       int flags, Error **errp)
@@ -1282,6 +1323,16 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+    ret = validate_compression_type(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* Check support for various header values */
     if (header.refcount_order > 6) {
         error_setg(errp, "Reference count entry width too large; may not "
@@ -1322,8 +1373,22 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    if (has_subclusters(s) &&
+        s->cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries are only supported with "
+                   "cluster sizes of at least %d bytes",
+                   1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
     s->refcount_block_size = 1 << s->refcount_block_bits;
@@ -1679,7 +1744,7 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
         /* Encryption works on a sector granularity */
         bs->bl.request_alignment = qcrypto_block_get_sector_size(s->crypto);
     }
-    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pwrite_zeroes_alignment = s->subcluster_size;
     bs->bl.pdiscard_alignment = s->cluster_size;
 }
 
@@ -1854,137 +1919,304 @@ out:
     return ret;
 }
 
-static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
-                                        uint64_t bytes, QEMUIOVector *qiov,
-                                        int flags)
+static ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size);
+
+static coroutine_fn int
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t file_cluster_offset,
+                           uint64_t offset, uint64_t bytes,
+                           QEMUIOVector *qiov, uint64_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int offset_in_cluster;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    int ret, csize, nb_csectors;
+    uint64_t coffset, cache_gen;
+    uint8_t *buf, *out_buf;
+    struct iovec iov;
+    QEMUIOVector local_qiov;
+
+    coffset = file_cluster_offset & s->cluster_offset_mask;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->cluster_cache_offset == coffset) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            s->cluster_cache + offset_in_cluster, bytes);
+        qemu_co_mutex_unlock(&s->lock);
+        return 0;
+    }
+    cache_gen = s->cluster_cache_gen;
+    qemu_co_mutex_unlock(&s->lock);
+
+    nb_csectors = ((file_cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * BDRV_SECTOR_SIZE - (coffset & (BDRV_SECTOR_SIZE - 1));
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    out_buf = g_malloc(s->cluster_size);
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = csize,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset, csize, &local_qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
+
+    /* Keep the cluster for following small reads, unless a write may have
+     * reused its host offset while we were reading it */
+    qemu_co_mutex_lock(&s->lock);
+    if (s->cluster_cache_gen == cache_gen) {
+        g_free(s->cluster_cache);
+        s->cluster_cache = out_buf;
+        s->cluster_cache_offset = coffset;
+        out_buf = NULL;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+fail:
+    g_free(buf);
+    g_free(out_buf);
+
+    return ret;
+}
+
+static coroutine_fn int
+qcow2_co_preadv_encrypted(BlockDriverState *bs,
+                          uint64_t file_cluster_offset,
+                          uint64_t offset, uint64_t bytes,
+                          QEMUIOVector *qiov, uint64_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t host_offset = file_cluster_offset + offset_into_cluster(s, offset);
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector local_qiov;
     int ret;
-    unsigned int cur_bytes; /* number of bytes in current iteration */
-    uint64_t cluster_offset = 0;
-    uint64_t bytes_done = 0;
+
+    assert(bs->encrypted && s->crypto);
+    assert(bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+
+    /*
+     * For encrypted images, read everything into a temporary
+     * contiguous buffer on which the AES functions can work.
+     */
+    buf = qemu_try_blockalign(bs->file->bs, bytes);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = bytes,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+    ret = bdrv_co_preadv(bs->file, host_offset, bytes, &local_qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
+    assert((bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
+    if (qcrypto_block_decrypt(s->crypto,
+                              (s->crypt_physical_offset ?
+                               host_offset : offset),
+                              buf, bytes, NULL) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf, bytes);
+
+fail:
+    qemu_vfree(buf);
+
+    return ret;
+}
+
+typedef struct Qcow2AioTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    QCow2ClusterType cluster_type; /* only for read */
+    uint64_t file_cluster_offset;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    uint64_t qiov_offset;
+    QCowL2Meta *l2meta; /* only for write */
+} Qcow2AioTask;
+
+static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task);
+
+/* Run @func for one host-contiguous part of a request.  Without a @pool the
+ * part is processed synchronously; otherwise it gets its own coroutine and
+ * this only waits for a free slot in the pool.
+ */
+static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
+                                       AioTaskPool *pool,
+                                       AioTaskFunc func,
+                                       QCow2ClusterType cluster_type,
+                                       uint64_t file_cluster_offset,
+                                       uint64_t offset,
+                                       uint64_t bytes,
+                                       QEMUIOVector *qiov,
+                                       uint64_t qiov_offset,
+                                       QCowL2Meta *l2meta)
+{
+    Qcow2AioTask local_task;
+    Qcow2AioTask *task = pool ? g_new(Qcow2AioTask, 1) : &local_task;
+
+    *task = (Qcow2AioTask) {
+        .task.func = func,
+        .bs = bs,
+        .cluster_type = cluster_type,
+        .qiov = qiov,
+        .file_cluster_offset = file_cluster_offset,
+        .offset = offset,
+        .bytes = bytes,
+        .qiov_offset = qiov_offset,
+        .l2meta = l2meta,
+    };
+
+    trace_qcow2_add_task(qemu_coroutine_self(), bs, pool,
+                         func == qcow2_co_preadv_task_entry ? "read" : "write",
+                         cluster_type, file_cluster_offset, offset, bytes,
+                         qiov, qiov_offset);
+
+    if (!pool) {
+        return func(&task->task);
+    }
+
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+static coroutine_fn int qcow2_co_preadv_task(BlockDriverState *bs,
+                                             QCow2ClusterType cluster_type,
+                                             uint64_t file_cluster_offset,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             uint64_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int offset_in_cluster = offset_into_cluster(s, offset);
     QEMUIOVector hd_qiov;
-    uint8_t *cluster_data = NULL;
+    int ret;
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    switch (cluster_type) {
+    case QCOW2_CLUSTER_ZERO_PLAIN:
+    case QCOW2_CLUSTER_ZERO_ALLOC:
+        /* Both zero types are handled in qcow2_co_preadv */
+        g_assert_not_reached();
 
-    qemu_co_mutex_lock(&s->lock);
+    case QCOW2_CLUSTER_UNALLOCATED:
+        assert(bs->backing); /* otherwise handled in qcow2_co_preadv */
 
-    while (bytes != 0) {
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
+        qemu_iovec_init(&hd_qiov, qiov->niov);
+        qemu_iovec_concat(&hd_qiov, qiov, qiov_offset, bytes);
+        ret = bdrv_co_preadv(bs->backing, offset, bytes, &hd_qiov, 0);
+        qemu_iovec_destroy(&hd_qiov);
+        return ret;
 
-        /* prepare next request */
-        cur_bytes = MIN(bytes, INT_MAX);
-        if (s->crypto) {
-            cur_bytes = MIN(cur_bytes,
-                            QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+    case QCOW2_CLUSTER_COMPRESSED:
+        return qcow2_co_preadv_compressed(bs, file_cluster_offset,
+                                          offset, bytes, qiov, qiov_offset);
+
+    case QCOW2_CLUSTER_NORMAL:
+        if ((file_cluster_offset & 511) != 0) {
+            return -EIO;
         }
 
-        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
-        if (ret < 0) {
-            goto fail;
+        if (bs->encrypted) {
+            return qcow2_co_preadv_encrypted(bs, file_cluster_offset,
+                                             offset, bytes, qiov, qiov_offset);
         }
 
-        offset_in_cluster = offset_into_cluster(s, offset);
+        BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+        qemu_iovec_init(&hd_qiov, qiov->niov);
+        qemu_iovec_concat(&hd_qiov, qiov, qiov_offset, bytes);
+        ret = bdrv_co_preadv(bs->file, file_cluster_offset + offset_in_cluster,
+                             bytes, &hd_qiov, 0);
+        qemu_iovec_destroy(&hd_qiov);
+        return ret;
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
+    default:
+        g_assert_not_reached();
+    }
 
-        switch (ret) {
-        case QCOW2_CLUSTER_UNALLOCATED:
+    g_assert_not_reached();
+}
 
-            if (bs->backing) {
-                BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                qemu_co_mutex_unlock(&s->lock);
-                ret = bdrv_co_preadv(bs->backing, offset, cur_bytes,
-                                     &hd_qiov, 0);
-                qemu_co_mutex_lock(&s->lock);
-                if (ret < 0) {
-                    goto fail;
-                }
-            } else {
-                /* Note: in this case, no need to wait */
-                qemu_iovec_memset(&hd_qiov, 0, 0, cur_bytes);
-            }
-            break;
+static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
+{
+    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
 
-        case QCOW2_CLUSTER_ZERO_PLAIN:
-        case QCOW2_CLUSTER_ZERO_ALLOC:
-            qemu_iovec_memset(&hd_qiov, 0, 0, cur_bytes);
-            break;
+    assert(!t->l2meta);
 
-        case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
-            if (ret < 0) {
-                goto fail;
-            }
+    return qcow2_co_preadv_task(t->bs, t->cluster_type, t->file_cluster_offset,
+                                t->offset, t->bytes, t->qiov, t->qiov_offset);
+}
 
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                                s->cluster_cache + offset_in_cluster,
-                                cur_bytes);
-            break;
+static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t bytes, QEMUIOVector *qiov,
+                                        int flags)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = 0;
+    unsigned int cur_bytes; /* number of bytes in current iteration */
+    uint64_t cluster_offset = 0;
+    uint64_t bytes_done = 0;
+    AioTaskPool *aio = NULL;
 
-        case QCOW2_CLUSTER_NORMAL:
-            if ((cluster_offset & 511) != 0) {
-                ret = -EIO;
-                goto fail;
-            }
+    while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        /* prepare next request */
+        cur_bytes = MIN(bytes, INT_MAX);
+        if (s->crypto) {
+            cur_bytes = MIN(cur_bytes,
+                            QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+        }
 
-            if (bs->encrypted) {
-                assert(s->crypto);
-
-                /*
-                 * For encrypted images, read everything into a temporary
-                 * contiguous buffer on which the AES functions can work.
-                 */
-                if (!cluster_data) {
-                    cluster_data =
-                        qemu_try_blockalign(bs->file->bs,
-                                            QCOW_MAX_CRYPT_CLUSTERS
-                                            * s->cluster_size);
-                    if (cluster_data == NULL) {
-                        ret = -ENOMEM;
-                        goto fail;
-                    }
-                }
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto out;
+        }
 
-                assert(cur_bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-                qemu_iovec_reset(&hd_qiov);
-                qemu_iovec_add(&hd_qiov, cluster_data, cur_bytes);
+        if (ret == QCOW2_CLUSTER_ZERO_PLAIN ||
+            ret == QCOW2_CLUSTER_ZERO_ALLOC ||
+            (ret == QCOW2_CLUSTER_UNALLOCATED && !bs->backing))
+        {
+            /* Note: in this case, no need to wait */
+            qemu_iovec_memset(qiov, bytes_done, 0, cur_bytes);
+        } else {
+            if (!aio && cur_bytes != bytes) {
+                aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
             }
-
-            BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
-            ret = bdrv_co_preadv(bs->file,
-                                 cluster_offset + offset_in_cluster,
-                                 cur_bytes, &hd_qiov, 0);
-            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, ret,
+                                 cluster_offset, offset, cur_bytes,
+                                 qiov, bytes_done, NULL);
             if (ret < 0) {
-                goto fail;
-            }
-            if (bs->encrypted) {
-                assert(s->crypto);
-                assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
-                assert((cur_bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
-                if (qcrypto_block_decrypt(s->crypto,
-                                          (s->crypt_physical_offset ?
-                                           cluster_offset + offset_in_cluster :
-                                           offset),
-                                          cluster_data,
-                                          cur_bytes,
-                                          NULL) < 0) {
-                    ret = -EIO;
-                    goto fail;
-                }
-                qemu_iovec_from_buf(qiov, bytes_done, cluster_data, cur_bytes);
+                goto out;
             }
-            break;
-
-        default:
-            g_assert_not_reached();
-            ret = -EIO;
-            goto fail;
         }
 
         bytes -= cur_bytes;
@@ -1993,11 +2225,14 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
     }
     ret = 0;
 
-fail:
-    qemu_co_mutex_unlock(&s->lock);
-
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cluster_data);
+out:
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
+        }
+        aio_task_pool_free(aio);
+    }
 
     return ret;
 }
@@ -2040,6 +2275,95 @@ static bool merge_cow(uint64_t offset, unsigned bytes,
     return false;
 }
 
+/* qcow2_co_pwritev_task
+ * Called with s->lock unlocked
+ * l2meta  - if not NULL, qcow2_co_pwritev_task() will consume it. Caller must
+ *           not use it somehow after qcow2_co_pwritev_task() call
+ */
+static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
+                                              uint64_t file_cluster_offset,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              uint64_t qiov_offset,
+                                              QCowL2Meta *l2meta)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint8_t *crypt_buf = NULL;
+    QEMUIOVector hd_qiov;
+    int ret;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    if (bs->encrypted) {
+        assert(s->crypto);
+        assert(bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+        crypt_buf = qemu_try_blockalign(bs->file->bs, bytes);
+        if (crypt_buf == NULL) {
+            ret = -ENOMEM;
+            goto out_unlocked;
+        }
+        qemu_iovec_to_buf(qiov, qiov_offset, crypt_buf, bytes);
+
+        if (qcrypto_block_encrypt(s->crypto,
+                                  (s->crypt_physical_offset ?
+                                   file_cluster_offset + offset_in_cluster :
+                                   offset),
+                                  crypt_buf, bytes, NULL) < 0) {
+            ret = -EIO;
+            goto out_unlocked;
+        }
+
+        qemu_iovec_add(&hd_qiov, crypt_buf, bytes);
+    } else {
+        qemu_iovec_concat(&hd_qiov, qiov, qiov_offset, bytes);
+    }
+
+    /* If we need to do COW, check if it's possible to merge the
+     * writing of the guest data together with that of the COW regions.
+     * If it's not possible (or not necessary) then write the
+     * guest data now. */
+    if (!merge_cow(offset, bytes, &hd_qiov, l2meta)) {
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        trace_qcow2_writev_data(qemu_coroutine_self(),
+                                file_cluster_offset + offset_in_cluster);
+        ret = bdrv_co_pwritev(bs->file,
+                              file_cluster_offset + offset_in_cluster,
+                              bytes, &hd_qiov, 0);
+        if (ret < 0) {
+            goto out_unlocked;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    ret = qcow2_handle_l2meta(bs, &l2meta, true);
+    goto out_locked;
+
+out_unlocked:
+    qemu_co_mutex_lock(&s->lock);
+
+out_locked:
+    qcow2_handle_l2meta(bs, &l2meta, false);
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_iovec_destroy(&hd_qiov);
+    qemu_vfree(crypt_buf);
+
+    return ret;
+}
+
+static coroutine_fn int qcow2_co_pwritev_task_entry(AioTask *task)
+{
+    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
+
+    assert(!t->cluster_type);
+
+    return qcow2_co_pwritev_task(t->bs, t->file_cluster_offset,
+                                 t->offset, t->bytes, t->qiov, t->qiov_offset,
+                                 t->l2meta);
+}
+
 static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                          uint64_t bytes, QEMUIOVector *qiov,
                                          int flags)
@@ -2049,20 +2373,13 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
     int ret;
     unsigned int cur_bytes; /* number of sectors in current iteration */
     uint64_t cluster_offset;
-    QEMUIOVector hd_qiov;
-    uint64_t bytes_done = 0;
-    uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    uint64_t bytes_done = 0;
+    AioTaskPool *aio = NULL;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
-
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
-    qemu_co_mutex_lock(&s->lock);
-
-    while (bytes != 0) {
+    while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
         l2meta = NULL;
 
@@ -2075,74 +2392,37 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                             - offset_in_cluster);
         }
 
+        qemu_co_mutex_lock(&s->lock);
+
+        /* disable compressed cache */
+        s->cluster_cache_offset = -1;
+        s->cluster_cache_gen++;
+
         ret = qcow2_alloc_cluster_offset(bs, offset, &cur_bytes,
                                          &cluster_offset, &l2meta);
         if (ret < 0) {
-            goto fail;
+            goto out_locked;
         }
 
         assert((cluster_offset & 511) == 0);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
-
-        if (bs->encrypted) {
-            assert(s->crypto);
-            if (!cluster_data) {
-                cluster_data = qemu_try_blockalign(bs->file->bs,
-                                                   QCOW_MAX_CRYPT_CLUSTERS
-                                                   * s->cluster_size);
-                if (cluster_data == NULL) {
-                    ret = -ENOMEM;
-                    goto fail;
-                }
-            }
-
-            assert(hd_qiov.size <=
-                   QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-            qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
-
-            if (qcrypto_block_encrypt(s->crypto,
-                                      (s->crypt_physical_offset ?
-                                       cluster_offset + offset_in_cluster :
-                                       offset),
-                                      cluster_data,
-                                      cur_bytes, NULL) < 0) {
-                ret = -EIO;
-                goto fail;
-            }
-
-            qemu_iovec_reset(&hd_qiov);
-            qemu_iovec_add(&hd_qiov, cluster_data, cur_bytes);
-        }
-
         ret = qcow2_pre_write_overlap_check(bs, 0,
                 cluster_offset + offset_in_cluster, cur_bytes);
         if (ret < 0) {
-            goto fail;
+            goto out_locked;
         }
 
-        /* If we need to do COW, check if it's possible to merge the
-         * writing of the guest data together with that of the COW regions.
-         * If it's not possible (or not necessary) then write the
-         * guest data now. */
-        if (!merge_cow(offset, cur_bytes, &hd_qiov, l2meta)) {
-            qemu_co_mutex_unlock(&s->lock);
-            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-            trace_qcow2_writev_data(qemu_coroutine_self(),
-                                    cluster_offset + offset_in_cluster);
-            ret = bdrv_co_pwritev(bs->file,
-                                  cluster_offset + offset_in_cluster,
-                                  cur_bytes, &hd_qiov, 0);
-            qemu_co_mutex_lock(&s->lock);
-            if (ret < 0) {
-                goto fail;
-            }
-        }
+        qemu_co_mutex_unlock(&s->lock);
 
-        ret = qcow2_handle_l2meta(bs, &l2meta, true);
-        if (ret) {
-            goto fail;
+        if (!aio && cur_bytes != bytes) {
+            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+        }
+        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
+                             cluster_offset, offset, cur_bytes,
+                             qiov, bytes_done, l2meta);
+        l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
+        if (ret < 0) {
+            goto fail_nometa;
         }
 
         bytes -= cur_bytes;
@@ -2152,13 +2432,22 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
     }
     ret = 0;
 
-fail:
+    qemu_co_mutex_lock(&s->lock);
+
+out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
 
     qemu_co_mutex_unlock(&s->lock);
 
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cluster_data);
+fail_nometa:
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
+        }
+        aio_task_pool_free(aio);
+    }
+
     trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
 
     return ret;
@@ -2224,7 +2513,6 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_format);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -2323,7 +2611,14 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    /* Only zlib images may omit the compression type, so keep their header
+     * readable for implementations that know only the version 3 fields */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !s->unknown_header_fields_size) {
+        header_length = offsetof(QCowHeader, compression_type);
+    } else {
+        header_length = sizeof(*header) + s->unknown_header_fields_size;
+    }
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -2349,6 +2644,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -2357,7 +2653,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = header_length - s->unknown_header_fields_size;
         break;
     default:
         ret = -EINVAL;
@@ -2423,6 +2719,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2702,28 +3008,31 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
  * @total_size: virtual disk size in bytes
  * @cluster_size: cluster size in bytes
  * @refcount_order: refcount bits power-of-2 exponent
+ * @extended_l2: true if the image has extended L2 entries
  *
  * Returns: Total number of bytes required for the fully allocated image
  * (including metadata).
  */
 static int64_t qcow2_calc_prealloc_size(int64_t total_size,
                                         size_t cluster_size,
-                                        int refcount_order)
+                                        int refcount_order,
+                                        bool extended_l2)
 {
     int64_t meta_size = 0;
     uint64_t nl1e, nl2e;
     int64_t aligned_total_size = ROUND_UP(total_size, cluster_size);
+    size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
 
     /* header: 1 cluster */
     meta_size += cluster_size;
 
     /* total size of L2 tables */
     nl2e = aligned_total_size / cluster_size;
-    nl2e = ROUND_UP(nl2e, cluster_size / sizeof(uint64_t));
-    meta_size += nl2e * sizeof(uint64_t);
+    nl2e = ROUND_UP(nl2e, cluster_size / l2e_size);
+    meta_size += nl2e * l2e_size;
 
     /* total size of L1 tables */
-    nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+    nl1e = nl2e * l2e_size / cluster_size;
     nl1e = ROUND_UP(nl1e, cluster_size / sizeof(uint64_t));
     meta_size += nl1e * sizeof(uint64_t);
 
@@ -2918,6 +3227,46 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     }
     refcount_order = ctz32(qcow2_opts->refcount_bits);
 
+    if (!qcow2_opts->has_extended_l2) {
+        qcow2_opts->extended_l2 = false;
+    }
+    if (qcow2_opts->extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use version=v3 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+        if (cluster_size < (1 << QCOW_EXTL2_MIN_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    if (!qcow2_opts->has_compression_type) {
+        qcow2_opts->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+    if (qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        if (version < 3) {
+            error_setg(errp, "Non-zlib compression type is only supported "
+                       "with compatibility level 1.1 and above (use "
+                       "version=v3 or greater)");
+            ret = -EINVAL;
+            goto out;
+        }
+#ifndef CONFIG_ZSTD
+        if (qcow2_opts->compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+            error_setg(errp, "This build does not support zstd compression");
+            ret = -ENOTSUP;
+            goto out;
+        }
+#endif
+    }
+
 
     /* Create BlockBackend to write to the image */
     blk = blk_new(BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL);
@@ -2938,7 +3287,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     {
         int64_t prealloc_size =
             qcow2_calc_prealloc_size(qcow2_opts->size, cluster_size,
-                                     refcount_order);
+                                     refcount_order, qcow2_opts->extended_l2);
 
         ret = blk_truncate(blk, prealloc_size, qcow2_opts->preallocation, errp);
         if (ret < 0) {
@@ -2960,6 +3309,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         .header_length              = cpu_to_be32(sizeof(*header)),
+        .compression_type           = qcow2_opts->compression_type,
     };
 
     /* We'll update this to correct value later */
@@ -2969,6 +3319,14 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         header->compatible_features |=
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
+    if (qcow2_opts->extended_l2) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+    if (qcow2_opts->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    }
 
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
@@ -3146,6 +3504,8 @@ static int coroutine_fn qcow2_co_create_opts(const char *filename, QemuOpts *opt
         { BLOCK_OPT_BACKING_FMT,        "backing-fmt" },
         { BLOCK_OPT_CLUSTER_SIZE,       "cluster-size" },
         { BLOCK_OPT_LAZY_REFCOUNTS,     "lazy-refcounts" },
+        { BLOCK_OPT_EXTL2,              "extended-l2" },
+        { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
         { BLOCK_OPT_REFCOUNT_BITS,      "refcount-bits" },
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
@@ -3232,8 +3592,8 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
     int ret;
     BDRVQcow2State *s = bs->opaque;
 
-    uint32_t head = offset % s->cluster_size;
-    uint32_t tail = (offset + bytes) % s->cluster_size;
+    uint32_t head = offset_into_subcluster(s, offset);
+    uint32_t tail = offset_into_subcluster(s, offset + bytes);
 
     trace_qcow2_pwrite_zeroes_start_req(qemu_coroutine_self(), offset, bytes);
     if (offset + bytes == bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3244,20 +3604,20 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         uint64_t off;
         unsigned int nr;
 
-        assert(head + bytes <= s->cluster_size);
+        assert(head + bytes <= s->subcluster_size);
 
-        /* check whether remainder of cluster already reads as zero */
+        /* check whether remainder of (sub)cluster already reads as zero */
         if (!(is_zero(bs, offset - head, head) &&
               is_zero(bs, offset + bytes,
-                      tail ? s->cluster_size - tail : 0))) {
+                      tail ? s->subcluster_size - tail : 0))) {
             return -ENOTSUP;
         }
 
         qemu_co_mutex_lock(&s->lock);
         /* We can have new write after previous check */
-        offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
-        bytes = s->cluster_size;
-        nr = s->cluster_size;
+        offset = QEMU_ALIGN_DOWN(offset, s->subcluster_size);
+        bytes = s->subcluster_size;
+        nr = s->subcluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
         if (ret != QCOW2_CLUSTER_UNALLOCATED &&
             ret != QCOW2_CLUSTER_ZERO_PLAIN &&
@@ -3290,7 +3650,15 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
          * complete partial cluster at the end of an unaligned file */
         if (!QEMU_IS_ALIGNED(offset, s->cluster_size) ||
             offset + bytes != bs->total_sectors * BDRV_SECTOR_SIZE) {
-            return -ENOTSUP;
+            /* Whole subclusters can still be made to read as zeroes */
+            if (!has_subclusters(s) ||
+                !QEMU_IS_ALIGNED(offset | bytes, s->subcluster_size)) {
+                return -ENOTSUP;
+            }
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_cluster_zeroize(bs, offset, bytes, 0);
+            qemu_co_mutex_unlock(&s->lock);
+            return ret;
         }
     }
 
@@ -3401,7 +3769,10 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
     QCowL2Meta *l2meta = NULL;
 
     assert(!bs->encrypted);
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+
+    /* disable compressed cache */
+    s->cluster_cache_offset = -1;
+    s->cluster_cache_gen++;
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -3722,14 +4093,15 @@ fail:
 /*
  * qcow2_compress()
  *
- * @dest - destination buffer, at least of @size-1 bytes
- * @src - source buffer, @size bytes
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
  *
  * Returns: compressed size on success
- *          -1 if compression is inefficient
+ *          -1 destination buffer is not enough to store compressed data
  *          -2 on any other error
  */
-static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size)
 {
     ssize_t ret;
     z_stream strm;
@@ -3744,14 +4116,14 @@ static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
 
     /* strm.next_in is not const in old zlib versions, such as those used on
      * OpenBSD/NetBSD, so cast the const away */
-    strm.avail_in = size;
+    strm.avail_in = src_size;
     strm.next_in = (void *) src;
-    strm.avail_out = size - 1;
+    strm.avail_out = dest_size;
     strm.next_out = dest;
 
     ret = deflate(&strm, Z_FINISH);
     if (ret == Z_STREAM_END) {
-        ret = size - 1 - strm.avail_out;
+        ret = dest_size - strm.avail_out;
     } else {
         ret = (ret == Z_OK ? -1 : -2);
     }
@@ -3761,20 +4133,139 @@ static ssize_t qcow2_compress(void *dest, const void *src, size_t size)
     return ret;
 }
 
-#define MAX_COMPRESS_THREADS 4
+/*
+ * qcow2_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes.
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          -1 on fail
+ */
+static ssize_t qcow2_decompress(void *dest, size_t dest_size,
+                                const void *src, size_t src_size)
+{
+    int ret = 0;
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -1;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        /* We approve Z_BUF_ERROR because we need @dest buffer to be filled,
+         * but @src buffer may be processed partly (because in qcow2 we know
+         * size of compressed data with precision of one sector) */
+        ret = -1;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * qcow2_zstd_compress()
+ *
+ * Same as qcow2_compress(), but uses zstd. The output is a single zstd frame.
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall ? -1 : -2;
+    }
+
+    return ret;
+}
+
+/*
+ * qcow2_zstd_decompress()
+ *
+ * Same as qcow2_decompress(), but uses zstd. As with zlib, @src may extend
+ * beyond the end of the compressed frame, so decompression stops once the
+ * frame is complete or @dest is full.
+ */
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    size_t zret;
+    ssize_t ret = 0;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -1;
+    }
+
+    do {
+        size_t in_pos = input.pos, out_pos = output.pos;
+
+        zret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zret)) {
+            ret = -1;
+            break;
+        }
+        if (input.pos == in_pos && output.pos == out_pos) {
+            /* No progress: the input is truncated */
+            break;
+        }
+    } while (zret != 0 && output.pos < output.size);
+
+    if (output.pos != output.size) {
+        ret = -1;
+    }
+
+    ZSTD_freeDCtx(dctx);
 
+    return ret;
+}
+#endif
+
+/* Compression jobs of all requests together, so that many-cluster compressed
+ * writes do not starve the thread pool for everybody else */
+#define MAX_COMPRESS_THREADS 16
+
+/* Clusters that a compressed write processes at once */
+#define QCOW2_COMPRESS_BATCH_CLUSTERS 64
+
+typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size);
 typedef struct Qcow2CompressData {
     void *dest;
+    size_t dest_size;
     const void *src;
-    size_t size;
+    size_t src_size;
     ssize_t ret;
+
+    Qcow2CompressFunc func;
 } Qcow2CompressData;
 
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
-    data->ret = qcow2_compress(data->dest, data->src, data->size);
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
 
     return 0;
 }
@@ -3784,17 +4275,19 @@ static void qcow2_compress_complete(void *opaque, int ret)
     qemu_coroutine_enter(opaque);
 }
 
-/* See qcow2_compress definition for parameters description */
-static ssize_t qcow2_co_compress(BlockDriverState *bs,
-                                 void *dest, const void *src, size_t size)
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc func)
 {
     BDRVQcow2State *s = bs->opaque;
     BlockAIOCB *acb;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
     Qcow2CompressData arg = {
         .dest = dest,
+        .dest_size = dest_size,
         .src = src,
-        .size = size,
+        .src_size = src_size,
+        .func = func,
     };
 
     while (s->nb_compress_threads >= MAX_COMPRESS_THREADS) {
@@ -3817,6 +4310,225 @@ static ssize_t qcow2_co_compress(BlockDriverState *bs,
     return arg.ret;
 }
 
+/* See qcow2_compress definition for parameters description */
+static ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+/* See qcow2_decompress definition for parameters description */
+static ssize_t coroutine_fn
+qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                    const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressFunc fn;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        fn = qcow2_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        fn = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+}
+
+typedef struct Qcow2CompressedCluster {
+    uint8_t *buf;
+    ssize_t len;            /* -1 if the cluster does not compress */
+    uint64_t host_offset;
+} Qcow2CompressedCluster;
+
+typedef struct Qcow2CompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    uint64_t qiov_offset;
+    uint64_t bytes;
+    Qcow2CompressedCluster *cluster;
+} Qcow2CompressTask;
+
+static coroutine_fn int qcow2_compress_task_entry(AioTask *task)
+{
+    Qcow2CompressTask *t = container_of(task, Qcow2CompressTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    uint8_t *buf;
+    ssize_t out_len;
+
+    buf = qemu_blockalign(t->bs, s->cluster_size);
+    if (t->bytes != s->cluster_size) {
+        /* Zero-pad last write if image size is not cluster aligned */
+        memset(buf + t->bytes, 0, s->cluster_size - t->bytes);
+    }
+    qemu_iovec_to_buf(t->qiov, t->qiov_offset, buf, t->bytes);
+
+    t->cluster->buf = g_malloc(s->cluster_size);
+    out_len = qcow2_co_compress(t->bs, t->cluster->buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    qemu_vfree(buf);
+
+    if (out_len == -2) {
+        return -EINVAL;
+    }
+    t->cluster->len = out_len;
+    return 0;
+}
+
+/*
+ * Writes up to QCOW2_COMPRESS_BATCH_CLUSTERS clusters: all of them are
+ * compressed in parallel first, then host space for the whole batch is
+ * allocated under a single lock, and runs of contiguous compressed clusters
+ * are written with one request each.
+ */
+static coroutine_fn int
+qcow2_co_pwritev_compressed_batch(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes, QEMUIOVector *qiov,
+                                  uint64_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int nb_clusters = size_to_clusters(s, bytes);
+    Qcow2CompressedCluster *clusters;
+    AioTaskPool *aio = NULL;
+    QEMUIOVector hd_qiov;
+    int64_t cluster_offset;
+    int i, j, ret = 0;
+
+    assert(nb_clusters <= QCOW2_COMPRESS_BATCH_CLUSTERS);
+    clusters = g_new0(Qcow2CompressedCluster, nb_clusters);
+
+    if (nb_clusters > 1) {
+        aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    }
+    for (i = 0; i < nb_clusters && aio_task_pool_status(aio) == 0; i++) {
+        uint64_t cluster_bytes = (uint64_t) i << s->cluster_bits;
+        Qcow2CompressTask local_task;
+        Qcow2CompressTask *task = aio ? g_new(Qcow2CompressTask, 1)
+                                      : &local_task;
+
+        *task = (Qcow2CompressTask) {
+            .task.func      = qcow2_compress_task_entry,
+            .bs             = bs,
+            .qiov           = qiov,
+            .qiov_offset    = qiov_offset + cluster_bytes,
+            .bytes          = MIN(s->cluster_size, bytes - cluster_bytes),
+            .cluster        = &clusters[i],
+        };
+
+        if (aio) {
+            aio_task_pool_start_task(aio, &task->task);
+        } else {
+            ret = task->task.func(&task->task);
+        }
+    }
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        aio_task_pool_free(aio);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        if (clusters[i].len < 0) {
+            continue;
+        }
+
+        cluster_offset = qcow2_alloc_compressed_cluster_offset(
+            bs, offset + ((uint64_t) i << s->cluster_bits), clusters[i].len);
+        if (!cluster_offset) {
+            ret = -EIO;
+            break;
+        }
+        cluster_offset &= s->cluster_offset_mask;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset,
+                                            clusters[i].len);
+        if (ret < 0) {
+            break;
+        }
+        clusters[i].host_offset = cluster_offset;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < nb_clusters; i = j) {
+        uint64_t cluster_bytes = (uint64_t) i << s->cluster_bits;
+        uint64_t end;
+
+        if (clusters[i].len < 0) {
+            /* could not compress: write normal cluster */
+            uint64_t len = MIN(s->cluster_size, bytes - cluster_bytes);
+
+            qemu_iovec_init(&hd_qiov, qiov->niov);
+            qemu_iovec_concat(&hd_qiov, qiov, qiov_offset + cluster_bytes,
+                              len);
+            ret = qcow2_co_pwritev(bs, offset + cluster_bytes, len,
+                                   &hd_qiov, 0);
+            qemu_iovec_destroy(&hd_qiov);
+            if (ret < 0) {
+                goto fail;
+            }
+            j = i + 1;
+            continue;
+        }
+
+        qemu_iovec_init(&hd_qiov, nb_clusters - i);
+        end = clusters[i].host_offset;
+        for (j = i; j < nb_clusters && clusters[j].len >= 0 &&
+                    clusters[j].host_offset == end; j++)
+        {
+            qemu_iovec_add(&hd_qiov, clusters[j].buf, clusters[j].len);
+            end += clusters[j].len;
+        }
+
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwritev(bs->file, clusters[i].host_offset, hd_qiov.size,
+                              &hd_qiov, 0);
+        qemu_iovec_destroy(&hd_qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    ret = 0;
+
+fail:
+    for (i = 0; i < nb_clusters; i++) {
+        g_free(clusters[i].buf);
+    }
+    g_free(clusters);
+    return ret;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
@@ -3824,12 +4536,9 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
                             uint64_t bytes, QEMUIOVector *qiov)
 {
     BDRVQcow2State *s = bs->opaque;
-    QEMUIOVector hd_qiov;
-    struct iovec iov;
-    int ret;
-    size_t out_len;
-    uint8_t *buf, *out_buf;
+    uint64_t qiov_offset = 0;
     int64_t cluster_offset;
+    int ret;
 
     if (bytes == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -3846,67 +4555,30 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
         return -EINVAL;
     }
 
-    buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes != s->cluster_size) {
-        if (bytes > s->cluster_size ||
-            offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS)
-        {
-            qemu_vfree(buf);
-            return -EINVAL;
-        }
-        /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+    /* Only the last cluster of the image may be written partially */
+    if (offset_into_cluster(s, bytes) &&
+        offset + bytes != bs->total_sectors << BDRV_SECTOR_BITS)
+    {
+        return -EINVAL;
     }
-    qemu_iovec_to_buf(qiov, 0, buf, bytes);
 
-    out_buf = g_malloc(s->cluster_size);
+    while (bytes) {
+        uint64_t cur_bytes =
+            MIN(bytes, (uint64_t) QCOW2_COMPRESS_BATCH_CLUSTERS <<
+                       s->cluster_bits);
 
-    out_len = qcow2_co_compress(bs, out_buf, buf, s->cluster_size);
-    if (out_len == -2) {
-        ret = -EINVAL;
-        goto fail;
-    } else if (out_len == -1) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
+        ret = qcow2_co_pwritev_compressed_batch(bs, offset, cur_bytes, qiov,
+                                                qiov_offset);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
-        goto success;
-    }
-
-    qemu_co_mutex_lock(&s->lock);
-    cluster_offset =
-        qcow2_alloc_compressed_cluster_offset(bs, offset, out_len);
-    if (!cluster_offset) {
-        qemu_co_mutex_unlock(&s->lock);
-        ret = -EIO;
-        goto fail;
-    }
-    cluster_offset &= s->cluster_offset_mask;
 
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-    qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+        bytes -= cur_bytes;
     }
 
-    iov = (struct iovec) {
-        .iov_base   = out_buf,
-        .iov_len    = out_len,
-    };
-    qemu_iovec_init_external(&hd_qiov, &iov, 1);
-
-    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwritev(bs->file, cluster_offset, out_len, &hd_qiov, 0);
-    if (ret < 0) {
-        goto fail;
-    }
-success:
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    g_free(out_buf);
-    return ret;
+    return 0;
 }
 
 static int make_completely_empty(BlockDriverState *bs)
@@ -4001,6 +4673,7 @@ static int make_completely_empty(BlockDriverState *bs)
     g_free(s->refcount_table);
     s->refcount_table = new_reftable;
     new_reftable = NULL;
+    qcow2_drop_used_cluster_bitmaps(bs);
 
     /* Now the in-memory refcount information again corresponds to the on-disk
      * information (reftable is empty and no refblocks (the refblock cache is
@@ -4079,7 +4752,9 @@ static int qcow2_make_empty(BlockDriverState *bs)
          * empties the image.  Furthermore, the L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. */
-        return make_completely_empty(bs);
+        ret = make_completely_empty(bs);
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
+        return ret;
     }
 
     /* This fallback code simply discards every active cluster; this is slow,
@@ -4097,6 +4772,7 @@ static int qcow2_make_empty(BlockDriverState *bs)
             break;
         }
     }
+    bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
 
     return ret;
 }
@@ -4123,10 +4799,12 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     uint64_t refcount_bits;
     uint64_t l2_tables;
     size_t cluster_size;
+    size_t l2e_size;
     int version;
     char *optstr;
     PreallocMode prealloc;
     bool has_backing_file;
+    bool extended_l2;
 
     /* Parse image creation options */
     cluster_size = qcow2_opt_get_cluster_size_del(opts, &local_err);
@@ -4144,6 +4822,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
         goto err;
     }
 
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+
     optstr = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
     prealloc = qapi_enum_parse(&PreallocMode_lookup, optstr,
                                PREALLOC_MODE_OFF, &local_err);
@@ -4161,7 +4842,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
 
     /* Check that virtual disk size is valid */
     l2_tables = DIV_ROUND_UP(virtual_size / cluster_size,
-                             cluster_size / sizeof(uint64_t));
+                             cluster_size / l2e_size);
     if (l2_tables * sizeof(uint64_t) > QCOW_MAX_L1_SIZE) {
         error_setg(&local_err, "The image size is too large "
                                "(try using a larger cluster size)");
@@ -4226,7 +4907,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     info = g_new(BlockMeasureInfo, 1);
     info->fully_allocated =
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
-                                 ctz32(refcount_bits));
+                                 ctz32(refcount_bits), extended_l2);
 
     /* Remove data clusters that are not required.  This overestimates the
      * required size because metadata needed for the fully allocated file is
@@ -4244,6 +4925,7 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcow2State *s = bs->opaque;
     bdi->unallocated_blocks_are_zero = true;
+    bdi->multi_cluster_compressed_writes = true;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     return 0;
@@ -4279,6 +4961,11 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
+            .compression_type   = s->compression_type,
+            .has_compression_type =
+                s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB,
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -4312,6 +4999,23 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BlockStatsSpecificQcow2 *qcow2_stats = &stats->u.qcow2;
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    qcow2_stats->l2_cache = g_new0(Qcow2CacheStats, 1);
+    qcow2_stats->refcount_cache = g_new0(Qcow2CacheStats, 1);
+
+    qcow2_cache_get_stats(s->l2_table_cache, qcow2_stats->l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          qcow2_stats->refcount_cache);
+
+    return stats;
+}
+
 static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
                               int64_t pos)
 {
@@ -4405,6 +5109,7 @@ typedef enum Qcow2AmendOperation {
     QCOW2_NO_OPERATION = 0,
 
     QCOW2_CHANGING_REFCOUNT_ORDER,
+    QCOW2_CHANGING_L2_ENTRY_SIZE,
     QCOW2_DOWNGRADING,
 } Qcow2AmendOperation;
 
@@ -4478,6 +5183,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     uint64_t new_size = 0;
     const char *backing_file = NULL, *backing_format = NULL;
     bool lazy_refcounts = s->use_lazy_refcounts;
+    bool extended_l2 = has_subclusters(s);
     const char *compat = NULL;
     uint64_t cluster_size = s->cluster_size;
     bool encrypt;
@@ -4547,6 +5253,20 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             lazy_refcounts = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_REFCOUNTS,
                                                lazy_refcounts);
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *compression_type =
+                qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+
+            if (compression_type &&
+                strcmp(compression_type,
+                       Qcow2CompressionType_str(s->compression_type))) {
+                error_setg(errp, "Changing the compression type is not "
+                           "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            extended_l2 = qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                            extended_l2);
         } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_BITS)) {
             refcount_bits = qemu_opt_get_number(opts, BLOCK_OPT_REFCOUNT_BITS,
                                                 refcount_bits);
@@ -4572,6 +5292,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         .original_cb_opaque = cb_opaque,
         .total_operations = (new_version < old_version)
                           + (s->refcount_bits != refcount_bits)
+                          + (has_subclusters(s) != extended_l2)
     };
 
     /* Upgrade first (some features may require compat=1.1) */
@@ -4604,6 +5325,28 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
     }
 
+    if (has_subclusters(s) != extended_l2) {
+        if (extended_l2 && new_version < 3) {
+            error_setg(errp, "Extended L2 entries require compatibility "
+                       "level 1.1 or above (use compat=1.1 or greater)");
+            return -EINVAL;
+        }
+        if (extended_l2 && s->cluster_bits < QCOW_EXTL2_MIN_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       1 << QCOW_EXTL2_MIN_CLUSTER_BITS);
+            return -EINVAL;
+        }
+
+        helper_cb_info.current_operation = QCOW2_CHANGING_L2_ENTRY_SIZE;
+        ret = qcow2_change_l2_entry_size(bs, extended_l2,
+                                         &qcow2_amend_helper_cb,
+                                         &helper_cb_info, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (backing_file || backing_format) {
         ret = qcow2_change_backing_file(bs,
                     backing_file ?: s->image_backing_file,
@@ -4788,6 +5531,16 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Postpone refcount updates",
             .def_value_str = "off"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 tables",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for image cluster compression",
+        },
         {
             .name = BLOCK_OPT_REFCOUNT_BITS,
             .type = QEMU_OPT_NUMBER,
@@ -4813,6 +5566,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_create       = qcow2_co_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_block_status = qcow2_co_block_status,
+    .supports_block_status_cache = true,
 
     .bdrv_co_preadv         = qcow2_co_preadv,
     .bdrv_co_pwritev        = qcow2_co_pwritev,
@@ -4834,6 +5588,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure           = qcow2_measure,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -42,6 +42,10 @@
 #define QCOW_MAX_CRYPT_CLUSTERS 32
 #define QCOW_MAX_SNAPSHOTS 65536
 
+/* Maximum number of host-contiguous parts of a single guest request that
+ * are processed concurrently */
+#define QCOW2_MAX_WORKERS 8
+
 /* Field widths in qcow2 mean normal cluster offsets cannot reach
  * 64PB; depending on cluster size, compressed clusters can have a
  * smaller limit (64PB for up to 16k clusters, then ramps down to
@@ -71,6 +75,30 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* Images with extended L2 entries split every cluster into 32 subclusters.
+ * Each L2 entry is followed by a 64-bit bitmap: bits 0-31 say that the
+ * subcluster is allocated in the host cluster, bits 32-63 that it reads as
+ * zeroes. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_EXTL2_MIN_CLUSTER_BITS 14
+
+/* The subcluster X [0..31] is allocated */
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+/* The subcluster X [0..31] reads as zeroes */
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Subclusters [X, Y) (0 <= X <= Y <= 32) are allocated */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y)     (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+/* Subclusters [X, Y) (0 <= X <= Y <= 32) read as zeroes */
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y)     (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+/* L2 entry bitmap with all allocation bits set */
+#define QCOW_L2_BITMAP_ALL_ALLOC  (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+/* L2 entry bitmap with all "read as zeroes" bits set */
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
+/* Size of normal and extended L2 entries */
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
@@ -134,6 +162,12 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Additional fields, only valid if header_length covers them */
+    uint8_t compression_type;
+
+    /* header must be a multiple of 8 */
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
@@ -199,11 +233,17 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -256,10 +296,19 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+/* Bitmap of the used clusters in the range of one refcount block */
+typedef struct Qcow2UsedClusterBitmap {
+    unsigned long *bitmap;      /* NULL if not loaded */
+    uint64_t lru_counter;
+} Qcow2UsedClusterBitmap;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subclusters_per_cluster;
+    int subcluster_size;
+    int subcluster_bits;
     int l2_slice_size;
     int l2_bits;
     int l2_size;
@@ -278,9 +327,11 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Last decompressed cluster, protected by lock */
     uint8_t *cluster_cache;
-    uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    /* Bumped whenever host clusters may be reused under cluster_cache */
+    uint64_t cluster_cache_gen;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -289,6 +340,12 @@ typedef struct BDRVQcow2State {
     uint32_t max_refcount_table_index; /* Last used entry in refcount_table */
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
+    /* Used cluster bitmaps, indexed like the refcount table */
+    Qcow2UsedClusterBitmap *used_cluster_bitmaps;
+    uint64_t nb_used_cluster_bitmaps;
+    int used_cluster_bitmaps_loaded;
+    int max_used_cluster_bitmaps;
+    uint64_t used_cluster_bitmap_lru_counter;
 
     CoMutex lock;
 
@@ -340,6 +397,9 @@ typedef struct BDRVQcow2State {
 
     CoQueue compress_wait_queue;
     int nb_compress_threads;
+
+    /* Qcow2CompressionType; anything but zlib sets the incompatible bit */
+    uint8_t compression_type;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -368,7 +428,12 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
-    /** Do not free the old clusters */
+    /**
+     * Do not free the old clusters. This is set when the write goes to
+     * clusters that are already allocated in the image file (preallocated
+     * zero clusters, or partially allocated clusters with extended L2
+     * entries) and only their L2 entries need to be updated.
+     */
     bool keep_old_clusters;
 
     /**
@@ -472,6 +537,64 @@ static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
 }
 
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0; /* For convenience only; this value has no meaning. */
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int64_t offset_into_subcluster(BDRVQcow2State *s, int64_t offset)
+{
+    return offset & (s->subcluster_size - 1);
+}
+
+static inline uint64_t size_to_subclusters(BDRVQcow2State *s, uint64_t size)
+{
+    return (size + (s->subcluster_size - 1)) >> s->subcluster_bits;
+}
+
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) & (s->subclusters_per_cluster - 1);
+}
+
 static inline int64_t size_to_l1(BDRVQcow2State *s, int64_t size)
 {
     int shift = s->cluster_bits + s->l2_bits;
@@ -514,6 +637,56 @@ static inline QCow2ClusterType qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type of subcluster @sc_index of a cluster with extended L2
+ * entry @l2_entry and subcluster bitmap @l2_bitmap. A subcluster that is
+ * neither allocated nor zero reads from the backing file, even if the cluster
+ * has a host offset; callers must not use the host offset in that case.
+ * Compressed clusters have no subclusters.
+ */
+static inline QCow2ClusterType qcow2_get_subcluster_type(uint64_t l2_entry,
+                                                         uint64_t l2_bitmap,
+                                                         unsigned sc_index)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        if (l2_entry & L2E_OFFSET_MASK) {
+            return QCOW2_CLUSTER_ZERO_ALLOC;
+        }
+        return QCOW2_CLUSTER_ZERO_PLAIN;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
+/*
+ * Checks the subcluster bitmap of an extended L2 entry for consistency: no
+ * subcluster may be both allocated and zero, an entry without a host offset
+ * cannot have allocated subclusters, and the zero flag of the standard L2
+ * entry is reserved.
+ */
+static inline bool qcow2_l2_bitmap_is_valid(uint64_t l2_entry,
+                                            uint64_t l2_bitmap)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return true;
+    }
+    if (l2_entry & QCOW_OFLAG_ZERO) {
+        return false;
+    }
+    if ((l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) & (l2_bitmap >> 32)) {
+        return false;
+    }
+    if (!(l2_entry & L2E_OFFSET_MASK) &&
+        (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)) {
+        return false;
+    }
+    return true;
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -563,6 +736,7 @@ int qcow2_validate_table(BlockDriverState *bs, uint64_t offset,
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_drop_used_cluster_bitmaps(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
@@ -616,7 +790,6 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
 int qcow2_shrink_l1_table(BlockDriverState *bs, uint64_t max_size);
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
@@ -640,6 +813,9 @@ int qcow2_cluster_zeroize(BlockDriverState *bs, uint64_t offset,
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
                                void *cb_opaque);
+int qcow2_change_l2_entry_size(BlockDriverState *bs, bool extended,
+                               BlockDriverAmendStatusCB *status_cb,
+                               void *cb_opaque, Error **errp);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -679,6 +855,7 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -198,6 +198,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to load snapshot");
         }
@@ -226,6 +227,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
         ret = bdrv_snapshot_goto(file, snapshot_id, errp);
         open_ret = drv->bdrv_open(bs, options, bs->open_flags, &local_err);
+        bdrv_bsc_invalidate_range(bs, 0, INT64_MAX);
         qobject_unref(options);
         if (open_ret < 0) {
             bdrv_unref(file);
@@ -140,7 +140,8 @@ void qmp_nbd_server_start(SocketAddressLegacy *addr,
 }
 
 void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
-                        bool has_writable, bool writable, Error **errp)
+                        bool has_writable, bool writable,
+                        bool has_multi_conn, bool multi_conn, Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
@@ -174,7 +175,14 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /* Clients of a writable export must ask for multi-conn explicitly */
+    if (!has_multi_conn) {
+        multi_conn = !writable;
+    }
+
+    exp = nbd_export_new(bs, 0, -1,
+                         (multi_conn ? NBD_FLAG_CAN_MULTI_CONN : 0) |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
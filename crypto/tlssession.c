@@ -32,6 +32,18 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -549,6 +561,128 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+#ifdef CONFIG_KTLS
+typedef union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+} QCryptoTLSKernelInfo;
+
+/*
+ * The nonce is the 4 byte implicit IV followed by the explicit part,
+ * which GNUTLS sets to the record sequence number.
+ */
+#define QCRYPTO_TLS_KTLS_FILL(gcm, iv, key, seq)                          \
+    ({                                                                    \
+        bool ok_ = (key).size == sizeof((gcm)->key) &&                    \
+            (iv).size >= sizeof((gcm)->salt);                             \
+        if (ok_) {                                                        \
+            memcpy((gcm)->key, (key).data, sizeof((gcm)->key));           \
+            memcpy((gcm)->salt, (iv).data, sizeof((gcm)->salt));          \
+            memcpy((gcm)->iv, (seq), sizeof((gcm)->iv));                  \
+            memcpy((gcm)->rec_seq, (seq), sizeof((gcm)->rec_seq));        \
+        }                                                                 \
+        ok_;                                                              \
+    })
+
+static int
+qcrypto_tls_session_get_kernel_info(QCryptoTLSSession *session,
+                                    QCryptoTLSKernelInfo *ci,
+                                    socklen_t *len)
+{
+    gnutls_datum_t iv, key;
+    unsigned char seq[8];
+
+    memset(ci, 0, sizeof(*ci));
+
+    /*
+     * Only TLS 1.2: with TLS 1.3, GNUTLS answers a KeyUpdate from the
+     * peer by sending a KeyUpdate record of its own and moving to new
+     * keys, neither of which a kernel that owns the sending side would
+     * know about.
+     */
+    if (gnutls_protocol_get_version(session->handle) != GNUTLS_TLS1_2) {
+        return -1;
+    }
+    ci->info.version = TLS_1_2_VERSION;
+
+    if (gnutls_record_get_state(session->handle, 0,
+                                NULL, &iv, &key, seq) < 0) {
+        return -1;
+    }
+
+    switch (gnutls_cipher_get(session->handle)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        *len = sizeof(ci->aes_gcm_128);
+        if (!QCRYPTO_TLS_KTLS_FILL(&ci->aes_gcm_128, iv, key, seq)) {
+            return -1;
+        }
+        return 0;
+    case GNUTLS_CIPHER_AES_256_GCM:
+        ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        *len = sizeof(ci->aes_gcm_256);
+        if (!QCRYPTO_TLS_KTLS_FILL(&ci->aes_gcm_256, iv, key, seq)) {
+            return -1;
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session,
+                                int fd)
+{
+    QCryptoTLSKernelInfo ci;
+    socklen_t len;
+    int ret = 0;
+
+    if (!session->handshakeComplete) {
+        return 0;
+    }
+
+    /* Check the cipher suite before the socket is committed to kTLS */
+    if (qcrypto_tls_session_get_kernel_info(session, &ci, &len) < 0) {
+        trace_qcrypto_tls_session_ktls(session, fd,
+                                       "unsupported version or cipher");
+        goto out;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        trace_qcrypto_tls_session_ktls(session, fd, strerror(errno));
+        goto out;
+    }
+
+    /*
+     * Receiving stays with GNUTLS: a plain read() of a kTLS socket fails
+     * on alerts, KeyUpdate and other non-data records, which GNUTLS
+     * handles for us.
+     */
+    if (setsockopt(fd, SOL_TLS, TLS_TX, &ci, len) == 0) {
+        ret |= QCRYPTO_TLS_KTLS_TX;
+    }
+
+    trace_qcrypto_tls_session_ktls(session, fd,
+                                   ret & QCRYPTO_TLS_KTLS_TX ? "tx" : "none");
+
+ out:
+    /* Don't leave the session keys lying around on the stack */
+    memset(&ci, 0, sizeof(ci));
+    return ret;
+}
+#else /* ! CONFIG_KTLS */
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *session G_GNUC_UNUSED,
+                                int fd G_GNUC_UNUSED)
+{
+    return 0;
+}
+#endif /* ! CONFIG_KTLS */
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -640,4 +774,12 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+int
+qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                                int fd G_GNUC_UNUSED)
+{
+    return 0;
+}
+
 #endif
@@ -207,6 +207,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
         }
+        if (info->has_predicted_downtime) {
+            monitor_printf(mon, "predicted downtime: %" PRIu64
+                           " milliseconds\n", info->predicted_downtime);
+        }
         if (info->has_setup_time) {
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
@@ -396,6 +400,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_POSTCOPY_BANDWIDTH),
             params->max_postcopy_bandwidth);
+        assert(params->has_direct_io);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRECT_IO),
+            params->direct_io ? "on" : "off");
+        assert(params->has_x_colo_ram_update_delay);
+        monitor_printf(mon, "%s: %u milliseconds\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_COLO_RAM_UPDATE_DELAY),
+            params->x_colo_ram_update_delay);
     }
 
     qapi_free_MigrationParameters(params);
@@ -1752,6 +1764,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_max_postcopy_bandwidth = true;
         visit_type_size(v, param, &p->max_postcopy_bandwidth, &err);
         break;
+    case MIGRATION_PARAMETER_DIRECT_IO:
+        p->has_direct_io = true;
+        visit_type_bool(v, param, &p->direct_io, &err);
+        break;
+    case MIGRATION_PARAMETER_X_COLO_RAM_UPDATE_DELAY:
+        p->has_x_colo_ram_update_delay = true;
+        visit_type_int(v, param, &p->x_colo_ram_update_delay, &err);
+        break;
     default:
         assert(0);
     }
@@ -2323,7 +2343,7 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
         }
 
         qmp_nbd_server_add(info->value->device, false, NULL,
-                           true, writable, &local_err);
+                           true, writable, false, false, &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -2344,7 +2364,8 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     bool writable = qdict_get_try_bool(qdict, "writable", false);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, !!name, name, true, writable, &local_err);
+    qmp_nbd_server_add(device, !!name, name, true, writable, false, false,
+                       &local_err);
     hmp_handle_error(mon, &local_err);
 }
 
@@ -42,6 +42,15 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * IOThreads of iothread-vq-mapping, the first one is also iothread.
+     * vq_aio_context[i] is where the host notifier of virtqueue i is
+     * handled; without a mapping it is ctx for every virtqueue.
+     */
+    IOThread **vq_iothreads;
+    unsigned num_vq_iothreads;
+    AioContext **vq_aio_context;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -79,6 +88,62 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/*
+ * Resolve the IOThread ids of the iothread-vq-mapping property.
+ *
+ * Context: QEMU global mutex held
+ */
+static bool virtio_blk_parse_vq_mapping(VirtIOBlkConf *conf,
+                                        IOThread ***iothreads,
+                                        unsigned *num_iothreads,
+                                        Error **errp)
+{
+    char **ids = g_strsplit(conf->iothread_vq_mapping, ":", -1);
+    unsigned n = g_strv_length(ids);
+    unsigned i, j;
+
+    *iothreads = NULL;
+    *num_iothreads = 0;
+
+    if (n == 0) {
+        error_setg(errp, "iothread-vq-mapping needs at least one iothread");
+        goto fail;
+    }
+    if (n > conf->num_queues) {
+        error_setg(errp, "iothread-vq-mapping has more iothreads (%u) than "
+                   "num-queues (%u)", n, conf->num_queues);
+        goto fail;
+    }
+
+    *iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        IOThread *iothread = iothread_by_id(ids[i]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", ids[i]);
+            goto fail;
+        }
+        for (j = 0; j < i; j++) {
+            if ((*iothreads)[j] == iothread) {
+                error_setg(errp, "iothread \"%s\" is listed more than once "
+                           "in iothread-vq-mapping", ids[i]);
+                goto fail;
+            }
+        }
+        (*iothreads)[i] = iothread;
+    }
+
+    *num_iothreads = n;
+    g_strfreev(ids);
+    return true;
+
+fail:
+    g_free(*iothreads);
+    *iothreads = NULL;
+    g_strfreev(ids);
+    return false;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -87,19 +152,34 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **vq_iothreads = NULL;
+    unsigned num_vq_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread_vq_mapping) {
+        if (conf->iothread) {
+            error_setg(errp, "iothread and iothread-vq-mapping properties "
+                       "cannot be set at the same time");
+            return false;
+        }
+        if (!virtio_blk_parse_vq_mapping(conf, &vq_iothreads,
+                                         &num_vq_iothreads, errp)) {
+            return false;
+        }
+    }
+
+    if (conf->iothread || vq_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
                        "(transport does not support notifiers)");
-            return false;
+            goto fail;
         }
         if (!virtio_device_ioeventfd_enabled(vdev)) {
             error_setg(errp, "ioeventfd is required for iothread");
-            return false;
+            goto fail;
         }
 
         /* If dataplane is (re-)enabled while the guest is running there could
@@ -107,37 +187,58 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
          */
         if (blk_op_is_blocked(conf->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
-            return false;
+            goto fail;
         }
     }
     /* Don't try if transport does not support notifiers. */
     if (!virtio_device_ioeventfd_enabled(vdev)) {
-        return false;
+        goto fail;
     }
 
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
+    if (vq_iothreads) {
+        /* The BlockBackend lives in the first IOThread of the mapping */
+        s->iothread = vq_iothreads[0];
+        s->vq_iothreads = vq_iothreads;
+        s->num_vq_iothreads = num_vq_iothreads;
+        for (i = 0; i < num_vq_iothreads; i++) {
+            object_ref(OBJECT(vq_iothreads[i]));
+        }
+        s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
     } else {
         s->ctx = qemu_get_aio_context();
     }
+
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_aio_context[i] = vq_iothreads ?
+            iothread_get_aio_context(vq_iothreads[i % num_vq_iothreads]) :
+            s->ctx;
+    }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
     *dataplane = s;
 
     return true;
+
+fail:
+    g_free(vq_iothreads);
+    return false;
 }
 
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -147,12 +248,26 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
-    if (s->iothread) {
+    if (s->vq_iothreads) {
+        for (i = 0; i < s->num_vq_iothreads; i++) {
+            object_unref(OBJECT(s->vq_iothreads[i]));
+        }
+        g_free(s->vq_iothreads);
+    } else if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
+/*
+ * With iothread-vq-mapping this runs in the IOThread of @vq, which need
+ * not be the one of the BlockBackend.  virtio_blk_handle_vq() takes the
+ * BlockBackend's AioContext lock and request coroutines are entered in
+ * that AioContext, so the block layer itself is still single-threaded;
+ * what is spread across IOThreads is the notification, vring and request
+ * parsing work.
+ */
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
@@ -212,6 +327,10 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     vblk->dataplane_started = true;
     trace_virtio_blk_data_plane_start(s);
 
+    aio_context_acquire(blk_get_aio_context(s->conf->conf.blk));
+    virtio_blk_merge_window_flush(vblk);
+    aio_context_release(blk_get_aio_context(s->conf->conf.blk));
+
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
     /* Kick right away to begin processing requests already in vring */
@@ -222,14 +341,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -239,19 +359,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues
+ * handled in the current AioContext.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_aio_context[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -278,8 +402,18 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    /* The IOThreads of iothread-vq-mapping other than the first one */
+    for (i = 1; i < s->num_vq_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->vq_iothreads[i]);
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+    virtio_blk_merge_window_flush(vblk);
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
@@ -16,6 +16,7 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "hw/block/block.h"
 #include "sysemu/blockdev.h"
@@ -336,9 +337,12 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
     bool is_write = mrb->is_write;
 
     if (num_reqs > 1) {
+        VirtIOBlock *s = mrb->reqs[start]->dev;
         int i;
         struct iovec *tmp_iov = qiov->iov;
         int tmp_niov = qiov->niov;
+        int64_t end = sector_num + qiov->size / BDRV_SECTOR_SIZE;
+        uint64_t gap_bytes = 0;
 
         /* mrb->reqs[start]->qiov was initialized from external so we can't
          * modify it here. We need to initialize it locally and then add the
@@ -350,9 +354,23 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
         }
 
         for (i = start + 1; i < start + num_reqs; i++) {
-            qemu_iovec_concat(qiov, &mrb->reqs[i]->qiov, 0,
-                              mrb->reqs[i]->qiov.size);
-            mrb->reqs[i - 1]->mr_next = mrb->reqs[i];
+            VirtIOBlockReq *req = mrb->reqs[i];
+
+            if (req->sector_num > end) {
+                /* Read the hole between two requests into a scratch
+                 * buffer whose contents are thrown away.
+                 */
+                uint64_t bytes = (req->sector_num - end) << BDRV_SECTOR_BITS;
+
+                assert(!is_write && bytes <= s->conf.merge_gap);
+                trace_virtio_blk_merge_gap(VIRTIO_DEVICE(s),
+                                           end << BDRV_SECTOR_BITS, bytes);
+                qemu_iovec_add(qiov, s->merge_gap_buf, bytes);
+                gap_bytes += bytes;
+            }
+            qemu_iovec_concat(qiov, &req->qiov, 0, req->qiov.size);
+            end = req->sector_num + req->qiov.size / BDRV_SECTOR_SIZE;
+            mrb->reqs[i - 1]->mr_next = req;
         }
 
         trace_virtio_blk_submit_multireq(VIRTIO_DEVICE(mrb->reqs[start]->dev),
@@ -362,6 +380,10 @@ static inline void submit_requests(BlockBackend *blk, MultiReqBuffer *mrb,
         block_acct_merge_done(blk_get_stats(blk),
                               is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
                               num_reqs - 1);
+        if (gap_bytes) {
+            block_acct_merge_gap(blk_get_stats(blk), BLOCK_ACCT_READ,
+                                 gap_bytes);
+        }
     }
 
     if (is_write) {
@@ -396,6 +418,7 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     int i = 0, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
     uint32_t max_transfer;
     int64_t sector_num = 0;
+    int64_t max_gap = 0;
 
     if (mrb->num_reqs == 1) {
         submit_requests(blk, mrb, 0, 1, -1);
@@ -404,26 +427,35 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     }
 
     max_transfer = blk_get_max_transfer(mrb->reqs[0]->dev->blk);
+    if (!mrb->is_write) {
+        max_gap = mrb->reqs[0]->dev->conf.merge_gap / BDRV_SECTOR_SIZE;
+    }
 
     qsort(mrb->reqs, mrb->num_reqs, sizeof(*mrb->reqs),
           &multireq_compare);
 
     for (i = 0; i < mrb->num_reqs; i++) {
         VirtIOBlockReq *req = mrb->reqs[i];
+        int64_t gap = 0;
+
         if (num_reqs > 0) {
+            gap = req->sector_num - (sector_num + nb_sectors);
+
             /*
              * NOTE: We cannot merge the requests in below situations:
-             * 1. requests are not sequential
+             * 1. requests are not sequential, apart from reads separated
+             *    by a hole of at most merge-gap bytes
              * 2. merge would exceed maximum number of IOVs
              * 3. merge would exceed maximum transfer length of backend device
              */
-            if (sector_num + nb_sectors != req->sector_num ||
-                niov > blk_get_max_iov(blk) - req->qiov.niov ||
+            if (gap < 0 || gap > max_gap ||
+                niov + !!gap > blk_get_max_iov(blk) - req->qiov.niov ||
                 req->qiov.size > max_transfer ||
-                nb_sectors > (max_transfer -
-                              req->qiov.size) / BDRV_SECTOR_SIZE) {
+                nb_sectors + gap > (max_transfer -
+                                    req->qiov.size) / BDRV_SECTOR_SIZE) {
                 submit_requests(blk, mrb, start, num_reqs, niov);
                 num_reqs = 0;
+                gap = 0;
             }
         }
 
@@ -433,8 +465,8 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
             start = i;
         }
 
-        nb_sectors += req->qiov.size / BDRV_SECTOR_SIZE;
-        niov += req->qiov.niov;
+        nb_sectors += gap + req->qiov.size / BDRV_SECTOR_SIZE;
+        niov += !!gap + req->qiov.niov;
         num_reqs++;
     }
 
@@ -442,6 +474,72 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     mrb->num_reqs = 0;
 }
 
+/* Context: AioContext of s->blk held */
+void virtio_blk_merge_window_flush(VirtIOBlock *s)
+{
+    MultiReqBuffer *mrb = s->merge_window;
+
+    if (!mrb) {
+        return;
+    }
+    if (s->merge_timer) {
+        timer_del(s->merge_timer);
+    }
+    if (mrb->num_reqs) {
+        trace_virtio_blk_merge_window_flush(VIRTIO_DEVICE(s), mrb->num_reqs);
+        virtio_blk_submit_multireq(s->blk, mrb);
+    }
+}
+
+static void virtio_blk_merge_window_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    blk_io_plug(s->blk);
+    virtio_blk_merge_window_flush(s);
+    blk_io_unplug(s->blk);
+    aio_context_release(ctx);
+}
+
+/* Called at the end of a notify batch with requests left in @mrb.  Either
+ * submit them now or keep them in the merge window, so that requests from
+ * the next batch can still be merged with them.  The window is bounded by
+ * both the number of requests and the time since it was first armed.
+ */
+static void virtio_blk_merge_window_defer(VirtIOBlock *s, MultiReqBuffer *mrb)
+{
+    AioContext *ctx;
+
+    if (mrb != s->merge_window ||
+        mrb->num_reqs >= s->conf.merge_window_reqs) {
+        virtio_blk_merge_window_flush(s);
+        if (mrb->num_reqs) {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        }
+        return;
+    }
+
+    ctx = blk_get_aio_context(s->blk);
+    if (s->merge_timer && s->merge_timer_ctx != ctx) {
+        timer_del(s->merge_timer);
+        timer_free(s->merge_timer);
+        s->merge_timer = NULL;
+    }
+    if (!s->merge_timer) {
+        s->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                       virtio_blk_merge_window_timer_cb, s);
+        s->merge_timer_ctx = ctx;
+    }
+
+    trace_virtio_blk_merge_window_defer(VIRTIO_DEVICE(s), mrb->num_reqs);
+    if (!timer_pending(s->merge_timer)) {
+        timer_mod(s->merge_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                  (int64_t)s->conf.merge_window_us * SCALE_US);
+    }
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     block_acct_start(blk_get_stats(req->dev->blk), &req->acct, 0,
@@ -594,7 +692,8 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = s->merge_window ? s->merge_window : &local_mrb;
     bool progress = false;
 
     aio_context_acquire(blk_get_aio_context(s->blk));
@@ -605,7 +704,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 
         while ((req = virtio_blk_get_request(s, vq))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
+            if (virtio_blk_handle_request(req, mrb)) {
                 virtqueue_detach_element(req->vq, &req->elem, 0);
                 virtio_blk_free_request(req);
                 break;
@@ -615,8 +714,8 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         virtio_queue_set_notification(vq, 1);
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    if (mrb->num_reqs) {
+        virtio_blk_merge_window_defer(s, mrb);
     }
 
     blk_io_unplug(s->blk);
@@ -686,6 +785,14 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtIOBlock *s = opaque;
 
     if (!running) {
+        AioContext *ctx = blk_get_aio_context(s->conf.conf.blk);
+
+        /* Requests still in the merge window must be in flight before
+         * the block layer is drained for the stop.
+         */
+        aio_context_acquire(ctx);
+        virtio_blk_merge_window_flush(s);
+        aio_context_release(ctx);
         return;
     }
 
@@ -704,6 +811,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_merge_window_flush(s);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
@@ -934,6 +1042,24 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
                    conf->queue_size, VIRTQUEUE_MAX_SIZE);
         return;
     }
+    if (!conf->merge_window_reqs ||
+        conf->merge_window_reqs > VIRTIO_BLK_MAX_MERGE_REQS) {
+        error_setg(errp, "merge-window-reqs must be between 1 and %d",
+                   VIRTIO_BLK_MAX_MERGE_REQS);
+        return;
+    }
+    if (conf->merge_gap % BDRV_SECTOR_SIZE ||
+        conf->merge_gap > VIRTIO_BLK_MAX_MERGE_GAP) {
+        error_setg(errp, "merge-gap must be a multiple of 512 and at most %d",
+                   VIRTIO_BLK_MAX_MERGE_GAP);
+        return;
+    }
+    if ((conf->merge_window_us || conf->merge_gap) &&
+        !conf->request_merging) {
+        error_setg(errp, "merge-window-us and merge-gap need "
+                   "request-merging=on");
+        return;
+    }
 
     if (!blkconf_apply_backend_options(&conf->conf,
                                        blk_is_read_only(conf->conf.blk), true,
@@ -971,6 +1097,13 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (conf->merge_window_us) {
+        s->merge_window = g_new0(MultiReqBuffer, 1);
+    }
+    if (conf->merge_gap) {
+        s->merge_gap_buf = blk_blockalign(s->blk, conf->merge_gap);
+    }
+
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
@@ -985,6 +1118,15 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
 
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
+    if (s->merge_timer) {
+        timer_del(s->merge_timer);
+        timer_free(s->merge_timer);
+        s->merge_timer = NULL;
+    }
+    g_free(s->merge_window);
+    s->merge_window = NULL;
+    qemu_vfree(s->merge_gap_buf);
+    s->merge_gap_buf = NULL;
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
@@ -1020,8 +1162,14 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us, 0),
+    DEFINE_PROP_UINT32("merge-window-reqs", VirtIOBlock,
+                       conf.merge_window_reqs, VIRTIO_BLK_MAX_MERGE_REQS),
+    DEFINE_PROP_UINT32("merge-gap", VirtIOBlock, conf.merge_gap, 0),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
+    DEFINE_PROP_STRING("iothread-vq-mapping", VirtIOBlock,
+                       conf.iothread_vq_mapping),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
     DEFINE_PROP_END_OF_LIST(),
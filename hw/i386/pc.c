@@ -548,6 +548,12 @@ static const VMStateDescription vmstate_port92_isa = {
     .name = "port92",
     .version_id = 1,
     .minimum_version_id = 1,
+    /*
+     * outport is only touched by port92_write/read, which don't run while
+     * the VM is stopped, and has no hooks; the A20 state it drives is
+     * migrated with the CPU.
+     */
+    .parallel = true,
     .fields = (VMStateField[]) {
         VMSTATE_UINT8(outport, Port92State),
         VMSTATE_END_OF_LIST()
@@ -76,15 +76,39 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
-struct BlockAcctStats {
-    QemuMutex lock;
+typedef struct BlockAcctCounters {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
     uint64_t failed_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
+    uint64_t merge_gap_bytes[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
+} BlockAcctCounters;
+
+/* Number of counter shards per BlockAcctStats.  Completions are accounted
+ * in the shard of the AioContext they run in, so that up to this many
+ * IOThreads never write to the same cache line.  The shards are only
+ * summed up when the statistics are queried.
+ */
+#define BLOCK_ACCT_SHARDS 8
+
+/* Shards are allocated with this alignment, see block_acct_init() */
+#define BLOCK_ACCT_SHARD_ALIGN 64
+
+typedef struct BlockAcctShard {
+    /* Only contended when the shard is shared by two threads or while
+     * block_acct_get_counters() reads it.
+     */
+    QemuSpin lock;
+    BlockAcctCounters counters;
+} QEMU_ALIGNED(BLOCK_ACCT_SHARD_ALIGN) BlockAcctShard;
+
+struct BlockAcctStats {
+    /* Protects @intervals and @latency_histogram */
+    QemuMutex lock;
+    BlockAcctShard *shards;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
     bool account_failed;
@@ -111,6 +135,9 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_merge_gap(BlockAcctStats *stats, enum BlockAcctType type,
+                          uint64_t bytes);
+void block_acct_get_counters(BlockAcctStats *stats, BlockAcctCounters *c);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
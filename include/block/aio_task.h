@@ -0,0 +1,48 @@
+/*
+ * Bounded pools of concurrent coroutine tasks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_AIO_TASK_H
+#define BLOCK_AIO_TASK_H
+
+#include "qemu/coroutine.h"
+
+typedef struct AioTaskPool AioTaskPool;
+typedef struct AioTask AioTask;
+typedef int coroutine_fn (*AioTaskFunc)(AioTask *task);
+
+/*
+ * A unit of work run in its own coroutine by an AioTaskPool.  Users embed
+ * AioTask as the first member of their own structure, allocate it with
+ * g_new() and hand it over to aio_task_pool_start_task(), which frees it
+ * once @func returns.
+ */
+struct AioTask {
+    AioTaskPool *pool;
+    AioTaskFunc func;
+    int ret;
+};
+
+/*
+ * The pool is owned by the coroutine that creates it; only that coroutine
+ * may start tasks and wait for them.
+ */
+AioTaskPool *coroutine_fn aio_task_pool_new(int max_busy_tasks);
+void aio_task_pool_free(AioTaskPool *pool);
+
+/* error code of the first failed task or 0 */
+int aio_task_pool_status(AioTaskPool *pool);
+
+bool aio_task_pool_empty(AioTaskPool *pool);
+
+/* Wait for a free slot if needed, then start @task in a new coroutine */
+void coroutine_fn aio_task_pool_start_task(AioTaskPool *pool, AioTask *task);
+
+void coroutine_fn aio_task_pool_wait_slot(AioTaskPool *pool);
+void coroutine_fn aio_task_pool_wait_one(AioTaskPool *pool);
+void coroutine_fn aio_task_pool_wait_all(AioTaskPool *pool);
+
+#endif /* BLOCK_AIO_TASK_H */
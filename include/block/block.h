@@ -31,6 +31,10 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a single compressed write may cover more than one cluster
+     */
+    bool multi_cluster_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -116,6 +120,7 @@ typedef struct HDGeometry {
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
 #define BDRV_O_AUTO_RDONLY 0x20000 /* degrade to read-only if opening read-write fails */
+#define BDRV_O_IO_URING    0x40000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -282,6 +287,7 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top,
 void bdrv_replace_node(BlockDriverState *from, BlockDriverState *to,
                        Error **errp);
 
+int bdrv_parse_aio(const char *mode, int *flags);
 int bdrv_parse_cache_mode(const char *mode, int *flags, bool *writethrough);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
 BdrvChild *bdrv_open_child(const char *filename,
@@ -477,7 +483,9 @@ const char *bdrv_get_device_name(const BlockDriverState *bs);
 const char *bdrv_get_device_or_node_name(const BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t *offset);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t offset, int64_t bytes,
                             int64_t *cluster_offset,
@@ -714,4 +722,30 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
                                     BdrvChild *dst, uint64_t dst_offset,
                                     uint64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
+
+/**
+ * BdrvHostFdReadFunc:
+ *
+ * Reads the data of a bdrv_co_read_host_fd() request from @fd, where it
+ * starts at @host_offset.
+ */
+typedef int coroutine_fn BdrvHostFdReadFunc(int fd, int64_t host_offset,
+                                            void *opaque);
+
+/**
+ *
+ * bdrv_co_read_host_fd:
+ *
+ * Let @fn read @bytes at @offset of @child itself from the host file that
+ * bdrv_get_host_fd() returns, e.g. to copy them to a socket with
+ * sendfile(2).  The request is tracked like one from bdrv_co_preadv(), so
+ * overlapping serialising requests are waited for first and writes that
+ * need to serialise wait for @fn to finish.
+ *
+ * Returns: a negative error code if there is no such host file, without
+ * calling @fn; otherwise the return value of @fn.
+ **/
+int coroutine_fn bdrv_co_read_host_fd(BdrvChild *child, int64_t offset,
+                                      unsigned int bytes,
+                                      BdrvHostFdReadFunc *fn, void *opaque);
 #endif
@@ -51,6 +51,8 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 #define BLOCK_OPT_REDUNDANCY        "redundancy"
 #define BLOCK_OPT_NOCOW             "nocow"
@@ -118,6 +120,11 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /* Set if the answers of bdrv_co_block_status() only change through
+     * requests on this node, so that the block layer may cache them.  Not
+     * for protocol drivers, whose data can be changed by others. */
+    bool supports_block_status_cache;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -319,7 +326,15 @@ struct BlockDriver {
                                   const char *name,
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /*
+     * Return a host file descriptor from which the data of @bs can be read
+     * directly, and store in @offset where that data starts in the file.
+     * Only implemented by drivers whose data is a plain byte range of a
+     * host file that is kept coherent with the block layer's writes.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs, int64_t *offset);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -665,6 +680,19 @@ struct BdrvChild {
     QLIST_ENTRY(BdrvChild) next_parent;
 };
 
+#define BDRV_BSC_SIZE 16
+
+/* One answer of BlockDriver.bdrv_co_block_status() */
+typedef struct BdrvBlockStatusCacheEntry {
+    bool valid;
+    bool want_zero;
+    int ret;
+    int64_t offset;
+    int64_t bytes;
+    int64_t map;
+    BlockDriverState *file;
+} BdrvBlockStatusCacheEntry;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -808,6 +836,13 @@ struct BlockDriverState {
 
     unsigned int write_gen;               /* Current data generation */
 
+    /* Recent block status answers of the driver, replaced round-robin and
+     * dropped by bdrv_bsc_invalidate_range().  Only used if the driver sets
+     * supports_block_status_cache.  Protected by the AioContext lock. */
+    BdrvBlockStatusCacheEntry bsc[BDRV_BSC_SIZE];
+    unsigned int bsc_next;
+    uint64_t bsc_gen;
+
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
@@ -1154,6 +1189,14 @@ bool blk_dev_is_medium_locked(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+/*
+ * Forget the cached block status of @bs for the given range.  Drivers must
+ * call this when they change their mapping other than through a write,
+ * zero write, discard or truncate request on @bs.
+ */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes);
+
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
 void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup);
 
@@ -319,4 +319,36 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+typedef enum {
+    QCRYPTO_TLS_KTLS_TX = (1 << 0),
+} QCryptoTLSSessionKTLS;
+
+/**
+ * qcrypto_tls_session_enable_ktls:
+ * @sess: the TLS session object
+ * @fd: the TCP socket the session runs over
+ *
+ * Once the handshake has completed, try to hand the
+ * sending half of the record layer over to the kernel
+ * (Linux kernel TLS), so that the socket itself encrypts
+ * what is written to it. This requires TLS 1.2, a cipher
+ * suite the kernel implements (AES-GCM) and the "tls"
+ * module; when any is missing nothing is changed and the
+ * session keeps doing the work in userspace. TLS 1.3 is
+ * left alone because GNUTLS itself must send the answer
+ * to a KeyUpdate and switch to the new keys.
+ *
+ * Receiving is never offloaded: GNUTLS keeps decrypting
+ * incoming records, so that alerts, KeyUpdate and session
+ * tickets are still handled.
+ *
+ * Once sending has been offloaded, the session must not be
+ * used to send payload data again: the caller must write
+ * to the socket directly.
+ *
+ * Returns: a mask of QCryptoTLSSessionKTLS flags for the
+ * directions now handled by the kernel
+ */
+int qcrypto_tls_session_enable_ktls(QCryptoTLSSession *sess, int fd);
+
 #endif /* QCRYPTO_TLSSESSION_H */
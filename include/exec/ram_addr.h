@@ -50,6 +50,13 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /*
+     * With mapped-ram, bitmap of the pages present in the migration file
+     * and the file offsets of that bitmap and of the page slots.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
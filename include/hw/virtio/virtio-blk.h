@@ -34,10 +34,17 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    /* Colon-separated IOThread ids, virtqueues are spread round-robin */
+    char *iothread_vq_mapping;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t request_merging;
+    /* Hold back requests for up to this long to merge across notifies */
+    uint32_t merge_window_us;
+    uint32_t merge_window_reqs;
+    /* Largest hole (in bytes) between two reads that may be merged */
+    uint32_t merge_gap;
     uint16_t num_queues;
     uint16_t queue_size;
 };
@@ -45,6 +52,7 @@ struct VirtIOBlkConf
 struct VirtIOBlockDataPlane;
 
 struct VirtIOBlockReq;
+struct MultiReqBuffer;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -57,6 +65,11 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    /* Requests deferred by the merge window, protected by the AioContext */
+    struct MultiReqBuffer *merge_window;
+    QEMUTimer *merge_timer;
+    AioContext *merge_timer_ctx;
+    void *merge_gap_buf;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -74,6 +87,7 @@ typedef struct VirtIOBlockReq {
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
+#define VIRTIO_BLK_MAX_MERGE_GAP (128 * 1024)
 
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
@@ -82,5 +96,6 @@ typedef struct MultiReqBuffer {
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_merge_window_flush(VirtIOBlock *s);
 
 #endif
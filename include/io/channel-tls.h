@@ -49,6 +49,7 @@ struct QIOChannelTLS {
     QIOChannel *master;
     QCryptoTLSSession *session;
     QIOChannelShutdown shutdown;
+    int ktls; /* QCryptoTLSSessionKTLS: directions done by the kernel */
 };
 
 /**
@@ -125,6 +126,13 @@ qio_channel_tls_new_client(QIOChannel *master,
  * continue in the background, provided the main
  * loop is running. When the handshake is complete,
  * or fails, the @func callback will be invoked.
+ *
+ * If the master channel is a socket, a successful
+ * handshake also tries to move the encryption into the
+ * kernel (see qcrypto_tls_session_enable_ktls()); from
+ * then on, writes to the channel go straight to the
+ * socket. This is transparent to users of the channel.
+ * Reads always go through GNUTLS.
  */
 void qio_channel_tls_handshake(QIOChannelTLS *ioc,
                                QIOTaskFunc func,
@@ -66,6 +66,15 @@ typedef struct SaveVMHandlers {
     int (*load_cleanup)(void *opaque);
     /* Called when postcopy migration wants to resume from failure */
     int (*resume_prepare)(MigrationState *s, void *opaque);
+
+    /* With the parallel-vmstate capability, save_state and load_state of a
+     * section that sets @parallel run on a worker thread, outside the
+     * iothread lock and concurrently with any other section except those
+     * named in @depends_on (a NULL-terminated list of section idstrs, or
+     * vmsd names), which are always saved and loaded first.
+     */
+    bool parallel;
+    const char * const *depends_on;
 } SaveVMHandlers;
 
 int register_savevm_live(DeviceState *dev,
@@ -237,4 +237,8 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                                    int bytes, BdrvRequestFlags read_flags,
                                    BdrvRequestFlags write_flags);
 
+int coroutine_fn blk_co_read_host_fd(BlockBackend *blk, int64_t offset,
+                                     unsigned int bytes,
+                                     BdrvHostFdReadFunc *fn, void *opaque);
+
 #endif
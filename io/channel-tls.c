@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 
 
@@ -150,6 +151,19 @@ static gboolean qio_channel_tls_handshake_io(QIOChannel *ioc,
                                              GIOCondition condition,
                                              gpointer user_data);
 
+static void qio_channel_tls_enable_ktls(QIOChannelTLS *ioc)
+{
+    QIOChannelSocket *sioc;
+
+    if (!object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        return;
+    }
+    sioc = QIO_CHANNEL_SOCKET(ioc->master);
+
+    ioc->ktls = qcrypto_tls_session_enable_ktls(ioc->session, sioc->fd);
+    trace_qio_channel_tls_ktls(ioc, ioc->ktls);
+}
+
 static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
                                            QIOTask *task,
                                            GMainContext *context)
@@ -173,6 +187,7 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             qio_task_set_error(task, err);
         } else {
             trace_qio_channel_tls_credentials_allow(ioc);
+            qio_channel_tls_enable_ktls(ioc);
         }
         qio_task_complete(task);
     } else {
@@ -304,6 +319,10 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
     size_t i;
     ssize_t done = 0;
 
+    if (tioc->ktls & QCRYPTO_TLS_KTLS_TX) {
+        return qio_channel_writev(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
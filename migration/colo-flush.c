@@ -0,0 +1,177 @@
+/*
+ * COLO RAM cache flush
+ *
+ * The pages that the primary dirtied since the last checkpoint are copied
+ * from the RAM cache to the secondary's RAM by a few threads, each taking
+ * chunks of pages in turn.  Chunks are a multiple of the bitmap word size,
+ * so that threads never share a word of a bitmap.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/thread.h"
+#include "colo-flush.h"
+
+typedef struct {
+    QemuThread thread;
+    ColoFlush *cf;
+    /* Posted to start flushing, or to quit */
+    QemuSemaphore sem;
+    /* Pages flushed by this thread */
+    uint64_t flushed;
+    bool quit;
+} ColoFlushThread;
+
+struct ColoFlush {
+    unsigned int page_bits;
+    unsigned long chunk_pages;
+    ColoFlushThread *threads;
+    int nthreads;
+    /* Posted by each thread when it is done */
+    QemuSemaphore done_sem;
+    /* The regions of the current colo_flush_run() */
+    const ColoFlushRegion *regions;
+    int nregions;
+    /* Next chunk to flush, counted across all regions */
+    unsigned long next_chunk;
+};
+
+/* Copy the dirty pages in [start, end) of @r; returns their number */
+static uint64_t colo_flush_range(ColoFlush *cf, const ColoFlushRegion *r,
+                                 unsigned long start, unsigned long end)
+{
+    unsigned long page = find_next_bit(r->bmap, end, start);
+    uint64_t flushed = 0;
+
+    while (page < end) {
+        /* Copy each run of dirty pages in one go */
+        unsigned long clean = find_next_zero_bit(r->bmap, end, page);
+        size_t offset = (size_t)page << cf->page_bits;
+
+        memcpy(r->dst + offset, r->src + offset,
+               (size_t)(clean - page) << cf->page_bits);
+        bitmap_clear(r->bmap, page, clean - page);
+        flushed += clean - page;
+        page = find_next_bit(r->bmap, end, clean);
+    }
+    return flushed;
+}
+
+/* Flush chunks until there are none left */
+static uint64_t colo_flush_chunks(ColoFlush *cf)
+{
+    uint64_t flushed = 0;
+
+    while (true) {
+        unsigned long chunk = atomic_fetch_inc(&cf->next_chunk);
+        unsigned long base = 0;
+        int i;
+
+        for (i = 0; i < cf->nregions; i++) {
+            const ColoFlushRegion *r = &cf->regions[i];
+            unsigned long nchunks = DIV_ROUND_UP(r->pages, cf->chunk_pages);
+
+            if (chunk < base + nchunks) {
+                unsigned long start = (chunk - base) * cf->chunk_pages;
+
+                flushed += colo_flush_range(cf, r, start,
+                               MIN(start + cf->chunk_pages, r->pages));
+                break;
+            }
+            base += nchunks;
+        }
+        if (i == cf->nregions) {
+            return flushed;
+        }
+    }
+}
+
+static void *colo_flush_thread(void *opaque)
+{
+    ColoFlushThread *t = opaque;
+
+    while (true) {
+        qemu_sem_wait(&t->sem);
+        if (atomic_read(&t->quit)) {
+            break;
+        }
+        t->flushed = colo_flush_chunks(t->cf);
+        qemu_sem_post(&t->cf->done_sem);
+    }
+
+    return NULL;
+}
+
+ColoFlush *colo_flush_new(int nthreads, unsigned int page_bits,
+                          unsigned long chunk_pages)
+{
+    ColoFlush *cf = g_new0(ColoFlush, 1);
+    int i;
+
+    assert(chunk_pages && chunk_pages % BITS_PER_LONG == 0);
+    cf->page_bits = page_bits;
+    cf->chunk_pages = chunk_pages;
+    cf->nthreads = nthreads > 1 ? nthreads : 0;
+    cf->threads = g_new0(ColoFlushThread, cf->nthreads);
+    qemu_sem_init(&cf->done_sem, 0);
+    for (i = 0; i < cf->nthreads; i++) {
+        ColoFlushThread *t = &cf->threads[i];
+
+        t->cf = cf;
+        qemu_sem_init(&t->sem, 0);
+        qemu_thread_create(&t->thread, "colo-flush", colo_flush_thread, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return cf;
+}
+
+uint64_t colo_flush_run(ColoFlush *cf, const ColoFlushRegion *regions,
+                        int nregions)
+{
+    uint64_t flushed = 0;
+    int i;
+
+    cf->regions = regions;
+    cf->nregions = nregions;
+    cf->next_chunk = 0;
+    if (!cf->nthreads) {
+        flushed = colo_flush_chunks(cf);
+    } else {
+        for (i = 0; i < cf->nthreads; i++) {
+            qemu_sem_post(&cf->threads[i].sem);
+        }
+        for (i = 0; i < cf->nthreads; i++) {
+            qemu_sem_wait(&cf->done_sem);
+        }
+        for (i = 0; i < cf->nthreads; i++) {
+            flushed += cf->threads[i].flushed;
+        }
+    }
+    cf->regions = NULL;
+    cf->nregions = 0;
+    return flushed;
+}
+
+void colo_flush_free(ColoFlush *cf)
+{
+    int i;
+
+    if (!cf) {
+        return;
+    }
+    for (i = 0; i < cf->nthreads; i++) {
+        ColoFlushThread *t = &cf->threads[i];
+
+        atomic_set(&t->quit, true);
+        qemu_sem_post(&t->sem);
+        qemu_thread_join(&t->thread);
+        qemu_sem_destroy(&t->sem);
+    }
+    qemu_sem_destroy(&cf->done_sem);
+    g_free(cf->threads);
+    g_free(cf);
+}
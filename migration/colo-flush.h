@@ -0,0 +1,39 @@
+/*
+ * COLO RAM cache flush
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COLO_FLUSH_H
+#define QEMU_MIGRATION_COLO_FLUSH_H
+
+typedef struct ColoFlushRegion {
+    /* Dirty pages to copy; their bits are cleared as they are copied */
+    unsigned long *bmap;
+    uint8_t *dst;
+    const uint8_t *src;
+    unsigned long pages;
+} ColoFlushRegion;
+
+typedef struct ColoFlush ColoFlush;
+
+/*
+ * Create a pool of @nthreads threads that copy dirty pages of
+ * 1 << @page_bits bytes in chunks of @chunk_pages pages, which must be a
+ * multiple of BITS_PER_LONG.  With @nthreads <= 1 no thread is created
+ * and colo_flush_run() does the copy itself.
+ */
+ColoFlush *colo_flush_new(int nthreads, unsigned int page_bits,
+                          unsigned long chunk_pages);
+
+/*
+ * Copy the dirty pages of @regions from src to dst and return how many
+ * there were.  The regions must stay valid until it returns.
+ */
+uint64_t colo_flush_run(ColoFlush *cf, const ColoFlushRegion *regions,
+                        int nregions);
+
+void colo_flush_free(ColoFlush *cf);
+
+#endif
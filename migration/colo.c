@@ -504,6 +504,51 @@ static void colo_compare_notify_checkpoint(Notifier *notifier, void *data)
     colo_checkpoint_notify(data);
 }
 
+/*
+ * Send the RAM dirtied since the last checkpoint while the VM keeps
+ * running; the secondary only puts it into its RAM cache.
+ */
+static int colo_send_ram_update(MigrationState *s)
+{
+    Error *local_err = NULL;
+
+    colo_send_message(s->to_dst_file, COLO_MESSAGE_RAM_UPDATE, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+    qemu_savevm_live_state_update(s->to_dst_file);
+    qemu_fflush(s->to_dst_file);
+
+    return qemu_file_get_error(s->to_dst_file);
+}
+
+/*
+ * Wait for the next checkpoint, sending RAM updates every
+ * x-colo-ram-update-delay milliseconds meanwhile if that is set.
+ */
+static int colo_wait_checkpoint(MigrationState *s)
+{
+    int ret;
+
+    while (s->parameters.x_colo_ram_update_delay) {
+        if (!qemu_sem_timedwait(&s->colo_checkpoint_sem,
+                                s->parameters.x_colo_ram_update_delay)) {
+            return 0;
+        }
+        if (s->state != MIGRATION_STATUS_COLO ||
+            failover_get_state() != FAILOVER_STATUS_NONE) {
+            return 0;
+        }
+        ret = colo_send_ram_update(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    qemu_sem_wait(&s->colo_checkpoint_sem);
+    return 0;
+}
+
 static void colo_process_checkpoint(MigrationState *s)
 {
     QIOChannelBuffer *bioc;
@@ -560,7 +605,9 @@ static void colo_process_checkpoint(MigrationState *s)
             goto out;
         }
 
-        qemu_sem_wait(&s->colo_checkpoint_sem);
+        if (colo_wait_checkpoint(s) < 0) {
+            goto out;
+        }
 
         if (s->state != MIGRATION_STATUS_COLO) {
             goto out;
@@ -665,6 +712,9 @@ static void colo_wait_handle_message(QEMUFile *f, int *checkpoint_request,
     case COLO_MESSAGE_CHECKPOINT_REQUEST:
         *checkpoint_request = 1;
         break;
+    case COLO_MESSAGE_RAM_UPDATE:
+        *checkpoint_request = 0;
+        break;
     default:
         *checkpoint_request = 0;
         error_setg(errp, "Got unknown COLO message: %d", msg);
@@ -734,12 +784,28 @@ void *colo_process_incoming_thread(void *opaque)
         if (local_err) {
             goto out;
         }
-        assert(request);
         if (failover_get_state() != FAILOVER_STATUS_NONE) {
             error_report("failover request");
             goto out;
         }
 
+        if (!request) {
+            /*
+             * RAM sent ahead of the checkpoint.  It only goes into the RAM
+             * cache, which is flushed at the checkpoint, so the SVM keeps
+             * running.  The section handlers still run under the iothread
+             * lock, as they do for every other load.
+             */
+            qemu_mutex_lock_iothread();
+            ret = qemu_loadvm_state_main(mis->from_src_file, mis);
+            qemu_mutex_unlock_iothread();
+            if (ret < 0) {
+                error_report("Load RAM update error");
+                goto out;
+            }
+            continue;
+        }
+
         qemu_mutex_lock_iothread();
         vm_stop_force_state(RUN_STATE_COLO);
         trace_colo_vm_state_change("run", "stop");
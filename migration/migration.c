@@ -19,6 +19,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "rdma.h"
 #include "ram.h"
@@ -45,6 +46,7 @@
 #include "migration/colo.h"
 #include "hw/boards.h"
 #include "monitor/monitor.h"
+#include "sysemu/cpus.h"
 #include "hw/i386/pc.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
@@ -192,6 +194,12 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        postcopy_preempt_incoming_cleanup(mis);
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
+    memset(mis->last_recv_block, 0, sizeof(mis->last_recv_block));
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -318,6 +326,17 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     const char *p;
 
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL) &&
+        strcmp(uri, "defer")) {
+        error_setg(errp, "Mapped-ram requires a 'file:' migration URI");
+        return;
+    }
+    if (migrate_direct_io() && !migrate_mapped_ram() &&
+        strcmp(uri, "defer")) {
+        error_setg(errp, "Direct-io requires the mapped-ram capability");
+        return;
+    }
+
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
     } else if (strstart(uri, "tcp:", &p)) {
@@ -332,6 +351,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -539,13 +560,23 @@ void migration_fd_process_incoming(QEMUFile *f)
     }
 
     migration_incoming_setup(f);
+
+    /*
+     * Multifd channels (RDMA) connect on their own; the last one in
+     * starts the migration from migration_ioc_process_incoming().
+     */
+    if (migrate_use_multifd() && !migrate_mapped_ram()) {
+        return;
+    }
     migration_incoming_process();
 }
 
 void migration_ioc_process_incoming(QIOChannel *ioc)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
     bool start_migration;
+    uint32_t magic;
 
     if (!mis->from_src_file) {
         /* The first connection (multifd may have multiple) */
@@ -560,13 +591,43 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd needs more than one channel, we wait;
+         * except with mapped-ram, which reads pages from the file.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() || migrate_mapped_ram();
     } else {
-        /* Multiple connections */
-        assert(migrate_use_multifd());
-        start_migration = multifd_recv_new_channel(ioc);
+        /*
+         * Multiple connections; each extra channel starts with a magic
+         * telling us what it is for.
+         */
+        assert(migrate_use_multifd() || migrate_postcopy_preempt());
+        if (qio_channel_read_all(ioc, (char *)&magic, sizeof(magic),
+                                 &local_err)) {
+            error_report_err(local_err);
+            return;
+        }
+        magic = be32_to_cpu(magic);
+
+        if (magic == POSTCOPY_PREEMPT_MAGIC && migrate_postcopy_preempt()) {
+            QEMUFile *f = qemu_fopen_channel_input(ioc);
+            uint32_t version = qemu_get_be32(f);
+
+            if (version != POSTCOPY_PREEMPT_VERSION) {
+                error_report("postcopy preempt: received version %u "
+                             "expected %u", version,
+                             POSTCOPY_PREEMPT_VERSION);
+                qemu_fclose(f);
+                return;
+            }
+            postcopy_preempt_new_channel(mis, f);
+            /* Never required to start the migration */
+            start_migration = false;
+        } else if (migrate_use_multifd()) {
+            start_migration = multifd_recv_new_channel(ioc, magic);
+        } else {
+            error_report("%s: unexpected channel magic %x", __func__, magic);
+            return;
+        }
     }
 
     if (start_migration) {
@@ -587,6 +648,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        all_channels = false;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -735,6 +800,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->max_postcopy_bandwidth = s->parameters.max_postcopy_bandwidth;
     params->has_max_cpu_throttle = true;
     params->max_cpu_throttle = s->parameters.max_cpu_throttle;
+    params->has_direct_io = true;
+    params->direct_io = s->parameters.direct_io;
+    params->has_x_colo_ram_update_delay = true;
+    params->x_colo_ram_update_delay = s->parameters.x_colo_ram_update_delay;
 
     return params;
 }
@@ -868,6 +937,10 @@ static void fill_source_migration_info(MigrationInfo *info)
         info->total_time = s->total_time;
         info->has_downtime = true;
         info->downtime = s->downtime;
+        if (s->predicted_downtime) {
+            info->has_predicted_downtime = true;
+            info->predicted_downtime = s->predicted_downtime;
+        }
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
 
@@ -954,6 +1027,62 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        /*
+         * Pages live at fixed offsets in the file; anything that sends
+         * them as deltas or through the stream can't use that layout.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO] ||
+            cap_list[MIGRATION_CAPABILITY_RDMA_PIN_ALL]) {
+            error_setg(errp, "Mapped-ram is not compatible with xbzrle, "
+                       "compress, postcopy-ram, x-colo or rdma-pin-all");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /*
+         * Every page is saved exactly once, from the write fault handler
+         * or the linear scan; nothing that relies on dirty tracking or on
+         * resending pages can be combined with it.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_BLOCK] ||
+            cap_list[MIGRATION_CAPABILITY_DIRTY_BITMAPS] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO] ||
+            cap_list[MIGRATION_CAPABILITY_RELEASE_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Background-snapshot is not compatible with "
+                       "postcopy-ram, x-multifd, xbzrle, compress, block, "
+                       "dirty-bitmaps, x-colo, release-ram or mapped-ram");
+            return false;
+        }
+
+        if (!ram_write_tracking_available()) {
+            error_setg(errp, "Background-snapshot is not supported by host "
+                       "kernel");
+            return false;
+        }
+        if (!ram_write_tracking_compatible()) {
+            error_setg(errp, "Background-snapshot is not compatible with "
+                       "guest memory configuration");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1111,6 +1240,13 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+#ifndef O_DIRECT
+    if (params->has_direct_io && params->direct_io) {
+        error_setg(errp, "O_DIRECT is not supported on this host");
+        return false;
+    }
+#endif
+
     return true;
 }
 
@@ -1185,6 +1321,12 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_max_cpu_throttle) {
         dest->max_cpu_throttle = params->max_cpu_throttle;
     }
+    if (params->has_direct_io) {
+        dest->direct_io = params->direct_io;
+    }
+    if (params->has_x_colo_ram_update_delay) {
+        dest->x_colo_ram_update_delay = params->x_colo_ram_update_delay;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1267,6 +1409,13 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_cpu_throttle) {
         s->parameters.max_cpu_throttle = params->max_cpu_throttle;
     }
+    if (params->has_direct_io) {
+        s->parameters.direct_io = params->direct_io;
+    }
+    if (params->has_x_colo_ram_update_delay) {
+        s->parameters.x_colo_ram_update_delay =
+            params->x_colo_ram_update_delay;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1396,6 +1545,10 @@ static void migrate_fd_cleanup(void *opaque)
         if (multifd_save_cleanup(&local_err) != 0) {
             error_report_err(local_err);
         }
+        if (s->postcopy_qemufile_src) {
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -1473,6 +1626,9 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
     }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
@@ -1566,6 +1722,11 @@ void migrate_init(MigrationState *s)
     s->mbps = 0.0;
     s->downtime = 0;
     s->expected_downtime = 0;
+    s->predicted_downtime = 0;
+    s->bandwidth_avg = 0;
+    s->dirty_sync_count = 0;
+    s->dirty_sync_time = 0;
+    s->device_state_size = 0;
     s->setup_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
@@ -1787,6 +1948,23 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Mapped-ram requires a 'file:' migration URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    /* Without mapped-ram the stream would not be aligned for O_DIRECT */
+    if (migrate_direct_io() && !migrate_mapped_ram()) {
+        error_setg(errp, "Direct-io requires the mapped-ram capability");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
 #ifdef CONFIG_RDMA
@@ -1799,6 +1977,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1926,6 +2106,51 @@ bool migrate_postcopy_blocktime(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_parallel_vmstate(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_VMSTATE];
+}
+
+bool migrate_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.direct_io;
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -2400,6 +2625,11 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+    bool preempt;
+
+    /* Make sure the preempt channel has finished connecting (or failing) */
+    preempt = postcopy_preempt_wait_channel(ms);
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -2506,6 +2736,14 @@ static int postcopy_start(MigrationState *ms)
 
     restart_block = false;
 
+    /*
+     * Page requests may arrive as soon as the destination has the blob;
+     * from now on they're serviced on the preempt channel.
+     */
+    if (preempt) {
+        ram_postcopy_preempt_start(ms);
+    }
+
     /* Now send that blob */
     if (qemu_savevm_send_packaged(ms->to_dst_file, bioc->data, bioc->usage)) {
         goto fail_closefb;
@@ -2599,6 +2837,34 @@ static int migration_maybe_pause(MigrationState *s,
     return s->state == new_state ? 0 : -EINVAL;
 }
 
+/* The PC machine, if that is what we run; the SGX EPC hangs off it */
+static PCMachineState *migration_pc_machine(void)
+{
+    return (PCMachineState *)object_dynamic_cast(OBJECT(qdev_get_machine()),
+                                                 TYPE_PC_MACHINE);
+}
+
+/*
+ * Hand the SGX enclaves over to the destination, which resumes them.
+ * This is still part of the downtime, so it is timed for the downtime
+ * prediction of the next migration.
+ */
+static void migration_enclave_handover(MigrationState *s)
+{
+    PCMachineState *pcms = migration_pc_machine();
+    bool has_sgx = pcms && pcms->sgx_epc != NULL;
+    int64_t start;
+
+    printf("migration_thread: sgx_loadepc_state %d\n", has_sgx);
+    if (!has_sgx) {
+        return;
+    }
+
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    sgx_epc_postload(pcms->sgx_epc->sections[0]);
+    s->enclave_quiesce_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+}
+
 /**
  * migration_completion: Used by migration_thread when there's not much left.
  *   The caller 'breaks' the loop when this returns.
@@ -2620,6 +2886,8 @@ static void migration_completion(MigrationState *s)
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            s->vm_stop_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                              s->downtime_start;
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
@@ -2667,6 +2935,7 @@ static void migration_completion(MigrationState *s)
     }
 
     if (!migrate_colo_enabled()) {
+        migration_enclave_handover(s);
         migrate_set_state(&s->state, current_active_state,
                           MIGRATION_STATUS_COMPLETED);
     }
@@ -2780,6 +3049,14 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * The preempt channel is most likely broken as well; kick its
+         * sender out, requests go on the main channel after recovery.
+         */
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
+
         error_report("Detected IO failure for postcopy. "
                      "Migration paused.");
 
@@ -2879,6 +3156,41 @@ static void migration_calculate_complete(MigrationState *s)
     }
 }
 
+/*
+ * Time (ms) the switchover spends on anything but sending RAM and device
+ * state, as measured the last time round
+ */
+static int64_t migration_switchover_overhead(MigrationState *s)
+{
+    return s->vm_stop_time + s->enclave_quiesce_time;
+}
+
+/*
+ * migration_predict_downtime: predict the downtime (ms) of switching over now
+ *
+ * The remaining RAM, plus what the guest is estimated to have dirtied
+ * since the bitmap was last synced, plus the device state estimated at
+ * setup, is sent at the smoothed bandwidth; stopping the VM and handing
+ * enclaves over are expected to take as long as they did last time.
+ *
+ * @s: current migration state
+ * @pending: bytes still to send
+ * @now: current time (ms, QEMU_CLOCK_REALTIME)
+ */
+static int64_t migration_predict_downtime(MigrationState *s, uint64_t pending,
+                                          int64_t now)
+{
+    double dirtied = 0;
+
+    if (s->dirty_sync_time) {
+        dirtied = (double)ram_counters.dirty_pages_rate *
+                  qemu_target_page_size() * (now - s->dirty_sync_time) / 1000;
+    }
+
+    return (pending + dirtied + s->device_state_size) / s->bandwidth_avg +
+           migration_switchover_overhead(s);
+}
+
 static void migration_update_counters(MigrationState *s,
                                       int64_t current_time)
 {
@@ -2894,7 +3206,24 @@ static void migration_update_counters(MigrationState *s,
     transferred = current_bytes - s->iteration_initial_bytes;
     time_spent = current_time - s->iteration_start_time;
     bandwidth = (double)transferred / time_spent;
-    s->threshold_size = bandwidth * s->parameters.downtime_limit;
+
+    /*
+     * A single BUFFER_DELAY sample is noisy; smooth it, but not so much
+     * that a real change in bandwidth takes long to show up.
+     */
+    if (!s->bandwidth_avg) {
+        s->bandwidth_avg = bandwidth;
+    } else {
+        s->bandwidth_avg = (s->bandwidth_avg * 3 + bandwidth) / 4;
+    }
+
+    /*
+     * This only tells the pending handlers when to resync the dirty
+     * bitmap; migration_switchover_ready() takes the switchover overhead
+     * into account.  It must stay positive even when that overhead alone
+     * exceeds the limit, or the bitmap would never be synced again.
+     */
+    s->threshold_size = s->bandwidth_avg * s->parameters.downtime_limit;
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -2903,8 +3232,10 @@ static void migration_update_counters(MigrationState *s,
      * if we haven't sent anything, we don't want to
      * recalculate. 10000 is a small enough number for our purposes
      */
-    if (ram_counters.dirty_pages_rate && transferred > 10000) {
-        s->expected_downtime = ram_counters.remaining / bandwidth;
+    if (ram_counters.dirty_pages_rate && transferred > 10000 &&
+        s->bandwidth_avg) {
+        s->expected_downtime = migration_predict_downtime(s,
+                                   ram_counters.remaining, current_time);
     }
 
     qemu_file_reset_rate_limit(s->to_dst_file);
@@ -2916,6 +3247,48 @@ static void migration_update_counters(MigrationState *s,
                               bandwidth, s->threshold_size);
 }
 
+/*
+ * Switch over once the predicted downtime fits in the downtime limit.
+ * Called right after the pending size was computed, which syncs the
+ * dirty bitmap when it gets close.
+ */
+static bool migration_switchover_ready(MigrationState *s, uint64_t pending)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    bool synced = false;
+    int64_t predicted;
+
+    if (ram_counters.dirty_sync_count != s->dirty_sync_count) {
+        s->dirty_sync_count = ram_counters.dirty_sync_count;
+        s->dirty_sync_time = now;
+        synced = true;
+    }
+
+    if (!s->bandwidth_avg) {
+        /* Nothing measured yet */
+        return false;
+    }
+
+    /*
+     * Nothing pending only means that the last sync's pages have all been
+     * sent; what the guest dirtied since then is only known after the next
+     * sync, which an empty bitmap always triggers.
+     */
+    if (!pending && !synced) {
+        return false;
+    }
+
+    predicted = migration_predict_downtime(s, pending, now);
+    trace_migration_predict_downtime(pending, predicted,
+                                     s->parameters.downtime_limit);
+    if (predicted > s->parameters.downtime_limit) {
+        return false;
+    }
+
+    s->predicted_downtime = predicted;
+    return true;
+}
+
 /* Migration thread iteration status */
 typedef enum {
     MIG_ITERATE_RESUME,         /* Resume current iteration */
@@ -2939,7 +3312,8 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     trace_migrate_pending(pending_size, s->threshold_size,
                           pend_pre, pend_compat, pend_post);
 
-    if (pending_size && pending_size >= s->threshold_size) {
+    if (in_postcopy ? pending_size && pending_size >= s->threshold_size :
+                      !migration_switchover_ready(s, pending_size)) {
         /* Still a significant amount to transfer */
         if (migrate_postcopy() && !in_postcopy &&
             pend_pre <= s->threshold_size &&
@@ -2971,10 +3345,9 @@ static void migration_iteration_finish(MigrationState *s)
     case MIGRATION_STATUS_COMPLETED:
         migration_calculate_complete(s);
         runstate_set(RUN_STATE_POSTMIGRATE);
-		PCMachineState *pcms = PC_MACHINE(qdev_get_machine());
-		bool has_sgx = (pcms->sgx_epc != NULL);
-		printf("migration_thread: sgx_loadepc_state %d\n", has_sgx);
-		sgx_epc_postload( pcms->sgx_epc->sections[0] );
+		trace_migration_downtime_result(s->predicted_downtime,
+		                                s->downtime,
+		                                s->enclave_quiesce_time);
 
 
         break;
@@ -3077,12 +3450,19 @@ static void *migration_thread(void *opaque)
 
     trace_migration_thread_setup_complete();
 
+    /* The device state goes out during the downtime too */
+    qemu_mutex_lock_iothread();
+    s->device_state_size = qemu_savevm_state_non_iterable_size();
+    qemu_mutex_unlock_iothread();
+
 	// before entering post copy, take snapshot the sgx enclave
 	// so that the snapshot in memory can be transferred
-	PCMachineState *pcms = PC_MACHINE(qdev_get_machine());
-	bool has_sgx = (pcms->sgx_epc != NULL);
+	PCMachineState *pcms = migration_pc_machine();
+	bool has_sgx = pcms && pcms->sgx_epc != NULL;
 	printf("migration_thread: sgx_savevm_state %d\n", has_sgx);
-	sgx_epc_early_save(pcms->sgx_epc->sections[0]);
+	if (has_sgx) {
+		sgx_epc_early_save(pcms->sgx_epc->sections[0]);
+	}
 
     while (s->state == MIGRATION_STATUS_ACTIVE ||
            s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
@@ -3146,6 +3526,204 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Background snapshot: the device state is saved into a buffer while the
+ * VM is briefly paused; RAM is then saved while the guest runs, and the
+ * buffer is appended to the stream once all of RAM has gone out.
+ */
+static void bg_migration_completion(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    int current_active_state = s->state;
+    int ret = 0;
+
+    /*
+     * Every page has been saved by now; drop the tracking so that
+     * nothing can block on it any more.
+     */
+    ram_write_tracking_stop();
+
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_mutex_lock_iothread();
+        ret = qemu_savevm_state_complete_precopy_iterable(s->to_dst_file,
+                                                          false);
+        qemu_mutex_unlock_iothread();
+        if (ret >= 0) {
+            qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+            qemu_fflush(s->to_dst_file);
+        }
+    } else if (s->state == MIGRATION_STATUS_CANCELLING) {
+        goto fail;
+    }
+
+    if (ret < 0 || qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        goto fail;
+    }
+
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_COMPLETED);
+    return;
+
+fail:
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_FAILED);
+}
+
+static MigIterateState bg_migration_iteration_run(MigrationState *s,
+                                                  QIOChannelBuffer *bioc)
+{
+    int res;
+
+    res = qemu_savevm_state_iterate(s->to_dst_file, false);
+    if (res > 0) {
+        bg_migration_completion(s, bioc);
+        return MIG_ITERATE_BREAK;
+    }
+
+    return MIG_ITERATE_RESUME;
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Restarting the VM runs state change notifiers which may write to guest
+ * RAM; do it from the main loop so that the migration thread is free to
+ * service the write faults.
+ */
+static void bg_migration_vm_start_bh(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->vm_start_bh);
+    s->vm_start_bh = NULL;
+
+    if (s->vm_was_running) {
+        vm_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+    trace_bg_migration_vm_start(s->downtime);
+}
+
+/*
+ * Background snapshot thread on the source VM.
+ * Like migration_thread(), but the VM keeps running while RAM is saved
+ * and every page is sent exactly once, as of the moment the VM was paused.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    MigThrError thr_error;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    bool early_fail = true;
+
+    rcu_register_thread();
+
+    s->iteration_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+    migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    trace_migration_thread_setup_complete();
+
+    bioc = qio_channel_buffer_new(512 * 1024);
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    /*
+     * A suspended VM has to be woken up for the transition to
+     * RUN_STATE_PAUSED to be valid.
+     */
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    s->vm_was_running = runstate_is_running();
+    if (global_state_store()) {
+        goto fail;
+    }
+    if (vm_stop_force_state(RUN_STATE_PAUSED)) {
+        goto fail;
+    }
+
+    cpu_synchronize_all_states();
+    if (qemu_savevm_state_complete_precopy_non_iterable(fb, false, false)) {
+        goto fail;
+    }
+    qemu_fflush(fb);
+    if (qemu_file_get_error(fb)) {
+        goto fail;
+    }
+
+    if (ram_write_tracking_start()) {
+        goto fail;
+    }
+    early_fail = false;
+
+    s->vm_start_bh = qemu_bh_new(bg_migration_vm_start_bh, s);
+    qemu_bh_schedule(s->vm_start_bh);
+    qemu_mutex_unlock_iothread();
+
+    while (s->state == MIGRATION_STATUS_ACTIVE) {
+        if (bg_migration_iteration_run(s, bioc) == MIG_ITERATE_BREAK) {
+            break;
+        }
+
+        thr_error = migration_detect_error(s);
+        if (thr_error == MIG_THR_ERR_FATAL) {
+            break;
+        }
+
+        migration_update_counters(s, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
+
+    trace_migration_thread_after_loop();
+
+fail:
+    if (early_fail) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        if (s->vm_was_running) {
+            vm_start();
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    bg_migration_iteration_finish(s);
+
+    qemu_fclose(fb);
+    object_unref(OBJECT(bioc));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     int64_t rate_limit;
@@ -3201,6 +3779,13 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+        s->migration_thread_running = true;
+        return;
+    }
+    postcopy_preempt_setup(s);
     qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -3278,6 +3863,10 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("max-cpu-throttle", MigrationState,
                       parameters.max_cpu_throttle,
                       DEFAULT_MIGRATE_MAX_CPU_THROTTLE),
+    DEFINE_PROP_BOOL("direct-io", MigrationState,
+                      parameters.direct_io, false),
+    DEFINE_PROP_UINT32("x-colo-ram-update-delay", MigrationState,
+                      parameters.x_colo_ram_update_delay, 0),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -3292,6 +3881,13 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_X_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-background-snapshot",
+                        MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-parallel-vmstate",
+                        MIGRATION_CAPABILITY_PARALLEL_VMSTATE),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3314,6 +3910,7 @@ static void migration_instance_finalize(Object *obj)
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
     qemu_sem_destroy(&ms->rate_limit_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
@@ -3349,11 +3946,14 @@ static void migration_instance_init(Object *obj)
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
+    params->has_direct_io = true;
+    params->has_x_colo_ram_update_delay = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
 }
 
@@ -26,6 +26,20 @@ struct PostcopyBlocktimeContext;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
+/* Magic sent first on the postcopy preempt channel to identify it */
+#define  POSTCOPY_PREEMPT_MAGIC      0x50435052U
+#define  POSTCOPY_PREEMPT_VERSION    1
+
+/*
+ * Channels that RAM pages can arrive on: the main migration stream, and
+ * (with postcopy-preempt) the channel dedicated to urgent page requests.
+ */
+typedef enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+} RamChannel;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -55,7 +69,8 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary host page for each channel that loads postcopy pages */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -80,6 +95,16 @@ struct MigrationIncomingState {
     bool postcopy_recover_triggered;
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
+
+    /* Last RAMBlock seen in a page header, per channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+
+    /* Postcopy preempt channel; NULL until the source connects it */
+    QEMUFile *postcopy_qemufile_dst;
+    bool          have_preempt_thread;
+    QemuThread    postcopy_preempt_thread;
+    /* Set when we want the preempt thread to quit */
+    bool          postcopy_preempt_thread_quit;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -113,6 +138,8 @@ struct MigrationState
     size_t xfer_limit;
     QemuThread thread;
     QEMUBH *cleanup_bh;
+    /* Restarts the VM once a background snapshot has write-protected RAM */
+    QEMUBH *vm_start_bh;
     QEMUFile *to_dst_file;
     /*
      * Protects to_dst_file pointer.  We need to make sure we won't
@@ -126,6 +153,14 @@ struct MigrationState
      */
     QemuSemaphore rate_limit_sem;
 
+    /*
+     * Postcopy preempt channel, used only to service page requests
+     * from the destination; NULL if it's not (or no longer) in use.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the preempt channel connect has completed or failed */
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /* bytes already send at the beggining of current interation */
     uint64_t iteration_initial_bytes;
     /* time at the start of current iteration */
@@ -159,6 +194,27 @@ struct MigrationState
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* Downtime predicted when the switchover was decided (ms) */
+    int64_t predicted_downtime;
+
+    /*
+     * Downtime predictor, see migration_predict_downtime().
+     * Smoothed bandwidth (bytes/ms) and when the dirty bitmap was last
+     * synced, for the current migration.
+     */
+    double bandwidth_avg;
+    uint64_t dirty_sync_count;
+    int64_t dirty_sync_time;
+    /* Estimated size of the non-iterable device state, in bytes */
+    uint64_t device_state_size;
+    /*
+     * Measured during the last switchover and kept across migrations (ms):
+     * stopping the VM (vhost, draining block I/O) and handing SGX enclaves
+     * over.
+     */
+    int64_t vm_stop_time;
+    int64_t enclave_quiesce_time;
+
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
     /*
@@ -278,6 +334,11 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_mapped_ram(void);
+bool migrate_background_snapshot(void);
+bool migrate_parallel_vmstate(void);
+bool migrate_direct_io(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -28,6 +28,9 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -528,8 +531,13 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* Stop the preempt thread first, it may still be placing pages */
+    postcopy_preempt_incoming_cleanup(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -568,9 +576,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1175,11 +1185,12 @@ int postcopy_notify_shared_wake(RAMBlock *rb, uint64_t offset)
 }
 
 /*
- * Place a host page (from) at (host) atomically
+ * Place a host page (from) at (host) atomically; with @may_exist, a page
+ * that is already there is not an error.
  * returns 0 on success
  */
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
-                        RAMBlock *rb)
+static int postcopy_do_place_page(MigrationIncomingState *mis, void *host,
+                                  void *from, RAMBlock *rb, bool may_exist)
 {
     size_t pagesize = qemu_ram_pagesize(rb);
 
@@ -1190,6 +1201,11 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
      */
     if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, from, pagesize, rb)) {
         int e = errno;
+
+        if (e == EEXIST && may_exist) {
+            trace_postcopy_place_page_exists(host);
+            return 0;
+        }
         error_report("%s: %s copy host: %p from: %p (size: %zd)",
                      __func__, strerror(e), host, from, pagesize);
 
@@ -1201,6 +1217,36 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
                                        qemu_ram_block_host_offset(rb, host));
 }
 
+/*
+ * Place a host page (from) at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        RAMBlock *rb)
+{
+    /*
+     * With postcopy-preempt a page may legitimately arrive on both
+     * channels (e.g. resent on the main channel after the preempt
+     * channel failed); the first copy wins.
+     */
+    return postcopy_do_place_page(mis, host, from, rb,
+                                  mis->postcopy_qemufile_dst &&
+                                  ramblock_recv_bitmap_test(rb, host));
+}
+
+/*
+ * Place a host page (from) received on a multifd channel at (host)
+ * atomically.  The page may have been placed since the caller checked
+ * the received bitmap, e.g. because the destination requested it and
+ * the source sent it on the main channel; the first copy wins.
+ * returns 0 on success
+ */
+int postcopy_place_page_multifd(MigrationIncomingState *mis, void *host,
+                                void *from, RAMBlock *rb)
+{
+    return postcopy_do_place_page(mis, host, from, rb, true);
+}
+
 /*
  * Place a zero page at (host) atomically
  * returns 0 on success
@@ -1227,19 +1273,22 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+        if (!atomic_read(&mis->postcopy_tmp_zero_page)) {
+            void *zero_page = mmap(NULL, mis->largest_page_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (zero_page == MAP_FAILED) {
                 int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
                 error_report("%s: %s mapping large zero page",
                              __func__, strerror(e));
                 return -e;
             }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+            memset(zero_page, '\0', mis->largest_page_size);
+            /* The preempt thread may be racing with us to set it up */
+            if (atomic_cmpxchg(&mis->postcopy_tmp_zero_page, NULL,
+                               zero_page)) {
+                munmap(zero_page, mis->largest_page_size);
+            }
         }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
@@ -1254,20 +1303,20 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
-{
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
+{
+    if (!mis->postcopy_tmp_pages[channel]) {
+        void *page = mmap(NULL, mis->largest_page_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                          MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
+        mis->postcopy_tmp_pages[channel] = page;
     }
 
-    return mis->postcopy_tmp_page;
+    return mis->postcopy_tmp_pages[channel];
 }
 
 #else
@@ -1320,6 +1369,13 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
     return -1;
 }
 
+int postcopy_place_page_multifd(MigrationIncomingState *mis, void *host,
+                                void *from, RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                         RAMBlock *rb)
 {
@@ -1327,7 +1383,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
@@ -1485,3 +1541,155 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/* ------------------------------------------------------------------------- */
+/* Postcopy preemption channel */
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        /* Not fatal; page requests will go over the main channel */
+        trace_postcopy_preempt_send_channel_failed(
+            error_get_pretty(local_err));
+        warn_report("postcopy-preempt: failed to connect the preempt "
+                    "channel: %s", error_get_pretty(local_err));
+        error_free(local_err);
+    } else {
+        QEMUFile *f;
+
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        f = qemu_fopen_channel_output(ioc);
+        qemu_put_be32(f, POSTCOPY_PREEMPT_MAGIC);
+        qemu_put_be32(f, POSTCOPY_PREEMPT_VERSION);
+        qemu_fflush(f);
+        s->postcopy_qemufile_src = f;
+        trace_postcopy_preempt_send_channel_new();
+    }
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Called on the source when a fresh migration connects; starts opening
+ * the preempt channel to the same address as the main channel.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return;
+    }
+
+    if (!socket_send_channel_available()) {
+        warn_report("postcopy-preempt needs a socket based transport, "
+                    "page requests will use the main channel");
+        qemu_sem_post(&s->postcopy_qemufile_src_sem);
+        return;
+    }
+
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+/*
+ * Wait for the preempt channel connection started by
+ * postcopy_preempt_setup() to complete.
+ * Returns true if the channel is usable.
+ */
+bool postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return false;
+    }
+
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    return s->postcopy_qemufile_src != NULL;
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f = mis->postcopy_qemufile_dst;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    /* We're a thread; block in the QEMUFile rather than yield */
+    qemu_file_set_blocking(f, true);
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    rcu_read_unlock();
+
+    if (ret && !atomic_read(&mis->postcopy_preempt_thread_quit)) {
+        error_report("%s: loading urgent pages failed: %d", __func__, ret);
+        /*
+         * The source can't tell which of the pages it sent made it, so
+         * take the main channel down with us; postcopy recovery will
+         * then sync the received bitmap again.
+         */
+        if (mis->from_src_file) {
+            qemu_file_shutdown(mis->from_src_file);
+        }
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
+/*
+ * Called on the destination when the preempt channel has been accepted.
+ * The thread loading from it is started once we're listening for
+ * postcopy pages (whichever of the two happens last).
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    if (mis->postcopy_qemufile_dst) {
+        error_report("%s: duplicate postcopy preempt channel", __func__);
+        qemu_fclose(f);
+        return;
+    }
+
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = f;
+
+    if (postcopy_state_get() == POSTCOPY_INCOMING_LISTENING ||
+        postcopy_state_get() == POSTCOPY_INCOMING_RUNNING) {
+        postcopy_preempt_incoming_start(mis);
+    }
+}
+
+void postcopy_preempt_incoming_start(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_qemufile_dst || mis->have_preempt_thread) {
+        return;
+    }
+
+    mis->postcopy_preempt_thread_quit = false;
+    qemu_thread_create(&mis->postcopy_preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_preempt_thread = true;
+}
+
+void postcopy_preempt_incoming_cleanup(MigrationIncomingState *mis)
+{
+    if (!mis->have_preempt_thread) {
+        return;
+    }
+
+    /*
+     * On success the source finishes the preempt channel with an EOS
+     * before completing the main stream; otherwise kick the thread out.
+     */
+    if (atomic_read(&mis->state) != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        atomic_set(&mis->postcopy_preempt_thread_quit, true);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+    trace_postcopy_preempt_incoming_cleanup_join();
+    qemu_thread_join(&mis->postcopy_preempt_thread);
+    mis->have_preempt_thread = false;
+}
@@ -74,6 +74,14 @@ void postcopy_discard_send_finish(MigrationState *ms,
 int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
                         RAMBlock *rb);
 
+/*
+ * Like postcopy_place_page, for pages received on multifd channels, which
+ * may race with the same page arriving on the main channel
+ * returns 0 on success
+ */
+int postcopy_place_page_multifd(MigrationIncomingState *mis, void *host,
+                                void *from, RAMBlock *rb);
+
 /*
  * Place a zero page at (host) atomically
  * returns 0 on success
@@ -105,10 +113,10 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page; each RAM channel gets its own page.
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -189,4 +197,12 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Postcopy preemption channel (source side) */
+void postcopy_preempt_setup(MigrationState *s);
+bool postcopy_preempt_wait_channel(MigrationState *s);
+/* Postcopy preemption channel (destination side) */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+void postcopy_preempt_incoming_start(MigrationIncomingState *mis);
+void postcopy_preempt_incoming_cleanup(MigrationIncomingState *mis);
+
 #endif
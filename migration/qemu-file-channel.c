@@ -27,6 +27,8 @@
 #include "exec/cpu-common.h"
 #include "qemu-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
+#include "qapi/error.h"
 #include "qemu/iov.h"
 
 
@@ -145,6 +147,127 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+static QIOChannelFile *channel_file_check(QIOChannel *ioc, Error **errp)
+{
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        error_setg(errp, "Channel does not support random access");
+        return NULL;
+    }
+    return QIO_CHANNEL_FILE(ioc);
+}
+
+/*
+ * Write all of @buf at @offset of the file behind @ioc.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int qemu_channel_pwrite_all(QIOChannel *ioc, const void *buf, size_t len,
+                            off_t offset, Error **errp)
+{
+    QIOChannelFile *fioc = channel_file_check(ioc, errp);
+    const uint8_t *p = buf;
+
+    if (!fioc) {
+        return -1;
+    }
+
+    while (len) {
+        ssize_t ret = pwrite(fioc->fd, p, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno, "Unable to write to file");
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*
+ * Read all of @buf from @offset of the file behind @ioc; reaching the
+ * end of the file is an error.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int qemu_channel_pread_all(QIOChannel *ioc, void *buf, size_t len,
+                           off_t offset, Error **errp)
+{
+    QIOChannelFile *fioc = channel_file_check(ioc, errp);
+    uint8_t *p = buf;
+
+    if (!fioc) {
+        return -1;
+    }
+
+    while (len) {
+        ssize_t ret = pread(fioc->fd, p, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno, "Unable to read from file");
+            return -1;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of file");
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static ssize_t channel_pread(void *opaque,
+                             uint8_t *buf,
+                             size_t size,
+                             off_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qemu_channel_pread_all(ioc, buf, size, offset, NULL) < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return size;
+}
+
+static ssize_t channel_pwrite(void *opaque,
+                              const uint8_t *buf,
+                              size_t size,
+                              off_t offset)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (qemu_channel_pwrite_all(ioc, buf, size, offset, NULL) < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return size;
+}
+
+static off_t channel_seek(void *opaque,
+                          off_t offset,
+                          int whence)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    ret = qio_channel_io_seek(ioc, offset, whence, NULL);
+    if (ret < 0) {
+        /* XXX handle Error * object */
+        return -EIO;
+    }
+    return ret;
+}
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -165,6 +288,8 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .pread = channel_pread,
+    .seek = channel_seek,
 };
 
 
@@ -174,6 +299,8 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .pwrite = channel_pwrite,
+    .seek = channel_seek,
 };
 
 
@@ -29,4 +29,9 @@
 
 QEMUFile *qemu_fopen_channel_input(QIOChannel *ioc);
 QEMUFile *qemu_fopen_channel_output(QIOChannel *ioc);
+
+int qemu_channel_pwrite_all(QIOChannel *ioc, const void *buf, size_t len,
+                            off_t offset, Error **errp);
+int qemu_channel_pread_all(QIOChannel *ioc, void *buf, size_t len,
+                           off_t offset, Error **errp);
 #endif
@@ -542,6 +542,101 @@ size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size)
     return qemu_get_buffer(f, *buf, size);
 }
 
+/*
+ * Write a buffer at a fixed offset of the backing file, bypassing the
+ * stream (and its buffer).  Only seekable files (file: migration)
+ * support this; errors are reported through the file error state.
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        off_t offset)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (!f->ops->pwrite) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    ret = f->ops->pwrite(f->opaque, buf, size, offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+    f->bytes_xfer += size;
+}
+
+/*
+ * Read a buffer from a fixed offset of the backing file, bypassing the
+ * stream.  Returns size on success; on error 0 is returned and the file
+ * error state is set.
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          off_t offset)
+{
+    ssize_t ret;
+
+    if (f->last_error) {
+        return 0;
+    }
+
+    if (!f->ops->pread) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return 0;
+    }
+
+    ret = f->ops->pread(f->opaque, buf, size, offset);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+    return size;
+}
+
+/*
+ * Move the stream position of a seekable file.  Pending writes are
+ * flushed first and read-ahead data is dropped, so that SEEK_CUR is
+ * relative to what the caller has put or got so far.
+ *
+ * Returns the new offset, or a negative errno value (which is also
+ * set as the file error).
+ */
+off_t qemu_file_seek(QEMUFile *f, off_t offset, int whence)
+{
+    off_t ret;
+
+    if (f->last_error) {
+        return f->last_error;
+    }
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        if (f->last_error) {
+            return f->last_error;
+        }
+    } else {
+        if (whence == SEEK_CUR) {
+            offset -= f->buf_size - f->buf_index;
+        }
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = f->ops->seek(f->opaque, offset, whence);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 /*
  * Peeks a single byte from the buffer; this isn't guaranteed to work if
  * offset leaves a gap after the previous read/peeked data.
@@ -99,6 +99,22 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Read or write a buffer at a fixed offset of a seekable backing file,
+ * without moving the stream position.  The handler must transfer all
+ * of the data or return a negative errno value.
+ */
+typedef ssize_t (QEMUFilePReadFunc)(void *opaque, uint8_t *buf,
+                                    size_t size, off_t offset);
+typedef ssize_t (QEMUFilePWriteFunc)(void *opaque, const uint8_t *buf,
+                                     size_t size, off_t offset);
+
+/*
+ * Move the stream position of a seekable backing file, as lseek().
+ * Returns the resulting offset or a negative errno value.
+ */
+typedef off_t (QEMUFileSeekFunc)(void *opaque, off_t offset, int whence);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +122,9 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFilePReadFunc *pread;
+    QEMUFilePWriteFunc *pwrite;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -134,6 +153,11 @@ bool qemu_file_is_writable(QEMUFile *f);
 
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        off_t offset);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size,
+                          off_t offset);
+off_t qemu_file_seek(QEMUFile *f, off_t offset, int whence);
 ssize_t qemu_put_compression_data(QEMUFile *f, z_stream *stream,
                                   const uint8_t *p, size_t size);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
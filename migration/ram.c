@@ -38,9 +38,12 @@
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
+#include "rdma.h"
 #include "migration/register.h"
 #include "migration/misc.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
 #include "postcopy-ram.h"
 #include "page_cache.h"
 #include "qemu/error-report.h"
@@ -52,12 +55,23 @@
 #include "exec/target_page.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
+#include "colo-flush.h"
 #include "block.h"
 #include "sysemu/sysemu.h"
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+#define RAM_WRITE_TRACKING
+#endif
+
 /***********************************************************/
 /* ram save/restore */
 
@@ -323,6 +337,47 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+
+    /* Postcopy preemption, see ram_postcopy_preempt_start() */
+    /* QEMUFile of the preempt channel */
+    QEMUFile *preempt_f;
+    /*
+     * Set while the preempt thread owns the page request queue;
+     * protected by src_page_req_mutex
+     */
+    bool preempt_active;
+    bool preempt_thread_running;
+    bool preempt_quit;
+    QemuThread preempt_thread;
+    /* Posted for each request queued for the preempt thread, and on quit */
+    QemuSemaphore preempt_sem;
+    /* Posted by the preempt thread when it has no requests pending */
+    QemuSemaphore preempt_done_sem;
+    /* Requests queued for, but not yet completed by, the preempt thread */
+    int preempt_pending;
+    /* Set by the preempt thread if sending failed */
+    int preempt_error;
+    /* Last block from where we have sent data on the preempt channel */
+    RAMBlock *preempt_last_sent_block;
+    /*
+     * Host page the migration thread is sending in the background; the
+     * preempt thread leaves it alone.  Protected by bitmap_mutex, as is
+     * the bitmap itself while the preempt thread is running.
+     */
+    RAMBlock *postcopy_bg_block;
+    unsigned long postcopy_bg_page;
+    /* Sent by the preempt thread, not yet in ram_counters (bitmap_mutex) */
+    uint64_t preempt_transferred;
+    uint64_t preempt_normal;
+    uint64_t preempt_duplicate;
+    /*
+     * Set by the preempt thread when a requested page was already taken
+     * by the background push; it may be sitting in a multifd batch.
+     */
+    int preempt_multifd_flush;
+
+    /* userfaultfd write-protecting RAM for a background snapshot, or -1 */
+    int uffdio_fd;
 };
 typedef struct RAMState RAMState;
 
@@ -344,6 +399,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* The page was requested by the postcopy destination */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -519,6 +576,8 @@ exit:
 #define MULTIFD_VERSION 1
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
+/* Pages must be placed atomically, the destination is in postcopy */
+#define MULTIFD_FLAG_POSTCOPY (1 << 1)
 
 typedef struct {
     uint32_t magic;
@@ -622,6 +681,8 @@ typedef struct {
     uint64_t num_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* buffer postcopy pages are read into before being placed */
+    uint8_t *postcopy_buf;
 } MultiFDRecvParams;
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
@@ -641,25 +702,31 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     return 0;
 }
 
-static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+/*
+ * The magic has already been read (in host order) by the caller to
+ * find out which kind of channel this is; read the rest of the packet.
+ */
+static int multifd_recv_initial_packet(QIOChannel *c, uint32_t magic,
+                                       Error **errp)
 {
     MultiFDInit_t msg;
     int ret;
 
-    ret = qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp);
-    if (ret != 0) {
+    if (magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", magic, MULTIFD_MAGIC);
         return -1;
     }
 
-    msg.magic = be32_to_cpu(msg.magic);
-    msg.version = be32_to_cpu(msg.version);
-
-    if (msg.magic != MULTIFD_MAGIC) {
-        error_setg(errp, "multifd: received packet magic %x "
-                   "expected %x", msg.magic, MULTIFD_MAGIC);
+    ret = qio_channel_read_all(c, (char *)&msg + sizeof(msg.magic),
+                               sizeof(msg) - sizeof(msg.magic), errp);
+    if (ret != 0) {
         return -1;
     }
 
+    msg.magic = magic;
+    msg.version = be32_to_cpu(msg.version);
+
     if (msg.version != MULTIFD_VERSION) {
         error_setg(errp, "multifd: received packet version %d "
                    "expected %d", msg.version, MULTIFD_VERSION);
@@ -782,6 +849,22 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        packet->ramblock);
             return -1;
         }
+        p->pages->block = block;
+
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            if (!p->postcopy_buf) {
+                error_setg(errp, "multifd: received postcopy pages "
+                           "without postcopy-ram");
+                return -1;
+            }
+            /* Each page is placed on its own, it must be a host page */
+            if (block->page_size != TARGET_PAGE_SIZE) {
+                error_setg(errp, "multifd: postcopy pages for ram block %s "
+                           "with page size %zu", block->idstr,
+                           block->page_size);
+                return -1;
+            }
+        }
     }
 
     for (i = 0; i < p->pages->used; i++) {
@@ -793,7 +876,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->offset[i] = offset;
+        if (p->flags & MULTIFD_FLAG_POSTCOPY) {
+            p->pages->iov[i].iov_base = p->postcopy_buf +
+                                        i * TARGET_PAGE_SIZE;
+        } else {
+            p->pages->iov[i].iov_base = block->host + offset;
+        }
         p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
     }
 
@@ -855,10 +944,16 @@ static void multifd_send_pages(void)
     p->pages->used = 0;
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
+    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE;
+    if (!migrate_mapped_ram()) {
+        transferred += p->packet_len;
+    }
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;;
     qemu_mutex_unlock(&p->mutex);
@@ -891,6 +986,19 @@ static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
     }
 }
 
+/*
+ * In postcopy the destination may be waiting for a page that sits in
+ * the partially filled batch; send it rather than wait for it to fill.
+ */
+static void multifd_postcopy_flush(void)
+{
+    if (migrate_use_multifd() && migration_in_postcopy() &&
+        multifd_send_state->pages->used) {
+        trace_multifd_postcopy_flush(multifd_send_state->pages->used);
+        multifd_send_pages();
+    }
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -932,7 +1040,13 @@ int multifd_save_cleanup(Error **errp)
         if (p->running) {
             qemu_thread_join(&p->thread);
         }
-        socket_send_channel_destroy(p->c);
+        if (migrate_mapped_ram()) {
+            object_unref(OBJECT(p->c));
+        } else if (rdma_send_channel_available()) {
+            rdma_send_channel_destroy(p->c);
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -988,6 +1102,32 @@ static void multifd_send_sync_main(void)
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Write the pages of a batch to their slots in the migration file,
+ * merging runs of consecutive pages into a single write.
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, uint32_t used,
+                                    Error **errp)
+{
+    RAMBlock *block = p->pages->block;
+    uint32_t i, start;
+
+    for (i = 0, start = 0; i < used; i++) {
+        if (i + 1 < used &&
+            p->pages->offset[i + 1] == p->pages->offset[i] + TARGET_PAGE_SIZE) {
+            continue;
+        }
+        if (qemu_channel_pwrite_all(p->c, block->host + p->pages->offset[start],
+                                    (i - start + 1) * TARGET_PAGE_SIZE,
+                                    block->pages_offset +
+                                    p->pages->offset[start], errp) < 0) {
+            return -1;
+        }
+        start = i + 1;
+    }
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -997,11 +1137,14 @@ static void *multifd_send_thread(void *opaque)
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        goto out;
+    /* With mapped-ram the pages go straight to their slot in the file */
+    if (!migrate_mapped_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -1021,15 +1164,45 @@ static void *multifd_send_thread(void *opaque)
 
             trace_multifd_send(p->id, packet_num, used, flags);
 
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
-            if (ret != 0) {
-                break;
-            }
+            if (migrate_mapped_ram()) {
+                ret = multifd_file_write_pages(p, used, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else if (rdma_multifd_channel(p->c)) {
+                /*
+                 * The pages are RDMA-written into place; the packet
+                 * follows on the same queue pair, so it can't overtake
+                 * them.
+                 */
+                if (used) {
+                    ret = rdma_multifd_write_pages(p->c,
+                                                   p->pages->block->offset,
+                                                   p->pages->offset, used,
+                                                   TARGET_PAGE_SIZE,
+                                                   &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                }
 
-            ret = qio_channel_writev_all(p->c, p->pages->iov, used, &local_err);
-            if (ret != 0) {
-                break;
+                ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                            p->packet_len, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else {
+                ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                            p->packet_len, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+
+                ret = qio_channel_writev_all(p->c, p->pages->iov, used,
+                                             &local_err);
+                if (ret != 0) {
+                    break;
+                }
             }
 
             qemu_mutex_lock(&p->mutex);
@@ -1067,7 +1240,6 @@ out:
 static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
 {
     MultiFDSendParams *p = opaque;
-    QIOChannel *sioc = QIO_CHANNEL(qio_task_get_source(task));
     Error *local_err = NULL;
 
     if (qio_task_propagate_error(task, &local_err)) {
@@ -1075,7 +1247,7 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
             migrate_set_error(migrate_get_current(), local_err);
         }
     } else {
-        p->c = QIO_CHANNEL(sioc);
+        p->c = QIO_CHANNEL(qio_task_get_source(task));
         qio_channel_set_delay(p->c, false);
         p->running = true;
         qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
@@ -1116,7 +1288,13 @@ int multifd_save_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (migrate_mapped_ram()) {
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else if (rdma_send_channel_available()) {
+            rdma_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
     return 0;
 }
@@ -1129,8 +1307,19 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* set once postcopy pages can be placed (or on termination) */
+    QemuEvent postcopy_listening;
 } *multifd_recv_state;
 
+/*
+ * With mapped-ram the destination reads the pages from the migration
+ * file itself, no multifd channels are received.
+ */
+static bool multifd_recv_use_channels(void)
+{
+    return migrate_use_multifd() && !migrate_mapped_ram();
+}
+
 static void multifd_recv_terminate_threads(Error *err)
 {
     int i;
@@ -1145,6 +1334,9 @@ static void multifd_recv_terminate_threads(Error *err)
         }
     }
 
+    /* Don't leave anybody waiting to place postcopy pages */
+    qemu_event_set(&multifd_recv_state->postcopy_listening);
+
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1163,7 +1355,7 @@ int multifd_load_cleanup(Error **errp)
     int i;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1184,8 +1376,11 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_event_destroy(&multifd_recv_state->postcopy_listening);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -1198,7 +1393,7 @@ static void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1221,6 +1416,59 @@ static void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_postcopy_listen: postcopy pages can now be placed
+ *
+ * Called on the destination once userfault is armed; pages received
+ * on multifd channels during postcopy wait for it, since the listen
+ * command travels on the main channel.
+ */
+void multifd_recv_postcopy_listen(void)
+{
+    if (!multifd_recv_use_channels()) {
+        return;
+    }
+    qemu_event_set(&multifd_recv_state->postcopy_listening);
+}
+
+/*
+ * Place the pages of a postcopy packet atomically; pages that already
+ * arrived (as per the received bitmap) are skipped.
+ */
+static int multifd_recv_postcopy_place(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block = p->pages->block;
+    PostcopyState ps;
+    int i, ret;
+
+    qemu_event_wait(&multifd_recv_state->postcopy_listening);
+    ps = postcopy_state_get();
+    if (ps != POSTCOPY_INCOMING_LISTENING && ps != POSTCOPY_INCOMING_RUNNING) {
+        error_setg(errp, "multifd: postcopy pages received in "
+                   "postcopy state %d", ps);
+        return -1;
+    }
+
+    for (i = 0; i < p->pages->used; i++) {
+        void *host = block->host + p->pages->offset[i];
+
+        if (ramblock_recv_bitmap_test(block, host)) {
+            continue;
+        }
+        ret = postcopy_place_page_multifd(mis, host,
+                                          p->pages->iov[i].iov_base, block);
+        if (ret) {
+            error_setg_errno(errp, -ret, "multifd: failed to place page "
+                             "%s:" RAM_ADDR_FMT, block->idstr,
+                             p->pages->offset[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1257,9 +1505,20 @@ static void *multifd_recv_thread(void *opaque)
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
-        ret = qio_channel_readv_all(p->c, p->pages->iov, used, &local_err);
-        if (ret != 0) {
-            break;
+        /* Over RDMA the pages were already written before the packet */
+        if (!rdma_multifd_channel(p->c)) {
+            ret = qio_channel_readv_all(p->c, p->pages->iov, used,
+                                        &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
+        if (used && (flags & MULTIFD_FLAG_POSTCOPY)) {
+            ret = multifd_recv_postcopy_place(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
         }
 
         if (flags & MULTIFD_FLAG_SYNC) {
@@ -1287,7 +1546,7 @@ int multifd_load_setup(void)
     uint32_t page_count = migrate_multifd_page_count();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return 0;
     }
     thread_count = migrate_multifd_channels();
@@ -1295,6 +1554,7 @@ int multifd_load_setup(void)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listening, false);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1307,6 +1567,9 @@ int multifd_load_setup(void)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
+        if (migrate_postcopy_ram()) {
+            p->postcopy_buf = g_malloc(page_count * TARGET_PAGE_SIZE);
+        }
     }
     return 0;
 }
@@ -1315,7 +1578,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return true;
     }
 
@@ -1323,13 +1586,13 @@ bool multifd_recv_all_channels_created(void)
 }
 
 /* Return true if multifd is ready for the migration, otherwise false */
-bool multifd_recv_new_channel(QIOChannel *ioc)
+bool multifd_recv_new_channel(QIOChannel *ioc, uint32_t magic)
 {
     MultiFDRecvParams *p;
     Error *local_err = NULL;
     int id;
 
-    id = multifd_recv_initial_packet(ioc, &local_err);
+    id = multifd_recv_initial_packet(ioc, magic, &local_err);
     if (id < 0) {
         multifd_recv_terminate_threads(local_err);
         return false;
@@ -1355,23 +1618,24 @@ bool multifd_recv_new_channel(QIOChannel *ioc)
 }
 
 /**
- * save_page_header: write page header to wire
+ * put_page_header: write page header to wire
  *
  * If this is the 1st block, it also writes the block identification
  *
  * Returns the number of bytes written
  *
  * @f: QEMUFile where to send the data
+ * @last_sent_block: last block sent on @f, updated
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
  *          in the lower bits, it contains flags
  */
-static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
-                               ram_addr_t offset)
+static size_t put_page_header(QEMUFile *f, RAMBlock **last_sent_block,
+                              RAMBlock *block, ram_addr_t offset)
 {
     size_t size, len;
 
-    if (block == rs->last_sent_block) {
+    if (block == *last_sent_block) {
         offset |= RAM_SAVE_FLAG_CONTINUE;
     }
     qemu_put_be64(f, offset);
@@ -1382,11 +1646,28 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
         qemu_put_byte(f, len);
         qemu_put_buffer(f, (uint8_t *)block->idstr, len);
         size += 1 + len;
-        rs->last_sent_block = block;
+        *last_sent_block = block;
     }
     return size;
 }
 
+/**
+ * save_page_header: write page header to the main migration stream
+ *
+ * Returns the number of bytes written
+ *
+ * @rs: current RAM state
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ *          in the lower bits, it contains flags
+ */
+static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
+                               ram_addr_t offset)
+{
+    return put_page_header(f, &rs->last_sent_block, block, offset);
+}
+
 /**
  * mig_throttle_guest_down: throotle down the guest
  *
@@ -1734,7 +2015,19 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    if (migrate_mapped_ram()) {
+        if (!is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        /* Not written at all; the destination zeroes pages not in the file */
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
 
     if (len) {
         ram_counters.duplicate++;
@@ -1805,14 +2098,22 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
-    ram_counters.transferred += save_page_header(rs, rs->f, block,
-                                                 offset | RAM_SAVE_FLAG_PAGE);
-    if (async) {
-        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
-                              migrate_release_ram() &
-                              migration_in_postcopy());
+    if (migrate_mapped_ram()) {
+        /* The page goes to its slot in the file, not into the stream */
+        qemu_put_buffer_at(rs->f, buf, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset);
+        set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
     } else {
-        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        ram_counters.transferred += save_page_header(rs, rs->f, block,
+                                                     offset |
+                                                     RAM_SAVE_FLAG_PAGE);
+        if (async) {
+            qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
+                                  migrate_release_ram() &
+                                  migration_in_postcopy());
+        } else {
+            qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        }
     }
     ram_counters.transferred += TARGET_PAGE_SIZE;
     ram_counters.normal++;
@@ -1836,7 +2137,11 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
     int pages = -1;
     uint8_t *p;
-    bool send_async = true;
+    /*
+     * A background snapshot unprotects the page as soon as it's saved, so
+     * the data has to be copied before the guest can write to it again
+     */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
@@ -1871,11 +2176,77 @@ static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
     multifd_queue_page(block, offset);
+    if (migrate_mapped_ram()) {
+        set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+    }
     ram_counters.normal++;
 
     return 1;
 }
 
+/*
+ * mapped-ram: in the setup section, the name and length of each RAMBlock
+ * are followed by a header locating two regions reserved in the file for
+ * it: a bitmap of the pages present in the file, and a slot for each
+ * target page.  Pages are written to their slot with pwrite, however
+ * often they are dirtied; the bitmap is written on completion.  The
+ * stream carries on after the regions.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+/* Keeps the regions suitably aligned for O_DIRECT */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+
+static size_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    return ROUND_UP(DIV_ROUND_UP(length >> TARGET_PAGE_BITS, 8), 8);
+}
+
+static off_t mapped_ram_end(RAMBlock *block, ram_addr_t length)
+{
+    return block->pages_offset +
+           ROUND_UP(length, MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+}
+
+static int mapped_ram_save_header(QEMUFile *f, RAMBlock *block)
+{
+    /* version, page size, bitmap offset, pages offset */
+    const size_t header_size = 4 + 3 * 8;
+    off_t pos;
+
+    pos = qemu_file_seek(f, 0, SEEK_CUR);
+    if (pos < 0) {
+        error_report("mapped-ram: the migration file is not seekable");
+        return pos;
+    }
+
+    block->bitmap_offset = ROUND_UP(pos + header_size,
+                                    MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block->used_length),
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    pos = qemu_file_seek(f, mapped_ram_end(block, block->used_length),
+                         SEEK_SET);
+    return pos < 0 ? pos : 0;
+}
+
+static void mapped_ram_save_bitmap(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long *le_bitmap, nbits = block->used_length >> TARGET_PAGE_BITS;
+
+    le_bitmap = bitmap_new(nbits + BITS_PER_LONG);
+    bitmap_to_le(le_bitmap, block->file_bmap, nbits);
+    qemu_put_buffer_at(f, (uint8_t *)le_bitmap,
+                       mapped_ram_bitmap_size(block->used_length),
+                       block->bitmap_offset);
+    g_free(le_bitmap);
+}
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf)
 {
@@ -2075,7 +2446,8 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
     }
 
     qemu_mutex_lock(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+    /* The queue belongs to the preempt thread while it's active */
+    if (!rs->preempt_active && !QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
         struct RAMSrcPageRequest *entry =
                                 QSIMPLEQ_FIRST(&rs->src_page_requests);
         block = entry->rb;
@@ -2128,6 +2500,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
                        page, test_bit(page, block->unsentmap));
+                /* It may still be waiting in a multifd batch */
+                multifd_postcopy_flush();
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -2237,7 +2611,12 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
-    migration_make_urgent_request();
+    if (rs->preempt_active) {
+        atomic_inc(&rs->preempt_pending);
+        qemu_sem_post(&rs->preempt_sem);
+    } else {
+        migration_make_urgent_request();
+    }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -2248,77 +2627,441 @@ err:
     return -1;
 }
 
-static bool save_page_use_compression(RAMState *rs)
+/*
+ * Postcopy preemption
+ *
+ * With the postcopy-preempt capability, page requests from the
+ * destination are serviced by a dedicated thread writing to a separate
+ * channel, so they don't queue behind background pages already buffered
+ * on the main migration stream.  The migration thread keeps streaming
+ * background pages, but yields between the target pages of a host page
+ * while requests are outstanding.
+ *
+ * Both threads claim pages by clearing them in the dirty bitmap under
+ * bitmap_mutex; a host page is always sent entirely on one channel.
+ */
+
+/* Longest time the background stream yields to the preempt thread */
+#define POSTCOPY_PREEMPT_YIELD_MS 1
+
+static inline bool postcopy_preempt_active(RAMState *rs)
 {
-    if (!migrate_use_compression()) {
-        return false;
-    }
+    return atomic_read(&rs->preempt_active);
+}
 
-    /*
-     * If xbzrle is on, stop using the data compression after first
-     * round of migration even if compression is enabled. In theory,
-     * xbzrle can do better than compression.
-     */
-    if (rs->ram_bulk_stage || !migrate_use_xbzrle()) {
-        return true;
+/**
+ * postcopy_preempt_claim_host_page: claim a host page for the preempt thread
+ *
+ * Returns the number of dirty target pages claimed; zero if the host page
+ * has already been sent or the migration thread is sending it.
+ *
+ * @rs: current RAM state
+ * @rb: RAMBlock the host page belongs to
+ * @page: first target page of the host page
+ * @npages: number of target pages in the host page
+ */
+static unsigned long postcopy_preempt_claim_host_page(RAMState *rs,
+                                                      RAMBlock *rb,
+                                                      unsigned long page,
+                                                      unsigned long npages)
+{
+    unsigned long i, claimed = 0;
+
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    if (rb != rs->postcopy_bg_block || page != rs->postcopy_bg_page) {
+        for (i = page; i < page + npages; i++) {
+            if (migration_bitmap_clear_dirty(rs, rb, i)) {
+                if (rb->unsentmap) {
+                    clear_bit(i, rb->unsentmap);
+                }
+                claimed++;
+            }
+        }
     }
+    qemu_mutex_unlock(&rs->bitmap_mutex);
 
-    return false;
+    return claimed;
 }
 
-/*
- * try to compress the page before posting it out, return true if the page
- * has been properly handled by compression, otherwise needs other
- * paths to handle it
+/**
+ * postcopy_preempt_send_host_page: send a claimed host page on the
+ * preempt channel
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rs: current RAM state
+ * @rb: RAMBlock the host page belongs to
+ * @page: first target page of the host page
+ * @npages: number of target pages in the host page
  */
-static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static int postcopy_preempt_send_host_page(RAMState *rs, RAMBlock *rb,
+                                           unsigned long page,
+                                           unsigned long npages)
 {
-    if (!save_page_use_compression(rs)) {
-        return false;
-    }
+    QEMUFile *f = rs->preempt_f;
+    uint64_t transferred = 0, normal = 0, duplicate = 0;
+    unsigned long i;
 
     /*
-     * When starting the process of a new block, the first page of
-     * the block should be sent out before other pages in the same
-     * block, and all the pages in last block should have been sent
-     * out, keeping this order is important, because the 'cont' flag
-     * is used to avoid resending the block name.
-     *
-     * We post the fist page as normal page as compression will take
-     * much CPU resource.
+     * Postcopy sends whole host pages (see postcopy_chunk_hostpages), and
+     * the destination places them atomically, so send every target page.
      */
-    if (block != rs->last_sent_block) {
-        flush_compressed_data(rs);
-        return false;
+    for (i = page; i < page + npages; i++) {
+        ram_addr_t offset = i << TARGET_PAGE_BITS;
+        uint8_t *p = rb->host + offset;
+
+        if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+            transferred += put_page_header(f, &rs->preempt_last_sent_block,
+                                           rb, offset | RAM_SAVE_FLAG_ZERO);
+            qemu_put_byte(f, 0);
+            transferred += 1;
+            duplicate++;
+            ram_release_pages(rb->idstr, offset, 1);
+        } else {
+            transferred += put_page_header(f, &rs->preempt_last_sent_block,
+                                           rb, offset | RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE,
+                                  migrate_release_ram());
+            transferred += TARGET_PAGE_SIZE;
+            normal++;
+        }
     }
+    qemu_fflush(f);
 
-    if (compress_page_with_multi_thread(rs, block, offset) > 0) {
-        return true;
-    }
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    rs->preempt_transferred += transferred;
+    rs->preempt_normal += normal;
+    rs->preempt_duplicate += duplicate;
+    qemu_mutex_unlock(&rs->bitmap_mutex);
 
-    compression_counters.busy++;
-    return false;
+    return qemu_file_get_error(f);
 }
 
 /**
- * ram_save_target_page: save one target page
+ * postcopy_preempt_send_request: service one page request
  *
- * Returns the number of pages written
+ * Returns zero on success or negative on error
  *
  * @rs: current RAM state
- * @pss: data about the page we want to send
- * @last_stage: if we are at the completion stage
+ * @req: the request, already removed from the queue
  */
-static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
-                                bool last_stage)
+static int postcopy_preempt_send_request(RAMState *rs,
+                                         struct RAMSrcPageRequest *req)
 {
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
-    int res;
+    RAMBlock *rb = req->rb;
+    unsigned long hp_pages = qemu_ram_pagesize(rb) >> TARGET_PAGE_BITS;
+    unsigned long last = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long page = QEMU_ALIGN_DOWN(req->offset >> TARGET_PAGE_BITS,
+                                         hp_pages);
+    unsigned long end = MIN(DIV_ROUND_UP(req->offset + req->len,
+                                         TARGET_PAGE_SIZE), last);
+    int ret;
 
-    if (control_save_page(rs, block, offset, &res)) {
-        return res;
-    }
+    if (!qemu_ram_is_migratable(rb)) {
+        error_report("block %s should not be migrated !", rb->idstr);
+        return 0;
+    }
+
+    for (; page < end; page += hp_pages) {
+        unsigned long npages = MIN(hp_pages, last - page);
+
+        if (!postcopy_preempt_claim_host_page(rs, rb, page, npages)) {
+            trace_postcopy_preempt_skip_host_page(rb->idstr, page);
+            if (migrate_use_multifd()) {
+                atomic_set(&rs->preempt_multifd_flush, 1);
+            }
+            continue;
+        }
+
+        trace_postcopy_preempt_send_host_page(rb->idstr, page);
+        ret = postcopy_preempt_send_host_page(rs, rb, page, npages);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Hand the page request queue back to the migration thread */
+static void postcopy_preempt_deactivate(RAMState *rs)
+{
+    struct RAMSrcPageRequest *req;
+
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    if (rs->preempt_active) {
+        atomic_set(&rs->preempt_active, false);
+        /* unqueue_page() consumes one urgent request for each entry */
+        QSIMPLEQ_FOREACH(req, &rs->src_page_requests, next_req) {
+            migration_make_urgent_request();
+        }
+        atomic_set(&rs->preempt_pending, 0);
+        /* Don't leave the migration thread yielding to nobody */
+        qemu_sem_post(&rs->preempt_done_sem);
+    }
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    RAMState *rs = opaque;
+    struct RAMSrcPageRequest *req;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_send_thread_entry();
+
+    while (!ret) {
+        qemu_sem_wait(&rs->preempt_sem);
+        if (atomic_read(&rs->preempt_quit)) {
+            break;
+        }
+
+        qemu_mutex_lock(&rs->src_page_req_mutex);
+        req = QSIMPLEQ_FIRST(&rs->src_page_requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+        }
+        qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+        if (!req) {
+            continue;
+        }
+
+        rcu_read_lock();
+        ret = postcopy_preempt_send_request(rs, req);
+        rcu_read_unlock();
+
+        memory_region_unref(req->rb->mr);
+        g_free(req);
+
+        if (atomic_dec_fetch(&rs->preempt_pending) == 0) {
+            qemu_sem_post(&rs->preempt_done_sem);
+        }
+    }
+
+    if (ret) {
+        /*
+         * We can't know which pages made it to the destination, so let
+         * the migration thread fail the main stream; postcopy recovery
+         * resyncs the received bitmap.
+         */
+        error_report("%s: sending urgent pages failed: %d", __func__, ret);
+        atomic_set(&rs->preempt_error, ret);
+    }
+    postcopy_preempt_deactivate(rs);
+
+    trace_postcopy_preempt_send_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/**
+ * ram_postcopy_preempt_start: service page requests on the preempt channel
+ *
+ * Called by the migration thread when entering postcopy, once the
+ * preempt channel is known to be connected.
+ *
+ * @ms: current migration state
+ */
+void ram_postcopy_preempt_start(MigrationState *ms)
+{
+    RAMState *rs = ram_state;
+    struct RAMSrcPageRequest *req;
+
+    assert(ms->postcopy_qemufile_src && !rs->preempt_thread_running);
+
+    rs->preempt_f = ms->postcopy_qemufile_src;
+    rs->preempt_last_sent_block = NULL;
+    rs->preempt_quit = false;
+    rs->preempt_error = 0;
+    rs->preempt_pending = 0;
+
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    /* Take over anything already queued for the migration thread */
+    QSIMPLEQ_FOREACH(req, &rs->src_page_requests, next_req) {
+        migration_consume_urgent_request();
+        rs->preempt_pending++;
+        qemu_sem_post(&rs->preempt_sem);
+    }
+    atomic_set(&rs->preempt_active, true);
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
+
+    qemu_thread_create(&rs->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, rs, QEMU_THREAD_JOINABLE);
+    rs->preempt_thread_running = true;
+}
+
+/* Fold what the preempt thread sent into ram_counters */
+static void postcopy_preempt_account(RAMState *rs)
+{
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    ram_counters.transferred += rs->preempt_transferred;
+    ram_counters.normal += rs->preempt_normal;
+    ram_counters.duplicate += rs->preempt_duplicate;
+    rs->preempt_transferred = 0;
+    rs->preempt_normal = 0;
+    rs->preempt_duplicate = 0;
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+}
+
+/*
+ * Called from the migration thread: pick up the preempt thread's stats,
+ * and turn a failure of the preempt channel into one of the main stream.
+ */
+static void postcopy_preempt_check(RAMState *rs, QEMUFile *f)
+{
+    if (!rs->preempt_thread_running) {
+        return;
+    }
+
+    postcopy_preempt_account(rs);
+    if (atomic_xchg(&rs->preempt_error, 0)) {
+        qemu_file_set_error(f, -EIO);
+    }
+}
+
+/**
+ * postcopy_preempt_stop: stop servicing requests on the preempt channel
+ *
+ * Requests still queued are left to the migration thread.
+ *
+ * @rs: current RAM state
+ * @finish: true at the end of a successful migration, the channel is
+ *          ended with an EOS; otherwise it is shut down
+ */
+static void postcopy_preempt_stop(RAMState *rs, bool finish)
+{
+    if (!rs->preempt_thread_running) {
+        return;
+    }
+
+    trace_postcopy_preempt_stop(finish);
+    if (!finish) {
+        /* It may be stuck writing to a dead connection */
+        qemu_file_shutdown(rs->preempt_f);
+    }
+    atomic_set(&rs->preempt_quit, true);
+    qemu_sem_post(&rs->preempt_sem);
+    qemu_thread_join(&rs->preempt_thread);
+    rs->preempt_thread_running = false;
+    postcopy_preempt_deactivate(rs);
+
+    if (finish && !atomic_read(&rs->preempt_error)) {
+        qemu_put_be64(rs->preempt_f, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(rs->preempt_f);
+    }
+    postcopy_preempt_account(rs);
+    rs->preempt_f = NULL;
+}
+
+/**
+ * postcopy_preempt_yield: let urgent pages overtake the background stream
+ *
+ * Called by the migration thread between the target pages of a host
+ * page; waits (for a bounded time) while the preempt thread has
+ * requests outstanding.
+ *
+ * @rs: current RAM state
+ */
+static void postcopy_preempt_yield(RAMState *rs)
+{
+    /* Drop wakeups for requests that completed while we weren't waiting */
+    while (!qemu_sem_timedwait(&rs->preempt_done_sem, 0)) {
+        /* nothing */
+    }
+
+    if (atomic_read(&rs->preempt_pending)) {
+        trace_postcopy_preempt_yield(atomic_read(&rs->preempt_pending));
+        qemu_sem_timedwait(&rs->preempt_done_sem, POSTCOPY_PREEMPT_YIELD_MS);
+    }
+}
+
+static bool save_page_use_compression(RAMState *rs)
+{
+    if (!migrate_use_compression()) {
+        return false;
+    }
+
+    /*
+     * If xbzrle is on, stop using the data compression after first
+     * round of migration even if compression is enabled. In theory,
+     * xbzrle can do better than compression.
+     */
+    if (rs->ram_bulk_stage || !migrate_use_xbzrle()) {
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * try to compress the page before posting it out, return true if the page
+ * has been properly handled by compression, otherwise needs other
+ * paths to handle it
+ */
+static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+{
+    if (!save_page_use_compression(rs)) {
+        return false;
+    }
+
+    /*
+     * When starting the process of a new block, the first page of
+     * the block should be sent out before other pages in the same
+     * block, and all the pages in last block should have been sent
+     * out, keeping this order is important, because the 'cont' flag
+     * is used to avoid resending the block name.
+     *
+     * We post the fist page as normal page as compression will take
+     * much CPU resource.
+     */
+    if (block != rs->last_sent_block) {
+        flush_compressed_data(rs);
+        return false;
+    }
+
+    if (compress_page_with_multi_thread(rs, block, offset) > 0) {
+        return true;
+    }
+
+    compression_counters.busy++;
+    return false;
+}
+
+/**
+ * ram_save_target_page: save one target page
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+/*
+ * In postcopy, multifd channels only carry the background push: pages
+ * the destination asked for go on the main channel so they are not
+ * queued behind a batch, and huge pages must be placed as a whole.
+ */
+static bool ram_save_multifd_allowed(PageSearchStatus *pss)
+{
+    if (!migration_in_postcopy()) {
+        return true;
+    }
+    return !pss->postcopy_requested &&
+           pss->block->page_size == TARGET_PAGE_SIZE;
+}
+
+static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
+                                bool last_stage)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    int res;
+
+    if (control_save_page(rs, block, offset, &res)) {
+        return res;
+    }
 
     if (save_compress_page(rs, block, offset)) {
         return 1;
@@ -2342,13 +3085,364 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
      * do not use multifd for compression as the first page in the new
      * block should be posted out before sending the compressed page
      */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
+    if (!save_page_use_compression(rs) && migrate_use_multifd() &&
+        ram_save_multifd_allowed(pss)) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
     return ram_save_page(rs, pss, last_stage);
 }
 
+/*
+ * Background snapshot
+ *
+ * While the VM is stopped to save device state, all migratable RAM is
+ * write-protected with userfaultfd.  From then on every host page is
+ * saved exactly once: by the linear scan, or earlier if the guest tries
+ * to write to it, in which case the write fault is serviced before
+ * anything else.  A page is unprotected (waking any vCPU blocked on it)
+ * right after it has been copied to the stream.
+ */
+#ifdef RAM_WRITE_TRACKING
+
+static bool ram_write_tracking_skip_block(RAMBlock *block)
+{
+    /* The guest can't write to these, so they need no protection */
+    return block->mr->readonly || block->mr->rom_device;
+}
+
+/*
+ * Open a non-blocking userfaultfd with @features enabled; if @avail is
+ * given the API handshake is done without features and the ones the
+ * kernel supports are returned there.
+ */
+static int ram_uffd_open(uint64_t features, uint64_t *avail)
+{
+    struct uffdio_api api_struct;
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+        trace_ram_write_tracking_error("userfaultfd", errno);
+        return -1;
+    }
+
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
+    if (ioctl(fd, UFFDIO_API, &api_struct)) {
+        trace_ram_write_tracking_error("UFFDIO_API", errno);
+        close(fd);
+        return -1;
+    }
+    if (avail) {
+        *avail = api_struct.features;
+    }
+    return fd;
+}
+
+static int ram_uffd_register(int fd, RAMBlock *block, uint64_t *ioctls)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)block->host;
+    reg_struct.range.len = block->max_length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(fd, UFFDIO_REGISTER, &reg_struct)) {
+        trace_ram_write_tracking_error("UFFDIO_REGISTER", errno);
+        return -1;
+    }
+    if (ioctls) {
+        *ioctls = reg_struct.ioctls;
+    }
+    return 0;
+}
+
+static void ram_uffd_unregister(int fd, RAMBlock *block)
+{
+    struct uffdio_range range_struct;
+
+    range_struct.start = (uintptr_t)block->host;
+    range_struct.len = block->max_length;
+    if (ioctl(fd, UFFDIO_UNREGISTER, &range_struct)) {
+        trace_ram_write_tracking_error("UFFDIO_UNREGISTER", errno);
+    }
+}
+
+static int ram_uffd_protect(int fd, void *addr, uint64_t length, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)addr;
+    wp_struct.range.len = length;
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    if (ioctl(fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        trace_ram_write_tracking_error("UFFDIO_WRITEPROTECT", errno);
+        return -1;
+    }
+    return 0;
+}
+
+bool ram_write_tracking_available(void)
+{
+    uint64_t features;
+    int fd;
+
+    fd = ram_uffd_open(0, &features);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return !!(features & UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t ioctl_mask = 1ULL << _UFFDIO_WRITEPROTECT;
+    RAMBlock *block;
+    bool ret = true;
+    int fd;
+
+    fd = ram_uffd_open(UFFD_FEATURE_PAGEFAULT_FLAG_WP, NULL);
+    if (fd < 0) {
+        return false;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        uint64_t ioctls;
+
+        if (ram_write_tracking_skip_block(block)) {
+            continue;
+        }
+        /* e.g. shared memory on kernels without uffd-wp support for it */
+        if (ram_uffd_register(fd, block, &ioctls)) {
+            ret = false;
+            break;
+        }
+        ram_uffd_unregister(fd, block);
+        if ((ioctls & ioctl_mask) != ioctl_mask) {
+            ret = false;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    close(fd);
+    return ret;
+}
+
+/*
+ * Write protection only applies to pages that are mapped, so read-fault
+ * everything in first (unbacked anonymous memory maps the zero page).
+ * Done while the guest still runs, to keep the pause short.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        size_t pagesize = qemu_ram_pagesize(block);
+        ram_addr_t offset;
+
+        if (ram_write_tracking_skip_block(block)) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length; offset += pagesize) {
+            (void)*((volatile char *)block->host + offset);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Called with the VM stopped, after device state has been saved.
+ *
+ * Returns 0 for success or -1 for error
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block, *failed = NULL;
+    int fd;
+
+    fd = ram_uffd_open(UFFD_FEATURE_PAGEFAULT_FLAG_WP, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (ram_write_tracking_skip_block(block)) {
+            continue;
+        }
+        if (ram_uffd_register(fd, block, NULL)) {
+            failed = block;
+            break;
+        }
+        if (ram_uffd_protect(fd, block->host, block->max_length, true)) {
+            ram_uffd_unregister(fd, block);
+            failed = block;
+            break;
+        }
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->max_length);
+    }
+
+    if (failed) {
+        error_report("%s: failed to write-protect RAM block %s", __func__,
+                     failed->idstr);
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            if (block == failed) {
+                break;
+            }
+            if (!ram_write_tracking_skip_block(block)) {
+                ram_uffd_unregister(fd, block);
+            }
+        }
+        rcu_read_unlock();
+        close(fd);
+        return -1;
+    }
+    rcu_read_unlock();
+
+    rs->uffdio_fd = fd;
+    return 0;
+}
+
+/*
+ * Unregistering drops the protection of anything still unsaved and
+ * wakes any vCPU waiting for a write fault to be resolved.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (!ram_write_tracking_skip_block(block)) {
+            ram_uffd_unregister(rs->uffdio_fd, block);
+        }
+    }
+    rcu_read_unlock();
+
+    close(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+}
+
+/*
+ * ram_write_tracking_fault: pick up a guest write to a protected page
+ *
+ * Returns true with @pss pointing at the start of the host page that
+ * was written to, or false if no write fault is pending.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static bool ram_write_tracking_fault(RAMState *rs, PageSearchStatus *pss)
+{
+    struct uffd_msg msg;
+    ssize_t len;
+
+    if (rs->uffdio_fd < 0) {
+        return false;
+    }
+
+    while (true) {
+        RAMBlock *block;
+        ram_addr_t offset;
+        void *addr;
+
+        len = read(rs->uffdio_fd, &msg, sizeof(msg));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len != sizeof(msg)) {
+            /* EAGAIN: nothing pending */
+            return false;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        addr = (void *)(uintptr_t)msg.arg.pagefault.address;
+        block = qemu_ram_block_from_host(addr, false, &offset);
+        if (!block || !offset_in_ramblock(block, offset)) {
+            /* Not ours to save; don't leave the writer blocked */
+            addr = QEMU_ALIGN_PTR_DOWN(addr, qemu_real_host_page_size);
+            ram_uffd_protect(rs->uffdio_fd, addr, qemu_real_host_page_size,
+                             false);
+            continue;
+        }
+
+        trace_ram_write_tracking_fault(block->idstr, offset);
+        offset &= ~((ram_addr_t)qemu_ram_pagesize(block) - 1);
+        pss->block = block;
+        pss->page = offset >> TARGET_PAGE_BITS;
+        pss->complete_round = false;
+        return true;
+    }
+}
+
+/* Unprotect the host page holding @page, which has just been saved */
+static void ram_write_tracking_release(RAMState *rs, RAMBlock *block,
+                                       unsigned long page)
+{
+    size_t pagesize = qemu_ram_pagesize(block);
+    ram_addr_t offset;
+
+    offset = (page << TARGET_PAGE_BITS) & ~((ram_addr_t)pagesize - 1);
+
+    if (rs->uffdio_fd < 0) {
+        return;
+    }
+    ram_uffd_protect(rs->uffdio_fd, block->host + offset,
+                     MIN(pagesize, block->used_length - offset), false);
+}
+
+#else
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    return false;
+}
+
+void ram_write_tracking_prepare(void)
+{
+}
+
+int ram_write_tracking_start(void)
+{
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+
+static bool ram_write_tracking_fault(RAMState *rs, PageSearchStatus *pss)
+{
+    return false;
+}
+
+static void ram_write_tracking_release(RAMState *rs, RAMBlock *block,
+                                       unsigned long page)
+{
+}
+
+#endif /* RAM_WRITE_TRACKING */
+
 /**
  * ram_save_host_page: save a whole host page
  *
@@ -2374,32 +3468,70 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
 
+    bool preempt = postcopy_preempt_active(rs);
+    bool dirty;
+
     if (!qemu_ram_is_migratable(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
         return 0;
     }
 
+    if (preempt) {
+        /* Keep the preempt thread off the host page we're sending */
+        qemu_mutex_lock(&rs->bitmap_mutex);
+        rs->postcopy_bg_block = pss->block;
+        rs->postcopy_bg_page = pss->page & ~(pagesize_bits - 1);
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+    }
+
     do {
         /* Check the pages is dirty and if it is send it */
-        if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
+        if (preempt) {
+            qemu_mutex_lock(&rs->bitmap_mutex);
+        }
+        dirty = migration_bitmap_clear_dirty(rs, pss->block, pss->page);
+        if (preempt) {
+            qemu_mutex_unlock(&rs->bitmap_mutex);
+        }
+        if (!dirty) {
             pss->page++;
             continue;
         }
 
         tmppages = ram_save_target_page(rs, pss, last_stage);
         if (tmppages < 0) {
-            return tmppages;
+            pages = tmppages;
+            break;
         }
 
         pages += tmppages;
         if (pss->block->unsentmap) {
+            if (preempt) {
+                qemu_mutex_lock(&rs->bitmap_mutex);
+            }
             clear_bit(pss->page, pss->block->unsentmap);
+            if (preempt) {
+                qemu_mutex_unlock(&rs->bitmap_mutex);
+            }
         }
 
         pss->page++;
+        if (preempt && (pss->page & (pagesize_bits - 1))) {
+            postcopy_preempt_yield(rs);
+        }
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block, pss->page << TARGET_PAGE_BITS));
 
+    if (preempt) {
+        qemu_mutex_lock(&rs->bitmap_mutex);
+        rs->postcopy_bg_block = NULL;
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+    }
+
+    if (pages < 0) {
+        return pages;
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -2441,7 +3573,12 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
-        found = get_queued_page(rs, &pss);
+        /* A vCPU is blocked until a write-protected page has been saved */
+        found = ram_write_tracking_fault(rs, &pss);
+        if (!found) {
+            found = get_queued_page(rs, &pss);
+        }
+        pss.postcopy_requested = found && migration_in_postcopy();
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -2450,6 +3587,12 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
         if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
+            if (pages >= 0) {
+                ram_write_tracking_release(rs, pss.block, pss.page);
+            }
+        }
+        if (atomic_xchg(&rs->preempt_multifd_flush, 0)) {
+            multifd_postcopy_flush();
         }
     } while (!pages && again);
 
@@ -2499,7 +3642,10 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        postcopy_preempt_stop(*rsp, false);
         migration_page_queue_free(*rsp);
+        qemu_sem_destroy(&(*rsp)->preempt_sem);
+        qemu_sem_destroy(&(*rsp)->preempt_done_sem);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -2531,13 +3677,19 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against this migration_bitmap
      */
-    memory_global_dirty_log_stop();
+    if (migrate_background_snapshot()) {
+        ram_write_tracking_stop();
+    } else {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -3029,6 +4181,9 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    qemu_sem_init(&(*rsp)->preempt_sem, 0);
+    qemu_sem_init(&(*rsp)->preempt_done_sem, 0);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -3056,6 +4211,9 @@ static void ram_list_init_bitmaps(void)
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
             }
+            if (migrate_mapped_ram()) {
+                block->file_bmap = bitmap_new(pages);
+            }
         }
     }
 }
@@ -3068,8 +4226,14 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync(rs);
+    /*
+     * A background snapshot saves every page once, as of when the VM
+     * was paused; write protection takes the place of dirty logging.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync(rs);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -3146,6 +4310,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    int ret;
 
     if (compress_threads_save_setup()) {
         return -1;
@@ -3171,6 +4336,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
             qemu_put_be64(f, block->page_size);
         }
+        if (migrate_mapped_ram()) {
+            ret = mapped_ram_save_header(f, block);
+            if (ret < 0) {
+                rcu_read_unlock();
+                return ret;
+            }
+        }
     }
 
     rcu_read_unlock();
@@ -3209,6 +4381,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         goto out;
     }
 
+    postcopy_preempt_check(rs, f);
+
     rcu_read_lock();
     if (ram_list.version != rs->last_version) {
         ram_state_reset(rs);
@@ -3222,7 +4396,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0 ||
-            !QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+            (!postcopy_preempt_active(rs) &&
+             !QSIMPLEQ_EMPTY(&rs->src_page_requests))) {
         int pages;
 
         if (qemu_file_get_error(f)) {
@@ -3295,9 +4470,17 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     RAMState *rs = *temp;
     int ret = 0;
 
+    if (rs->preempt_thread_running) {
+        /* Any request still outstanding goes on the main stream now */
+        postcopy_preempt_stop(rs, true);
+        if (atomic_xchg(&rs->preempt_error, 0)) {
+            qemu_file_set_error(f, -EIO);
+        }
+    }
+
     rcu_read_lock();
 
-    if (!migration_in_postcopy()) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot()) {
         migration_bitmap_sync(rs);
     }
 
@@ -3326,6 +4509,18 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     rcu_read_unlock();
 
     multifd_send_sync_main();
+
+    if (!ret && migrate_mapped_ram()) {
+        RAMBlock *block;
+
+        /* All pages are in place, say which ones */
+        rcu_read_lock();
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            mapped_ram_save_bitmap(f, block);
+        }
+        rcu_read_unlock();
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3343,8 +4538,8 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
-    if (!migration_in_postcopy() &&
-        remaining_size < max_size) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot() &&
+        (remaining_size < max_size || !remaining_size)) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync(rs);
@@ -3402,12 +4597,16 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * Returns a pointer from within the RCU-protected ram_list.
  *
+ * @mis: current migration incoming state
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the RAM channel @f belongs to
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3434,6 +4633,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    mis->last_recv_block[channel] = block;
     return block;
 }
 
@@ -3674,6 +4874,12 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
+/* Threads and chunk size used to flush the RAM cache at a checkpoint */
+#define COLO_FLUSH_MAX_THREADS  4
+#define COLO_FLUSH_CHUNK_PAGES  (16 * 1024)
+
+static ColoFlush *colo_flush;
+
 /*
  * colo cache: this is for secondary VM, we cache the whole
  * memory of the secondary VM, it is need to hold the global lock
@@ -3715,6 +4921,9 @@ int colo_init_ram_cache(void)
     ram_state = g_new0(RAMState, 1);
     ram_state->migration_dirty_pages = 0;
     memory_global_dirty_log_start();
+    colo_flush = colo_flush_new(MIN(g_get_num_processors(),
+                                    COLO_FLUSH_MAX_THREADS),
+                                TARGET_PAGE_BITS, COLO_FLUSH_CHUNK_PAGES);
 
     return 0;
 
@@ -3736,6 +4945,8 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
+    colo_flush_free(colo_flush);
+    colo_flush = NULL;
     memory_global_dirty_log_stop();
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
         g_free(block->bmap);
@@ -3818,19 +5029,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the preempt channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the RAM channel @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -3859,7 +5072,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3933,7 +5146,9 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: %#x"
@@ -3983,9 +5198,8 @@ static bool postcopy_is_running(void)
 static void colo_flush_ram_cache(void)
 {
     RAMBlock *block = NULL;
-    void *dst_host;
-    void *src_host;
-    unsigned long offset = 0;
+    ColoFlushRegion *regions;
+    int nregions = 0;
 
     memory_global_dirty_log_sync();
     rcu_read_lock();
@@ -3996,28 +5210,157 @@ static void colo_flush_ram_cache(void)
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
     rcu_read_lock();
-    block = QLIST_FIRST_RCU(&ram_list.blocks);
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        nregions++;
+    }
+    regions = g_new(ColoFlushRegion, nregions);
+    nregions = 0;
+    /* The blocks stay alive in this RCU read section, until the copy ends */
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        regions[nregions++] = (ColoFlushRegion) {
+            .bmap = block->bmap,
+            .dst = block->host,
+            .src = block->colo_cache,
+            .pages = block->used_length >> TARGET_PAGE_BITS,
+        };
+    }
+    ram_state->migration_dirty_pages -= colo_flush_run(colo_flush, regions,
+                                                       nregions);
+    rcu_read_unlock();
+    g_free(regions);
+    trace_colo_flush_ram_cache_end();
+}
+
+typedef struct {
+    QemuThread thread;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    /* range of target pages loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    Error *err;
+} MappedRamLoadParams;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoadParams *p = opaque;
+    QIOChannel *ioc;
+    unsigned long page, next;
 
-    while (block) {
-        offset = migration_bitmap_find_dirty(ram_state, block, offset);
+    ioc = file_recv_channel_create(&p->err);
+    if (!ioc) {
+        return NULL;
+    }
 
-        if (offset << TARGET_PAGE_BITS >= block->used_length) {
-            offset = 0;
-            block = QLIST_NEXT_RCU(block, next);
+    for (page = p->start; page < p->end; page = next) {
+        bool present = test_bit(page, p->bitmap);
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+        size_t len;
+
+        if (present) {
+            next = find_next_zero_bit(p->bitmap, p->end, page);
+        } else {
+            next = find_next_bit(p->bitmap, p->end, page);
+        }
+        len = (next - page) << TARGET_PAGE_BITS;
+
+        if (present) {
+            if (qemu_channel_pread_all(ioc, p->block->host + offset, len,
+                                       p->block->pages_offset + offset,
+                                       &p->err) < 0) {
+                break;
+            }
         } else {
-            migration_bitmap_clear_dirty(ram_state, block, offset);
-            dst_host = block->host + (offset << TARGET_PAGE_BITS);
-            src_host = block->colo_cache + (offset << TARGET_PAGE_BITS);
-            memcpy(dst_host, src_host, TARGET_PAGE_SIZE);
+            /* Zero pages are not in the file */
+            ram_handle_compressed(p->block->host + offset, 0, len);
         }
     }
 
-    rcu_read_unlock();
-    trace_colo_flush_ram_cache_end();
+    object_unref(OBJECT(ioc));
+    return NULL;
+}
+
+/*
+ * Load the pages of a RAMBlock from its regions of a mapped-ram file,
+ * then move the stream on past them.  Pages are read in parallel, with
+ * one thread per multifd channel.
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                 ram_addr_t length)
+{
+    unsigned long *le_bitmap, *bitmap, nbits = length >> TARGET_PAGE_BITS;
+    MappedRamLoadParams *params;
+    uint32_t version;
+    uint64_t page_size;
+    int i, threads, ret = 0;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("mapped-ram: unsupported header version %u for %s",
+                     version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("mapped-ram: mismatched page size %" PRIu64
+                     " for %s", page_size, block->idstr);
+        return -EINVAL;
+    }
+
+    le_bitmap = bitmap_new(nbits + BITS_PER_LONG);
+    bitmap = bitmap_new(nbits);
+    qemu_get_buffer_at(f, (uint8_t *)le_bitmap, mapped_ram_bitmap_size(length),
+                       block->bitmap_offset);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        goto out;
+    }
+    bitmap_from_le(bitmap, le_bitmap, nbits);
+
+    threads = migrate_use_multifd() ? migrate_multifd_channels() : 1;
+    threads = MAX(MIN(threads, nbits), 1);
+    trace_ram_mapped_ram_load_block(block->idstr,
+                                    bitmap_count_one(bitmap, nbits), threads);
+
+    params = g_new0(MappedRamLoadParams, threads);
+    for (i = 0; i < threads; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        p->block = block;
+        p->bitmap = bitmap;
+        p->start = (uint64_t)nbits * i / threads;
+        p->end = (uint64_t)nbits * (i + 1) / threads;
+        qemu_thread_create(&p->thread, "mapped-ram-load",
+                           mapped_ram_load_thread, p, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < threads; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->err) {
+            error_report_err(p->err);
+            ret = -EIO;
+        }
+    }
+    g_free(params);
+
+    if (!ret && qemu_file_seek(f, mapped_ram_end(block, length),
+                               SEEK_SET) < 0) {
+        ret = qemu_file_get_error(f);
+    }
+
+out:
+    g_free(bitmap);
+    g_free(le_bitmap);
+    return ret;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0;
     static uint64_t seq_iter;
     int len = 0;
@@ -4046,7 +5389,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -4069,7 +5412,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4132,6 +5476,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_block(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4193,7 +5540,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_unlock();
     trace_ram_load_complete(ret, seq_iter);
 
-    if (!ret  && migration_incoming_in_colo_state()) {
+    /*
+     * RAM sent ahead of a checkpoint, while the SVM is running, stays in
+     * the cache until the checkpoint itself.
+     */
+    if (!ret && migration_incoming_in_colo_state() && !runstate_is_running()) {
         colo_flush_ram_cache();
     }
     return ret;
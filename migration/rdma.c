@@ -71,12 +71,14 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+#define RDMA_CAPABILITY_MULTIFD 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_MULTIFD;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -238,6 +240,16 @@ typedef struct QEMU_PACKED RDMADestBlock {
     uint32_t padding;
 } RDMADestBlock;
 
+/*
+ * Sent by the dest on each multifd connection as soon as it is
+ * established.  The channels connect independently of the main
+ * stream's RAMBlock negotiation, so blocks are matched by name.
+ */
+typedef struct QEMU_PACKED RDMAMultiFDBlock {
+    RDMADestBlock block;
+    char name[256];
+} RDMAMultiFDBlock;
+
 static const char *control_desc(unsigned int rdma_control)
 {
     static const char *strs[] = {
@@ -392,6 +404,13 @@ typedef struct RDMAContext {
     /* the RDMAContext for return path */
     struct RDMAContext *return_path;
     bool is_return_path;
+
+    /*
+     * A multifd channel: RAM is always written straight into the
+     * dest's pinned blocks and the CM event channel, on the dest,
+     * belongs to the listening context.
+     */
+    bool multifd;
 } RDMAContext;
 
 #define TYPE_QIO_CHANNEL_RDMA "qio-channel-rdma"
@@ -409,6 +428,18 @@ struct QIOChannelRDMA {
     bool blocking; /* XXX we don't actually honour this yet */
 };
 
+/* Where the source opens its multifd channels */
+static struct {
+    char *host_port;
+} rdma_outgoing_args;
+
+/*
+ * Multifd channels accepted by the dest.  They share the listening
+ * context's CM event channel, so the main loop looks them up here to
+ * dispatch their events.  Only used from the main loop.
+ */
+static GSList *rdma_multifd_incoming;
+
 /*
  * Main structure for IB Send/Recv control messages.
  * This gets prepended at the beginning of every Send/Recv.
@@ -1430,6 +1461,10 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
     wr_id = wc.wr_id & RDMA_WRID_TYPE_MASK;
 
     if (wc.status != IBV_WC_SUCCESS) {
+        if (rdma->multifd && wc.status == IBV_WC_WR_FLUSH_ERR) {
+            /* The peer has closed this multifd channel */
+            return -EPIPE;
+        }
         fprintf(stderr, "ibv_poll_cq wc.status=%d %s!\n",
                         wc.status, ibv_wc_status_str(wc.status));
         fprintf(stderr, "ibv_poll_cq wrid=%s!\n", wrid_desc[wr_id]);
@@ -1509,23 +1544,31 @@ static int qemu_rdma_wait_comp_channel(RDMAContext *rdma)
          */
         while (!rdma->error_state  && !rdma->received_error) {
             GPollFD pfds[2];
+            /*
+             * A multifd channel on the dest shares the listener's CM
+             * channel, whose events belong to the main loop.
+             */
+            int nfds = rdma->channel ? 2 : 1;
+
             pfds[0].fd = rdma->comp_channel->fd;
             pfds[0].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
             pfds[0].revents = 0;
 
-            pfds[1].fd = rdma->channel->fd;
-            pfds[1].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
-            pfds[1].revents = 0;
+            if (rdma->channel) {
+                pfds[1].fd = rdma->channel->fd;
+                pfds[1].events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+                pfds[1].revents = 0;
+            }
 
             /* 0.1s timeout, should be fine for a 'cancel' */
-            switch (qemu_poll_ns(pfds, 2, 100 * 1000 * 1000)) {
+            switch (qemu_poll_ns(pfds, nfds, 100 * 1000 * 1000)) {
             case 2:
             case 1: /* fd active */
                 if (pfds[0].revents) {
                     return 0;
                 }
 
-                if (pfds[1].revents) {
+                if (nfds > 1 && pfds[1].revents) {
                     ret = rdma_get_cm_event(rdma->channel, &cm_event);
                     if (!ret) {
                         rdma_ack_cm_event(cm_event);
@@ -1760,7 +1803,9 @@ static int qemu_rdma_exchange_get_response(RDMAContext *rdma,
                                        &byte_len);
 
     if (ret < 0) {
-        error_report("rdma migration: recv polling control error!");
+        if (!rdma->multifd || ret != -EPIPE) {
+            error_report("rdma migration: recv polling control error!");
+        }
         return ret;
     }
 
@@ -2060,7 +2105,9 @@ retry:
                     return -EIO;
                 }
 
-                acct_update_position(f, sge.length, true);
+                if (f) {
+                    acct_update_position(f, sge.length, true);
+                }
 
                 return 1;
             }
@@ -2168,7 +2215,10 @@ retry:
     }
 
     set_bit(chunk, block->transit_bitmap);
-    acct_update_position(f, sge.length, false);
+    /* multifd channels have no QEMUFile; ram.c accounts for their pages */
+    if (f) {
+        acct_update_position(f, sge.length, false);
+    }
     rdma->total_writes++;
 
     return 0;
@@ -2380,6 +2430,10 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
     }
     g_free(rdma->host);
     rdma->host = NULL;
+
+    if (rdma->multifd) {
+        rdma_multifd_incoming = g_slist_remove(rdma_multifd_incoming, rdma);
+    }
 }
 
 
@@ -2467,6 +2521,10 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
 
+    if (rdma->multifd) {
+        cap.flags |= RDMA_CAPABILITY_MULTIFD;
+    }
+
     caps_to_network(&cap);
 
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
@@ -2515,6 +2573,12 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     rdma_ack_cm_event(cm_event);
 
+    if (rdma->multifd && (!rdma->pin_all ||
+                          !(cap.flags & RDMA_CAPABILITY_MULTIFD))) {
+        ERROR(errp, "Server does not support RDMA multifd channels");
+        goto err_rdma_source_connect;
+    }
+
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
     return 0;
@@ -2792,6 +2856,12 @@ static ssize_t qio_channel_rdma_readv(QIOChannel *ioc,
          */
         ret = qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_QEMU_FILE);
 
+        if (ret < 0 && rdma->multifd && ret == -EPIPE) {
+            /* The source closed the channel between two packets */
+            rcu_read_unlock();
+            return 0;
+        }
+
         if (ret < 0) {
             rdma->error_state = ret;
             rcu_read_unlock();
@@ -3130,7 +3200,9 @@ static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
 
     CHECK_ERROR_STATE();
 
-    if (migrate_get_current()->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+    /* With multifd, RAM goes over the per-channel queue pairs instead */
+    if (migrate_get_current()->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+        migrate_use_multifd()) {
         rcu_read_unlock();
         return RAM_SAVE_CONTROL_NOT_SUPP;
     }
@@ -3226,11 +3298,177 @@ err:
 
 static void rdma_accept_incoming_migration(void *opaque);
 
+/*
+ * A multifd channel asked to connect to a running incoming migration.
+ * It gets its own protection domain and queue pair, and all of RAM is
+ * registered with it so the source can write pages in place; the
+ * connection completes asynchronously in rdma_cm_poll_handler().
+ */
+static void qemu_rdma_accept_multifd(struct rdma_cm_event *cm_event)
+{
+    RDMACapabilities cap;
+    struct rdma_conn_param conn_param = {
+                                            .responder_resources = 2,
+                                            .private_data = &cap,
+                                            .private_data_len = sizeof(cap),
+                                         };
+    struct rdma_cm_id *cm_id = cm_event->id;
+    RDMAContext *rdma;
+    int ret, idx;
+
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    network_to_caps(&cap);
+    rdma_ack_cm_event(cm_event);
+
+    if (!(cap.flags & RDMA_CAPABILITY_MULTIFD) || !migrate_use_multifd()) {
+        error_report("rdma migration: unexpected connection request");
+        rdma_reject(cm_id, NULL, 0);
+        rdma_destroy_id(cm_id);
+        return;
+    }
+
+    rdma = g_new0(RDMAContext, 1);
+    rdma->current_index = -1;
+    rdma->current_chunk = -1;
+    rdma->multifd = true;
+    rdma->pin_all = true;
+    rdma->cm_id = cm_id;
+    rdma->verbs = cm_id->verbs;
+
+    cap.flags = RDMA_CAPABILITY_PIN_ALL | RDMA_CAPABILITY_MULTIFD;
+    caps_to_network(&cap);
+
+    ret = qemu_rdma_alloc_pd_cq(rdma);
+    if (ret) {
+        error_report("rdma migration: error allocating pd and cq!");
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma);
+    if (ret) {
+        error_report("rdma migration: error allocating qp!");
+        goto err;
+    }
+
+    ret = qemu_rdma_init_ram_blocks(rdma);
+    if (ret) {
+        error_report("rdma migration: error initializing ram blocks!");
+        goto err;
+    }
+
+    ret = qemu_rdma_reg_whole_ram_blocks(rdma);
+    if (ret) {
+        error_report("rdma migration: error dest registering ram blocks");
+        goto err;
+    }
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        ret = qemu_rdma_reg_control(rdma, idx);
+        if (ret) {
+            error_report("rdma: error registering %d control", idx);
+            goto err;
+        }
+    }
+
+    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
+    if (ret) {
+        error_report("rdma migration: error posting control recv");
+        goto err;
+    }
+
+    ret = rdma_accept(rdma->cm_id, &conn_param);
+    if (ret) {
+        error_report("rdma_accept returns %d", ret);
+        goto err;
+    }
+
+    rdma_multifd_incoming = g_slist_prepend(rdma_multifd_incoming, rdma);
+    trace_qemu_rdma_accept_multifd(rdma->local_ram_blocks.nb_blocks);
+    return;
+
+err:
+    rdma_reject(rdma->cm_id, NULL, 0);
+    qemu_rdma_cleanup(rdma);
+    g_free(rdma);
+}
+
+/*
+ * The multifd channel is up: tell the source where each block lives
+ * and hand the channel to the migration code.
+ */
+static void qemu_rdma_multifd_established(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAControlHeader head = { .len = local->nb_blocks *
+                                      sizeof(RDMAMultiFDBlock),
+                               .type = RDMA_CONTROL_RAM_BLOCKS_RESULT,
+                               .repeat = 1,
+                             };
+    RDMAMultiFDBlock *blocks;
+    QIOChannelRDMA *rioc;
+    int i, ret;
+
+    rdma->connected = true;
+
+    if (head.len > RDMA_CONTROL_MAX_BUFFER - sizeof(head)) {
+        error_report("rdma migration: too many ram blocks (%d) for multifd",
+                     local->nb_blocks);
+        goto err;
+    }
+
+    blocks = g_new0(RDMAMultiFDBlock, local->nb_blocks);
+    for (i = 0; i < local->nb_blocks; i++) {
+        blocks[i].block.remote_host_addr =
+            (uintptr_t)(local->block[i].local_host_addr);
+        blocks[i].block.remote_rkey = local->block[i].mr->rkey;
+        blocks[i].block.offset = local->block[i].offset;
+        blocks[i].block.length = local->block[i].length;
+        dest_block_to_network(&blocks[i].block);
+        pstrcpy(blocks[i].name, sizeof(blocks[i].name),
+                local->block[i].block_name);
+    }
+
+    ret = qemu_rdma_post_send_control(rdma, (uint8_t *)blocks, &head);
+    g_free(blocks);
+    if (ret < 0) {
+        error_report("rdma migration: error sending multifd ram blocks");
+        goto err;
+    }
+
+    rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    rioc->rdmain = rdma;
+    migration_ioc_process_incoming(QIO_CHANNEL(rioc));
+    object_unref(OBJECT(rioc));
+    return;
+
+err:
+    rdma->error_state = -EINVAL;
+    qemu_rdma_cleanup(rdma);
+    g_free(rdma);
+}
+
+static RDMAContext *qemu_rdma_multifd_lookup(struct rdma_cm_id *cm_id)
+{
+    GSList *l;
+
+    for (l = rdma_multifd_incoming; l; l = l->next) {
+        RDMAContext *rdma = l->data;
+
+        if (rdma->cm_id == cm_id) {
+            return rdma;
+        }
+    }
+    return NULL;
+}
+
 static void rdma_cm_poll_handler(void *opaque)
 {
     RDMAContext *rdma = opaque;
+    RDMAContext *multifd;
     int ret;
     struct rdma_cm_event *cm_event;
+    enum rdma_cm_event_type event;
+    struct rdma_cm_id *cm_id;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
     ret = rdma_get_cm_event(rdma->channel, &cm_event);
@@ -3238,11 +3476,34 @@ static void rdma_cm_poll_handler(void *opaque)
         error_report("get_cm_event failed %d", errno);
         return;
     }
+
+    if (cm_event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+        qemu_rdma_accept_multifd(cm_event);
+        return;
+    }
+
+    event = cm_event->event;
+    cm_id = cm_event->id;
     rdma_ack_cm_event(cm_event);
 
-    if (cm_event->event == RDMA_CM_EVENT_DISCONNECTED ||
-        cm_event->event == RDMA_CM_EVENT_DEVICE_REMOVAL) {
-        error_report("receive cm event, cm event is %d", cm_event->event);
+    multifd = qemu_rdma_multifd_lookup(cm_id);
+    if (multifd) {
+        trace_qemu_rdma_multifd_cm_event(rdma_event_str(event));
+        if (event == RDMA_CM_EVENT_ESTABLISHED) {
+            qemu_rdma_multifd_established(multifd);
+        } else if (event != RDMA_CM_EVENT_DISCONNECTED) {
+            /*
+             * A disconnect is the normal end of the channel; its
+             * pending receive is flushed and read as EOF.
+             */
+            multifd->error_state = -EPIPE;
+        }
+        return;
+    }
+
+    if (event == RDMA_CM_EVENT_DISCONNECTED ||
+        event == RDMA_CM_EVENT_DEVICE_REMOVAL) {
+        error_report("receive cm event, cm event is %d", event);
         rdma->error_state = -EPIPE;
         if (rdma->return_path) {
             rdma->return_path->error_state = -EPIPE;
@@ -4071,6 +4332,11 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    if (migrate_use_multifd() && migrate_postcopy()) {
+        ERROR(errp, "multifd over RDMA does not support postcopy");
+        goto err;
+    }
+
     ret = qemu_rdma_source_init(rdma,
         s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL], errp);
 
@@ -4113,6 +4379,12 @@ void rdma_start_outgoing_migration(void *opaque,
 
     trace_rdma_start_outgoing_migration_after_rdma_connect();
 
+    g_free(rdma_outgoing_args.host_port);
+    rdma_outgoing_args.host_port = NULL;
+    if (migrate_use_multifd()) {
+        rdma_outgoing_args.host_port = g_strdup(host_port);
+    }
+
     s->to_dst_file = qemu_fopen_rdma(rdma, "wb");
     migrate_fd_connect(s, NULL);
     return;
@@ -4120,3 +4392,152 @@ err:
     g_free(rdma);
     g_free(rdma_return_path);
 }
+
+/*
+ * Connect one multifd channel: a queue pair of its own to the same
+ * destination, which answers with where each RAMBlock lives.
+ */
+static void rdma_send_channel_connect(QIOTask *task, gpointer opaque)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(qio_task_get_source(task));
+    const char *host_port = opaque;
+    RDMALocalBlocks *local;
+    RDMAControlHeader head;
+    RDMAMultiFDBlock *blocks;
+    RDMAContext *rdma;
+    Error *err = NULL;
+    int i, j, nb_blocks;
+
+    rdma = qemu_rdma_data_init(host_port, &err);
+    if (!rdma) {
+        goto err;
+    }
+    rdma->multifd = true;
+
+    /* The dest always pins its RAM for multifd channels */
+    if (qemu_rdma_source_init(rdma, true, &err) ||
+        qemu_rdma_connect(rdma, &err)) {
+        goto err;
+    }
+
+    if (qemu_rdma_exchange_get_response(rdma, &head,
+                                        RDMA_CONTROL_RAM_BLOCKS_RESULT,
+                                        RDMA_WRID_READY) < 0) {
+        error_setg(&err, "RDMA ERROR: receiving multifd ram blocks");
+        goto err_cleanup;
+    }
+    qemu_rdma_move_header(rdma, RDMA_WRID_READY, &head);
+    blocks = (RDMAMultiFDBlock *)rdma->wr_data[RDMA_WRID_READY].control_curr;
+    nb_blocks = head.len / sizeof(RDMAMultiFDBlock);
+    local = &rdma->local_ram_blocks;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+
+        for (j = 0; j < nb_blocks; j++) {
+            if (!strncmp(block->block_name, blocks[j].name,
+                         sizeof(blocks[j].name))) {
+                break;
+            }
+        }
+        if (j == nb_blocks) {
+            error_setg(&err, "RDMA ERROR: block %s is missing on the "
+                       "destination", block->block_name);
+            goto err_cleanup;
+        }
+        network_to_dest_block(&blocks[j].block);
+        if (blocks[j].block.length != block->length) {
+            error_setg(&err, "RDMA ERROR: block %s has a different length "
+                       "%" PRIu64 " vs %" PRIu64, block->block_name,
+                       block->length, blocks[j].block.length);
+            goto err_cleanup;
+        }
+        block->remote_host_addr = blocks[j].block.remote_host_addr;
+        block->remote_rkey = blocks[j].block.remote_rkey;
+    }
+    rdma->wr_data[RDMA_WRID_READY].control_len = 0;
+
+    /* Replace the receive the block list consumed, for the next READY */
+    if (qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY)) {
+        error_setg(&err, "RDMA ERROR: posting control recv");
+        goto err_cleanup;
+    }
+
+    trace_rdma_send_channel_connect(nb_blocks);
+    rioc->rdmaout = rdma;
+    return;
+
+err_cleanup:
+    qemu_rdma_cleanup(rdma);
+err:
+    g_free(rdma);
+    qio_task_set_error(task, err);
+}
+
+void rdma_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    QIOTask *task = qio_task_new(OBJECT(rioc), f, data, NULL);
+
+    qio_task_run_in_thread(task, rdma_send_channel_connect,
+                           g_strdup(rdma_outgoing_args.host_port),
+                           g_free, NULL);
+}
+
+/* Whether multifd channels should be opened over RDMA */
+bool rdma_send_channel_available(void)
+{
+    return rdma_outgoing_args.host_port != NULL;
+}
+
+int rdma_send_channel_destroy(QIOChannel *send)
+{
+    object_unref(OBJECT(send));
+    g_free(rdma_outgoing_args.host_port);
+    rdma_outgoing_args.host_port = NULL;
+    return 0;
+}
+
+bool rdma_multifd_channel(QIOChannel *ioc)
+{
+    return object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_RDMA) != NULL;
+}
+
+/*
+ * Write a batch of pages of one RAMBlock straight into the dest's
+ * memory.  Pages are merged into chunk-sized writes; the local chunk
+ * registrations are kept for the whole migration, so later iterations
+ * only post work requests.  The completions are reaped here, in the
+ * channel's thread, before the packet describing the pages is sent.
+ */
+int rdma_multifd_write_pages(QIOChannel *ioc, ram_addr_t block_offset,
+                             ram_addr_t *offset, uint32_t used,
+                             size_t page_size, Error **errp)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
+    RDMAContext *rdma;
+    uint32_t i;
+    int ret = 0;
+
+    rcu_read_lock();
+    rdma = atomic_rcu_read(&rioc->rdmaout);
+    if (!rdma || rdma->error_state) {
+        rcu_read_unlock();
+        error_setg(errp, "RDMA multifd channel is in an error state");
+        return -1;
+    }
+
+    for (i = 0; i < used && ret == 0; i++) {
+        ret = qemu_rdma_write(NULL, rdma, block_offset, offset[i], page_size);
+    }
+    if (ret == 0) {
+        ret = qemu_rdma_drain_cq(NULL, rdma);
+    }
+    if (ret < 0) {
+        rdma->error_state = ret;
+        error_setg(errp, "RDMA multifd: failed to write pages: %d", ret);
+    }
+
+    rcu_read_unlock();
+    return ret < 0 ? -1 : 0;
+}
@@ -17,9 +17,51 @@
 #ifndef QEMU_MIGRATION_RDMA_H
 #define QEMU_MIGRATION_RDMA_H
 
+#include "exec/cpu-common.h"
+#include "io/channel.h"
+#include "io/task.h"
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port,
                                    Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+#ifdef CONFIG_RDMA
+void rdma_send_channel_create(QIOTaskFunc f, void *data);
+bool rdma_send_channel_available(void);
+int rdma_send_channel_destroy(QIOChannel *send);
+bool rdma_multifd_channel(QIOChannel *ioc);
+int rdma_multifd_write_pages(QIOChannel *ioc, ram_addr_t block_offset,
+                             ram_addr_t *offset, uint32_t used,
+                             size_t page_size, Error **errp);
+#else
+static inline void rdma_send_channel_create(QIOTaskFunc f, void *data)
+{
+    g_assert_not_reached();
+}
+
+static inline bool rdma_send_channel_available(void)
+{
+    return false;
+}
+
+static inline int rdma_send_channel_destroy(QIOChannel *send)
+{
+    g_assert_not_reached();
+}
+
+static inline bool rdma_multifd_channel(QIOChannel *ioc)
+{
+    return false;
+}
+
+static inline int rdma_multifd_write_pages(QIOChannel *ioc,
+                                           ram_addr_t block_offset,
+                                           ram_addr_t *offset, uint32_t used,
+                                           size_t page_size, Error **errp)
+{
+    g_assert_not_reached();
+}
+#endif
+
 #endif
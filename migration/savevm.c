@@ -790,7 +790,8 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
 }
 
 /*
- * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
+ * Write the header for device section
+ * (QEMU_VM_SECTION START/END/PART/FULL/PARALLEL)
  */
 static void save_section_header(QEMUFile *f, SaveStateEntry *se,
                                 uint8_t section_type)
@@ -799,7 +800,8 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
-        section_type == QEMU_VM_SECTION_START) {
+        section_type == QEMU_VM_SECTION_START ||
+        section_type == QEMU_VM_SECTION_PARALLEL) {
         /* ID string */
         size_t len = strlen(se->idstr);
         qemu_put_byte(f, len);
@@ -822,6 +824,280 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * Parallel save and load of device state (the parallel-vmstate capability)
+ *
+ * Every section saved at switchover becomes a job that fills its own buffer.
+ * Jobs for sections that are marked parallel in their SaveVMHandlers or
+ * VMStateDescription are run by a small pool of worker threads, the others
+ * by the migration thread as before; the buffers are then written out in
+ * the usual order.  Parallel sections carry their length in the stream
+ * (QEMU_VM_SECTION_PARALLEL), so that the destination can read them ahead
+ * and hand them to its own pool.  A job never starts before the jobs for
+ * the sections named in its depends_on list; only sections that come
+ * earlier in the stream can be waited for.
+ */
+#define SAVEVM_PARALLEL_MAX_THREADS     8
+#define MAX_VM_SECTION_PARALLEL_SIZE    (1U << 30)
+
+typedef struct SaveVMParallelJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    bool load;
+    /* Position in SaveVMParallel.jobs */
+    guint index;
+    bool done;
+    int ret;
+    QSIMPLEQ_ENTRY(SaveVMParallelJob) next;
+} SaveVMParallelJob;
+
+typedef struct SaveVMParallel {
+    QemuThread *threads;
+    int nthreads;
+    QemuMutex lock;
+    /* Signalled whenever a job is queued or completes */
+    QemuCond cond;
+    /* Jobs waiting for a worker thread */
+    QSIMPLEQ_HEAD(, SaveVMParallelJob) queue;
+    /* All jobs, in stream order */
+    GPtrArray *jobs;
+    bool quit;
+} SaveVMParallel;
+
+static bool se_parallel(SaveStateEntry *se)
+{
+    if (se->vmsd) {
+        return se->vmsd->parallel;
+    }
+    return se->ops && se->ops->parallel;
+}
+
+static const char * const *se_depends_on(SaveStateEntry *se)
+{
+    if (se->vmsd) {
+        return se->vmsd->depends_on;
+    }
+    return se->ops ? se->ops->depends_on : NULL;
+}
+
+/* @name may be a full idstr, its last path component, or a vmsd name */
+static bool se_matches(SaveStateEntry *se, const char *name)
+{
+    size_t len = strlen(se->idstr);
+    size_t n = strlen(name);
+
+    if (se->vmsd && !strcmp(se->vmsd->name, name)) {
+        return true;
+    }
+    return len >= n && !strcmp(se->idstr + len - n, name) &&
+           (len == n || se->idstr[len - n - 1] == '/');
+}
+
+/* Called with p->lock held */
+static bool savevm_parallel_job_ready(SaveVMParallel *p,
+                                      SaveVMParallelJob *job)
+{
+    const char * const *dep = se_depends_on(job->se);
+    guint i;
+
+    for (; dep && *dep; dep++) {
+        for (i = 0; i < job->index; i++) {
+            SaveVMParallelJob *other = g_ptr_array_index(p->jobs, i);
+
+            if (!other->done && se_matches(other->se, *dep)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void savevm_parallel_run(SaveVMParallelJob *job)
+{
+    SaveStateEntry *se = job->se;
+
+    if (job->load) {
+        job->ret = vmstate_load(job->f, se);
+        if (job->ret < 0) {
+            error_report("error while loading state for instance 0x%x of"
+                         " device '%s'", se->instance_id, se->idstr);
+        }
+    } else {
+        job->ret = vmstate_save(job->f, se, NULL);
+        qemu_fflush(job->f);
+    }
+    if (!job->ret) {
+        job->ret = qemu_file_get_error(job->f);
+    }
+    trace_vmstate_parallel_done(se->idstr, job->load, job->ret);
+}
+
+static void *savevm_parallel_thread(void *opaque)
+{
+    SaveVMParallel *p = opaque;
+    SaveVMParallelJob *job;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&p->lock);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&p->queue);
+        if (!job) {
+            if (p->quit) {
+                break;
+            }
+            qemu_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&p->queue, next);
+
+        /*
+         * Jobs are taken in order and only wait for earlier ones, which
+         * are already running or done, so this can't deadlock.
+         */
+        while (!savevm_parallel_job_ready(p, job)) {
+            qemu_cond_wait(&p->cond, &p->lock);
+        }
+        qemu_mutex_unlock(&p->lock);
+
+        savevm_parallel_run(job);
+
+        qemu_mutex_lock(&p->lock);
+        job->done = true;
+        qemu_cond_broadcast(&p->cond);
+    }
+    qemu_mutex_unlock(&p->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static SaveVMParallel *savevm_parallel_new(void)
+{
+    SaveVMParallel *p = g_new0(SaveVMParallel, 1);
+    int i;
+
+    qemu_mutex_init(&p->lock);
+    qemu_cond_init(&p->cond);
+    QSIMPLEQ_INIT(&p->queue);
+    p->jobs = g_ptr_array_new();
+    p->nthreads = MAX(1, MIN(g_get_num_processors(),
+                             SAVEVM_PARALLEL_MAX_THREADS));
+    p->threads = g_new0(QemuThread, p->nthreads);
+    for (i = 0; i < p->nthreads; i++) {
+        qemu_thread_create(&p->threads[i], "vmstate", savevm_parallel_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+    return p;
+}
+
+/*
+ * Add a job for @se that saves into, or loads from, @bioc; the job takes
+ * over the caller's reference to @bioc.  Jobs that are not queued to the
+ * worker threads must be run with savevm_parallel_run_inline().
+ */
+static SaveVMParallelJob *savevm_parallel_add(SaveVMParallel *p,
+                                              SaveStateEntry *se,
+                                              QIOChannelBuffer *bioc,
+                                              bool load, bool queue)
+{
+    SaveVMParallelJob *job = g_new0(SaveVMParallelJob, 1);
+
+    job->se = se;
+    job->bioc = bioc;
+    job->load = load;
+    job->f = load ? qemu_fopen_channel_input(QIO_CHANNEL(bioc)) :
+                    qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+
+    qemu_mutex_lock(&p->lock);
+    job->index = p->jobs->len;
+    g_ptr_array_add(p->jobs, job);
+    if (queue) {
+        trace_vmstate_parallel_queue(se->idstr, load);
+        QSIMPLEQ_INSERT_TAIL(&p->queue, job, next);
+        qemu_cond_broadcast(&p->cond);
+    }
+    qemu_mutex_unlock(&p->lock);
+
+    return job;
+}
+
+static void savevm_parallel_run_inline(SaveVMParallel *p,
+                                       SaveVMParallelJob *job)
+{
+    qemu_mutex_lock(&p->lock);
+    while (!savevm_parallel_job_ready(p, job)) {
+        qemu_cond_wait(&p->cond, &p->lock);
+    }
+    qemu_mutex_unlock(&p->lock);
+
+    savevm_parallel_run(job);
+
+    qemu_mutex_lock(&p->lock);
+    job->done = true;
+    qemu_cond_broadcast(&p->cond);
+    qemu_mutex_unlock(&p->lock);
+}
+
+static int savevm_parallel_wait(SaveVMParallel *p, SaveVMParallelJob *job)
+{
+    qemu_mutex_lock(&p->lock);
+    while (!job->done) {
+        qemu_cond_wait(&p->cond, &p->lock);
+    }
+    qemu_mutex_unlock(&p->lock);
+
+    return job->ret;
+}
+
+/* Wait for all jobs added so far; returns the first error */
+static int savevm_parallel_wait_all(SaveVMParallel *p)
+{
+    int ret = 0;
+    guint i;
+
+    for (i = 0; i < p->jobs->len; i++) {
+        int job_ret = savevm_parallel_wait(p, g_ptr_array_index(p->jobs, i));
+
+        if (!ret) {
+            ret = job_ret;
+        }
+    }
+    return ret;
+}
+
+/* Wait for all jobs and free everything; returns the first error */
+static int savevm_parallel_free(SaveVMParallel *p)
+{
+    int ret = savevm_parallel_wait_all(p);
+    guint i;
+    int t;
+
+    qemu_mutex_lock(&p->lock);
+    p->quit = true;
+    qemu_cond_broadcast(&p->cond);
+    qemu_mutex_unlock(&p->lock);
+    for (t = 0; t < p->nthreads; t++) {
+        qemu_thread_join(&p->threads[t]);
+    }
+
+    for (i = 0; i < p->jobs->len; i++) {
+        SaveVMParallelJob *job = g_ptr_array_index(p->jobs, i);
+
+        qemu_fclose(job->f);
+        object_unref(OBJECT(job->bioc));
+        g_free(job);
+    }
+    g_ptr_array_free(p->jobs, true);
+    g_free(p->threads);
+    qemu_cond_destroy(&p->cond);
+    qemu_mutex_destroy(&p->lock);
+    g_free(p);
+
+    return ret;
+}
+
 /**
  * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
  *                           command and associated data.
@@ -1173,24 +1449,15 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
-                                       bool inactivate_disks)
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
-    bool in_postcopy = migration_in_postcopy();
-
-    trace_savevm_state_complete_precopy();
-
-    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->has_postcopy &&
              se->ops->has_postcopy(se->opaque)) ||
-            (in_postcopy && !iterable_only) ||
             !se->ops->save_live_complete_precopy) {
             continue;
         }
@@ -1213,15 +1480,38 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         }
     }
 
-    if (iterable_only) {
-        return 0;
-    }
+    return 0;
+}
+
+/*
+ * Estimate the size of the device state that
+ * qemu_savevm_state_complete_precopy_non_iterable() will send, as far as
+ * it is described by VMStateDescriptions.  Must be called with the
+ * iothread lock held.
+ */
+uint64_t qemu_savevm_state_non_iterable_size(void)
+{
+    SaveStateEntry *se;
+    uint64_t size = 0;
 
-    vmdesc = qjson_new();
-    json_prop_int(vmdesc, "page_size", qemu_target_page_size());
-    json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->vmsd && vmstate_save_needed(se->vmsd, se->opaque)) {
+            size += vmstate_estimate_size(se->vmsd, se->opaque);
+        }
+    }
 
+    return size;
+}
+
+static int qemu_savevm_state_save_parallel(QEMUFile *f, QJSON *vmdesc)
+{
+    SaveVMParallel *p = savevm_parallel_new();
+    SaveVMParallelJob *job;
+    SaveStateEntry *se;
+    int ret = 0;
+    guint i;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
@@ -1230,22 +1520,99 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
             continue;
         }
 
+        job = savevm_parallel_add(p, se, qio_channel_buffer_new(4096), false,
+                                  se_parallel(se));
+        if (!se_parallel(se)) {
+            savevm_parallel_run_inline(p, job);
+        }
+    }
+
+    /*
+     * The buffers are written in the usual order.  The vmdesc can't be
+     * built from several threads at once, so it only names the sections.
+     */
+    for (i = 0; i < p->jobs->len; i++) {
+        job = g_ptr_array_index(p->jobs, i);
+        se = job->se;
+        ret = savevm_parallel_wait(p, job);
+        if (ret) {
+            break;
+        }
+        if (job->bioc->usage > MAX_VM_SECTION_PARALLEL_SIZE) {
+            error_report("%s: Unreasonably large state for '%s': %zu",
+                         __func__, se->idstr, job->bioc->usage);
+            ret = -EINVAL;
+            break;
+        }
+
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
+        json_end_object(vmdesc);
 
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        ret = vmstate_save(f, se, vmdesc);
+        if (se_parallel(se)) {
+            save_section_header(f, se, QEMU_VM_SECTION_PARALLEL);
+            qemu_put_be32(f, job->bioc->usage);
+        } else {
+            save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        }
+        qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+        trace_savevm_section_end(se->idstr, se->section_id, 0);
+        save_section_footer(f, se);
+    }
+
+    savevm_parallel_free(p);
+    return ret;
+}
+
+int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                    bool in_postcopy,
+                                                    bool inactivate_disks)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int ret;
+
+    vmdesc = qjson_new();
+    json_prop_int(vmdesc, "page_size", qemu_target_page_size());
+    json_start_array(vmdesc, "devices");
+    if (migrate_parallel_vmstate()) {
+        ret = qemu_savevm_state_save_parallel(f, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
             return ret;
         }
-        trace_savevm_section_end(se->idstr, se->section_id, 0);
-        save_section_footer(f, se);
+    } else {
+        QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
-        json_end_object(vmdesc);
+            if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+                continue;
+            }
+            if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
+                trace_savevm_section_skip(se->idstr, se->section_id);
+                continue;
+            }
+
+            trace_savevm_section_start(se->idstr, se->section_id);
+
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+
+            save_section_header(f, se, QEMU_VM_SECTION_FULL);
+            ret = vmstate_save(f, se, vmdesc);
+            if (ret) {
+                qemu_file_set_error(f, ret);
+                return ret;
+            }
+            trace_savevm_section_end(se->idstr, se->section_id, 0);
+            save_section_footer(f, se);
+
+            json_end_object(vmdesc);
+        }
     }
 
     if (inactivate_disks) {
@@ -1275,6 +1642,34 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     }
     qjson_destroy(vmdesc);
 
+    return 0;
+}
+
+int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
+                                       bool inactivate_disks)
+{
+    int ret;
+    bool in_postcopy = migration_in_postcopy();
+
+    trace_savevm_state_complete_precopy();
+
+    cpu_synchronize_all_states();
+
+    if (!in_postcopy || iterable_only) {
+        ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!iterable_only) {
+        ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
+                                                              inactivate_disks);
+        if (ret) {
+            return ret;
+        }
+    }
+
     qemu_fflush(f);
     return 0;
 }
@@ -1389,6 +1784,29 @@ void qemu_savevm_live_state(QEMUFile *f)
     qemu_put_byte(f, QEMU_VM_EOF);
 }
 
+/*
+ * COLO: send what has been dirtied since the last checkpoint while the VM
+ * is still running, as QEMU_VM_SECTION_PART sections, so that less is left
+ * for qemu_savevm_live_state() at the checkpoint.  Stops early when the
+ * rate limit is hit; whatever is left goes with the checkpoint.
+ */
+void qemu_savevm_live_state_update(QEMUFile *f)
+{
+    uint64_t pend_pre = 0, pend_compat = 0, pend_post = 0;
+
+    /* Each update may send up to the rate limit */
+    qemu_file_reset_rate_limit(f);
+    /* A threshold this large makes RAM sync its dirty bitmap */
+    qemu_savevm_state_pending(f, UINT64_MAX, &pend_pre, &pend_compat,
+                              &pend_post);
+    trace_qemu_savevm_live_state_update(pend_pre + pend_compat + pend_post);
+    while (!qemu_file_rate_limit(f) &&
+           qemu_savevm_state_iterate(f, false) == 0) {
+        /* keep going until the iterable handlers have sent everything */
+    }
+    qemu_put_byte(f, QEMU_VM_EOF);
+}
+
 int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1752,6 +2170,11 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
     qemu_sem_wait(&mis->listen_thread_sem);
     qemu_sem_destroy(&mis->listen_thread_sem);
 
+    /* Urgent pages may now arrive on the preempt channel too */
+    postcopy_preempt_incoming_start(mis);
+    /* ...and background pages on the multifd channels */
+    multifd_recv_postcopy_listen();
+
     return 0;
 }
 
@@ -2076,8 +2499,11 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the header of a QEMU_VM_SECTION_START/FULL/PARALLEL section and look
+ * up the section it describes.
+ */
+static int qemu_loadvm_section_header(QEMUFile *f, SaveStateEntry **sep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2128,10 +2554,25 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    *sep = se;
+    return 0;
+}
+
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
         return ret;
     }
     if (!check_section_footer(f, se)) {
@@ -2141,6 +2582,68 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Read a QEMU_VM_SECTION_PARALLEL section into a buffer and queue it to be
+ * loaded by a worker thread; the pool is created on first use.  Sections
+ * that this side doesn't consider safe to load in parallel are loaded here
+ * once everything before them has been.
+ */
+static int
+qemu_loadvm_section_parallel(QEMUFile *f, SaveVMParallel **pp)
+{
+    SaveVMParallelJob *job;
+    QIOChannelBuffer *bioc;
+    SaveStateEntry *se;
+    uint32_t length;
+    int ret;
+
+    ret = qemu_loadvm_section_header(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
+    length = qemu_get_be32(f);
+    trace_qemu_loadvm_state_section_parallel(se->idstr, length);
+    if (length > MAX_VM_SECTION_PARALLEL_SIZE) {
+        error_report("Unreasonably large state for '%s': %u",
+                     se->idstr, length);
+        return -EINVAL;
+    }
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-loadvm-parallel");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("%s: Buffer receive fail ret=%d length=%u",
+                     se->idstr, ret, length);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+    bioc->usage += length;
+
+    if (!check_section_footer(f, se)) {
+        object_unref(OBJECT(bioc));
+        return -EINVAL;
+    }
+
+    if (!*pp) {
+        *pp = savevm_parallel_new();
+    }
+    if (se_parallel(se)) {
+        savevm_parallel_add(*pp, se, bioc, true, true);
+        return 0;
+    }
+
+    ret = savevm_parallel_wait_all(*pp);
+    if (ret < 0) {
+        object_unref(OBJECT(bioc));
+        return ret;
+    }
+    job = savevm_parallel_add(*pp, se, bioc, true, false);
+    savevm_parallel_run_inline(*pp, job);
+    return job->ret;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
@@ -2259,6 +2762,7 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    SaveVMParallel *parallel = NULL;
     uint8_t section_type;
     int ret = 0;
 
@@ -2272,6 +2776,13 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        /* Anything but another parallel section waits for those in flight */
+        if (parallel && section_type != QEMU_VM_SECTION_PARALLEL) {
+            ret = savevm_parallel_wait_all(parallel);
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
@@ -2287,6 +2798,12 @@ retry:
                 goto out;
             }
             break;
+        case QEMU_VM_SECTION_PARALLEL:
+            ret = qemu_loadvm_section_parallel(f, &parallel);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
         case QEMU_VM_COMMAND:
             ret = loadvm_process_command(f);
             trace_qemu_loadvm_state_section_command(ret);
@@ -2305,6 +2822,14 @@ retry:
     }
 
 out:
+    if (parallel) {
+        int parallel_ret = savevm_parallel_free(parallel);
+
+        parallel = NULL;
+        if (ret >= 0 && parallel_ret < 0) {
+            ret = parallel_ret;
+        }
+    }
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
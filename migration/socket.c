@@ -39,6 +39,12 @@ void socket_send_channel_create(QIOTaskFunc f, void *data)
                                      f, data, NULL, NULL);
 }
 
+/* Whether extra channels can be opened to the current migration target */
+bool socket_send_channel_available(void)
+{
+    return outgoing_args.saddr != NULL;
+}
+
 int socket_send_channel_destroy(QIOChannel *send)
 {
     /* Remove channel */
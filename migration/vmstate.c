@@ -18,6 +18,7 @@
 #include "qemu-file.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "trace.h"
 #include "qjson.h"
 
@@ -76,10 +77,252 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
+/*
+ * Save/load plans
+ *
+ * Interpreting a VMStateField array costs an indirect call per element,
+ * which adds up for devices with large arrays of plain integers.  The
+ * first time a field array is used it is compiled into a plan: runs of
+ * consecutive integer or buffer fields that are laid out back to back in
+ * the device state and have the same width are merged into a single step
+ * that is copied with one qemu_put_buffer()/qemu_get_buffer(), byte-swapped
+ * to big endian in bulk.  Everything else is a one-field step that is left
+ * to the interpreter.  The stream format is unchanged.
+ */
+typedef struct VMStatePlanStep {
+    const VMStateField *field;
+    int nfields;
+    /* Only set for bulk steps */
+    bool bulk;
+    int version_id;             /* highest version_id of the fields */
+    size_t offset;
+    size_t width;               /* 1, 2, 4 or 8 bytes */
+    size_t len;                 /* in bytes */
+} VMStatePlanStep;
+
+typedef struct VMStatePlan {
+    int nsteps;
+    VMStatePlanStep steps[];
+} VMStatePlan;
+
+static QemuMutex vmstate_plan_lock;
+static GHashTable *vmstate_plans;
+
+static void __attribute__((constructor)) vmstate_plan_init(void)
+{
+    qemu_mutex_init(&vmstate_plan_lock);
+    vmstate_plans = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+/* Width of a field that can be copied in bulk, or 0 */
+static size_t vmstate_bulk_width(const VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+
+    if (field->field_exists ||
+        (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER |
+                          VMS_MUST_EXIST))) {
+        return 0;
+    }
+    if (info == &vmstate_info_buffer) {
+        return 1;
+    }
+    if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        return field->size == 1 ? 1 : 0;
+    }
+    if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        return field->size == 2 ? 2 : 0;
+    }
+    if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        return field->size == 4 ? 4 : 0;
+    }
+    if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        return field->size == 8 ? 8 : 0;
+    }
+    return 0;
+}
+
+static VMStatePlan *vmstate_plan_build(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    VMStatePlan *plan;
+    VMStatePlanStep *step = NULL;
+    int nfields = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        nfields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + nfields * sizeof(VMStatePlanStep));
+
+    for (field = vmsd->fields; field->name; field++) {
+        size_t width = vmstate_bulk_width(field);
+        size_t len = field->size *
+                     (field->flags & VMS_ARRAY ? field->num : 1);
+
+        if (width && step && step->bulk && step->width == width &&
+            step->offset + step->len == field->offset) {
+            step->nfields++;
+            step->len += len;
+            step->version_id = MAX(step->version_id, field->version_id);
+            continue;
+        }
+
+        step = &plan->steps[plan->nsteps++];
+        step->field = field;
+        step->nfields = 1;
+        if (width) {
+            step->bulk = true;
+            step->version_id = field->version_id;
+            step->offset = field->offset;
+            step->width = width;
+            step->len = len;
+        }
+    }
+
+    trace_vmstate_plan_build(vmsd->name, nfields, plan->nsteps);
+    return plan;
+}
+
+static const VMStatePlan *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    /*
+     * Plans only depend on the field array, which is static even for the
+     * few descriptions that are allocated at runtime.
+     */
+    qemu_mutex_lock(&vmstate_plan_lock);
+    plan = g_hash_table_lookup(vmstate_plans, vmsd->fields);
+    if (!plan) {
+        plan = vmstate_plan_build(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd->fields, plan);
+    }
+    qemu_mutex_unlock(&vmstate_plan_lock);
+
+    return plan;
+}
+
+static void vmstate_bswap_be(void *buf, size_t len, size_t width)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    size_t i;
+
+    switch (width) {
+    case 2:
+        for (i = 0; i < len; i += 2) {
+            bswap16s(buf + i);
+        }
+        break;
+    case 4:
+        for (i = 0; i < len; i += 4) {
+            bswap32s(buf + i);
+        }
+        break;
+    case 8:
+        for (i = 0; i < len; i += 8) {
+            bswap64s(buf + i);
+        }
+        break;
+    }
+#endif
+}
+
+static void vmstate_save_bulk(QEMUFile *f, const VMStatePlanStep *step,
+                              void *opaque)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    uint64_t buf[64];
+    size_t done, chunk;
+
+    if (step->width > 1) {
+        for (done = 0; done < step->len; done += chunk) {
+            chunk = MIN(step->len - done, sizeof(buf));
+            memcpy(buf, opaque + step->offset + done, chunk);
+            vmstate_bswap_be(buf, chunk, step->width);
+            qemu_put_buffer(f, (uint8_t *)buf, chunk);
+        }
+        return;
+    }
+#endif
+    qemu_put_buffer(f, opaque + step->offset, step->len);
+}
+
+static int vmstate_load_bulk(QEMUFile *f, const VMStatePlanStep *step,
+                             void *opaque)
+{
+    void *p = opaque + step->offset;
+
+    if (qemu_get_buffer(f, p, step->len) != step->len) {
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    vmstate_bswap_be(p, step->len, step->width);
+    return 0;
+}
+
+static int vmstate_load_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              const VMStateField *field, void *opaque,
+                              int version_id)
+{
+    int ret = 0;
+
+    trace_vmstate_load_state_field(vmsd->name, field->name);
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        vmstate_handle_alloc(first_elem, field, opaque);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            assert(first_elem || !n_elems || !size);
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                curr_elem = *(void **)curr_elem;
+            }
+            if (!curr_elem && size) {
+                /* if null pointer check placeholder and do not follow */
+                assert(field->flags & VMS_ARRAY_OF_POINTER);
+                ret = vmstate_info_nullptr.get(f, curr_elem, size, NULL);
+            } else if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, curr_elem,
+                                         field->vmsd->version_id);
+            } else if (field->flags & VMS_VSTRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, curr_elem,
+                                         field->struct_version_id);
+            } else {
+                ret = field->info->get(f, curr_elem, size, field);
+            }
+            if (ret >= 0) {
+                ret = qemu_file_get_error(f);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                error_report("Failed to load %s:%s", vmsd->name,
+                             field->name);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+        }
+    } else if (field->flags & VMS_MUST_EXIST) {
+        error_report("Input validation failed: %s/%s",
+                     vmsd->name, field->name);
+        return -1;
+    }
+    return 0;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
-    const VMStateField *field = vmsd->fields;
+    const VMStateField *field;
+    const VMStatePlan *plan;
+    const VMStatePlanStep *step;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -109,57 +352,27 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
-    while (field->name) {
-        trace_vmstate_load_state_field(vmsd->name, field->name);
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *first_elem = opaque + field->offset;
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            vmstate_handle_alloc(first_elem, field, opaque);
-            if (field->flags & VMS_POINTER) {
-                first_elem = *(void **)first_elem;
-                assert(first_elem || !n_elems || !size);
+    plan = vmstate_get_plan(vmsd);
+    for (step = plan->steps; step < plan->steps + plan->nsteps; step++) {
+        if (step->bulk && step->version_id <= version_id) {
+            trace_vmstate_load_state_field(vmsd->name, step->field->name);
+            ret = vmstate_load_bulk(f, step, opaque);
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                error_report("Failed to load %s:%s", vmsd->name,
+                             step->field->name);
+                trace_vmstate_load_field_error(step->field->name, ret);
+                return ret;
             }
-            for (i = 0; i < n_elems; i++) {
-                void *curr_elem = first_elem + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    curr_elem = *(void **)curr_elem;
-                }
-                if (!curr_elem && size) {
-                    /* if null pointer check placeholder and do not follow */
-                    assert(field->flags & VMS_ARRAY_OF_POINTER);
-                    ret = vmstate_info_nullptr.get(f, curr_elem, size, NULL);
-                } else if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, curr_elem,
-                                             field->vmsd->version_id);
-                } else if (field->flags & VMS_VSTRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, curr_elem,
-                                             field->struct_version_id);
-                } else {
-                    ret = field->info->get(f, curr_elem, size, field);
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
-                if (ret < 0) {
-                    qemu_file_set_error(f, ret);
-                    error_report("Failed to load %s:%s", vmsd->name,
-                                 field->name);
-                    trace_vmstate_load_field_error(field->name, ret);
-                    return ret;
-                }
+            continue;
+        }
+        for (field = step->field; field < step->field + step->nfields;
+             field++) {
+            ret = vmstate_load_field(f, vmsd, field, opaque, version_id);
+            if (ret < 0) {
+                return ret;
             }
-        } else if (field->flags & VMS_MUST_EXIST) {
-            error_report("Input validation failed: %s/%s",
-                         vmsd->name, field->name);
-            return -1;
         }
-        field++;
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -316,6 +529,59 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 }
 
 
+/*
+ * Estimate how many bytes vmstate_save_state() would write for @opaque,
+ * without running any pre_save hook or put function.  Fields whose put
+ * function writes more than their size (e.g. queues) are undercounted,
+ * and so is the framing of subsections.
+ */
+uint64_t vmstate_estimate_size(const VMStateDescription *vmsd, void *opaque)
+{
+    const VMStateDescription **sub;
+    const VMStateField *field;
+    uint64_t total = 0;
+
+    for (field = vmsd->fields; field && field->name; field++) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems, size;
+
+        if (field->field_exists ?
+            !field->field_exists(opaque, vmsd->version_id) :
+            field->version_id > vmsd->version_id) {
+            continue;
+        }
+
+        n_elems = vmstate_n_elems(opaque, field);
+        size = vmstate_size(opaque, field);
+        if (!(field->flags & (VMS_STRUCT | VMS_VSTRUCT))) {
+            total += (uint64_t)n_elems * size;
+            continue;
+        }
+
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+        }
+        for (i = 0; first_elem && i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                curr_elem = *(void **)curr_elem;
+            }
+            if (curr_elem) {
+                total += vmstate_estimate_size(field->vmsd, curr_elem);
+            }
+        }
+    }
+
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        if (vmstate_save_needed(*sub, opaque)) {
+            total += vmstate_estimate_size(*sub, opaque);
+        }
+    }
+
+    return total;
+}
+
 int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, QJSON *vmdesc_id)
 {
@@ -323,11 +589,84 @@ int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
     return vmstate_save_state_v(f, vmsd, opaque, vmdesc_id, vmsd->version_id);
 }
 
+static int vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              const VMStateField *field, void *opaque,
+                              QJSON *vmdesc, int version_id)
+{
+    int ret = 0;
+
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *first_elem = opaque + field->offset;
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+        int64_t old_offset, written_bytes;
+        QJSON *vmdesc_loop = vmdesc;
+
+        trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
+        if (field->flags & VMS_POINTER) {
+            first_elem = *(void **)first_elem;
+            assert(first_elem || !n_elems || !size);
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *curr_elem = first_elem + size * i;
+            ret = 0;
+
+            vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+            old_offset = qemu_ftell_fast(f);
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                assert(curr_elem);
+                curr_elem = *(void **)curr_elem;
+            }
+            if (!curr_elem && size) {
+                /* if null pointer write placeholder and do not follow */
+                assert(field->flags & VMS_ARRAY_OF_POINTER);
+                ret = vmstate_info_nullptr.put(f, curr_elem, size, NULL,
+                                               NULL);
+            } else if (field->flags & VMS_STRUCT) {
+                ret = vmstate_save_state(f, field->vmsd, curr_elem,
+                                         vmdesc_loop);
+            } else if (field->flags & VMS_VSTRUCT) {
+                ret = vmstate_save_state_v(f, field->vmsd, curr_elem,
+                                           vmdesc_loop,
+                                           field->struct_version_id);
+            } else {
+                ret = field->info->put(f, curr_elem, size, field,
+                                 vmdesc_loop);
+            }
+            if (ret) {
+                error_report("Save of field %s/%s failed",
+                             vmsd->name, field->name);
+                return ret;
+            }
+
+            written_bytes = qemu_ftell_fast(f) - old_offset;
+            vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
+
+            /* Compressed arrays only care about the first element */
+            if (vmdesc_loop && vmsd_can_compress(field)) {
+                vmdesc_loop = NULL;
+            }
+        }
+    } else {
+        if (field->flags & VMS_MUST_EXIST) {
+            error_report("Output state validation failed: %s/%s",
+                    vmsd->name, field->name);
+            assert(!(field->flags & VMS_MUST_EXIST));
+        }
+    }
+    return 0;
+}
+
 int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                          void *opaque, QJSON *vmdesc, int version_id)
 {
     int ret = 0;
-    const VMStateField *field = vmsd->fields;
+    const VMStateField *field;
+    const VMStatePlan *plan;
+    const VMStatePlanStep *step;
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -346,70 +685,29 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
         json_start_array(vmdesc, "fields");
     }
 
-    while (field->name) {
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *first_elem = opaque + field->offset;
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-            int64_t old_offset, written_bytes;
-            QJSON *vmdesc_loop = vmdesc;
-
-            trace_vmstate_save_state_loop(vmsd->name, field->name, n_elems);
-            if (field->flags & VMS_POINTER) {
-                first_elem = *(void **)first_elem;
-                assert(first_elem || !n_elems || !size);
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *curr_elem = first_elem + size * i;
-                ret = 0;
-
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
-                old_offset = qemu_ftell_fast(f);
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    assert(curr_elem);
-                    curr_elem = *(void **)curr_elem;
-                }
-                if (!curr_elem && size) {
-                    /* if null pointer write placeholder and do not follow */
-                    assert(field->flags & VMS_ARRAY_OF_POINTER);
-                    ret = vmstate_info_nullptr.put(f, curr_elem, size, NULL,
-                                                   NULL);
-                } else if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_save_state(f, field->vmsd, curr_elem,
-                                             vmdesc_loop);
-                } else if (field->flags & VMS_VSTRUCT) {
-                    ret = vmstate_save_state_v(f, field->vmsd, curr_elem,
-                                               vmdesc_loop,
-                                               field->struct_version_id);
-                } else {
-                    ret = field->info->put(f, curr_elem, size, field,
-                                     vmdesc_loop);
-                }
-                if (ret) {
-                    error_report("Save of field %s/%s failed",
-                                 vmsd->name, field->name);
-                    return ret;
-                }
-
-                written_bytes = qemu_ftell_fast(f) - old_offset;
-                vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
-
-                /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
-                    vmdesc_loop = NULL;
-                }
+    plan = vmstate_get_plan(vmsd);
+    for (step = plan->steps; step < plan->steps + plan->nsteps; step++) {
+        if (step->bulk && step->version_id <= version_id) {
+            trace_vmstate_save_state_loop(vmsd->name, step->field->name,
+                                          step->len / step->width);
+            for (field = step->field;
+                 vmdesc && field < step->field + step->nfields; field++) {
+                int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, field->size, 0);
             }
-        } else {
-            if (field->flags & VMS_MUST_EXIST) {
-                error_report("Output state validation failed: %s/%s",
-                        vmsd->name, field->name);
-                assert(!(field->flags & VMS_MUST_EXIST));
+            vmstate_save_bulk(f, step, opaque);
+            continue;
+        }
+        for (field = step->field; field < step->field + step->nfields;
+             field++) {
+            ret = vmstate_save_field(f, vmsd, field, opaque, vmdesc,
+                                     version_id);
+            if (ret) {
+                return ret;
             }
         }
-        field++;
     }
 
     if (vmdesc) {
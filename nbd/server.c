@@ -22,6 +22,11 @@
 #include "trace.h"
 #include "nbd-internal.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#include "block/thread-pool.h"
+#endif
+
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_DIRTY_BITMAP 1
 
@@ -1494,6 +1499,9 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
     QTAILQ_INIT(&exp->clients);
     exp->blk = blk;
     exp->dev_offset = dev_offset;
+    /* All clients of an export share exp->blk, so a flush received on any
+     * connection covers the writes completed on every other connection;
+     * this is what makes NBD_FLAG_CAN_MULTI_CONN safe to advertise. */
     exp->nbdflags = nbdflags;
     exp->size = size < 0 ? blk_getlength(blk) : size;
     if (exp->size < 0) {
@@ -1742,6 +1750,204 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+#ifdef CONFIG_SENDFILE
+/* Return the socket that the kernel can write read data to, or -1 */
+static int nbd_client_sendfile_socket(NBDClient *client)
+{
+    if (client->ioc == QIO_CHANNEL(client->sioc)) {
+        return client->sioc->fd;
+    }
+
+    /* With kernel TLS, data written to the socket is encrypted for us */
+    if (object_dynamic_cast(OBJECT(client->ioc), TYPE_QIO_CHANNEL_TLS) &&
+        (QIO_CHANNEL_TLS(client->ioc)->ktls & QCRYPTO_TLS_KTLS_TX)) {
+        return client->sioc->fd;
+    }
+
+    return -1;
+}
+
+typedef struct NBDSendfileData {
+    NBDClient *client;
+    struct iovec *hdr;
+    int sockfd;
+    size_t size;
+    bool sent_hdr;
+    Error **errp;
+} NBDSendfileData;
+
+typedef struct NBDSendfileWork {
+    int sockfd;
+    int fd;
+    off_t offset;
+    size_t size;
+} NBDSendfileWork;
+
+/* Runs in a worker thread, because sendfile() blocks on reading the file */
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileWork *work = opaque;
+    ssize_t len;
+
+    do {
+        len = sendfile(work->sockfd, work->fd, &work->offset, work->size);
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -errno : len;
+}
+
+static int coroutine_fn nbd_co_sendfile_fd(int fd, int64_t host_offset,
+                                           void *opaque)
+{
+    NBDSendfileData *data = opaque;
+    NBDClient *client = data->client;
+    AioContext *ctx = blk_get_aio_context(client->exp->blk);
+    ThreadPool *pool = aio_get_thread_pool(ctx);
+    NBDSendfileWork work = {
+        .sockfd = data->sockfd,
+        .fd     = fd,
+        .offset = host_offset,
+    };
+    size_t size = data->size;
+    struct stat st;
+    int ret = 0;
+
+    /* The block layer reads zeroes past the end of a file, sendfile() stops */
+    if (fstat(fd, &st) < 0 ||
+        (S_ISREG(st.st_mode) && host_offset + size > st.st_size)) {
+        return -ENOTSUP;
+    }
+
+    trace_nbd_co_sendfile(fd, host_offset, size);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    qio_channel_set_cork(client->ioc, true);
+
+    data->sent_hdr = true;
+    if (qio_channel_writev_all(client->ioc, data->hdr, 1, data->errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    while (size) {
+        int len;
+
+        work.size = MIN(size, NBD_MAX_BUFFER_SIZE);
+        len = thread_pool_submit_co(pool, nbd_sendfile_worker, &work);
+        if (len == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            error_setg_errno(data->errp, -len, "sending read data failed");
+            ret = -EIO;
+            goto out;
+        }
+
+        if (len == 0) {
+            /* The file was truncated under our feet; pad with zeroes */
+            void *zeroes = g_malloc0(work.size);
+
+            len = work.size;
+            ret = qio_channel_write_all(client->ioc, zeroes, len, data->errp);
+            g_free(zeroes);
+            if (ret < 0) {
+                ret = -EIO;
+                goto out;
+            }
+        }
+        size -= len;
+    }
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret;
+}
+
+/*
+ * Send the reply header in @hdr followed by @size bytes of the export at
+ * @offset, letting the kernel copy them from the image file to the socket
+ * in a worker thread.  The read is throttled and tracked by the block layer
+ * like the one that blk_pread() would do.
+ *
+ * Returns -ENOTSUP without sending anything if the export or the connection
+ * do not allow it, e.g. because of TLS in user space, O_DIRECT, filters, a
+ * format driver or a read past the end of the file; the caller then goes
+ * through a bounce buffer.  Once the header is sent, errors cannot be
+ * reported to the client any more and terminate the connection like any
+ * other send error.
+ */
+static int coroutine_fn nbd_co_sendfile(NBDClient *client, struct iovec *hdr,
+                                        uint64_t offset, size_t size,
+                                        Error **errp)
+{
+    NBDExport *exp = client->exp;
+    NBDSendfileData data = {
+        .client = client,
+        .hdr    = hdr,
+        .size   = size,
+        .errp   = errp,
+    };
+    int ret;
+
+    data.sockfd = nbd_client_sendfile_socket(client);
+    if (data.sockfd < 0) {
+        return -ENOTSUP;
+    }
+
+    ret = blk_co_read_host_fd(exp->blk, offset + exp->dev_offset, size,
+                              nbd_co_sendfile_fd, &data);
+    if (ret < 0 && !data.sent_hdr) {
+        return -ENOTSUP;
+    }
+    return ret;
+}
+#else
+static int coroutine_fn nbd_co_sendfile(NBDClient *client, struct iovec *hdr,
+                                        uint64_t offset, size_t size,
+                                        Error **errp)
+{
+    return -ENOTSUP;
+}
+#endif
+
+/*
+ * Send a successful reply to NBD_CMD_READ, or a data chunk of it, straight
+ * from the image file if possible.  Returns -ENOTSUP if the caller has to
+ * read the data into a buffer and send it with nbd_co_send_simple_reply()
+ * or nbd_co_send_structured_read() instead.
+ */
+static int coroutine_fn nbd_co_send_read_zero_copy(NBDClient *client,
+                                                   uint64_t handle,
+                                                   uint64_t offset,
+                                                   size_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    NBDSimpleReply reply;
+    NBDStructuredReadData chunk;
+    struct iovec hdr;
+
+    assert(size);
+    if (client->structured_reply) {
+        set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                     sizeof(chunk) - sizeof(chunk.h) + size);
+        stq_be_p(&chunk.offset, offset);
+        hdr.iov_base = &chunk;
+        hdr.iov_len = sizeof(chunk);
+    } else {
+        set_be_simple_reply(&reply, 0, handle);
+        hdr.iov_base = &reply;
+        hdr.iov_len = sizeof(reply);
+    }
+
+    return nbd_co_sendfile(client, &hdr, offset, size, errp);
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1815,15 +2021,20 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
         } else {
-            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_read_zero_copy(client, handle, offset + progress,
+                                             pnum, final, errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, handle,
+                                                  offset + progress,
+                                                  data + progress, pnum,
+                                                  final, errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -2173,6 +2384,15 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len && request->type != NBD_CMD_CACHE) {
+        ret = nbd_co_send_read_zero_copy(client, request->handle,
+                                         request->from, request->len, true,
+                                         errp);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->blk, request->from + exp->dev_offset, data,
                     request->len);
     if (ret < 0 || request->type == NBD_CMD_CACHE) {
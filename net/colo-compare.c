@@ -20,6 +20,7 @@
 #include "net/net.h"
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
+#include "qapi/visitor.h"
 #include "qemu/iov.h"
 #include "qom/object.h"
 #include "net/queue.h"
@@ -43,6 +44,7 @@ static NotifierList colo_compare_notifiers =
 
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
+#define COMPARE_MAX_THREADS 64
 
 #define COLO_COMPARE_FREE_PRIMARY     0x01
 #define COLO_COMPARE_FREE_SECONDARY   0x02
@@ -55,7 +57,12 @@ static QemuCond event_complete_cond;
 static int event_unhandled_count;
 
 /*
- *  + CompareState ++
+ * Connections are spread over one or more shards by the hash of their
+ * key.  Each shard owns its connections, so with compare_threads set the
+ * shards compare packets in parallel, each on its own thread; otherwise
+ * the single shard runs in the iothread.
+ *
+ *  + CompareShard ++
  *  |               |
  *  +---------------+   +---------------+         +---------------+
  *  |   conn list   + - >      conn     + ------- >      conn     + -- > ......
@@ -76,7 +83,35 @@ static int event_unhandled_count;
  *                    |packet  |  |packet  +    |packet  | |packet  +
  *                    +--------+  +--------+    +--------+ +--------+
  */
-typedef struct CompareState {
+typedef struct CompareState CompareState;
+
+typedef struct CompareShard {
+    CompareState *s;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /* Only used when the shard has its own thread */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    /* Element type: CompareJob, protected by lock */
+    GQueue jobs;
+    bool threaded;
+    bool quit;
+} CompareShard;
+
+typedef struct CompareJob {
+    int type;
+    Packet *pkt;
+} CompareJob;
+
+struct CompareState {
     Object parent;
 
     char *pri_indev;
@@ -88,14 +123,12 @@ typedef struct CompareState {
     SocketReadState pri_rs;
     SocketReadState sec_rs;
     bool vnet_hdr;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
+    uint32_t nr_shards;
+    /* Keeps the length-prefixed records written to outdev whole */
+    QemuMutex out_lock;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -105,7 +138,7 @@ typedef struct CompareState {
     enum colo_event event;
 
     QTAILQ_ENTRY(CompareState) next;
-} CompareState;
+};
 
 typedef struct CompareClass {
     ObjectClass parent_class;
@@ -114,6 +147,10 @@ typedef struct CompareClass {
 enum {
     PRIMARY_IN = 0,
     SECONDARY_IN,
+    /* look for packets that the secondary hasn't matched */
+    COMPARE_JOB_CHECK,
+    /* handle s->event */
+    COMPARE_JOB_EVENT,
 };
 
 static void colo_compare_inconsistency_notify(void)
@@ -127,15 +164,6 @@ static int compare_chr_send(CompareState *s,
                             uint32_t size,
                             uint32_t vnet_hdr_len);
 
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
-{
-    struct tcphdr *atcp, *btcp;
-
-    atcp = (struct tcphdr *)(a->transport_header);
-    btcp = (struct tcphdr *)(b->transport_header);
-    return ntohl(atcp->th_seq) - ntohl(btcp->th_seq);
-}
-
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
 {
     Packet *pkt = data;
@@ -157,17 +185,14 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
  * Return 1 on success, if return 0 means the
  * packet will be dropped
  */
-static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
+static int colo_insert_packet(PacketRing *ring, Packet *pkt, uint32_t *max_ack)
 {
-    if (g_queue_get_length(queue) <= MAX_QUEUE_SIZE) {
+    if (packet_ring_length(ring) <= MAX_QUEUE_SIZE) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            packet_ring_insert_seq(ring, pkt);
         } else {
-            g_queue_push_tail(queue, pkt);
+            packet_ring_push_tail(ring, pkt);
         }
         return 1;
     }
@@ -175,38 +200,22 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 }
 
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Called from the thread of the shard that owns the connection
+ * of @pkt, which was parsed by compare_dispatch_packet().
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static Connection *packet_enqueue(CompareShard *shard, int mode, Packet *pkt)
 {
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
-    }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
@@ -221,9 +230,8 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
                          "drop packet");
         }
     }
-    *con = conn;
 
-    return 0;
+    return conn;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -272,6 +280,18 @@ static int colo_compare_packet_payload(Packet *ppkt,
                                    sec_ip_src, sec_ip_dst);
     }
 
+    /*
+     * When both packets are compared up to their end, tell most
+     * mismatches apart by their cached checksums without reading the
+     * data again; this matters when a primary packet is tried against
+     * every queued secondary packet.
+     */
+    if (poffset + len == ppkt->size && soffset + len == spkt->size &&
+        packet_csum(ppkt, poffset) != packet_csum(spkt, soffset)) {
+        trace_colo_compare_csum_miscompare(ppkt->size, spkt->size);
+        return -1;
+    }
+
     return memcmp(ppkt->data + poffset, spkt->data + soffset, len);
 }
 
@@ -355,16 +375,16 @@ static void colo_compare_tcp(CompareState *s, Connection *conn)
     uint32_t min_ack = conn->pack > conn->sack ? conn->sack : conn->pack;
 
 pri:
-    if (g_queue_is_empty(&conn->primary_list)) {
+    if (packet_ring_is_empty(&conn->primary_list)) {
         return;
     }
-    ppkt = g_queue_pop_head(&conn->primary_list);
+    ppkt = packet_ring_pop_head(&conn->primary_list);
 sec:
-    if (g_queue_is_empty(&conn->secondary_list)) {
-        g_queue_push_head(&conn->primary_list, ppkt);
+    if (packet_ring_is_empty(&conn->secondary_list)) {
+        packet_ring_push_head(&conn->primary_list, ppkt);
         return;
     }
-    spkt = g_queue_pop_head(&conn->secondary_list);
+    spkt = packet_ring_pop_head(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
         colo_release_primary_pkt(s, ppkt);
@@ -395,7 +415,7 @@ sec:
             }
         }
         if (!ppkt) {
-            g_queue_push_head(&conn->secondary_list, spkt);
+            packet_ring_push_head(&conn->secondary_list, spkt);
             goto pri;
         }
     }
@@ -414,7 +434,7 @@ sec:
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
             colo_release_primary_pkt(s, ppkt);
-            g_queue_push_head(&conn->secondary_list, spkt);
+            packet_ring_push_head(&conn->secondary_list, spkt);
             goto pri;
         }
         if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -429,8 +449,8 @@ sec:
             goto pri;
         }
     } else {
-        g_queue_push_head(&conn->primary_list, ppkt);
-        g_queue_push_head(&conn->secondary_list, spkt);
+        packet_ring_push_head(&conn->primary_list, ppkt);
+        packet_ring_push_head(&conn->secondary_list, spkt);
 
         qemu_hexdump((char *)ppkt->data, stderr,
                      "colo-compare ppkt", ppkt->size);
@@ -556,11 +576,10 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
                                        ppkt->size - offset);
 }
 
-static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
+static int colo_old_packet_check_one(Packet *pkt, int64_t now,
+                                     int64_t check_time)
 {
-    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
-
-    if ((now - pkt->creation_ms) > (*check_time)) {
+    if ((now - pkt->creation_ms) > check_time) {
         trace_colo_old_packet_check_found(pkt->creation_ms);
         return 0;
     } else {
@@ -581,17 +600,16 @@ void colo_compare_unregister_notifier(Notifier *notify)
 static int colo_old_packet_check_one_conn(Connection *conn,
                                            void *user_data)
 {
-    GList *result = NULL;
-    int64_t check_time = REGULAR_PACKET_CHECK_MS;
-
-    result = g_queue_find_custom(&conn->primary_list,
-                                 &check_time,
-                                 (GCompareFunc)colo_old_packet_check_one);
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    uint32_t i;
 
-    if (result) {
-        /* Do checkpoint will flush old packet */
-        colo_compare_inconsistency_notify();
-        return 0;
+    for (i = 0; i < packet_ring_length(&conn->primary_list); i++) {
+        if (!colo_old_packet_check_one(packet_ring_peek(&conn->primary_list, i),
+                                       now, REGULAR_PACKET_CHECK_MS)) {
+            /* Do checkpoint will flush old packet */
+            colo_compare_inconsistency_notify();
+            return 0;
+        }
     }
 
     return 1;
@@ -602,15 +620,13 @@ static int colo_old_packet_check_one_conn(Connection *conn,
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareShard *shard)
 {
-    CompareState *s = opaque;
-
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, NULL,
+    g_queue_find_custom(&shard->conn_list, NULL,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
@@ -619,17 +635,22 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                                 Packet *ppkt))
 {
     Packet *pkt = NULL;
-    GList *result = NULL;
-
-    while (!g_queue_is_empty(&conn->primary_list) &&
-           !g_queue_is_empty(&conn->secondary_list)) {
-        pkt = g_queue_pop_head(&conn->primary_list);
-        result = g_queue_find_custom(&conn->secondary_list,
-                 pkt, (GCompareFunc)HandlePacket);
+    uint32_t i, n;
+
+    while (!packet_ring_is_empty(&conn->primary_list) &&
+           !packet_ring_is_empty(&conn->secondary_list)) {
+        pkt = packet_ring_pop_head(&conn->primary_list);
+        n = packet_ring_length(&conn->secondary_list);
+        for (i = 0; i < n; i++) {
+            if (!HandlePacket(packet_ring_peek(&conn->secondary_list, i),
+                              pkt)) {
+                break;
+            }
+        }
 
-        if (result) {
+        if (i < n) {
             colo_release_primary_pkt(s, pkt);
-            g_queue_remove(&conn->secondary_list, result->data);
+            packet_ring_remove(&conn->secondary_list, i);
         } else {
             /*
              * If one packet arrive late, the secondary_list or
@@ -638,7 +659,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
              * timeout, it will trigger a checkpoint request.
              */
             trace_colo_compare_main("packet different");
-            g_queue_push_head(&conn->primary_list, pkt);
+            packet_ring_push_head(&conn->primary_list, pkt);
             colo_compare_inconsistency_notify();
             break;
         }
@@ -651,10 +672,8 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  * specified connection when a new packet was
  * queued to it.
  */
-static void colo_compare_connection(void *opaque, void *user_data)
+static void colo_compare_connection(CompareState *s, Connection *conn)
 {
-    CompareState *s = user_data;
-    Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
@@ -684,6 +703,7 @@ static int compare_chr_send(CompareState *s,
         return 0;
     }
 
+    qemu_mutex_lock(&s->out_lock);
     ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
     if (ret != sizeof(len)) {
         goto err;
@@ -706,9 +726,11 @@ static int compare_chr_send(CompareState *s,
         goto err;
     }
 
+    qemu_mutex_unlock(&s->out_lock);
     return 0;
 
 err:
+    qemu_mutex_unlock(&s->out_lock);
     return ret < 0 ? ret : -EIO;
 }
 
@@ -751,6 +773,144 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
     }
 }
 
+static void colo_compare_shard_event(CompareShard *shard);
+
+static void compare_shard_process(CompareShard *shard, int type, Packet *pkt)
+{
+    Connection *conn;
+
+    switch (type) {
+    case PRIMARY_IN:
+    case SECONDARY_IN:
+        conn = packet_enqueue(shard, type, pkt);
+        /* compare packet in the specified connection */
+        colo_compare_connection(shard->s, conn);
+        break;
+    case COMPARE_JOB_CHECK:
+        colo_old_packet_check(shard);
+        break;
+    case COMPARE_JOB_EVENT:
+        colo_compare_shard_event(shard);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void *compare_shard_thread(void *opaque)
+{
+    CompareShard *shard = opaque;
+    CompareJob *job;
+
+    for (;;) {
+        qemu_mutex_lock(&shard->lock);
+        while (g_queue_is_empty(&shard->jobs) && !shard->quit) {
+            qemu_cond_wait(&shard->cond, &shard->lock);
+        }
+        /* Jobs queued before quit are still run, events must complete */
+        job = g_queue_pop_head(&shard->jobs);
+        qemu_mutex_unlock(&shard->lock);
+
+        if (!job) {
+            break;
+        }
+        compare_shard_process(shard, job->type, job->pkt);
+        g_slice_free(CompareJob, job);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand a job to @shard: run it right away when the shard lives in the
+ * iothread, or queue it to the shard thread.
+ */
+static void compare_shard_submit(CompareShard *shard, int type, Packet *pkt)
+{
+    CompareJob *job;
+
+    if (!shard->threaded) {
+        compare_shard_process(shard, type, pkt);
+        return;
+    }
+
+    job = g_slice_new(CompareJob);
+    job->type = type;
+    job->pkt = pkt;
+
+    qemu_mutex_lock(&shard->lock);
+    g_queue_push_tail(&shard->jobs, job);
+    qemu_cond_signal(&shard->cond);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Called from the compare iothread for each packet read from primary_in
+ * or secondary_in.  Both copies of a connection's packets hash to the same
+ * shard, so a connection is only ever compared by one thread.
+ *
+ * Return 0 on success, if return -1 means the pkt
+ * is unsupported(arp and ipv6) and will be sent later
+ */
+static int compare_dispatch_packet(CompareState *s, int mode,
+                                   SocketReadState *rs)
+{
+    ConnectionKey key;
+    Packet *pkt;
+    uint32_t index;
+
+    pkt = packet_new(rs->buf, rs->packet_len, rs->vnet_hdr_len);
+    if (parse_packet_early(pkt)) {
+        packet_destroy(pkt, NULL);
+        return -1;
+    }
+
+    fill_connection_key(pkt, &key);
+    index = connection_key_hash(&key) % s->nr_shards;
+    compare_shard_submit(&s->shards[index], mode, pkt);
+
+    return 0;
+}
+
+static void compare_shard_init(CompareState *s, CompareShard *shard,
+                               bool threaded)
+{
+    shard->s = s;
+    g_queue_init(&shard->conn_list);
+    shard->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                          connection_key_equal,
+                                                          g_free,
+                                                          connection_destroy);
+    g_queue_init(&shard->jobs);
+    shard->threaded = threaded;
+    shard->quit = false;
+
+    if (threaded) {
+        qemu_mutex_init(&shard->lock);
+        qemu_cond_init(&shard->cond);
+        qemu_thread_create(&shard->thread, "colo-compare",
+                           compare_shard_thread, shard,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void compare_shard_stop(CompareShard *shard)
+{
+    if (!shard->threaded) {
+        return;
+    }
+
+    qemu_mutex_lock(&shard->lock);
+    shard->quit = true;
+    qemu_cond_signal(&shard->cond);
+    qemu_mutex_unlock(&shard->lock);
+
+    qemu_thread_join(&shard->thread);
+    qemu_cond_destroy(&shard->cond);
+    qemu_mutex_destroy(&shard->lock);
+    shard->threaded = false;
+}
+
 /*
  * Check old packet regularly so it can watch for any packets
  * that the secondary hasn't produced equivalents of.
@@ -758,9 +918,12 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
 static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
+    uint32_t i;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
+    for (i = 0; i < s->nr_shards; i++) {
+        compare_shard_submit(&s->shards[i], COMPARE_JOB_CHECK, NULL);
+    }
     timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
                 REGULAR_PACKET_CHECK_MS);
 }
@@ -774,7 +937,7 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
     QTAILQ_FOREACH(s, &net_compares, next) {
         s->event = event;
         qemu_bh_schedule(s->event_bh);
-        event_unhandled_count++;
+        event_unhandled_count += s->nr_shards;
     }
     /* Wait all compare threads to finish handling this event */
     while (event_unhandled_count > 0) {
@@ -809,10 +972,21 @@ static void colo_flush_packets(void *opaque, void *user_data);
 static void colo_compare_handle_event(void *opaque)
 {
     CompareState *s = opaque;
+    uint32_t i;
+
+    for (i = 0; i < s->nr_shards; i++) {
+        compare_shard_submit(&s->shards[i], COMPARE_JOB_EVENT, NULL);
+    }
+}
+
+/* Called from the shard thread, once per shard for each event */
+static void colo_compare_shard_event(CompareShard *shard)
+{
+    CompareState *s = shard->s;
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        g_queue_foreach(&shard->conn_list, colo_flush_packets, s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -905,33 +1079,56 @@ static void compare_set_vnet_hdr(Object *obj,
     s->vnet_hdr = value;
 }
 
+static void compare_get_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value > COMPARE_MAX_THREADS) {
+        error_setg(&local_err, "Property '%s.%s' should be at most %d",
+                   object_get_typename(obj), name, COMPARE_MAX_THREADS);
+        goto out;
+    }
+    s->compare_threads = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (compare_dispatch_packet(s, PRIMARY_IN, pri_rs)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
                          pri_rs->packet_len,
                          pri_rs->vnet_hdr_len);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (compare_dispatch_packet(s, SECONDARY_IN, sec_rs)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -968,6 +1165,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    uint32_t i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -1001,15 +1199,15 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
     QTAILQ_INSERT_TAIL(&net_compares, s, next);
 
-    g_queue_init(&s->conn_list);
-
     qemu_mutex_init(&event_mtx);
     qemu_cond_init(&event_complete_cond);
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    s->nr_shards = MAX(s->compare_threads, 1);
+    s->shards = g_new0(CompareShard, s->nr_shards);
+    for (i = 0; i < s->nr_shards; i++) {
+        compare_shard_init(s, &s->shards[i], s->compare_threads > 0);
+    }
+    trace_colo_compare_shards(s->nr_shards, s->compare_threads > 0);
 
     colo_compare_iothread(s);
     return;
@@ -1021,16 +1219,16 @@ static void colo_flush_packets(void *opaque, void *user_data)
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
-    while (!g_queue_is_empty(&conn->primary_list)) {
-        pkt = g_queue_pop_head(&conn->primary_list);
+    while (!packet_ring_is_empty(&conn->primary_list)) {
+        pkt = packet_ring_pop_head(&conn->primary_list);
         compare_chr_send(s,
                          pkt->data,
                          pkt->size,
                          pkt->vnet_hdr_len);
         packet_destroy(pkt, NULL);
     }
-    while (!g_queue_is_empty(&conn->secondary_list)) {
-        pkt = g_queue_pop_head(&conn->secondary_list);
+    while (!packet_ring_is_empty(&conn->secondary_list)) {
+        pkt = packet_ring_pop_head(&conn->secondary_list);
         packet_destroy(pkt, NULL);
     }
 }
@@ -1063,12 +1261,20 @@ static void colo_compare_init(Object *obj)
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr, NULL);
+
+    s->compare_threads = 0;
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads, compare_set_threads,
+                        NULL, NULL, NULL);
+
+    qemu_mutex_init(&s->out_lock);
 }
 
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_chr_fe_deinit(&s->chr_pri_in, false);
     qemu_chr_fe_deinit(&s->chr_sec_in, false);
@@ -1077,6 +1283,10 @@ static void colo_compare_finalize(Object *obj)
         colo_compare_timer_del(s);
     }
 
+    for (i = 0; i < s->nr_shards; i++) {
+        compare_shard_stop(&s->shards[i]);
+    }
+
     qemu_bh_delete(s->event_bh);
 
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1087,13 +1297,14 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *shard = &s->shards[i];
 
-    g_queue_clear(&s->conn_list);
-
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+        g_queue_foreach(&shard->conn_list, colo_flush_packets, s);
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
     }
+    g_free(s->shards);
 
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
@@ -1102,6 +1313,8 @@ static void colo_compare_finalize(Object *obj)
     qemu_mutex_destroy(&event_mtx);
     qemu_cond_destroy(&event_complete_cond);
 
+    qemu_mutex_destroy(&s->out_lock);
+
     g_free(s->pri_indev);
     g_free(s->sec_indev);
     g_free(s->outdev);
@@ -14,8 +14,11 @@
 
 #include "qemu/osdep.h"
 #include "trace.h"
+#include "net/checksum.h"
 #include "colo.h"
 
+#define PACKET_RING_INIT_SIZE 16
+
 uint32_t connection_key_hash(const void *opaque)
 {
     const ConnectionKey *key = opaque;
@@ -140,8 +143,8 @@ Connection *connection_new(ConnectionKey *key)
     conn->tcp_state = TCPS_CLOSED;
     conn->pack = 0;
     conn->sack = 0;
-    g_queue_init(&conn->primary_list);
-    g_queue_init(&conn->secondary_list);
+    packet_ring_init(&conn->primary_list);
+    packet_ring_init(&conn->secondary_list);
 
     return conn;
 }
@@ -150,10 +153,8 @@ void connection_destroy(void *opaque)
 {
     Connection *conn = opaque;
 
-    g_queue_foreach(&conn->primary_list, packet_destroy, NULL);
-    g_queue_clear(&conn->primary_list);
-    g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
-    g_queue_clear(&conn->secondary_list);
+    packet_ring_destroy(&conn->primary_list);
+    packet_ring_destroy(&conn->secondary_list);
     g_slice_free(Connection, conn);
 }
 
@@ -172,6 +173,8 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
     pkt->payload_size = 0;
     pkt->offset = 0;
     pkt->flags = 0;
+    pkt->csum_offset = -1;
+    pkt->csum = 0;
 
     return pkt;
 }
@@ -184,6 +187,142 @@ void packet_destroy(void *opaque, void *user_data)
     g_slice_free(Packet, pkt);
 }
 
+/*
+ * Return the checksum of the packet data from @offset to the end.  It is
+ * computed once and then cached, so that a packet compared against several
+ * candidates only walks its data once.
+ */
+uint32_t packet_csum(Packet *pkt, int offset)
+{
+    if (pkt->csum_offset != offset) {
+        pkt->csum = net_checksum_add(pkt->size - offset,
+                                     (uint8_t *)pkt->data + offset);
+        pkt->csum_offset = offset;
+    }
+    return pkt->csum;
+}
+
+void packet_ring_init(PacketRing *ring)
+{
+    ring->pkts = NULL;
+    ring->head = 0;
+    ring->count = 0;
+    ring->size = 0;
+}
+
+void packet_ring_destroy(PacketRing *ring)
+{
+    while (!packet_ring_is_empty(ring)) {
+        packet_destroy(packet_ring_pop_head(ring), NULL);
+    }
+    g_free(ring->pkts);
+    packet_ring_init(ring);
+}
+
+static void packet_ring_grow(PacketRing *ring)
+{
+    uint32_t size = ring->size ? ring->size * 2 : PACKET_RING_INIT_SIZE;
+    Packet **pkts = g_new(Packet *, size);
+    uint32_t i;
+
+    for (i = 0; i < ring->count; i++) {
+        pkts[i] = packet_ring_peek(ring, i);
+    }
+    g_free(ring->pkts);
+    ring->pkts = pkts;
+    ring->head = 0;
+    ring->size = size;
+}
+
+void packet_ring_push_head(PacketRing *ring, Packet *pkt)
+{
+    if (ring->count == ring->size) {
+        packet_ring_grow(ring);
+    }
+    ring->head = (ring->head - 1) & (ring->size - 1);
+    ring->pkts[ring->head] = pkt;
+    ring->count++;
+}
+
+void packet_ring_push_tail(PacketRing *ring, Packet *pkt)
+{
+    if (ring->count == ring->size) {
+        packet_ring_grow(ring);
+    }
+    ring->pkts[(ring->head + ring->count) & (ring->size - 1)] = pkt;
+    ring->count++;
+}
+
+static inline int packet_seq_cmp(Packet *a, Packet *b)
+{
+    return (int32_t)(a->tcp_seq - b->tcp_seq);
+}
+
+/*
+ * Insert @pkt before the first packet whose sequence number is not
+ * smaller than its own, like g_queue_insert_sorted() did.
+ */
+void packet_ring_insert_seq(PacketRing *ring, Packet *pkt)
+{
+    uint32_t lo = 0, hi = ring->count, i;
+
+    if (ring->count == 0 ||
+        packet_seq_cmp(packet_ring_peek(ring, ring->count - 1), pkt) < 0) {
+        packet_ring_push_tail(ring, pkt);
+        return;
+    }
+    if (packet_seq_cmp(packet_ring_peek(ring, 0), pkt) >= 0) {
+        packet_ring_push_head(ring, pkt);
+        return;
+    }
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (packet_seq_cmp(packet_ring_peek(ring, mid), pkt) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (ring->count == ring->size) {
+        packet_ring_grow(ring);
+    }
+    for (i = ring->count; i > lo; i--) {
+        ring->pkts[(ring->head + i) & (ring->size - 1)] =
+            packet_ring_peek(ring, i - 1);
+    }
+    ring->pkts[(ring->head + lo) & (ring->size - 1)] = pkt;
+    ring->count++;
+}
+
+Packet *packet_ring_pop_head(PacketRing *ring)
+{
+    Packet *pkt;
+
+    if (ring->count == 0) {
+        return NULL;
+    }
+    pkt = ring->pkts[ring->head];
+    ring->head = (ring->head + 1) & (ring->size - 1);
+    ring->count--;
+    return pkt;
+}
+
+Packet *packet_ring_remove(PacketRing *ring, uint32_t index)
+{
+    Packet *pkt = packet_ring_peek(ring, index);
+    uint32_t i;
+
+    for (i = index; i + 1 < ring->count; i++) {
+        ring->pkts[(ring->head + i) & (ring->size - 1)] =
+            packet_ring_peek(ring, i + 1);
+    }
+    ring->count--;
+    return pkt;
+}
+
 /*
  * Clear hashtable, stop this hash growing really huge
  */
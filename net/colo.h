@@ -55,8 +55,23 @@ typedef struct Packet {
     /* record the payload offset(the length that has been compared) */
     uint16_t offset;
     uint8_t flags; /* Flags(aka Control bits) */
+    /* cached checksum of the data from csum_offset to the end */
+    int csum_offset;
+    uint32_t csum;
 } Packet;
 
+/*
+ * Packets of one direction of a connection.  TCP packets are kept
+ * ordered by sequence number: in-order arrivals are appended in O(1)
+ * and the rare out-of-order one is placed with a binary search.
+ */
+typedef struct PacketRing {
+    Packet **pkts;
+    uint32_t head;
+    uint32_t count;
+    uint32_t size; /* always a power of two */
+} PacketRing;
+
 typedef struct ConnectionKey {
     /* (src, dst) must be grouped, in the same way than in IP header */
     struct in_addr src;
@@ -67,10 +82,10 @@ typedef struct ConnectionKey {
 } QEMU_PACKED ConnectionKey;
 
 typedef struct Connection {
-    /* connection primary send queue: element type: Packet */
-    GQueue primary_list;
-    /* connection secondary send queue: element type: Packet */
-    GQueue secondary_list;
+    /* connection primary send queue */
+    PacketRing primary_list;
+    /* connection secondary send queue */
+    PacketRing secondary_list;
     /* flag to enqueue unprocessed_connections */
     bool processing;
     uint8_t ip_proto;
@@ -103,5 +118,30 @@ bool connection_has_tracked(GHashTable *connection_track_table,
 void connection_hashtable_reset(GHashTable *connection_track_table);
 Packet *packet_new(const void *data, int size, int vnet_hdr_len);
 void packet_destroy(void *opaque, void *user_data);
+uint32_t packet_csum(Packet *pkt, int offset);
+
+void packet_ring_init(PacketRing *ring);
+void packet_ring_destroy(PacketRing *ring);
+void packet_ring_push_head(PacketRing *ring, Packet *pkt);
+void packet_ring_push_tail(PacketRing *ring, Packet *pkt);
+void packet_ring_insert_seq(PacketRing *ring, Packet *pkt);
+Packet *packet_ring_pop_head(PacketRing *ring);
+Packet *packet_ring_remove(PacketRing *ring, uint32_t index);
+
+static inline uint32_t packet_ring_length(PacketRing *ring)
+{
+    return ring->count;
+}
+
+static inline bool packet_ring_is_empty(PacketRing *ring)
+{
+    return ring->count == 0;
+}
+
+/* Return the @index-th packet counting from the head */
+static inline Packet *packet_ring_peek(PacketRing *ring, uint32_t index)
+{
+    return ring->pkts[(ring->head + index) & (ring->size - 1)];
+}
 
 #endif /* QEMU_COLO_PROXY_H */
@@ -33,6 +33,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
@@ -174,7 +175,8 @@ static void QEMU_NORETURN help(void)
            "\n"
            "Parameters to convert subcommand:\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
-           "       process (defaults to 8)\n"
+           "       process (by default starts with 8 and adds more while that\n"
+           "       increases the throughput)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
@@ -1178,6 +1180,32 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Returns true if the first cluster of the buffer contains non-zero data,
+ * and sets *pnum to the number of sectors in the leading clusters that are
+ * either all zero or all contain data.  Used for compressed targets, which
+ * must be written a whole cluster at a time.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    int i = MIN(n, cluster_sectors);
+    bool is_zero = buffer_is_zero(buf, i * BDRV_SECTOR_SIZE);
+
+    while (i < n) {
+        int len = MIN(n - i, cluster_sectors);
+
+        if (buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                           len * BDRV_SECTOR_SIZE) != is_zero) {
+            break;
+        }
+        i += len;
+    }
+
+    *pnum = i;
+    return !is_zero;
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first
  * sector of each buffer matches, non-zero otherwise.
@@ -1550,6 +1578,19 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/* Upper limit for the block status extents remembered between both passes */
+#define MAX_CONVERT_EXTENTS (1 << 20)
+
+/* How often the worker count is re-evaluated and the rates are updated */
+#define CONVERT_TUNE_INTERVAL_NS (500 * SCALE_MS)
+#define CONVERT_RATE_INTERVAL_NS (250 * SCALE_MS)
+
+typedef struct ImgConvertExtent {
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1564,6 +1605,7 @@ typedef struct ImgConvertState {
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    bool compressed_multi_cluster;
     bool unallocated_blocks_are_zero;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
@@ -1579,6 +1621,27 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* Block status collected while sizing the job, reused for the copy */
+    ImgConvertExtent *extents;
+    size_t nb_extents;
+    size_t cur_extent;
+    bool record_extents;
+
+    /* Add coroutines as long as this increases the throughput */
+    bool autotune;
+    int64_t tune_start_ns;
+    int64_t tune_bytes;
+    double tune_best_rate;
+
+    /* Throughput of the individual stages, shown with the progress */
+    bool show_rates;
+    int64_t start_ns;
+    int64_t rates_ns;
+    int64_t target_start_size;
+    int64_t bytes_read;
+    int64_t bytes_compressed;
+    int64_t bytes_written;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1593,6 +1656,57 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Remember the block status found while sizing the job, so that the copy
+ * itself does not have to query it again.
+ */
+static void convert_record_extent(ImgConvertState *s, int64_t sector_num)
+{
+    if (!s->record_extents || s->nb_extents >= MAX_CONVERT_EXTENTS) {
+        return;
+    }
+
+    if (!(s->nb_extents & (s->nb_extents - 1))) {
+        s->extents = g_renew(ImgConvertExtent, s->extents,
+                             s->nb_extents ? s->nb_extents * 2 : 64);
+    }
+    s->extents[s->nb_extents++] = (ImgConvertExtent) {
+        .start  = sector_num,
+        .end    = s->sector_next_status,
+        .status = s->status,
+    };
+}
+
+/*
+ * Look up the block status at @sector_num among the recorded extents.
+ * Returns false if it must be queried from the source.
+ */
+static bool convert_find_extent(ImgConvertState *s, int64_t sector_num)
+{
+    ImgConvertExtent *e;
+
+    if (s->record_extents) {
+        return false;
+    }
+
+    while (s->cur_extent < s->nb_extents &&
+           s->extents[s->cur_extent].end <= sector_num) {
+        s->cur_extent++;
+    }
+    if (s->cur_extent == s->nb_extents) {
+        return false;
+    }
+
+    e = &s->extents[s->cur_extent];
+    if (e->start > sector_num) {
+        return false;
+    }
+
+    s->status = e->status;
+    s->sector_next_status = e->end;
+    return true;
+}
+
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
     int64_t src_cur_offset;
@@ -1614,7 +1728,9 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (s->sector_next_status <= sector_num &&
+        !convert_find_extent(s, sector_num))
+    {
         int64_t count = n * BDRV_SECTOR_SIZE;
 
         if (s->target_has_backing) {
@@ -1643,6 +1759,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+        convert_record_extent(s, sector_num);
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1731,14 +1848,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 iov.iov_base = buf;
                 iov.iov_len = n << BDRV_SECTOR_BITS;
@@ -1806,6 +1923,73 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+static void coroutine_fn convert_co_do_copy(void *opaque);
+
+/*
+ * Called after each request while tuning: every CONVERT_TUNE_INTERVAL_NS,
+ * start another coroutine if the last one made the copy faster, otherwise
+ * settle with the current number.
+ */
+static void coroutine_fn convert_co_autotune(ImgConvertState *s, int n)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    double rate;
+    int i;
+
+    s->tune_bytes += n * BDRV_SECTOR_SIZE;
+    if (now - s->tune_start_ns < CONVERT_TUNE_INTERVAL_NS) {
+        return;
+    }
+
+    rate = (double)s->tune_bytes / (now - s->tune_start_ns);
+    s->tune_start_ns = now;
+    s->tune_bytes = 0;
+
+    /* Require a clear improvement so that noise does not keep us growing */
+    if (rate < s->tune_best_rate * 1.05 ||
+        s->num_coroutines >= MAX_COROUTINES ||
+        s->sector_num >= s->total_sectors)
+    {
+        s->autotune = false;
+        return;
+    }
+    s->tune_best_rate = rate;
+
+    i = s->num_coroutines++;
+    s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+    s->wait_sector_num[i] = -1;
+    qemu_coroutine_enter(s->co[i]);
+}
+
+static void convert_update_rates(ImgConvertState *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    double elapsed = (double)(now - s->start_ns) / NANOSECONDS_PER_SECOND;
+    int64_t written = s->bytes_written;
+    char info[128];
+
+    if (!s->show_rates || now - s->rates_ns < CONVERT_RATE_INTERVAL_NS) {
+        return;
+    }
+    s->rates_ns = now;
+
+    /* Compressed data is best measured by what actually hits the disk */
+    if (s->compressed) {
+        int64_t size = bdrv_get_allocated_file_size(blk_bs(s->target));
+        written = size < 0 ? 0 : MAX(size - s->target_start_size, 0);
+    }
+
+    if (s->compressed) {
+        snprintf(info, sizeof(info), " read %7.1f MiB/s, compress %7.1f MiB/s,"
+                 " write %7.1f MiB/s", s->bytes_read / elapsed / MiB,
+                 s->bytes_compressed / elapsed / MiB, written / elapsed / MiB);
+    } else {
+        snprintf(info, sizeof(info), " read %7.1f MiB/s, write %7.1f MiB/s",
+                 s->bytes_read / elapsed / MiB, written / elapsed / MiB);
+    }
+    qemu_progress_set_info(info);
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1854,6 +2038,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
+            convert_update_rates(s);
             qemu_progress_print(100.0 * s->allocated_done /
                                         s->allocated_sectors, 0);
         }
@@ -1867,6 +2052,7 @@ retry:
                              ": %s", sector_num, strerror(-ret));
                 s->ret = ret;
             }
+            s->bytes_read += n * BDRV_SECTOR_SIZE;
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
@@ -1896,6 +2082,11 @@ retry:
                              ": %s", sector_num, strerror(-ret));
                 s->ret = ret;
             }
+            if (status == BLK_DATA && s->compressed) {
+                s->bytes_compressed += n * BDRV_SECTOR_SIZE;
+            } else if (status == BLK_DATA) {
+                s->bytes_written += n * BDRV_SECTOR_SIZE;
+            }
         }
 
         if (s->wr_in_order) {
@@ -1914,6 +2105,10 @@ retry:
                 }
             }
         }
+
+        if (s->autotune) {
+            convert_co_autotune(s, n);
+        }
     }
 
     qemu_vfree(buf);
@@ -1945,18 +2140,26 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+     * can be copied at a time, unless the driver compresses many clusters of
+     * a request in parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->compressed_multi_cluster) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
+    s->record_extents = true;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
+            g_free(s->extents);
             return n;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
@@ -1965,11 +2168,19 @@ static int convert_do_copy(ImgConvertState *s)
         }
         sector_num += n;
     }
+    s->record_extents = false;
 
     /* Do the copy */
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
 
+    s->start_ns = s->rates_ns = s->tune_start_ns =
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (s->show_rates && s->compressed) {
+        s->target_start_size =
+            MAX(bdrv_get_allocated_file_size(blk_bs(s->target)), 0);
+    }
+
     qemu_co_mutex_init(&s->lock);
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
@@ -1980,6 +2191,8 @@ static int convert_do_copy(ImgConvertState *s)
     while (s->running_coroutines) {
         main_loop_wait(false);
     }
+    g_free(s->extents);
+    s->extents = NULL;
 
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
@@ -2021,6 +2234,7 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .autotune           = true,
     };
 
     for(;;) {
@@ -2128,6 +2342,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            s.autotune = false;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2210,6 +2425,8 @@ static int img_convert(int argc, char **argv)
     }
     qemu_progress_init(progress, 1.0);
     qemu_progress_print(0, 100);
+    /* Throughput would only make the output of redirected runs unstable */
+    s.show_rates = progress && isatty(STDOUT_FILENO);
 
     s.src = g_new0(BlockBackend *, s.src_num);
     s.src_sectors = g_new(int64_t, s.src_num);
@@ -2450,6 +2667,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.compressed_multi_cluster = bdi.multi_cluster_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
         s.unallocated_blocks_are_zero = bdi.unallocated_blocks_are_zero;
     }
@@ -692,7 +692,7 @@ This is the protocol-level block driver for accessing regular files.
 @item filename
 The path to the image file in the local filesystem
 @item aio
-Specifies the AIO backend (threads/native, default: threads)
+Specifies the AIO backend (threads/native/io_uring, default: threads)
 @item locking
 Specifies whether the image file is protected with Linux OFD / POSIX locks. The
 default is to use the Linux Open File Descriptor API if available, otherwise no
@@ -802,7 +802,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,snapshot=on|off][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -870,7 +871,8 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native", or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO, or Linux io_uring API.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -3683,6 +3685,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3701,6 +3705,11 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Accept incoming migration from the given file.  A file written with the
+mapped-ram capability must be loaded with that capability set too, so use
+@code{-incoming defer} to set it first.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -4216,13 +4225,16 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
-@item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},outdev=@var{chardevid}[,vnet_hdr_support]
+@item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},outdev=@var{chardevid}[,vnet_hdr_support][,compare_threads=@var{n}]
 
 Colo-compare gets packet from primary_in@var{chardevid} and secondary_in@var{chardevid}, than compare primary packet with
 secondary packet. If the packets are same, we will output primary
 packet to outdev@var{chardevid}, else we will notify colo-frame
 do checkpoint and send primary packet to outdev@var{chardevid}.
 if it has the vnet_hdr_support flag, colo compare will send/recv packet with vnet_hdr_len.
+compare_threads=@var{n} spreads the connections over @var{n} compare threads
+by the hash of their address and ports; the default of 0 compares every
+connection in the iothread.
 
 we must use it with the help of filter-mirror and filter-redirector.
 
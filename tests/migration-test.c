@@ -80,6 +80,63 @@ static bool ufd_version_check(void)
 
 #endif
 
+#ifdef CONFIG_RDMA
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+
+/* The IPv4 address of network interface @netdev, or NULL */
+static char *netdev_ipv4_address(const char *netdev)
+{
+    struct ifaddrs *ifa_list, *ifa;
+    char buf[INET_ADDRSTRLEN];
+    char *addr = NULL;
+
+    if (getifaddrs(&ifa_list)) {
+        return NULL;
+    }
+    for (ifa = ifa_list; ifa && !addr; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+            !strcmp(ifa->ifa_name, netdev) &&
+            inet_ntop(AF_INET,
+                      &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr,
+                      buf, sizeof(buf))) {
+            addr = g_strdup(buf);
+        }
+    }
+    freeifaddrs(ifa_list);
+    return addr;
+}
+
+/*
+ * The IPv4 address of a network interface that an RDMA device is bound
+ * to, e.g. a soft-RoCE one ("rdma link add rxe0 type rxe netdev eth0"),
+ * or NULL if there is none.
+ */
+static char *rdma_find_address(void)
+{
+    GDir *dir = g_dir_open("/sys/class/infiniband", 0, NULL);
+    const char *dev;
+    char *addr = NULL;
+
+    if (!dir) {
+        return NULL;
+    }
+    while (!addr && (dev = g_dir_read_name(dir))) {
+        char *path = g_strdup_printf("/sys/class/infiniband/%s/ports/1/"
+                                     "gid_attrs/ndevs/0", dev);
+        char *netdev = NULL;
+
+        if (g_file_get_contents(path, &netdev, NULL, NULL)) {
+            addr = netdev_ipv4_address(g_strstrip(netdev));
+        }
+        g_free(netdev);
+        g_free(path);
+    }
+    g_dir_close(dir);
+    return addr;
+}
+#endif
+
 static const char *tmpfs;
 
 /* The boot file modifies memory area in [start_address, end_address)
@@ -392,6 +449,27 @@ static void migrate_set_capability(QTestState *who, const char *capability,
     qobject_unref(rsp);
 }
 
+/*
+ * Like migrate_set_capability(), but return false instead of failing the
+ * test if QEMU refuses to enable @capability on this host.
+ */
+static bool migrate_try_set_capability(QTestState *who,
+                                       const char *capability)
+{
+    QDict *rsp;
+    bool ok;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-capabilities',"
+                    "'arguments': { "
+                    "'capabilities': [ { "
+                    "'capability': %s, 'state': true } ] } }",
+                    capability);
+    ok = qdict_haskey(rsp, "return");
+    qobject_unref(rsp);
+    return ok;
+}
+
 /*
  * Send QMP command "migrate".
  * Arguments are built from @fmt... (formatted like
@@ -415,6 +493,17 @@ static void migrate(QTestState *who, const char *uri, const char *fmt, ...)
     qobject_unref(rsp);
 }
 
+static void migrate_incoming(QTestState *who, const char *uri)
+{
+    QDict *rsp;
+
+    rsp = wait_command(who,
+                       "{ 'execute': 'migrate-incoming', "
+                       "  'arguments': { 'uri': %s } }",
+                       uri);
+    qobject_unref(rsp);
+}
+
 static void migrate_postcopy_start(QTestState *from, QTestState *to)
 {
     QDict *rsp;
@@ -598,7 +687,9 @@ static void test_deprecated(void)
 
 static int migrate_postcopy_prepare(QTestState **from_ptr,
                                      QTestState **to_ptr,
-                                     bool hide_error)
+                                     bool hide_error,
+                                     bool postcopy_preempt,
+                                     bool multifd)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
@@ -610,6 +701,16 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(from, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+    if (multifd) {
+        migrate_set_capability(from, "x-multifd", true);
+        migrate_set_capability(to, "x-multifd", true);
+        migrate_set_parameter(from, "x-multifd-channels", 4);
+        migrate_set_parameter(to, "x-multifd-channels", 4);
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -650,19 +751,55 @@ static void test_postcopy(void)
 {
     QTestState *from, *to;
 
-    if (migrate_postcopy_prepare(&from, &to, false)) {
+    if (migrate_postcopy_prepare(&from, &to, false, false, false)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_preempt(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, true, false)) {
         return;
     }
     migrate_postcopy_start(from, to);
     migrate_postcopy_complete(from, to);
 }
 
+/*
+ * After the switch to postcopy, the background push keeps going out on the
+ * multifd channels, whose pages the destination places atomically once it
+ * listens; pages it asks for still come on the main channel.
+ */
+static void test_postcopy_multifd(void)
+{
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, false, false, true)) {
+        return;
+    }
+
+    /* Keep the background push busy for a while after the switch */
+    migrate_set_parameter(from, "max-postcopy-bandwidth", 10000000);
+
+    migrate_postcopy_start(from, to);
+    wait_for_migration_status(from, "postcopy-active");
+
+    /* Restore the postcopy bandwidth to unlimited */
+    migrate_set_parameter(from, "max-postcopy-bandwidth", 0);
+
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     QTestState *from, *to;
     char *uri;
 
-    if (migrate_postcopy_prepare(&from, &to, true)) {
+    if (migrate_postcopy_prepare(&from, &to, true, false, false)) {
         return;
     }
 
@@ -740,7 +877,7 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
-static void test_precopy_unix(void)
+static void do_test_precopy_unix(const char *capability)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *from, *to;
@@ -749,6 +886,10 @@ static void test_precopy_unix(void)
         return;
     }
 
+    if (capability) {
+        migrate_set_capability(from, capability, true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -777,9 +918,392 @@ static void test_precopy_unix(void)
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
+    /*
+     * port92 is loaded from a QEMU_VM_SECTION_PARALLEL section; the boot
+     * block enabled A20 through it on the source only.
+     */
+    if (capability && (!strcmp(qtest_get_arch(), "i386") ||
+                       !strcmp(qtest_get_arch(), "x86_64"))) {
+        g_assert_cmphex(qtest_inb(to, 0x92), ==, 0x02);
+    }
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_unix(void)
+{
+    do_test_precopy_unix(NULL);
+}
+
+static void test_precopy_unix_parallel_vmstate(void)
+{
+    do_test_precopy_unix("parallel-vmstate");
+}
+
+/*
+ * A downtime limit that can't be met while the guest keeps dirtying memory
+ * must hold off the switchover.  This must hold even if the switchover
+ * overhead measured by an earlier migration of the same VM already uses
+ * up the whole limit.
+ */
+static void test_precopy_unix_tiny_downtime(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    gchar *status;
+    int i;
+
+    if (test_migrate_start(&from, &to, uri, false)) {
+        g_free(uri);
+        return;
+    }
+
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* A first migration, to nowhere, measures the switchover overhead */
+    migrate(from, "exec:cat > /dev/null", "{}");
+    wait_for_migration_complete(from);
+    qobject_unref(wait_command(from, "{ 'execute': 'cont' }"));
+    got_stop = false;
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter(from, "downtime-limit", 1);
+    migrate(from, uri, "{}");
+
+    for (i = 0; i < 3; i++) {
+        wait_for_migration_pass(from);
+    }
+    g_assert(!got_stop);
+    status = migrate_query_status(from);
+    g_assert_cmpstr(status, ==, "active");
+    g_free(status);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_file_mapped_ram(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", false)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    migrate_set_capability(from, "x-multifd", true);
+    migrate_set_capability(to, "x-multifd", true);
+    migrate_set_parameter(from, "x-multifd-channels", 4);
+    migrate_set_parameter(to, "x-multifd-channels", 4);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The whole file is written before the destination reads it */
+    migrate(from, uri, "{}");
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    migrate_incoming(to, uri);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
+#ifdef CONFIG_RDMA
+/* Every multifd channel gets its own queue pair */
+static void test_precopy_rdma_multifd(void)
+{
+    char *addr = rdma_find_address();
+    QTestState *from, *to;
+    char *uri;
+
+    if (!addr) {
+        g_test_message("Skipping test: no RDMA device with an IPv4 address "
+                       "(e.g. rdma_rxe)");
+        return;
+    }
+    uri = g_strdup_printf("rdma:%s:29200", addr);
+    g_free(addr);
+
+    if (test_migrate_start(&from, &to, "defer", false)) {
+        g_free(uri);
+        return;
+    }
+
+    migrate_set_capability(from, "x-multifd", true);
+    migrate_set_capability(to, "x-multifd", true);
+    migrate_set_parameter(from, "x-multifd-channels", 4);
+    migrate_set_parameter(to, "x-multifd-channels", 4);
+    migrate_incoming(to, uri);
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
     test_migrate_end(from, to, true);
     g_free(uri);
 }
+#endif
+
+/* direct-io only works with the aligned layout of mapped-ram */
+static void test_precopy_file_direct_io_no_mapped_ram(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from;
+    QDict *rsp;
+
+    from = qtest_start("-machine none");
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-parameters',"
+                          "'arguments': { 'direct-io': true } }");
+    if (!qdict_haskey(rsp, "return")) {
+        g_test_message("Skipping test: O_DIRECT not supported on this host");
+        qobject_unref(rsp);
+        qtest_quit(from);
+        g_free(uri);
+        return;
+    }
+    qobject_unref(rsp);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate',"
+                          "'arguments': { 'uri': %s } }", uri);
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    qtest_quit(from);
+    cleanup("migfile");
+    g_free(uri);
+}
+
+static void test_background_snapshot(void)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp_return;
+    bool running;
+
+    if (test_migrate_start(&from, &to, "defer", false)) {
+        g_free(uri);
+        return;
+    }
+
+    /*
+     * QEMU refuses the capability if ram_write_tracking_available() or
+     * ram_write_tracking_compatible() is false, e.g. on kernels without
+     * userfaultfd write protection.
+     */
+    if (!migrate_try_set_capability(from, "background-snapshot")) {
+        g_test_message("Skipping test: background-snapshot not supported "
+                       "on this host");
+        test_migrate_end(from, to, false);
+        g_free(uri);
+        return;
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The source is only paused while its device state is saved */
+    migrate(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    /* ...and runs again, at the latest once the snapshot is complete */
+    do {
+        rsp_return = wait_command(from, "{ 'execute': 'query-status' }");
+        running = qdict_get_bool(rsp_return, "running");
+        qobject_unref(rsp_return);
+    } while (!running);
+
+    migrate_incoming(to, uri);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
+/*
+ * A UDP packet from 10.0.0.1:1000 to 10.0.0.2:7, as the primary guest
+ * would send it to colo-compare.
+ */
+static size_t colo_build_udp_packet(uint8_t *buf, const char *payload)
+{
+    size_t len = strlen(payload);
+
+    memset(buf, 0, 42);
+    memset(buf, 0x52, 12);
+    stw_be_p(buf + 12, 0x0800);
+    buf[14] = 0x45;
+    stw_be_p(buf + 16, 20 + 8 + len);
+    buf[22] = 64;
+    buf[23] = 17;
+    stl_be_p(buf + 26, 0x0a000001);
+    stl_be_p(buf + 30, 0x0a000002);
+    stw_be_p(buf + 34, 1000);
+    stw_be_p(buf + 36, 7);
+    stw_be_p(buf + 38, 8 + len);
+    memcpy(buf + 42, payload, len);
+
+    return 42 + len;
+}
+
+static int colo_chardev_add(QTestState *who, const char *id)
+{
+    char *path = g_strdup_printf("%s/%s", tmpfs, id);
+    int fd;
+
+    qobject_unref(wait_command(who, "{ 'execute': 'chardev-add',"
+                               "  'arguments': { 'id': %s, 'backend': {"
+                               "    'type': 'socket', 'data': {"
+                               "      'addr': { 'type': 'unix',"
+                               "                'data': { 'path': %s } },"
+                               "      'server': true, 'wait': false } } } }",
+                               id, path));
+    fd = unix_connect(path, NULL);
+    g_assert_cmpint(fd, !=, -1);
+    g_free(path);
+    return fd;
+}
+
+/*
+ * COLO with colo-compare running on compare threads on the primary: a
+ * primary packet that the secondary never matches is held back until the
+ * next checkpoint, whose event makes every shard flush it to outdev.
+ */
+static void test_colo_compare_checkpoint(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    uint8_t buf[128], out[128];
+    uint32_t len, size;
+    int pri_sock, sec_sock, out_sock;
+    size_t done;
+    ssize_t ret;
+
+    if (test_migrate_start(&from, &to, uri, false)) {
+        return;
+    }
+
+    if (!migrate_try_set_capability(from, "x-colo")) {
+        g_test_message("Skipping test: QEMU built without replication");
+        test_migrate_end(from, to, false);
+        g_free(uri);
+        return;
+    }
+    migrate_set_capability(to, "x-colo", true);
+
+    migrate_set_parameter(from, "downtime-limit", 300);
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter(from, "x-checkpoint-delay", 200);
+
+    pri_sock = colo_chardev_add(from, "colo_pri");
+    sec_sock = colo_chardev_add(from, "colo_sec");
+    out_sock = colo_chardev_add(from, "colo_out");
+    qobject_unref(wait_command(from, "{ 'execute': 'object-add',"
+                               "  'arguments': { 'qom-type': 'iothread',"
+                               "                 'id': 'colo_iothread' } }"));
+    qobject_unref(wait_command(from, "{ 'execute': 'object-add',"
+                               "  'arguments': { 'qom-type': 'colo-compare',"
+                               "    'id': 'colo_comp', 'props': {"
+                               "      'primary_in': 'colo_pri',"
+                               "      'secondary_in': 'colo_sec',"
+                               "      'outdev': 'colo_out',"
+                               "      'iothread': 'colo_iothread',"
+                               "      'compare_threads': 2 } } }"));
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+    wait_for_migration_status(from, "colo");
+
+    len = colo_build_udp_packet(buf, "checkpoint");
+    size = htonl(len);
+    ret = send(pri_sock, &size, sizeof(size), 0);
+    g_assert_cmpint(ret, ==, sizeof(size));
+    ret = send(pri_sock, buf, len, 0);
+    g_assert_cmpint(ret, ==, len);
+
+    /* Only the checkpoint can release it */
+    done = 0;
+    while (done < sizeof(size)) {
+        ret = recv(out_sock, (uint8_t *)&size + done, sizeof(size) - done, 0);
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+    g_assert_cmpuint(ntohl(size), ==, len);
+    done = 0;
+    while (done < len) {
+        ret = recv(out_sock, out + done, len - done, 0);
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+    g_assert(memcmp(out, buf, len) == 0);
+
+    /* Let the secondary take over, then stop the primary */
+    qobject_unref(wait_command(to, "{ 'execute': 'x-colo-lost-heartbeat' }"));
+    qobject_unref(wait_command(from,
+                               "{ 'execute': 'x-colo-lost-heartbeat' }"));
+
+    close(pri_sock);
+    close(sec_sock);
+    close(out_sock);
+    test_migrate_end(from, to, false);
+    cleanup("colo_pri");
+    cleanup("colo_sec");
+    cleanup("colo_out");
+    g_free(uri);
+}
 
 int main(int argc, char **argv)
 {
@@ -829,9 +1353,26 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/multifd", test_postcopy_multifd);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_func("/migration/precopy/unix/parallel-vmstate",
+                   test_precopy_unix_parallel_vmstate);
+    qtest_add_func("/migration/precopy/unix/tiny-downtime",
+                   test_precopy_unix_tiny_downtime);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+#ifdef CONFIG_RDMA
+    qtest_add_func("/migration/precopy/rdma/multifd",
+                   test_precopy_rdma_multifd);
+#endif
+    qtest_add_func("/migration/precopy/file/direct-io-no-mapped-ram",
+                   test_precopy_file_direct_io_no_mapped_ram);
+    qtest_add_func("/migration/background-snapshot", test_background_snapshot);
+    qtest_add_func("/migration/colo/compare-threads",
+                   test_colo_compare_checkpoint);
 
     ret = g_test_run();
 
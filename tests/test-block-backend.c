@@ -26,6 +26,8 @@
 #include "block/block.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-block-core.h"
+#include "iothread.h"
 
 static void test_drain_aio_error_flush_cb(void *opaque, int ret)
 {
@@ -67,6 +69,91 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+#define ACCT_NUM_IOTHREADS  (BLOCK_ACCT_SHARDS + 1)
+#define ACCT_NUM_OPS        1000
+
+typedef struct AcctData {
+    BlockBackend *blk;
+    QemuEvent done;
+} AcctData;
+
+static void account_ops(BlockBackend *blk)
+{
+    BlockAcctStats *stats = blk_get_stats(blk);
+    BlockAcctCookie cookie;
+    int i;
+
+    for (i = 0; i < ACCT_NUM_OPS; i++) {
+        block_acct_start(stats, &cookie, 512, BLOCK_ACCT_READ);
+        block_acct_done(stats, &cookie);
+        block_acct_start(stats, &cookie, 4096, BLOCK_ACCT_WRITE);
+        block_acct_done(stats, &cookie);
+        block_acct_start(stats, &cookie, 0, BLOCK_ACCT_FLUSH);
+        block_acct_failed(stats, &cookie);
+        block_acct_merge_done(stats, BLOCK_ACCT_READ, 1);
+    }
+}
+
+static void test_accounting_iothread_bh(void *opaque)
+{
+    AcctData *data = opaque;
+
+    account_ops(data->blk);
+    qemu_event_set(&data->done);
+}
+
+/*
+ * Account I/O from the main loop and from more IOThreads than there are
+ * counter shards at the same time, then check the query-blockstats totals.
+ */
+static void test_accounting_iothread(void)
+{
+    BlockBackend *blk = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+    IOThread *iothread[ACCT_NUM_IOTHREADS];
+    AcctData data[ACCT_NUM_IOTHREADS];
+    BlockStatsList *list;
+    BlockDeviceStats *ds;
+    uint64_t n = (ACCT_NUM_IOTHREADS + 1) * ACCT_NUM_OPS;
+    int i;
+
+    monitor_add_blk(blk, "drive0", &error_abort);
+
+    for (i = 0; i < ACCT_NUM_IOTHREADS; i++) {
+        iothread[i] = iothread_new();
+        data[i].blk = blk;
+        qemu_event_init(&data[i].done, false);
+    }
+    for (i = 0; i < ACCT_NUM_IOTHREADS; i++) {
+        aio_bh_schedule_oneshot(iothread_get_aio_context(iothread[i]),
+                                test_accounting_iothread_bh, &data[i]);
+    }
+    account_ops(blk);
+    for (i = 0; i < ACCT_NUM_IOTHREADS; i++) {
+        qemu_event_wait(&data[i].done);
+        qemu_event_destroy(&data[i].done);
+        iothread_join(iothread[i]);
+    }
+
+    list = qmp_query_blockstats(false, false, &error_abort);
+    g_assert(list != NULL);
+    g_assert(list->next == NULL);
+    g_assert_cmpstr(list->value->device, ==, "drive0");
+    ds = list->value->stats;
+
+    g_assert_cmpuint(ds->rd_operations, ==, n);
+    g_assert_cmpuint(ds->rd_bytes, ==, n * 512);
+    g_assert_cmpuint(ds->wr_operations, ==, n);
+    g_assert_cmpuint(ds->wr_bytes, ==, n * 4096);
+    g_assert_cmpuint(ds->flush_operations, ==, 0);
+    g_assert_cmpuint(ds->failed_flush_operations, ==, n);
+    g_assert_cmpuint(ds->rd_merged, ==, n);
+    g_assert(ds->has_idle_time_ns);
+
+    qapi_free_BlockStatsList(list);
+    monitor_remove_blk(blk);
+    blk_unref(blk);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -77,6 +164,8 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/accounting_iothread",
+                    test_accounting_iothread);
 
     return g_test_run();
 }
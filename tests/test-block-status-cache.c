@@ -0,0 +1,195 @@
+/*
+ * Block status cache tests
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qemu/units.h"
+
+#define TEST_IMAGE_SIZE     (1 * MiB)
+/* The test driver describes the image in extents of this size */
+#define TEST_EXTENT_SIZE    (64 * KiB)
+
+typedef struct BDRVTestState {
+    int block_status_calls;
+} BDRVTestState;
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVTestState *s = bs->opaque;
+
+    s->block_status_calls++;
+    *pnum = MIN(bytes, TEST_EXTENT_SIZE - offset % TEST_EXTENT_SIZE);
+    return BDRV_BLOCK_DATA;
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    return 0;
+}
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_IMAGE_SIZE;
+}
+
+static BlockDriver bdrv_test_cached = {
+    .format_name            = "test-cached",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_co_block_status   = bdrv_test_co_block_status,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+    .bdrv_getlength         = bdrv_test_getlength,
+
+    .supports_block_status_cache = true,
+};
+
+static BlockDriver bdrv_test_uncached = {
+    .format_name            = "test-uncached",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_co_block_status   = bdrv_test_co_block_status,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+    .bdrv_getlength         = bdrv_test_getlength,
+};
+
+static BlockBackend *test_setup(BlockDriver *drv, BDRVTestState **s)
+{
+    BlockBackend *blk;
+    BlockDriverState *bs;
+
+    blk = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(drv, "test-node", BDRV_O_RDWR, &error_abort);
+    blk_insert_bs(blk, bs, &error_abort);
+    bdrv_unref(bs);
+
+    *s = bs->opaque;
+    return blk;
+}
+
+/* Queries the block status at @offset and checks the driver's answer */
+static void test_block_status(BlockBackend *blk, int64_t offset)
+{
+    int64_t pnum, map;
+    BlockDriverState *file;
+    int ret;
+
+    ret = bdrv_block_status(blk_bs(blk), offset, TEST_IMAGE_SIZE - offset,
+                            &pnum, &map, &file);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, BDRV_BLOCK_DATA);
+    g_assert_cmpint(pnum, ==, TEST_EXTENT_SIZE - offset % TEST_EXTENT_SIZE);
+}
+
+static void test_write(BlockBackend *blk, int64_t offset)
+{
+    uint8_t buf[512] = { 0 };
+    int ret;
+
+    ret = blk_pwrite(blk, offset, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(buf));
+}
+
+static void test_uncached(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_setup(&bdrv_test_uncached, &s);
+
+    /* Drivers that do not opt in are asked every time */
+    test_block_status(blk, 0);
+    test_block_status(blk, 0);
+    test_block_status(blk, 4 * KiB);
+    g_assert_cmpint(s->block_status_calls, ==, 3);
+
+    blk_unref(blk);
+}
+
+static void test_cached(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_setup(&bdrv_test_cached, &s);
+
+    test_block_status(blk, 0);
+    g_assert_cmpint(s->block_status_calls, ==, 1);
+
+    /* The answer covers the whole first extent */
+    test_block_status(blk, 0);
+    test_block_status(blk, 4 * KiB);
+    g_assert_cmpint(s->block_status_calls, ==, 1);
+
+    /* But not the next one */
+    test_block_status(blk, TEST_EXTENT_SIZE);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+
+    /* A write to the second extent keeps the answer for the first one */
+    test_write(blk, TEST_EXTENT_SIZE);
+    test_block_status(blk, 0);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+    test_block_status(blk, TEST_EXTENT_SIZE);
+    g_assert_cmpint(s->block_status_calls, ==, 3);
+
+    /* A write to the first extent drops its answer */
+    test_write(blk, 8 * KiB);
+    test_block_status(blk, 0);
+    g_assert_cmpint(s->block_status_calls, ==, 4);
+
+    blk_unref(blk);
+}
+
+static void test_cached_force_share(void)
+{
+    BDRVTestState *s;
+    BlockBackend *blk = test_setup(&bdrv_test_cached, &s);
+
+    /* Other processes may change a shared image, so nothing is cached */
+    blk_bs(blk)->force_share = true;
+
+    test_block_status(blk, 0);
+    test_block_status(blk, 0);
+    g_assert_cmpint(s->block_status_calls, ==, 2);
+
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-status-cache/uncached", test_uncached);
+    g_test_add_func("/block-status-cache/cached", test_cached);
+    g_test_add_func("/block-status-cache/cached-force-share",
+                    test_cached_force_share);
+
+    return g_test_run();
+}
@@ -0,0 +1,217 @@
+/*
+ * QTest testcase for colo-compare with compare threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * qemu side                                   | test side
+ *                                             |
+ * +-----------+   +--------------+            |
+ * | chardev   <---+ colo-compare <---------------+ pri_sock
+ * | (outdev)  |   |  (shards on  <---------------+ sec_sock
+ * +-----+-----+   |   threads)   |            |
+ *       |         +--------------+            |
+ *       +------------------------------------------> out_sock
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define NR_CONNECTIONS  16
+#define PKT_MAX         128
+
+/* Build a UDP packet from 10.0.0.1:@sport to 10.0.0.2:7 carrying @payload */
+static size_t build_udp_packet(uint8_t *buf, uint16_t sport,
+                               const char *payload)
+{
+    size_t len = strlen(payload);
+
+    memset(buf, 0, 14 + 20 + 8);
+    /* Ethernet */
+    memset(buf, 0x52, 12);
+    stw_be_p(buf + 12, 0x0800);
+    /* IPv4 */
+    buf[14] = 0x45;
+    stw_be_p(buf + 16, 20 + 8 + len);
+    buf[22] = 64;
+    buf[23] = 17;
+    stl_be_p(buf + 26, 0x0a000001);
+    stl_be_p(buf + 30, 0x0a000002);
+    /* UDP */
+    stw_be_p(buf + 34, sport);
+    stw_be_p(buf + 36, 7);
+    stw_be_p(buf + 38, 8 + len);
+    memcpy(buf + 42, payload, len);
+
+    return 42 + len;
+}
+
+/* Send the packet of connection @sport with payload "@prefix@sport" */
+static void send_packet(int fd, uint16_t sport, const char *prefix)
+{
+    uint8_t buf[PKT_MAX];
+    char payload[64];
+    uint32_t len;
+    uint32_t size;
+    struct iovec iov[] = {
+        {
+            .iov_base = &size,
+            .iov_len = sizeof(size),
+        }, {
+            .iov_base = buf,
+        },
+    };
+    ssize_t ret;
+
+    snprintf(payload, sizeof(payload), "%s%u", prefix, sport);
+    len = build_udp_packet(buf, sport, payload);
+    size = htonl(len);
+    iov[1].iov_len = len;
+    ret = iov_send(fd, iov, 2, 0, sizeof(size) + len);
+    g_assert_cmpint(ret, ==, sizeof(size) + len);
+}
+
+static void recv_all(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = qemu_recv(fd, (uint8_t *)buf + done, len - done, 0);
+
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+}
+
+/* Receive a packet from outdev, check it and return its source port */
+static uint16_t recv_packet(int fd, const char *prefix)
+{
+    uint8_t buf[PKT_MAX], expect[PKT_MAX];
+    char payload[64];
+    uint32_t len;
+    uint16_t sport;
+
+    recv_all(fd, &len, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpuint(len, >, 42);
+    g_assert_cmpuint(len, <=, sizeof(buf));
+    recv_all(fd, buf, len);
+
+    sport = lduw_be_p(buf + 34);
+    snprintf(payload, sizeof(payload), "%s%u", prefix, sport);
+    g_assert_cmpuint(build_udp_packet(expect, sport, payload), ==, len);
+    g_assert(memcmp(buf, expect, len) == 0);
+
+    return sport;
+}
+
+static void colo_compare_add(const char *id, int threads, bool expect_ok)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': 'object-add', 'arguments': {"
+              " 'qom-type': 'colo-compare', 'id': %s, 'props': {"
+              " 'primary_in': 'pri', 'secondary_in': 'sec',"
+              " 'outdev': 'out', 'iothread': 'iothread0',"
+              " 'compare_threads': %d } } }", id, threads);
+    g_assert(qdict_haskey(rsp, expect_ok ? "return" : "error"));
+    qobject_unref(rsp);
+}
+
+static void test_colo_compare_threads(void)
+{
+    char sock_pri[] = "colo-compare-pri.XXXXXX";
+    char sock_sec[] = "colo-compare-sec.XXXXXX";
+    char sock_out[] = "colo-compare-out.XXXXXX";
+    int pri_sock, sec_sock, out_sock;
+    uint32_t seen = 0;
+    QDict *rsp;
+    int i;
+
+    g_assert_cmpint(mkstemp(sock_pri), !=, -1);
+    g_assert_cmpint(mkstemp(sock_sec), !=, -1);
+    g_assert_cmpint(mkstemp(sock_out), !=, -1);
+
+    global_qtest = qtest_initf(
+        "-machine none "
+        "-object iothread,id=iothread0 "
+        "-chardev socket,id=pri,path=%s,server,nowait "
+        "-chardev socket,id=sec,path=%s,server,nowait "
+        "-chardev socket,id=out,path=%s,server,nowait ",
+        sock_pri, sock_sec, sock_out);
+
+    pri_sock = unix_connect(sock_pri, NULL);
+    g_assert_cmpint(pri_sock, !=, -1);
+    sec_sock = unix_connect(sock_sec, NULL);
+    g_assert_cmpint(sec_sock, !=, -1);
+    out_sock = unix_connect(sock_out, NULL);
+    g_assert_cmpint(out_sock, !=, -1);
+
+    /* More threads than COMPARE_MAX_THREADS are refused */
+    colo_compare_add("comp0", 65, false);
+    colo_compare_add("comp0", 4, true);
+
+    /*
+     * All primary packets first, so that each shard queues connections
+     * before the secondary packets arrive and release them.
+     */
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        send_packet(pri_sock, 1000 + i, "match-");
+    }
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        send_packet(sec_sock, 1000 + i, "match-");
+    }
+
+    /* Shards run in parallel, so connections come out in any order */
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        uint16_t sport = recv_packet(out_sock, "match-");
+
+        g_assert_cmpuint(sport, >=, 1000);
+        g_assert_cmpuint(sport, <, 1000 + NR_CONNECTIONS);
+        g_assert(!(seen & (1u << (sport - 1000))));
+        seen |= 1u << (sport - 1000);
+    }
+
+    /*
+     * Leave primary packets without a secondary queued in the shards, then
+     * finalize: the shard threads must be stopped and the packets released.
+     */
+    for (i = 0; i < 4; i++) {
+        send_packet(pri_sock, 2000 + i, "unmatched-");
+    }
+    rsp = qmp("{ 'execute': 'object-del', 'arguments': { 'id': 'comp0' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    /* A new instance takes over the chardevs */
+    colo_compare_add("comp1", 2, true);
+    send_packet(pri_sock, 3000, "again-");
+    send_packet(sec_sock, 3000, "again-");
+    g_assert_cmpuint(recv_packet(out_sock, "again-"), ==, 3000);
+
+    rsp = qmp("{ 'execute': 'object-del', 'arguments': { 'id': 'comp1' } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    close(pri_sock);
+    close(sec_sock);
+    close(out_sock);
+    unlink(sock_pri);
+    unlink(sock_sec);
+    unlink(sock_out);
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/colo-compare/threads", test_colo_compare_threads);
+
+    return g_test_run();
+}
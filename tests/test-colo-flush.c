@@ -0,0 +1,137 @@
+/*
+ * COLO RAM cache flush unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "../migration/colo-flush.h"
+
+#define PAGE_BITS   4
+#define PAGE_SIZE   (1 << PAGE_BITS)
+#define CHUNK_PAGES BITS_PER_LONG
+
+typedef struct {
+    ColoFlushRegion r;
+    uint8_t *expect;
+    uint64_t dirty;
+} TestRegion;
+
+/*
+ * Region sizes that end inside a chunk, on a chunk boundary, inside the
+ * first chunk and one that is empty, so that chunks straddle regions.
+ */
+static const unsigned long test_pages[] = {
+    3 * CHUNK_PAGES + 5, 2 * CHUNK_PAGES, 7, 0, CHUNK_PAGES + 1,
+};
+
+static void test_region_init(TestRegion *t, unsigned long pages, bool all)
+{
+    size_t size = (size_t)pages << PAGE_BITS;
+    unsigned long i;
+
+    t->r.pages = pages;
+    t->r.bmap = bitmap_new(pages);
+    t->r.dst = g_malloc(size);
+    t->r.src = g_malloc(size);
+    t->expect = g_malloc(size);
+    t->dirty = 0;
+
+    for (i = 0; i < size; i++) {
+        t->r.dst[i] = g_test_rand_int();
+        ((uint8_t *)t->r.src)[i] = g_test_rand_int();
+    }
+    memcpy(t->expect, t->r.dst, size);
+
+    for (i = 0; i < pages; i++) {
+        if (all || g_test_rand_bit()) {
+            set_bit(i, t->r.bmap);
+            memcpy(t->expect + (i << PAGE_BITS), t->r.src + (i << PAGE_BITS),
+                   PAGE_SIZE);
+            t->dirty++;
+        }
+    }
+}
+
+static void test_region_check(TestRegion *t)
+{
+    g_assert(bitmap_empty(t->r.bmap, t->r.pages));
+    g_assert(memcmp(t->r.dst, t->expect, t->r.pages << PAGE_BITS) == 0);
+}
+
+static void test_region_cleanup(TestRegion *t)
+{
+    g_free(t->r.bmap);
+    g_free(t->r.dst);
+    g_free((uint8_t *)t->r.src);
+    g_free(t->expect);
+}
+
+static void test_flush(int nthreads, bool all)
+{
+    ColoFlush *cf = colo_flush_new(nthreads, PAGE_BITS, CHUNK_PAGES);
+    int n = ARRAY_SIZE(test_pages);
+    TestRegion t[ARRAY_SIZE(test_pages)];
+    ColoFlushRegion regions[ARRAY_SIZE(test_pages)];
+    uint64_t dirty = 0;
+    int i, round;
+
+    /* The same pool flushes several times, as it does at each checkpoint */
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < n; i++) {
+            test_region_init(&t[i], test_pages[i], all);
+            regions[i] = t[i].r;
+            dirty += t[i].dirty;
+        }
+
+        g_assert_cmpuint(colo_flush_run(cf, regions, n), ==, dirty);
+        for (i = 0; i < n; i++) {
+            test_region_check(&t[i]);
+        }
+
+        /* Nothing is left dirty */
+        g_assert_cmpuint(colo_flush_run(cf, regions, n), ==, 0);
+
+        for (i = 0; i < n; i++) {
+            test_region_cleanup(&t[i]);
+        }
+        dirty = 0;
+    }
+
+    colo_flush_free(cf);
+}
+
+static void test_flush_inline(void)
+{
+    test_flush(1, false);
+}
+
+static void test_flush_threads(void)
+{
+    test_flush(4, false);
+}
+
+static void test_flush_threads_all(void)
+{
+    test_flush(4, true);
+}
+
+static void test_flush_no_regions(void)
+{
+    ColoFlush *cf = colo_flush_new(2, PAGE_BITS, CHUNK_PAGES);
+
+    g_assert_cmpuint(colo_flush_run(cf, NULL, 0), ==, 0);
+    colo_flush_free(cf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/colo-flush/inline", test_flush_inline);
+    g_test_add_func("/colo-flush/threads", test_flush_threads);
+    g_test_add_func("/colo-flush/threads-all-dirty", test_flush_threads_all);
+    g_test_add_func("/colo-flush/no-regions", test_flush_no_regions);
+    return g_test_run();
+}
@@ -0,0 +1,214 @@
+/*
+ * COLO proxy packet ring unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "../net/colo.h"
+
+static Packet *test_packet(uint32_t seq)
+{
+    Packet *pkt = packet_new(&seq, sizeof(seq), 0);
+
+    pkt->tcp_seq = seq;
+    return pkt;
+}
+
+/* Check that @ring holds exactly the packets of @model, in order */
+static void test_ring_check(PacketRing *ring, GPtrArray *model)
+{
+    uint32_t i;
+
+    g_assert_cmpuint(packet_ring_length(ring), ==, model->len);
+    g_assert(packet_ring_is_empty(ring) == !model->len);
+    g_assert(!ring->size || is_power_of_2(ring->size));
+    g_assert_cmpuint(ring->count, <=, ring->size);
+    for (i = 0; i < model->len; i++) {
+        g_assert(packet_ring_peek(ring, i) == g_ptr_array_index(model, i));
+    }
+}
+
+static void test_push_pop(void)
+{
+    GPtrArray *model = g_ptr_array_new();
+    PacketRing ring;
+    Packet *pkt;
+    uint32_t i;
+
+    packet_ring_init(&ring);
+    g_assert(packet_ring_pop_head(&ring) == NULL);
+
+    /* Move the head away from slot 0, then grow while the ring wraps */
+    for (i = 0; i < 12; i++) {
+        pkt = test_packet(i);
+        packet_ring_push_tail(&ring, pkt);
+        g_ptr_array_add(model, pkt);
+    }
+    for (i = 0; i < 10; i++) {
+        pkt = packet_ring_pop_head(&ring);
+        g_assert(pkt == g_ptr_array_index(model, 0));
+        g_ptr_array_remove_index(model, 0);
+        packet_destroy(pkt, NULL);
+    }
+    for (i = 12; i < 60; i++) {
+        pkt = test_packet(i);
+        packet_ring_push_tail(&ring, pkt);
+        g_ptr_array_add(model, pkt);
+        test_ring_check(&ring, model);
+    }
+
+    /* push_head on a ring whose head is at slot 0 wraps to the end */
+    while (ring.head != 0) {
+        pkt = packet_ring_pop_head(&ring);
+        packet_ring_push_tail(&ring, pkt);
+        g_ptr_array_remove_index(model, 0);
+        g_ptr_array_add(model, pkt);
+    }
+    for (i = 0; i < 40; i++) {
+        pkt = test_packet(1000 + i);
+        packet_ring_push_head(&ring, pkt);
+        g_ptr_array_insert(model, 0, pkt);
+        test_ring_check(&ring, model);
+    }
+
+    packet_ring_destroy(&ring);
+    g_assert(packet_ring_is_empty(&ring));
+    g_assert(ring.pkts == NULL);
+    g_ptr_array_free(model, true);
+}
+
+/* Where g_queue_insert_sorted() would put @pkt: before the first >= one */
+static void test_model_insert_seq(GPtrArray *model, Packet *pkt)
+{
+    guint i;
+
+    for (i = 0; i < model->len; i++) {
+        Packet *p = g_ptr_array_index(model, i);
+
+        if ((int32_t)(p->tcp_seq - pkt->tcp_seq) >= 0) {
+            break;
+        }
+    }
+    g_ptr_array_insert(model, i, pkt);
+}
+
+static void test_insert_seq(void)
+{
+    GPtrArray *model = g_ptr_array_new();
+    PacketRing ring;
+    Packet *pkt;
+    uint32_t i;
+
+    packet_ring_init(&ring);
+
+    /*
+     * Sequence numbers around the 2^32 wrap, mostly in order, with
+     * duplicates and out of order ones; pop a few along the way so that
+     * the ring wraps and grows with packets in the middle.
+     */
+    for (i = 0; i < 500; i++) {
+        uint32_t seq = 0xffffff00u + i * 8;
+
+        switch (g_test_rand_int_range(0, 4)) {
+        case 0:
+            seq -= g_test_rand_int_range(1, 200) * 8;
+            break;
+        case 1:
+            if (model->len) {
+                seq = ((Packet *)g_ptr_array_index(model, g_test_rand_int_range(
+                           0, model->len)))->tcp_seq;
+            }
+            break;
+        default:
+            break;
+        }
+
+        pkt = test_packet(seq);
+        packet_ring_insert_seq(&ring, pkt);
+        test_model_insert_seq(model, pkt);
+        test_ring_check(&ring, model);
+
+        if (i % 7 == 6) {
+            pkt = packet_ring_pop_head(&ring);
+            g_assert(pkt == g_ptr_array_index(model, 0));
+            g_ptr_array_remove_index(model, 0);
+            packet_destroy(pkt, NULL);
+        }
+    }
+
+    packet_ring_destroy(&ring);
+    g_ptr_array_free(model, true);
+}
+
+static void test_remove(void)
+{
+    GPtrArray *model = g_ptr_array_new();
+    PacketRing ring;
+    Packet *pkt;
+    uint32_t i, index;
+
+    packet_ring_init(&ring);
+
+    /* Wrap the ring before removing from it */
+    for (i = 0; i < 10; i++) {
+        packet_ring_push_tail(&ring, test_packet(i));
+    }
+    for (i = 0; i < 10; i++) {
+        packet_destroy(packet_ring_pop_head(&ring), NULL);
+    }
+    for (i = 0; i < 16; i++) {
+        pkt = test_packet(i);
+        packet_ring_push_tail(&ring, pkt);
+        g_ptr_array_add(model, pkt);
+    }
+    g_assert_cmpuint(ring.size, ==, 16);
+    g_assert_cmpuint(ring.head, !=, 0);
+
+    /* The tail, the head, then from the middle until empty */
+    index = model->len - 1;
+    pkt = packet_ring_remove(&ring, index);
+    g_assert(pkt == g_ptr_array_index(model, index));
+    g_ptr_array_remove_index(model, index);
+    packet_destroy(pkt, NULL);
+    test_ring_check(&ring, model);
+
+    pkt = packet_ring_remove(&ring, 0);
+    g_assert(pkt == g_ptr_array_index(model, 0));
+    g_ptr_array_remove_index(model, 0);
+    packet_destroy(pkt, NULL);
+    test_ring_check(&ring, model);
+
+    while (model->len) {
+        index = model->len / 2;
+        pkt = packet_ring_remove(&ring, index);
+        g_assert(pkt == g_ptr_array_index(model, index));
+        g_ptr_array_remove_index(model, index);
+        packet_destroy(pkt, NULL);
+        test_ring_check(&ring, model);
+
+        /* Refill once, so that the remaining packets are moved around */
+        if (model->len == 4 && ring.size == 16) {
+            for (i = 0; i < 20; i++) {
+                pkt = test_packet(100 + i);
+                packet_ring_push_tail(&ring, pkt);
+                g_ptr_array_add(model, pkt);
+            }
+            test_ring_check(&ring, model);
+        }
+    }
+
+    packet_ring_destroy(&ring);
+    g_ptr_array_free(model, true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/colo/packet-ring/push-pop", test_push_pop);
+    g_test_add_func("/colo/packet-ring/insert-seq", test_insert_seq);
+    g_test_add_func("/colo/packet-ring/remove", test_remove);
+    return g_test_run();
+}
@@ -31,6 +31,7 @@
 #include "crypto/tlscredsx509.h"
 #include "qemu/acl.h"
 #include "qapi/error.h"
+#include "qemu/thread.h"
 #include "qom/object_interfaces.h"
 
 #ifdef QCRYPTO_HAVE_TLS_TEST_SUPPORT
@@ -47,6 +48,8 @@ struct QIOChannelTLSTestData {
     bool expectClientFail;
     const char *hostname;
     const char *const *wildcards;
+    bool ktls;
+    const char *priority;
 };
 
 struct QIOChannelTLSHandshakeData {
@@ -65,7 +68,8 @@ static void test_tls_handshake_done(QIOTask *task,
 
 
 static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
-                                              const char *certdir)
+                                              const char *certdir,
+                                              const char *priority)
 {
     Object *parent = object_get_objects_root();
     Object *creds = object_new_with_props(
@@ -78,7 +82,7 @@ static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
                      "server" : "client"),
         "dir", certdir,
         "verify-peer", "yes",
-        "priority", "NORMAL",
+        "priority", priority ? priority : "NORMAL",
         /* We skip initial sanity checks here because we
          * want to make sure that problems are being
          * detected at the TLS session validation stage,
@@ -93,6 +97,35 @@ static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
 }
 
 
+/*
+ * Kernel TLS only works on TCP sockets, so the kTLS test can't
+ * use socketpair()
+ */
+static void test_tls_tcp_socketpair(int sv[2])
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    int listenfd;
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(listenfd >= 0);
+    g_assert(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) == 0);
+    g_assert(listen(listenfd, 1) == 0);
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(sv[0] >= 0);
+    g_assert(connect(sv[0], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    sv[1] = accept(listenfd, NULL, NULL);
+    g_assert(sv[1] >= 0);
+
+    close(listenfd);
+}
+
+
 /*
  * This tests validation checking of peer certificates
  *
@@ -122,7 +155,11 @@ static void test_io_channel_tls(const void *opaque)
     GMainContext *mainloop;
 
     /* We'll use this for our fake client-server connection */
-    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == 0);
+    if (data->ktls) {
+        test_tls_tcp_socketpair(channel);
+    } else {
+        g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == 0);
+    }
 
 #define CLIENT_CERT_DIR "tests/test-io-channel-tls-client/"
 #define SERVER_CERT_DIR "tests/test-io-channel-tls-server/"
@@ -153,12 +190,12 @@ static void test_io_channel_tls(const void *opaque)
 
     clientCreds = test_tls_creds_create(
         QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
-        CLIENT_CERT_DIR);
+        CLIENT_CERT_DIR, data->priority);
     g_assert(clientCreds != NULL);
 
     serverCreds = test_tls_creds_create(
         QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
-        SERVER_CERT_DIR);
+        SERVER_CERT_DIR, data->priority);
     g_assert(serverCreds != NULL);
 
     acl = qemu_acl_init("channeltlsacl");
@@ -221,6 +258,16 @@ static void test_io_channel_tls(const void *opaque)
     g_assert(clientHandshake.failed == data->expectClientFail);
     g_assert(serverHandshake.failed == data->expectServerFail);
 
+    if (data->ktls) {
+        if (!clientChanTLS->ktls && !serverChanTLS->ktls) {
+            g_test_skip("kernel TLS not available");
+            goto cleanup;
+        }
+        /* Receiving always stays with GNUTLS */
+        g_assert_cmpint(clientChanTLS->ktls & ~QCRYPTO_TLS_KTLS_TX, ==, 0);
+        g_assert_cmpint(serverChanTLS->ktls & ~QCRYPTO_TLS_KTLS_TX, ==, 0);
+    }
+
     test = qio_channel_test_new();
     qio_channel_test_run_threads(test, false,
                                  QIO_CHANNEL(clientChanTLS),
@@ -233,6 +280,16 @@ static void test_io_channel_tls(const void *opaque)
                                  QIO_CHANNEL(serverChanTLS));
     qio_channel_test_validate(test);
 
+    if (data->ktls) {
+        /* The kernel encrypts for both ends; check both directions */
+        test = qio_channel_test_new();
+        qio_channel_test_run_threads(test, true,
+                                     QIO_CHANNEL(serverChanTLS),
+                                     QIO_CHANNEL(clientChanTLS));
+        qio_channel_test_validate(test);
+    }
+
+ cleanup:
     unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
     unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
     unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
@@ -258,6 +315,173 @@ static void test_io_channel_tls(const void *opaque)
 }
 
 
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+struct QIOChannelTLSKeyUpdateData {
+    int fd;
+    const char *cacrt;
+    const char *crt;
+    bool tls13;
+    bool ok;
+};
+
+/*
+ * A plain GNUTLS client, since QCryptoTLSSession can't send a KeyUpdate.
+ * It asks the server to update its keys too, so that the server's GNUTLS
+ * sends a KeyUpdate record of its own, and checks that the reply sent
+ * after it still decrypts.
+ */
+static void *test_tls_key_update_client(void *opaque)
+{
+    struct QIOChannelTLSKeyUpdateData *data = opaque;
+    gnutls_certificate_credentials_t creds;
+    gnutls_session_t session;
+    char buf[4];
+    ssize_t len;
+    int ret;
+
+    g_assert(gnutls_certificate_allocate_credentials(&creds) == 0);
+    g_assert(gnutls_certificate_set_x509_trust_file(
+                 creds, data->cacrt, GNUTLS_X509_FMT_PEM) > 0);
+    g_assert(gnutls_certificate_set_x509_key_file(
+                 creds, data->crt, KEYFILE, GNUTLS_X509_FMT_PEM) == 0);
+
+    g_assert(gnutls_init(&session, GNUTLS_CLIENT) == 0);
+    g_assert(gnutls_priority_set_direct(
+                 session, "NORMAL:-VERS-ALL:+VERS-TLS1.3", NULL) == 0);
+    g_assert(gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE,
+                                    creds) == 0);
+    gnutls_transport_set_int(session, data->fd);
+
+    do {
+        ret = gnutls_handshake(session);
+    } while (ret < 0 && !gnutls_error_is_fatal(ret));
+    if (ret < 0) {
+        goto out;
+    }
+    data->tls13 = gnutls_protocol_get_version(session) == GNUTLS_TLS1_3;
+
+    if (gnutls_session_key_update(session, GNUTLS_KU_PEER) < 0 ||
+        gnutls_record_send(session, "ping", 4) != 4) {
+        goto out;
+    }
+
+    /* The server's KeyUpdate comes first, GNUTLS handles it */
+    do {
+        len = gnutls_record_recv(session, buf, sizeof(buf));
+    } while (len == GNUTLS_E_AGAIN || len == GNUTLS_E_INTERRUPTED);
+    data->ok = len == 4 && memcmp(buf, "pong", 4) == 0;
+
+    gnutls_bye(session, GNUTLS_SHUT_WR);
+ out:
+    gnutls_deinit(session);
+    gnutls_certificate_free_credentials(creds);
+    return NULL;
+}
+
+/*
+ * A TLS 1.3 peer that requests a KeyUpdate: the server's sending side
+ * must stay with GNUTLS, which answers it, and not move to the kernel.
+ */
+static void test_io_channel_tls_key_update(const void *opaque)
+{
+    struct QIOChannelTLSTestData *data = (struct QIOChannelTLSTestData *)opaque;
+    struct QIOChannelTLSKeyUpdateData client = {
+        .cacrt = data->clientcacrt,
+        .crt = data->clientcrt,
+    };
+    struct QIOChannelTLSHandshakeData serverHandshake = { false, false };
+    QCryptoTLSCreds *serverCreds;
+    QIOChannelSocket *serverChanSock;
+    QIOChannelTLS *serverChanTLS;
+    GMainContext *mainloop;
+    QemuThread thread;
+    int channel[2];
+    char buf[4];
+
+    /* Over TCP, where the kernel could take over encryption */
+    test_tls_tcp_socketpair(channel);
+    client.fd = channel[0];
+
+    mkdir(SERVER_CERT_DIR, 0700);
+
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
+
+    g_assert(link(data->servercacrt,
+                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT) == 0);
+    g_assert(link(data->servercrt,
+                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT) == 0);
+    g_assert(link(KEYFILE,
+                  SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY) == 0);
+
+    serverCreds = test_tls_creds_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
+        SERVER_CERT_DIR, data->priority);
+    g_assert(serverCreds != NULL);
+
+    serverChanSock = qio_channel_socket_new_fd(
+        channel[1], &error_abort);
+    g_assert(serverChanSock != NULL);
+    qio_channel_set_blocking(QIO_CHANNEL(serverChanSock), false, NULL);
+
+    serverChanTLS = qio_channel_tls_new_server(
+        QIO_CHANNEL(serverChanSock), serverCreds,
+        NULL, &error_abort);
+    g_assert(serverChanTLS != NULL);
+
+    qemu_thread_create(&thread, "tls-client", test_tls_key_update_client,
+                       &client, QEMU_THREAD_JOINABLE);
+
+    qio_channel_tls_handshake(serverChanTLS,
+                              test_tls_handshake_done,
+                              &serverHandshake,
+                              NULL,
+                              NULL);
+
+    mainloop = g_main_context_default();
+    do {
+        g_main_context_iteration(mainloop, TRUE);
+    } while (!serverHandshake.finished);
+
+    if (serverHandshake.failed) {
+        shutdown(channel[1], SHUT_RDWR);
+        qemu_thread_join(&thread);
+        g_test_skip("TLS 1.3 not available");
+        goto cleanup;
+    }
+
+    g_assert_cmpint(serverChanTLS->ktls & QCRYPTO_TLS_KTLS_TX, ==, 0);
+
+    qio_channel_set_blocking(QIO_CHANNEL(serverChanTLS), true, NULL);
+    g_assert(qio_channel_read_all(QIO_CHANNEL(serverChanTLS),
+                                  buf, sizeof(buf), &error_abort) == 0);
+    g_assert(memcmp(buf, "ping", 4) == 0);
+    g_assert(qio_channel_write_all(QIO_CHANNEL(serverChanTLS),
+                                   "pong", 4, &error_abort) == 0);
+
+    qemu_thread_join(&thread);
+    g_assert(client.tls13);
+    g_assert(client.ok);
+
+ cleanup:
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_CA_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_CERT);
+    unlink(SERVER_CERT_DIR QCRYPTO_TLS_CREDS_X509_SERVER_KEY);
+
+    rmdir(SERVER_CERT_DIR);
+
+    object_unparent(OBJECT(serverCreds));
+
+    object_unref(OBJECT(serverChanTLS));
+    object_unref(OBJECT(serverChanSock));
+
+    close(channel[0]);
+    close(channel[1]);
+}
+#endif
+
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -316,6 +540,29 @@ int main(int argc, char **argv)
                  clientcertreq.filename, false, false,
                  "qemu.org", wildcards);
 
+    /*
+     * The same over TCP, where the kernel can take over encryption;
+     * it only does for TLS 1.2
+     */
+    struct QIOChannelTLSTestData ktls = {
+        cacertreq.filename, cacertreq.filename,
+        servercertreq.filename, clientcertreq.filename,
+        false, false, "qemu.org", wildcards, true,
+        "NORMAL:-VERS-ALL:+VERS-TLS1.2"
+    };
+    g_test_add_data_func("/qio/channel/tls/ktls", &ktls,
+                         test_io_channel_tls);
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+    struct QIOChannelTLSTestData keyupdate = {
+        cacertreq.filename, cacertreq.filename,
+        servercertreq.filename, clientcertreq.filename,
+        false, false, "qemu.org", wildcards, true
+    };
+    g_test_add_data_func("/qio/channel/tls/key-update", &keyupdate,
+                         test_io_channel_tls_key_update);
+#endif
+
     ret = g_test_run();
 
     test_tls_discard_cert(&clientcertreq);
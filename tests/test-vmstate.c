@@ -355,6 +355,63 @@ static void test_load_v2(void)
     qemu_fclose(loading);
 }
 
+/* Fields laid out back to back, which are saved and loaded in bulk */
+typedef struct TestBulk {
+    uint32_t a[3];
+    uint32_t b;
+    uint16_t c[2];
+    uint8_t buf[3];
+    uint8_t d;
+    uint64_t e;
+} TestBulk;
+
+static const VMStateDescription vmstate_bulk = {
+    .name = "test/bulk",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(a, TestBulk, 3),
+        VMSTATE_UINT32(b, TestBulk),
+        VMSTATE_UINT16_ARRAY(c, TestBulk, 2),
+        VMSTATE_BUFFER(buf, TestBulk),
+        VMSTATE_UINT8(d, TestBulk),
+        VMSTATE_UINT64(e, TestBulk),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_bulk(void)
+{
+    TestBulk obj = {
+        .a = { 1, 2, 0x01020304 },
+        .b = 4,
+        .c = { 5, 0x0607 },
+        .buf = { 8, 9, 10 },
+        .d = 11,
+        .e = 0x0102030405060708ULL,
+    };
+    TestBulk obj_load = { };
+    uint8_t wire[] = {
+        0, 0, 0, 1,             /* a[0] */
+        0, 0, 0, 2,             /* a[1] */
+        1, 2, 3, 4,             /* a[2] */
+        0, 0, 0, 4,             /* b */
+        0, 5,                   /* c[0] */
+        6, 7,                   /* c[1] */
+        8, 9, 10,               /* buf */
+        11,                     /* d */
+        1, 2, 3, 4, 5, 6, 7, 8, /* e */
+        QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+    };
+
+    save_vmstate(&vmstate_bulk, &obj);
+    compare_vmstate(wire, sizeof(wire));
+
+    SUCCESS(load_vmstate_one(&vmstate_bulk, &obj_load, 1, wire,
+                             sizeof(wire)));
+    SUCCESS(memcmp(&obj, &obj_load, sizeof(obj)));
+}
+
 static bool test_skip(void *opaque, int version_id)
 {
     TestStruct *t = (TestStruct *)opaque;
@@ -519,6 +576,23 @@ static void test_arr_ptr_str_no0_save(void)
     compare_vmstate(wire_arr_ptr_no0, sizeof(wire_arr_ptr_no0));
 }
 
+static void test_estimate_size(void)
+{
+    TestStruct obj = { .skip_c_e = false };
+    TestStructTriv ar[AR_SIZE] = {{.i = 0}, {.i = 1}, {.i = 2}, {.i = 3} };
+    TestArrayOfPtrToStuct sample = {.ar = {&ar[0], &ar[1], &ar[2], &ar[3]} };
+
+    /* Same sizes as test_save_noskip() and test_save_skip() */
+    g_assert_cmpint(vmstate_estimate_size(&vmstate_skipping, &obj), ==, 32);
+    obj.skip_c_e = true;
+    g_assert_cmpint(vmstate_estimate_size(&vmstate_skipping, &obj), ==, 24);
+
+    /* Structs are followed through pointers, NULL ones are skipped */
+    g_assert_cmpint(vmstate_estimate_size(&vmsd_arps, &sample), ==, 16);
+    sample.ar[1] = NULL;
+    g_assert_cmpint(vmstate_estimate_size(&vmsd_arps, &sample), ==, 12);
+}
+
 static void test_arr_ptr_str_no0_load(void)
 {
     TestStructTriv ar_gt[AR_SIZE] = {{.i = 0}, {.i = 1}, {.i = 2}, {.i = 3} };
@@ -865,6 +939,7 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
+    g_test_add_func("/vmstate/bulk", test_bulk);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
@@ -874,6 +949,7 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/array/ptr/str/no0/load",
                     test_arr_ptr_str_no0_load);
     g_test_add_func("/vmstate/array/ptr/str/0/save", test_arr_ptr_str_0_save);
+    g_test_add_func("/vmstate/estimate_size", test_estimate_size);
     g_test_add_func("/vmstate/array/ptr/str/0/load",
                     test_arr_ptr_str_0_load);
     g_test_add_func("/vmstate/array/ptr/prim/0/save",
@@ -17,6 +17,7 @@
 #include "libqos/virtio-mmio.h"
 #include "libqos/malloc-generic.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/bswap.h"
 #include "standard-headers/linux/virtio_ids.h"
 #include "standard-headers/linux/virtio_config.h"
@@ -61,22 +62,30 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QOSState *pci_test_start(void)
+/*
+ * Start with @extra_args on the command line and @dev_opts appended to the
+ * options of the virtio-blk-pci device drv0
+ */
+static QOSState *pci_test_start_args(const char *extra_args,
+                                     const char *dev_opts)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
     char *tmp_path;
-    const char *cmd = "-drive if=none,id=drive0,file=%s,format=raw "
-                      "-drive if=none,id=drive1,file=null-co://,format=raw "
-                      "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                      "addr=%x.%x";
+    char *cmd;
 
     tmp_path = drive_create();
+    cmd = g_strdup_printf("%s "
+                          "-drive if=none,id=drive0,file=%s,format=raw "
+                          "-drive if=none,id=drive1,file=null-co://,format=raw "
+                          "-device virtio-blk-pci,id=drv0,drive=drive0,"
+                          "addr=%x.%x%s",
+                          extra_args, tmp_path, PCI_SLOT, PCI_FN, dev_opts);
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, tmp_path, PCI_SLOT, PCI_FN);
+        qs = qtest_pc_boot("%s", cmd);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, tmp_path, PCI_SLOT, PCI_FN);
+        qs = qtest_spapr_boot("%s", cmd);
     } else {
         g_printerr("virtio-blk tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -84,9 +93,15 @@ static QOSState *pci_test_start(void)
     global_qtest = qs->qts;
     unlink(tmp_path);
     g_free(tmp_path);
+    g_free(cmd);
     return qs;
 }
 
+static QOSState *pci_test_start(void)
+{
+    return pci_test_start_args("", "");
+}
+
 static void arm_test_start(void)
 {
     char *tmp_path;
@@ -682,6 +697,386 @@ static void pci_hotplug(void)
     qtest_shutdown(qs);
 }
 
+#define MQ_NUM_QUEUES           4
+
+/*
+ * Add a @type request of @size bytes for @sector to @vq without making it
+ * available to the device.  Return the address of the request.
+ */
+static uint64_t virtio_blk_add_rw(QVirtioDevice *dev, QGuestAllocator *alloc,
+                                  QVirtQueue *vq, uint32_t type,
+                                  uint64_t sector, const char *data,
+                                  size_t size, uint32_t *free_head)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(size);
+    if (type == VIRTIO_BLK_T_OUT) {
+        memcpy(req.data, data, size);
+    }
+
+    req_addr = virtio_blk_request(alloc, dev, &req, size);
+
+    g_free(req.data);
+
+    *free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, size, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req_addr + 16 + size, 1, true, false);
+
+    return req_addr;
+}
+
+/* Wait for a request from virtio_blk_add_rw() and copy read data to @data */
+static void virtio_blk_wait_rw(QVirtioDevice *dev, QGuestAllocator *alloc,
+                               QVirtQueue *vq, uint32_t type,
+                               uint64_t req_addr, uint32_t free_head,
+                               char *data, size_t size)
+{
+    uint8_t status;
+
+    qvirtio_wait_used_elem(dev, vq, free_head, NULL, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 16 + size);
+    g_assert_cmpint(status, ==, 0);
+
+    if (type == VIRTIO_BLK_T_IN) {
+        memread(req_addr + 16, data, size);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+/* Issue a one-sector @type request for @sector on @vq and wait for it */
+static void virtio_blk_rw_sector(QVirtioDevice *dev, QGuestAllocator *alloc,
+                                 QVirtQueue *vq, uint32_t type,
+                                 uint64_t sector, char *data)
+{
+    uint64_t req_addr;
+    uint32_t free_head;
+
+    req_addr = virtio_blk_add_rw(dev, alloc, vq, type, sector, data, 512,
+                                 &free_head);
+    qvirtqueue_kick(dev, vq, free_head);
+    virtio_blk_wait_rw(dev, alloc, vq, type, req_addr, free_head, data, 512);
+}
+
+static void virtio_blk_mq_setup(QVirtioDevice *dev, QGuestAllocator *alloc,
+                                QVirtQueue **vqs)
+{
+    uint32_t features;
+    int i;
+
+    features = qvirtio_get_features(dev);
+    g_assert(features & (1u << VIRTIO_BLK_F_MQ));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    g_assert_cmpint(qvirtio_config_readw(dev,
+                        offsetof(struct virtio_blk_config, num_queues)),
+                    ==, MQ_NUM_QUEUES);
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vqs[i] = qvirtqueue_setup(dev, alloc, i);
+    }
+
+    qvirtio_set_driver_ok(dev);
+}
+
+/*
+ * Write a sector through every virtqueue, then read each one back through
+ * a virtqueue served by the other IOThread.
+ */
+static void virtio_blk_mq_rw(QVirtioDevice *dev, QGuestAllocator *alloc,
+                             QVirtQueue **vqs, const char *tag)
+{
+    char data[512];
+    char *expected;
+    int i;
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        memset(data, 0, sizeof(data));
+        snprintf(data, sizeof(data), "%s-vq%d", tag, i);
+        virtio_blk_rw_sector(dev, alloc, vqs[i], VIRTIO_BLK_T_OUT, i, data);
+    }
+
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        expected = g_strdup_printf("%s-vq%d", tag, i);
+        virtio_blk_rw_sector(dev, alloc, vqs[(i + 1) % MQ_NUM_QUEUES],
+                             VIRTIO_BLK_T_IN, i, data);
+        g_assert_cmpstr(data, ==, expected);
+        g_free(expected);
+    }
+}
+
+static void pci_iothread_vq_mapping(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueue *vqs[MQ_NUM_QUEUES];
+    int i;
+
+    qs = pci_test_start_args("-object iothread,id=iothread0 "
+                             "-object iothread,id=iothread1",
+                             ",num-queues=4,"
+                             "iothread-vq-mapping=iothread0:iothread1");
+    dev = virtio_blk_pci_init(qs->pcibus, PCI_SLOT);
+
+    virtio_blk_mq_setup(&dev->vdev, qs->alloc, vqs);
+    virtio_blk_mq_rw(&dev->vdev, qs->alloc, vqs, "first");
+
+    /* Stopping and resuming the VM stops and restarts the dataplane */
+    qmp_discard_response("{ 'execute': 'stop' }");
+    qmp_discard_response("{ 'execute': 'cont' }");
+    virtio_blk_mq_rw(&dev->vdev, qs->alloc, vqs, "cont");
+
+    /* So does a device reset */
+    qvirtio_reset(&dev->vdev);
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->vdev.bus, vqs[i], qs->alloc);
+    }
+    qvirtio_set_acknowledge(&dev->vdev);
+    qvirtio_set_driver(&dev->vdev);
+    virtio_blk_mq_setup(&dev->vdev, qs->alloc, vqs);
+    virtio_blk_mq_rw(&dev->vdev, qs->alloc, vqs, "reset");
+
+    /* End test */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->vdev.bus, vqs[i], qs->alloc);
+    }
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+    qtest_shutdown(qs);
+}
+
+/* Hotplug drv1 and expect realize to fail with @error */
+static void vq_mapping_add_fail(const char *iothread, int num_queues,
+                                const char *mapping, const char *error)
+{
+    QDict *rsp;
+    const char *desc;
+
+    if (iothread) {
+        rsp = qmp("{'execute': 'device_add', 'arguments': {"
+                  " 'driver': 'virtio-blk-pci', 'id': 'drv1',"
+                  " 'drive': 'drive1', 'iothread': %s,"
+                  " 'num-queues': %d, 'iothread-vq-mapping': %s } }",
+                  iothread, num_queues, mapping);
+    } else {
+        rsp = qmp("{'execute': 'device_add', 'arguments': {"
+                  " 'driver': 'virtio-blk-pci', 'id': 'drv1',"
+                  " 'drive': 'drive1',"
+                  " 'num-queues': %d, 'iothread-vq-mapping': %s } }",
+                  num_queues, mapping);
+    }
+    g_assert(qdict_haskey(rsp, "error"));
+    desc = qdict_get_str(qdict_get_qdict(rsp, "error"), "desc");
+    g_assert(strstr(desc, error));
+    qobject_unref(rsp);
+}
+
+static void pci_iothread_vq_mapping_errors(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+
+    qs = pci_test_start_args("-object iothread,id=iothread0 "
+                             "-object iothread,id=iothread1", "");
+
+    vq_mapping_add_fail(NULL, 2, "iothread0:iothread0",
+                        "iothread \"iothread0\" is listed more than once");
+    vq_mapping_add_fail(NULL, 1, "iothread0:iothread1",
+                        "more iothreads (2) than num-queues (1)");
+    vq_mapping_add_fail("iothread0", 2, "iothread1",
+                        "cannot be set at the same time");
+    vq_mapping_add_fail(NULL, 2, "iothread0:nosuchiothread",
+                        "iothread \"nosuchiothread\" not found");
+    vq_mapping_add_fail(NULL, 2, "", "needs at least one iothread");
+
+    /* The failures left nothing behind, a valid mapping still plugs */
+    qtest_qmp_device_add("virtio-blk-pci", "drv1",
+                         "{'addr': %s, 'drive': 'drive1', 'num-queues': 2,"
+                         " 'iothread-vq-mapping': 'iothread0:iothread1'}",
+                         stringify(PCI_SLOT_HP));
+
+    dev = virtio_blk_pci_init(qs->pcibus, PCI_SLOT_HP);
+    g_assert(dev);
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+
+    qpci_unplug_acpi_device_test("drv1", PCI_SLOT_HP);
+    qtest_shutdown(qs);
+}
+
+/* Make @free_head available to the device without notifying it */
+static void virtqueue_make_avail(QVirtQueue *vq, uint32_t free_head)
+{
+    uint16_t idx = readw(vq->avail + 2);
+
+    writew(vq->avail + 4 + (2 * (idx % vq->size)), free_head);
+    writew(vq->avail + 2, idx + 1);
+}
+
+static QDict *query_drive0_stats(void)
+{
+    QDict *rsp;
+    QList *list;
+    QDict *stats;
+
+    rsp = qmp("{ 'execute': 'query-blockstats' }");
+    list = qdict_get_qlist(rsp, "return");
+    stats = qdict_get_qdict(qobject_to(QDict, qlist_peek(list)), "stats");
+    qobject_ref(stats);
+    qobject_unref(rsp);
+
+    return stats;
+}
+
+/*
+ * With merge-window-reqs=2 the window is flushed as soon as it holds two
+ * requests, and merge-window-us is long enough never to expire before.
+ */
+static void pci_merge_window(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueue *vq;
+    QDict *stats;
+    uint64_t addr[2];
+    uint32_t head[2];
+    uint32_t features;
+    char *pattern, *data;
+    int i;
+
+    qs = pci_test_start_args("", ",merge-window-us=10000000,"
+                             "merge-window-reqs=2,merge-gap=4096");
+    dev = virtio_blk_pci_init(qs->pcibus, PCI_SLOT);
+
+    features = qvirtio_get_features(&dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&dev->vdev, features);
+    vq = qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    pattern = g_malloc(4096);
+    for (i = 0; i < 4096; i++) {
+        pattern[i] = i / 512 + 'a';
+    }
+
+    /* Two writes notified separately are held and merged into one */
+    addr[0] = virtio_blk_add_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_OUT,
+                                0, pattern, 2048, &head[0]);
+    qvirtqueue_kick(&dev->vdev, vq, head[0]);
+    addr[1] = virtio_blk_add_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_OUT,
+                                4, pattern + 2048, 2048, &head[1]);
+    qvirtqueue_kick(&dev->vdev, vq, head[1]);
+    for (i = 0; i < 2; i++) {
+        virtio_blk_wait_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_OUT,
+                           addr[i], head[i], NULL, 2048);
+    }
+
+    stats = query_drive0_stats();
+    g_assert_cmpint(qdict_get_int(stats, "wr_operations"), ==, 2);
+    g_assert_cmpint(qdict_get_int(stats, "wr_merged"), ==, 1);
+    qobject_unref(stats);
+
+    /*
+     * Two reads in one notify with a three sector hole between them are
+     * merged into one read covering the hole.
+     */
+    addr[0] = virtio_blk_add_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_IN,
+                                0, NULL, 512, &head[0]);
+    virtqueue_make_avail(vq, head[0]);
+    addr[1] = virtio_blk_add_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_IN,
+                                4, NULL, 1024, &head[1]);
+    qvirtqueue_kick(&dev->vdev, vq, head[1]);
+
+    data = g_malloc(1024);
+    virtio_blk_wait_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_IN,
+                       addr[0], head[0], data, 512);
+    g_assert(memcmp(data, pattern, 512) == 0);
+    virtio_blk_wait_rw(&dev->vdev, qs->alloc, vq, VIRTIO_BLK_T_IN,
+                       addr[1], head[1], data, 1024);
+    g_assert(memcmp(data, pattern + 2048, 1024) == 0);
+    g_free(data);
+
+    stats = query_drive0_stats();
+    g_assert_cmpint(qdict_get_int(stats, "rd_operations"), ==, 2);
+    g_assert_cmpint(qdict_get_int(stats, "rd_bytes"), ==, 1536);
+    g_assert_cmpint(qdict_get_int(stats, "rd_merged"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "rd_merge_gap_bytes"), ==, 1536);
+    qobject_unref(stats);
+
+    g_free(pattern);
+
+    /* End test */
+    qvirtqueue_cleanup(dev->vdev.bus, vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+    qtest_shutdown(qs);
+}
+
+/* Hotplug drv1 with @props and expect realize to fail with @error */
+static void merge_add_fail(QDict *props, const char *error)
+{
+    QDict *rsp;
+    const char *desc;
+
+    qdict_put_str(props, "driver", "virtio-blk-pci");
+    qdict_put_str(props, "id", "drv1");
+    qdict_put_str(props, "drive", "drive1");
+
+    rsp = qmp("{'execute': 'device_add', 'arguments': %p}", props);
+    g_assert(qdict_haskey(rsp, "error"));
+    desc = qdict_get_str(qdict_get_qdict(rsp, "error"), "desc");
+    g_assert(strstr(desc, error));
+    qobject_unref(rsp);
+}
+
+static void pci_merge_window_errors(void)
+{
+    QOSState *qs;
+    QDict *props;
+
+    qs = pci_test_start();
+
+    props = qdict_new();
+    qdict_put_int(props, "merge-window-reqs", 0);
+    merge_add_fail(props, "merge-window-reqs must be between 1 and 32");
+
+    props = qdict_new();
+    qdict_put_int(props, "merge-window-reqs", 33);
+    merge_add_fail(props, "merge-window-reqs must be between 1 and 32");
+
+    props = qdict_new();
+    qdict_put_int(props, "merge-gap", 1000);
+    merge_add_fail(props, "merge-gap must be a multiple of 512");
+
+    props = qdict_new();
+    qdict_put_int(props, "merge-gap", 256 * 1024);
+    merge_add_fail(props, "merge-gap must be a multiple of 512 and at most");
+
+    props = qdict_new();
+    qdict_put_int(props, "merge-window-us", 100);
+    qdict_put_bool(props, "request-merging", false);
+    merge_add_fail(props, "need request-merging=on");
+
+    props = qdict_new();
+    qdict_put_int(props, "merge-gap", 4096);
+    qdict_put_bool(props, "request-merging", false);
+    merge_add_fail(props, "need request-merging=on");
+
+    qtest_shutdown(qs);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -760,8 +1155,15 @@ int main(int argc, char **argv)
         if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
             qtest_add_func("/virtio/blk/pci/msix", pci_msix);
             qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+            qtest_add_func("/virtio/blk/pci/iothread-vq-mapping",
+                           pci_iothread_vq_mapping);
+            qtest_add_func("/virtio/blk/pci/iothread-vq-mapping-errors",
+                           pci_iothread_vq_mapping_errors);
         }
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+        qtest_add_func("/virtio/blk/pci/merge-window", pci_merge_window);
+        qtest_add_func("/virtio/blk/pci/merge-window-errors",
+                       pci_merge_window_errors);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }
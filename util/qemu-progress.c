@@ -24,11 +24,13 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/cutils.h"
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    char info[128];
     void (*print)(void);
     void (*end)(void);
 };
@@ -43,7 +45,7 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    printf("    (%3.2f/100%%)%s\r", state.current, state.info);
     fflush(stdout);
 }
 
@@ -68,7 +70,7 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        fprintf(stderr, "    (%3.2f/100%%)%s\n", state.current, state.info);
         print_pending = 0;
     }
 }
@@ -128,6 +130,15 @@ void qemu_progress_end(void)
     state.end();
 }
 
+/*
+ * Set a string that is printed after the percentage with every report,
+ * e.g. throughput figures.  An empty string removes it again.
+ */
+void qemu_progress_set_info(const char *info)
+{
+    pstrcpy(state.info, sizeof(state.info), info);
+}
+
 /*
  * Report progress.
  * @delta is how much progress we made.